@@ -8,24 +8,34 @@ This code is responsible for sending and handling IPIs between CPU cores in a mu
 #include "../../../lib/stdio.h" // printf
 
 #include "../../../sys/timer/tsc.h"    // tsc_sleep
+#include "../../../memory/tlb.h"       // init_tlb_shootdown
 
 
 
 #include "ipi.h"
 
+extern bool debug_on;
+
 uint64_t IPI_VECTOR = 50; // Interrupt vector for IPI (Inter-Processor Interrupt)
 uint64_t IPI_IRQ = 18;
 
+// Nothing to do here, the wakeup is the point: sched_irq_exit() runs after every IRQ
+// and lets an idle core pick up threads queued for it or steal some.
 void ipi_handler(registers_t *regs) {
-    // Handle the IPI interrupt here
-    // For example, you can print a message or perform some action
-    printf("Received IPI on CPU %d\n", get_lapic_id());
+    (void) regs;
+    if(debug_on) printf("Received IPI on CPU %d\n", get_lapic_id());
     apic_send_eoi(); // Send EOI to LAPIC after handling the interrupt
 }
 
+// Wake a core sleeping in its idle loop, its timer does not tick while it is idle
+void send_wakeup_ipi(uint32_t cpu_id) {
+    lapic_send_ipi((uint8_t) cpu_id, (uint8_t) IPI_VECTOR);
+}
+
 void init_ipi() {
     // Initialize the IPI handler
     irq_install(IPI_IRQ, &ipi_handler); // Install the IPI handler for IRQ 18
+    init_tlb_shootdown();               // TLB shootdown IPI on IRQ 19
 }
 
 
@@ -5,6 +5,7 @@
 #include <stddef.h>
 
 void init_ipi();
+void send_wakeup_ipi(uint32_t cpu_id);
 
 
 
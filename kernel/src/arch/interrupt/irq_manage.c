@@ -8,6 +8,9 @@ Interrupt Request(IRQ)
 #include "../../sys/cpu/cpuid.h"    //has_apic
 #include "apic/apic.h"              // apic_send_eoi
 #include "../../lib/stdio.h"
+#include "../../process/scheduler.h"  // sched_irq_exit
+#include "../../process/workqueue.h"  // softirq_run
+#include "../../sys/cpu/fpu.h"          // fpu_irq_enter
 
 #include "irq_manage.h"
 
@@ -24,7 +27,10 @@ void (*irq_routines[TOTAL_IRQ])(registers_t *) = {0};   // This hold all irq rou
 void irq_handler(registers_t *regs)
 {
     void (*handler)(registers_t *r);    // This is a blank function pointer
-    
+
+    fpu_irq_state_t fpu;
+    fpu_irq_enter(&fpu);                // Handlers are built with SSE, keep the interrupted registers
+
     int irq_no = regs->int_no - 32;     // Getting IRQ No from Interrupt No
     handler = irq_routines[irq_no];     // Getting Corresponding IRQ Routine
 
@@ -51,6 +57,12 @@ void irq_handler(registers_t *regs)
         *  interrupt controller too */
         outb(PIC_COMMAND_MASTER, PIC_EOI); /* master */
     }
+
+    softirq_run();                      // Work the handler deferred, the device may interrupt again meanwhile
+
+    sched_irq_exit(regs);               // May load another thread into regs
+
+    fpu_irq_exit(&fpu);
 }
 
 // Installing a custom handler function into irq_routines array
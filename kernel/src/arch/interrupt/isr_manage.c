@@ -4,6 +4,8 @@ Interrupt Service Routine(ISR) Manage
 
 
 #include "../../lib/stdio.h"
+#include "../../memory/vmm.h"
+#include "../../sys/cpu/fpu.h"
 
 #include "isr_manage.h"
 
@@ -61,6 +63,9 @@ void page_fault_handler(registers_t *regs)
     uint64_t faulting_address;
     asm volatile("mov %%cr2, %0" : "=r"(faulting_address));
 
+    // Not present page inside a reserved region or write to a copy-on-write page, resolve and retry
+    if (vm_handle_fault(faulting_address, regs->err_code)) return;
+
     // Decode the error code to determine the cause of the page fault.
     int present = !(regs->err_code & 0x1); // Page not present
     int rw = regs->err_code & 0x2;         // Write operation?
@@ -78,9 +83,6 @@ void page_fault_handler(registers_t *regs)
     printf(") at address %x\n", faulting_address);
 
 
-    // Additional action to handle the page fault could be added here,
-    // such as invoking a page allocator or terminating a faulty process.
-
     // Halt the system to prevent further errors (for now).
     printf("Halting the system due to page fault.\n");
     halt_kernel();
@@ -158,7 +160,13 @@ void debug_error_code(int err_code) {
 void isr_handler(registers_t *regs)
 {
     if (regs->int_no == 14) {
+        fpu_irq_state_t fpu;
+        fpu_irq_enter(&fpu);    // Resolving the fault copies memory with SSE
         page_fault_handler(regs);
+        fpu_irq_exit(&fpu);
+        return;
+    }else if(regs->int_no == 7){
+        fpu_trap(regs);         // Lazy FPU switch, load the thread's SSE state
         return;
     }else if(regs->int_no == 13){
         gpf_handler(regs);
@@ -40,6 +40,10 @@ References:
 
 #include "../../../memory/vmm.h"
 #include "../../../memory/kheap.h"
+#include "../../../memory/meminfo.h"
+
+#include "../../../process/wait_queue.h"
+#include "../../../process/mutex.h"
 
 #include "ahci.h"
 
@@ -161,6 +165,7 @@ void portRebase(HBA_PORT_T *port)
         printf("[AHCI] portRebase: malloc failed\n");
         return;
     }
+    mem_account(MEM_DMA, ALLOC_SIZE);
 
     // Convert to physical base (what HBA will use)
     uintptr_t base_phys = vir_to_phys((uintptr_t)base_virt);
@@ -234,18 +239,36 @@ int findCMDSlot(HBA_PORT_T* port, size_t cmd_slots)
 
 #define MAX_PRDT_ENTRIES 256 // or your actual limit
 
-// Execute read or write command
-// runCommand needs physical address of the buffer
-bool runCommand(FIS_TYPE type, uint8_t write, HBA_PORT_T *port, uint32_t start_l, uint32_t start_h, uint32_t count, uintptr_t phys_buf){
-    
-    if(!port)
-        return false;
+#define AHCI_BUSY_TIMEOUT_US    1000000     // Port must drop BSY and DRQ within 1 s
+#define AHCI_CMD_TIMEOUT_US     5000000     // A command must complete within 5 s
+
+typedef struct {
+    HBA_PORT_T *port;
+    int slot;
+} ahci_wait_t;
+
+// One command at a time: slot search, PxIS clearing and issue are not atomic.
+// Threads queue here instead of spinning while a command takes milliseconds.
+static mutex_t ahci_lock = MUTEX_INIT_NAMED("ahci");
+
+// The port takes a new command, condition for wait_poll()
+static bool port_ready(void *arg) {
+    HBA_PORT_T *port = ((ahci_wait_t *) arg)->port;
+    return !(port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ));
+}
+
+// The command in slot completed or failed, condition for wait_poll()
+static bool command_done(void *arg) {
+    ahci_wait_t *wait = (ahci_wait_t *) arg;
+    return !(wait->port->ci & (1 << wait->slot)) || (wait->port->is & HBA_PxIS_TFES);
+}
+
+// Build, issue and wait for one command, ahci_lock is held
+static bool issue_command(FIS_TYPE type, uint8_t write, HBA_PORT_T *port, uint32_t start_l, uint32_t start_h, uint32_t count, uintptr_t phys_buf){
 
     // Clear pending interrupt bits
     port->is = (uint32_t)-1;    // 0xFFFFFFFF
 
-    int spin = 0;
-
     int slot = findCMDSlot(port, 32);
     if (slot == -1) 
         return false;
@@ -325,13 +348,9 @@ bool runCommand(FIS_TYPE type, uint8_t write, HBA_PORT_T *port, uint32_t start_l
     cmd_fis->countl = (uint8_t)(count & 0xFF);
     cmd_fis->counth = (uint8_t)((count >> 8) & 0xFF);
 
-    // Wait for port not busy
-    while ((port->tfd & (ATA_DEV_BUSY | ATA_DEV_DRQ)) && spin < 1000000) {
-        printf(" [AHCI] port is busy...\n");
-        spin++;
-    }
-   
-    if (spin == 1000000) {
+    // Wait for port not busy, the port interrupt is not wired up so this sleeps between polls
+    ahci_wait_t wait = { .port = port, .slot = slot };
+    if (!wait_poll(port_ready, &wait, AHCI_BUSY_TIMEOUT_US)) {
         printf(" [AHCI] Port is hung\n");
         return false;
     }
@@ -340,21 +359,14 @@ bool runCommand(FIS_TYPE type, uint8_t write, HBA_PORT_T *port, uint32_t start_l
     __sync_synchronize();   // or asm volatile("" ::: "memory");
     port->ci |= 1 << slot;
 
-    int timeout = 1000000;
-
-    // Wait for completion
-    while( (port->ci & (1 << slot)) && timeout--){
-
-        // printf("[runCommand] Waiting...\n");
-
-        if (port->is & HBA_PxIS_TFES) {
-            printf(" [AHCI] Task File error!\n");
-            return false;
-        }
+    // Wait for completion, other threads run meanwhile
+    if (!wait_poll(command_done, &wait, AHCI_CMD_TIMEOUT_US)) {
+        printf("[AHCI] Command timeout!\n");
+        return false;
     }
 
-    if (timeout == 0) {
-        printf("[AHCI] Command timeout!\n");
+    if ((port->ci & (1 << slot)) && (port->is & HBA_PxIS_TFES)) {
+        printf(" [AHCI] Task File error!\n");
         return false;
     }
 
@@ -366,6 +378,20 @@ bool runCommand(FIS_TYPE type, uint8_t write, HBA_PORT_T *port, uint32_t start_l
     return true;
 }
 
+// Execute read or write command
+// runCommand needs physical address of the buffer
+bool runCommand(FIS_TYPE type, uint8_t write, HBA_PORT_T *port, uint32_t start_l, uint32_t start_h, uint32_t count, uintptr_t phys_buf){
+    
+    if(!port)
+        return false;
+
+    mutex_lock(&ahci_lock);
+    bool ok = issue_command(type, write, port, start_l, start_h, count, phys_buf);
+    mutex_unlock(&ahci_lock);
+
+    return ok;
+}
+
 
 
 
@@ -13,6 +13,7 @@ https://wiki.osdev.org/ISO_9660
 
 #include "../../../memory/vmm.h"
 #include "../../../memory/kheap.h"
+#include "../../../memory/meminfo.h"
 
 #include "satapi.h"
 
@@ -50,6 +51,7 @@ void AtpiPortRebase(HBA_PORT_T *port)
         printf("AtpiPortRebase: kheap_alloc failed\n");
         return;
     }
+    mem_account(MEM_DMA, ALLOC_SIZE);
 
     uintptr_t base_phys = vir_to_phys((uintptr_t)base_virt);
     if (base_phys == 0) {
@@ -16,6 +16,7 @@
 #include "../../driver/speaker/speaker.h"
 #include "../../driver/io/ports.h"
 #include "../../driver/vga/vga_term.h"
+#include "../../process/workqueue.h"
 
 #include "keyboard.h"
 
@@ -24,6 +25,7 @@ extern bool debug_on;
 #define KEYBOARD_BUF_SIZE 128   // Ring buffer capacity for keystrokes
 #define KEYBOARD_INT_VECTOR 33
 #define KEYBOARD_IRQ 1          // 33 - 32
+#define SCANCODE_RING_SIZE 64   // Scancodes between the interrupt and keyboard_bottom_half(), a power of two
 
 ring_buffer_t* keyboard_buffer;
 
@@ -229,8 +231,27 @@ static void key_ctrl(uint32_t scanCode, bool keyPress){
 }
 
 
-static void keyboardHandler(registers_t *regs) {
-    uint8_t scancode_raw = inb(0x60);
+wait_queue_t keyboard_wait = WAIT_QUEUE_INIT;   // Readers of keyboard_buffer sleep here
+
+
+// Whether a key waits in keyboard_buffer, the condition of keyboard_wait
+bool keyboard_has_input(void *arg) {
+    (void) arg;
+    return keyboard_buffer && !is_ring_buffer_empty(keyboard_buffer);
+}
+
+
+// Raw scancodes, written only by the interrupt and read only by the bottom half
+static uint8_t scancode_ring[SCANCODE_RING_SIZE];
+static volatile uint32_t scancode_head = 0;     // Next slot keyboardHandler() fills
+static volatile uint32_t scancode_tail = 0;     // Next scancode keyboard_bottom_half() takes
+static spinlock_t scancode_lock = SPINLOCK_INIT;    // Only one bottom half drains the ring
+
+static void keyboard_bottom_half(void *arg);
+static work_t keyboard_work = WORK_INIT(keyboard_bottom_half, NULL);
+
+
+static void process_scancode(uint8_t scancode_raw) {
     bool pressed = !(scancode_raw & 0x80);
     uint8_t scancode = scancode_raw & 0x7F;
 
@@ -239,7 +260,40 @@ static void keyboardHandler(registers_t *regs) {
     if (pressed && keyboard_buffer) {
         char c = scanCodeToChar(scancode);
         ring_buffer_push(keyboard_buffer, c);
+        wake_up(&keyboard_wait);
+    }
+}
+
+
+// Echo and buffer the keys, a softirq on the core which took the interrupt
+static void keyboard_bottom_half(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        if (!spin_trylock(&scancode_lock)) return;     // The holder drains and checks again after unlocking
+
+        while (scancode_tail != __atomic_load_n(&scancode_head, __ATOMIC_ACQUIRE)) {
+            uint8_t scancode_raw = scancode_ring[scancode_tail % SCANCODE_RING_SIZE];
+            __atomic_store_n(&scancode_tail, scancode_tail + 1, __ATOMIC_RELEASE);
+            process_scancode(scancode_raw);
+        }
+
+        spin_unlock(&scancode_lock);
+        if (scancode_tail == __atomic_load_n(&scancode_head, __ATOMIC_ACQUIRE)) return;
+    }
+}
+
+
+// Only read the scancode, which acknowledges the controller, the rest is deferred
+static void keyboardHandler(registers_t *regs) {
+    uint8_t scancode_raw = inb(0x60);
+
+    uint32_t head = scancode_head;
+    if (head - __atomic_load_n(&scancode_tail, __ATOMIC_ACQUIRE) < SCANCODE_RING_SIZE) {   // Dropped when full
+        scancode_ring[head % SCANCODE_RING_SIZE] = scancode_raw;
+        __atomic_store_n(&scancode_head, head + 1, __ATOMIC_RELEASE);
     }
+    queue_softirq(&keyboard_work);
 
     apic_send_eoi();
 }
@@ -6,6 +6,7 @@
 
 
 #include "../../util/util.h"
+#include "../../process/wait_queue.h"
 
 
 #define KEYBOARD_COMMAND_PORT 0x64  // Keyboard Command Port
@@ -115,7 +116,10 @@
 #define DELETE     0x00000053 // Same as NUMPAD_PERIOD without Num Lock
 
 
+extern wait_queue_t keyboard_wait;
+
 void initKeyboard();
+bool keyboard_has_input(void *arg);
 void enableKeyboard();
 void disableKeyboard();
 
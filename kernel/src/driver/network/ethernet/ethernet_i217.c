@@ -13,6 +13,9 @@ Reference:
 #include "../../../memory/kmalloc.h"
 #include "../../../memory/kheap.h"
 #include "../../../sys/timer/apic_timer.h"
+#include "../../../process/wait_queue.h"
+#include "../../../process/workqueue.h"
+#include "../../../process/mutex.h"
 
 #include "../../../lib/stdio.h"
 #include "../../../lib/string.h"
@@ -295,11 +298,18 @@ bool start ()
 }
 
 
+static mutex_t rx_lock = MUTEX_INIT_NAMED("e1000_rx");  // The worker and test_e1000() both walk the RX ring
+
+static void receive_work(void *arg);
+static work_t rx_work = WORK_INIT(receive_work, NULL);
+
+
 void handleReceive()
 {
     uint16_t old_cur;
     bool got_packet = false;
- 
+
+    mutex_lock(&rx_lock);
     while((rx_descs[rx_cur]->status & 0x1))
     {
         got_packet = true;
@@ -313,7 +323,15 @@ void handleReceive()
         old_cur = rx_cur;
         rx_cur = (rx_cur + 1) % E1000_NUM_RX_DESC;
         writeCommand(REG_RXDESCTAIL, old_cur );
-    }    
+    }
+    mutex_unlock(&rx_lock);
+}
+
+// Bottom half of fire(), runs in a worker thread
+static void receive_work(void *arg)
+{
+    (void) arg;
+    handleReceive();
 }
 
 void fire ()
@@ -333,13 +351,21 @@ void fire ()
     }
     else if(status & 0x80)
     {
-        handleReceive();
+        queue_work(&rx_work);   // Reading the cause acknowledged the card, the ring is walked later
     }
     
 }
 
 
 
+#define E1000_TX_TIMEOUT_US 100000     // The card must send a frame within 100 ms
+
+// The descriptor was written back by the card, condition for wait_poll()
+static bool tx_done(void *arg)
+{
+    return ((struct e1000_tx_desc *) arg)->status & 0xff;
+}
+
 int sendPacket(const void * p_data, uint16_t p_len)
 {    
     tx_descs[tx_cur]->addr = (uint64_t)p_data;
@@ -349,7 +375,11 @@ int sendPacket(const void * p_data, uint16_t p_len)
     uint8_t old_cur = tx_cur;
     tx_cur = (tx_cur + 1) % E1000_NUM_TX_DESC;
     writeCommand(REG_TXDESCTAIL, tx_cur);   
-    while(!(tx_descs[old_cur]->status & 0xff));    
+    // The TX interrupt is not wired up, sleep between polls instead of spinning
+    if (!wait_poll(tx_done, tx_descs[old_cur], E1000_TX_TIMEOUT_US)) {
+        printf("[Error] E1000: Transmit timeout\n");
+        return -1;
+    }
     return 0;
 }
 
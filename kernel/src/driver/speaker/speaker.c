@@ -1,6 +1,6 @@
 #include "../io/ports.h"
 #include "../../lib/stdio.h"
-#include "../../sys/timer/pit_timer.h"
+#include "../../sys/timer/apic_timer.h"
 
 #include "speaker.h"
 
@@ -45,7 +45,7 @@ void beep() {
     //     asm volatile("nop");
     // }
     printf("before\n");
-    pit_sleep(10);
+    apic_delay(10);
     printf("after");
     // Stop the sound
     stop_sound();
@@ -14,6 +14,8 @@
 
 #include "../include/cluster_manager.h"
 
+#include "../../../process/mutex.h"
+
 
 
 #define SECTOR_SIZE 512
@@ -24,6 +26,10 @@ uint32_t fat32_cwd_cluster = 2;             // Current Working Directory Cluster
 
 uint32_t fat32_free_cluster_no = 2;         // Hint for next free cluster (starts from 2 as 0 and 1 are reserved)
 
+// Serialises the read-modify-write of FAT sectors and fat32_free_cluster_no.
+// Chains built from several calls are not atomic as a whole, each entry update is.
+static mutex_t fat_lock = MUTEX_INIT_NAMED("fat");
+
 
 
 
@@ -102,7 +108,8 @@ bool fat32_read_cluster( uint32_t cluster_number, void *buffer){
     return next_cluster;
 }
 
- bool fat32_set_next_cluster(uint32_t current_cluster, uint32_t next_cluster)
+// Update one FAT entry in every FAT copy, fat_lock is held
+static bool fat32_write_fat_entry(uint32_t current_cluster, uint32_t next_cluster)
 {
     if (!is_valid_cluster(current_cluster))
         return false;
@@ -138,6 +145,15 @@ bool fat32_read_cluster( uint32_t cluster_number, void *buffer){
     return true;
 }
 
+ bool fat32_set_next_cluster(uint32_t current_cluster, uint32_t next_cluster)
+{
+    mutex_lock(&fat_lock);
+    bool ok = fat32_write_fat_entry(current_cluster, next_cluster);
+    mutex_unlock(&fat_lock);
+
+    return ok;
+}
+
 
 
 
@@ -186,6 +202,8 @@ bool fat32_read_cluster( uint32_t cluster_number, void *buffer){
 {
     uint32_t total_clusters = get_total_clusters();
 
+    mutex_lock(&fat_lock);              // No other core may take the entry between the check and the update
+
     for (uint32_t cluster = fat32_free_cluster_no; cluster < total_clusters + 1; cluster++)
     {
         uint32_t fat_offset = cluster * 4;  // Each entry is 4 bytes
@@ -195,20 +213,22 @@ bool fat32_read_cluster( uint32_t cluster_number, void *buffer){
         uint8_t sector_buffer[get_bytes_per_sector()];
 
         if (!fat32_read_sector( fat_sector_number, sector_buffer))
-            return false;
+            break;
 
         uint32_t entry = *(uint32_t *)&sector_buffer[ent_offset] & 0x0FFFFFFF;
 
         if (entry == 0) {                                             // Found a free cluster
-            fat32_set_next_cluster( cluster, CLUSTER_END_OF_CHAIN);   // Mark it as end of chain
+            if (!fat32_write_fat_entry( cluster, CLUSTER_END_OF_CHAIN)) break;   // Mark it as end of chain
             *allocated_cluster = cluster;
 
             fat32_free_cluster_no = cluster + 1;                      // update fat32_free_cluster_no
 
+            mutex_unlock(&fat_lock);
             return true;
         }
     }
 
+    mutex_unlock(&fat_lock);
     return false;
 }
 
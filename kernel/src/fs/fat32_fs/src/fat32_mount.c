@@ -2,6 +2,7 @@
 #include "../../../memory/kheap.h"
 #include "../../../memory/vmm.h"
 #include "../../../memory/kmalloc.h"
+#include "../../../memory/meminfo.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -191,6 +192,7 @@ bool fat32_load_fat_cache() {
     fat_buffer = (uint8_t *) phys_to_vir(kmalloc_a(fat_size_bytes, 1));
     if (!fat_buffer) return false;
     memset(fat_buffer, 0, fat_size_bytes);
+    mem_account(MEM_FS_CACHE, fat_size_bytes);
 
   //  if (!fat32_read_sectors(fat_start_lba,  fat_sectors, fat_buffer)) {
   if (!kebla_disk_read(disk_no, fat_start_lba,  fat_sectors, fat_buffer)) {
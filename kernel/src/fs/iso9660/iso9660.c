@@ -407,6 +407,46 @@ int iso9660_read(void *fp, char *buff, int size) {
 }
 
 
+// Read size bytes starting at offset, returns the bytes read or -1
+int iso9660_read_at(void *fp, uint32_t offset, char *buff, int size) {
+
+    if (!fp || !buff || size <= 0 || !disks) return -1;
+
+    iso9660_file_t *file = (iso9660_file_t *)fp;
+
+    if (offset >= file->size) return 0;
+    if ((uint32_t) size > file->size - offset) size = file->size - offset;
+
+    Disk disk = disks[file->disk_no];
+
+    uint32_t total_read = 0;
+    uint32_t remaining = size;
+    uint32_t cur_sector = file->sector + offset / disk.bytes_per_sector;
+    uint32_t skip = offset % disk.bytes_per_sector;      // Only the first sector starts inside
+
+    uint8_t *sector_buf = (uint8_t *)malloc(disk.bytes_per_sector);
+    if (!sector_buf) return -1;
+
+    while (remaining > 0) {
+        if (!kebla_disk_read(file->disk_no, cur_sector, 1, sector_buf)) {
+            free(sector_buf);
+            return total_read;
+        }
+
+        uint32_t copy = disk.bytes_per_sector - skip;
+        if (copy > remaining) copy = remaining;
+        memcpy(buff + total_read, sector_buf + skip, copy);
+
+        skip = 0;
+        total_read += copy;
+        remaining -= copy;
+        cur_sector++;
+    }
+
+    free(sector_buf);
+    return total_read;
+}
+
 int iso9660_get_fsize(void *fp) {
     if (!fp) return -1;
     iso9660_file_t *file = (iso9660_file_t *)fp;
@@ -99,6 +99,7 @@ int iso9660_unmount(int disk_no);
 int iso9660_stat(int disk_no, char *path, void *fno);
 void *iso9660_open(int disk_no, char *path);
 int iso9660_read(void *fp, char *buff, int size);
+int iso9660_read_at(void *fp, uint32_t offset, char *buff, int size);
 int iso9660_get_fsize(void *fp);
 int iso9660_close(void *fp);
 
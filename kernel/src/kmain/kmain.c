@@ -61,6 +61,7 @@ void kmain(){
     if(!has_apic()) printf("[Error] This System does not have APIC.\n");
         
     init_all_cpu_cores();    // Starts all CPU cores
+    init_workqueue();        // Worker threads for the deferred half of interrupt handlers
 
     if(!pci_exists()){
         printf("[Error] This system do not have PCI!\n");
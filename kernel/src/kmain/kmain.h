@@ -31,6 +31,7 @@
 // Process-Thread
 #include "../process/process.h" 
 #include "../process/test_process.h"
+#include "../process/workqueue.h"
 
 
 // Memory Management
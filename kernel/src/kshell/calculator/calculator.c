@@ -7,16 +7,14 @@
 #include "../../lib/stdlib.h" // atof
 #include "../../process/process.h"
 #include "../../process/thread.h"
+#include "../../process/scheduler.h"
 #include "../kshell.h"
 #include "../../util/util.h"
 
 #include "calculator.h"
 
-extern void restore_cpu_state(registers_t* registers);
-
-extern process_t* kshell_process;
-extern thread_t* kshell_thread;
 process_t* calculator_process;
+thread_t* calculator_thread;
 
 
 void calculator_main(void* arg) {
@@ -35,7 +33,7 @@ void calculator_main(void* arg) {
 
         if (operator == 'q' || operator == 'Q') {
             printf("\nExiting calculator...\n");
-            destroy_calculator();
+            destroy_calculator();       // Does not return
             break;
         }
 
@@ -73,9 +71,6 @@ void calculator_main(void* arg) {
                 break;
         }
     }
-
-    // After calculator exits, go back to shell
-    run_kshell();
 }
 
 
@@ -88,24 +83,25 @@ void start_calculator() {
     }
 
     // Create a new thread within the calculator process, with calculator_main as its entry.
-    thread_t* calculator_thread = create_thread(calculator_process, "Calculator Thread", &calculator_main, NULL);
+    calculator_thread = create_thread(calculator_process, "Calculator Thread", &calculator_main, NULL);
     if (!calculator_thread) {
         printf("Failed to create calculator thread!\n");
+        delete_process(calculator_process);
         return;
     }
 
-    restore_cpu_state((registers_t *)(uintptr_t)&calculator_thread->registers);
-
     printf("Calculator started successfully.\n");
-}
 
-void destroy_calculator() {
-    registers_t *regs = (registers_t *)&kshell_thread->registers;
-    if(!regs){
-        printf("Kshell is Null\n");
-    }
+    // The shell sleeps while the calculator owns the keyboard, then cleans up after it
+    thread_join(calculator_thread);
 
-    restore_cpu_state(regs);
     delete_process(calculator_process);
+    calculator_process = NULL;
+    calculator_thread = NULL;
     printf("Calculator process and thread destroyed.\n");
+}
+
+// Called by the calculator thread when it quits, start_calculator() frees it
+void destroy_calculator() {
+    thread_exit();
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 */
 
 #include "../util/util.h"   // registers_t structure
+#include "../util/bench.h"  // bench_mem, bench_alloc
 
 #include "kshell_helper.h"
 
@@ -13,15 +14,20 @@
 #include "../lib/stdio.h"
 #include "../lib/string.h"
 #include "../lib/stdlib.h" // atof
+#include "../lib/spinlock.h" // lock_stat_print
 
 #include "../sys/cpu/cpuid.h" // CPU information functions
+#include "../sys/cpu/fpu.h"   // fpu_print_info
 
 #include "../driver/keyboard/ring_buffer.h"  // Include your ring buffer header
+#include "../driver/keyboard/keyboard.h"     // keyboard_wait
 
 #include "../sys/acpi/descriptor_table/fadt.h" // for acpi_poweroff and acpi_reboot
 
 #include "../process/process.h"
 #include "../process/thread.h"
+#include "../process/scheduler.h"
+#include "../process/workqueue.h"     // workqueue_print_stats
 
 #include "calculator/calculator.h"
 #include "steam_locomotive/sl.h" // For locomotive animation
@@ -32,9 +38,6 @@
 process_t* kshell_process;
 thread_t* kshell_thread;
 
-
-extern void restore_cpu_state(registers_t* registers);
-
 // Global ring buffer to store keystrokes from the keyboard driver
 extern ring_buffer_t* keyboard_buffer;
 
@@ -47,9 +50,7 @@ void read_command(char *command, size_t bufsize) {
     // Loop until we either fill the command buffer or encounter Enter
     while (index < bufsize - 1) {
         // Wait for a character to be available
-        while (is_ring_buffer_empty(keyboard_buffer)) {
-            // Optionally, you could yield the CPU or sleep here
-        }
+        wait_event(&keyboard_wait, keyboard_has_input, NULL);
         // Pop a character from the ring buffer.
         if (ring_buffer_pop(keyboard_buffer, &ch) == 0) {
             // For this example, we assume Enter sends a newline ('\n')
@@ -116,13 +117,29 @@ void execute_command(char* command) {
     }else if(strcmp(command, "meminfo") == 0){
         print_meminfo();
 
+    }else if(strcmp(command, "membench") == 0){
+        bench_mem();
+
+    }else if(strcmp(command, "allocbench") == 0){
+        bench_alloc();
+
+    }else if(strcmp(command, "lockstat") == 0){
+        lock_stat_print();
+
+    }else if(strcmp(command, "lockstat reset") == 0){
+        lock_stat_reset();
+        printf("Lock statistics cleared.\n");
+
     }else if(strcmp(command, "ps") == 0) {
         print_process_list(); // Function to print the process list
+        sched_print_stats();
+        fpu_print_info();
+        workqueue_print_stats();
 
     }else if (strncmp(command, "pkill ", 6) == 0) {
         int pid = atoi(command + 6); // Parse PID after "pkill "
         
-        if(pid >= 0 && pid < 100) { // MAX_PROCESSES is your limit
+        if(pid >= 0 && pid < PID_MAX) {
             process_t* proc = get_process_by_pid(pid); // Function to find process by PID            
             if(proc != NULL) {
                 printf("Killing process with PID %d...\n", pid);
@@ -250,11 +267,11 @@ void start_kshell() {
         printf("Failed to create shell thread!\n");
         return;
     }
+    sched_set_nice(kshell_thread, SCHED_NICE_SHELL);
 
     // init_vfs();
 
-    restore_cpu_state((registers_t *)(uintptr_t)&kshell_thread->registers);
-
+    // The thread is queued already, the scheduler starts it on the next tick of its core
     printf("Shell started successfully.\n");
 }
 
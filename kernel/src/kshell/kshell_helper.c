@@ -12,6 +12,13 @@ Build Date: 2025-04-05
 #include "../process/thread.h"
 
 #include "../memory/detect_memory.h" // Memory management functions
+#include "../memory/pmm.h"           // pmm_print_stats
+#include "../memory/tlb.h"           // tlb_print_stats
+#include "../memory/kheap.h"         // kheap_print_stats
+#include "../memory/uheap.h"         // uheap_print_stats
+#include "../memory/meminfo.h"       // print_mem_counters
+#include "../memory/zero_pool.h"     // zero_pool_print_stats
+#include "../memory/kstack.h"        // kstack_print_stats
 
 #include "../bootloader/boot.h" // Bootloader information
 #include "../bootloader/firmware.h" // Firmware information
@@ -71,6 +78,13 @@ void print_meminfo() {
     printf("Kernel Physical Base Address: %x\n", KERNEL_PHYS_BASE);
     printf("HHDM Offset: %x\n", HHDM_OFFSET);
     printf("Paging Mode: %s\n", (paging_mode == 0) ? "4-Level" : "5-Level");
+    pmm_print_stats();
+    tlb_print_stats();
+    kheap_print_stats();
+    uheap_print_stats();
+    print_mem_counters();
+    zero_pool_print_stats();
+    kstack_print_stats();
 }
 
 void print_sys_info(){
@@ -116,6 +130,9 @@ void help(){
     printf("20. rmdir <dirname> : Remove a directory.\n");
     printf("21. cd <dirname> : Change directory.\n");
     printf("22. tree : Print directory tree.\n");
+    printf("23. membench : Compare the memcpy, memset and memcmp implementations.\n");
+    printf("24. allocbench : Time malloc, kheap, uheap and PMM allocations.\n");
+    printf("25. lockstat [reset] : Show or clear contention of the kernel locks.\n");
 }
 
 
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "spinlock.h"
+
+// Spinning reader-writer lock for data that is read far more often than it is changed.
+// Any number of readers may hold it together, a writer holds it alone.
+// Writers are preferred: once one is waiting new readers hold back, so lookups cannot starve it.
+// Never sleep while holding it, use mutex_t (process/mutex.h) for that.
+
+#define RWLOCK_WRITER   0x80000000      // Set in count while a writer holds the lock
+
+typedef struct {
+    volatile uint32_t count;            // Number of readers, or RWLOCK_WRITER
+    volatile uint32_t writers_waiting;  // Writers spinning for the lock
+#if LOCK_STATS
+    lock_stat_t stat;                   // Readers share the lock, so it is updated atomically
+#endif
+} rwlock_t;
+
+#if LOCK_STATS
+#define RWLOCK_INIT_NAMED(n) { .count = 0, .writers_waiting = 0, .stat = { .name = (n) } }
+#else
+#define RWLOCK_INIT_NAMED(n) { .count = 0, .writers_waiting = 0 }
+#endif
+#define RWLOCK_INIT RWLOCK_INIT_NAMED(NULL)
+
+
+static inline void rwlock_stat(rwlock_t *lock, uint64_t spins) {
+#if LOCK_STATS
+    lock_stat_t *stat = &lock->stat;
+    __atomic_fetch_add(&stat->acquired, 1, __ATOMIC_RELAXED);
+    if (spins) {
+        __atomic_fetch_add(&stat->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stat->spins, spins, __ATOMIC_RELAXED);
+        if (spins > stat->max_spins) stat->max_spins = spins;     // Racy, only a hint
+        if (stat->name && !stat->listed) lock_stat_register(stat);
+    }
+#else
+    (void) lock;
+    (void) spins;
+#endif
+}
+
+
+static inline void read_lock(rwlock_t *lock) {
+    uint64_t spins = 0;
+
+    for (;;) {
+        uint32_t count = __atomic_load_n(&lock->count, __ATOMIC_RELAXED);
+        if (!(count & RWLOCK_WRITER) && !__atomic_load_n(&lock->writers_waiting, __ATOMIC_RELAXED)) {
+            if (__atomic_compare_exchange_n(&lock->count, &count, count + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+            continue;                           // Another reader got in between, retry at once
+        }
+        asm volatile("pause");
+        spins++;
+    }
+    rwlock_stat(lock, spins);
+}
+
+static inline void read_unlock(rwlock_t *lock) {
+    __atomic_fetch_sub(&lock->count, 1, __ATOMIC_RELEASE);
+}
+
+static inline void write_lock(rwlock_t *lock) {
+    uint64_t spins = 0;
+
+    __atomic_fetch_add(&lock->writers_waiting, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        uint32_t expected = 0;
+        if (__atomic_load_n(&lock->count, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&lock->count, &expected, RWLOCK_WRITER, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        asm volatile("pause");
+        spins++;
+    }
+    __atomic_fetch_sub(&lock->writers_waiting, 1, __ATOMIC_RELAXED);
+    rwlock_stat(lock, spins);
+}
+
+static inline void write_unlock(rwlock_t *lock) {
+    __atomic_store_n(&lock->count, 0, __ATOMIC_RELEASE);
+}
+
+
+static inline uint64_t read_lock_irqsave(rwlock_t *lock) {
+    uint64_t flags = irq_save();
+    read_lock(lock);
+    return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t *lock, uint64_t flags) {
+    read_unlock(lock);
+    irq_restore(flags);
+}
+
+static inline uint64_t write_lock_irqsave(rwlock_t *lock) {
+    uint64_t flags = irq_save();
+    write_lock(lock);
+    return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t *lock, uint64_t flags) {
+    write_unlock(lock);
+    irq_restore(flags);
+}
@@ -0,0 +1,71 @@
+/*
+Lock Contention Statistics
+
+Every spinlock, rwlock and mutex carries a lock_stat_t when LOCK_STATS is on.
+The counters are cheap to keep, they are only touched by the core that won the
+lock. Named locks are put on a global list the first time somebody has to wait
+for them, `lockstat` in the kernel shell prints that list.
+
+Registration runs with the lock held and possibly with interrupts off, so the
+list is pushed with a compare-and-swap instead of taking yet another lock.
+
+References:
+    https://lwn.net/Articles/267968/
+    https://www.kernel.org/doc/html/latest/locking/lockstat.html
+*/
+
+#include "stdio.h"
+
+#include "spinlock.h"
+
+static lock_stat_t *lock_stat_list = NULL;      // Contended named locks, newest first, never shrinks
+
+
+void lock_stat_register(lock_stat_t *stat) {
+    uint32_t expected = 0;
+    if (!__atomic_compare_exchange_n(&stat->listed, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;                                 // Another core linked it first
+    }
+
+    lock_stat_t *head = __atomic_load_n(&lock_stat_list, __ATOMIC_RELAXED);
+    do {
+        stat->next = head;
+    } while (!__atomic_compare_exchange_n(&lock_stat_list, &head, stat, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+void lock_stat_print() {
+#if LOCK_STATS
+    printf("Lock\t\tAcquired\tContended\tCont%%\tAvg wait\tMax wait\n");
+
+    int count = 0;
+    for (lock_stat_t *s = __atomic_load_n(&lock_stat_list, __ATOMIC_ACQUIRE); s; s = s->next) {
+        uint64_t acquired = s->acquired;
+        uint64_t contended = s->contended;
+        uint64_t percent = acquired ? (contended * 100) / acquired : 0;
+        uint64_t avg = contended ? s->spins / contended : 0;
+
+        printf("%s\t\t%llu\t\t%llu\t\t%llu\t%llu\t\t%llu\n",
+               s->name, acquired, contended, percent, avg, s->max_spins);
+        count++;
+    }
+
+    if (count == 0) {
+        printf("No named lock has been contended yet.\n");
+    }
+    printf("Waits are pause loops for spinlocks and rwlocks, sleeps for mutexes.\n");
+#else
+    printf("Lock statistics are compiled out (LOCK_STATS=0).\n");
+#endif
+}
+
+
+void lock_stat_reset() {
+    // Racy against the lock holders, good enough to start a new measurement
+    for (lock_stat_t *s = __atomic_load_n(&lock_stat_list, __ATOMIC_ACQUIRE); s; s = s->next) {
+        s->acquired = 0;
+        s->contended = 0;
+        s->spins = 0;
+        s->max_spins = 0;
+    }
+}
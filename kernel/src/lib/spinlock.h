@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Ticket spinlock usable from any core.
+// Cores are served in arrival order, so a busy lock cannot starve one of them.
+// The irqsave variants also keep the local core from being interrupted while the lock is held,
+// so the same lock can be taken from interrupt handlers without deadlocking.
+
+#ifndef LOCK_STATS
+#define LOCK_STATS 1        // Build with -DLOCK_STATS=0 to drop the counters from every lock
+#endif
+
+// Contention counters, only written by the holder of the lock they belong to.
+// Named locks must never be freed, they stay on lock_stat_list once contended.
+typedef struct lock_stat {
+    const char *name;           // Set by the *_INIT_NAMED() initialisers, only named locks are listed
+    uint64_t acquired;          // Times the lock was taken
+    uint64_t contended;         // Times it was already held by someone else
+    uint64_t spins;             // Pause loops (or sleeps for a mutex) spent waiting in total
+    uint64_t max_spins;         // Longest single wait
+    struct lock_stat *next;     // lock_stat_list, linked the first time the lock is contended
+    volatile uint32_t listed;
+} lock_stat_t;
+
+void lock_stat_register(lock_stat_t *stat);
+void lock_stat_print();
+void lock_stat_reset();
+
+// Account one acquisition that waited `spins` rounds, the caller holds the lock
+static inline void lock_stat_acquired(lock_stat_t *stat, uint64_t spins) {
+    stat->acquired++;
+    if (spins) {
+        stat->contended++;
+        stat->spins += spins;
+        if (spins > stat->max_spins) stat->max_spins = spins;
+        if (stat->name && !stat->listed) lock_stat_register(stat);
+    }
+}
+
+
+typedef struct {
+    volatile uint16_t next;     // Ticket handed to the next core that arrives
+    volatile uint16_t owner;    // Ticket currently allowed in
+#if LOCK_STATS
+    lock_stat_t stat;
+#endif
+} spinlock_t;
+
+#if LOCK_STATS
+#define SPINLOCK_INIT_NAMED(n) { .next = 0, .owner = 0, .stat = { .name = (n) } }
+#else
+#define SPINLOCK_INIT_NAMED(n) { .next = 0, .owner = 0 }
+#endif
+#define SPINLOCK_INIT SPINLOCK_INIT_NAMED(NULL)
+
+
+static inline void spin_lock(spinlock_t *lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
+
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        asm volatile("pause");              // Every waiter reads the same line until the owner moves on
+        spins++;
+    }
+#if LOCK_STATS
+    lock_stat_acquired(&lock->stat, spins);
+#else
+    (void) spins;
+#endif
+}
+
+static inline bool spin_trylock(spinlock_t *lock) {
+    uint16_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    uint16_t expected = owner;
+
+    // Only succeeds while nobody holds or waits for the lock
+    if (!__atomic_compare_exchange_n(&lock->next, &expected, (uint16_t)(owner + 1),
+                                     false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
+    }
+#if LOCK_STATS
+    lock_stat_acquired(&lock->stat, 0);
+#endif
+    return true;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    // Only the holder writes owner, so a plain increment is enough
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline bool spin_is_locked(spinlock_t *lock) {
+    return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) != __atomic_load_n(&lock->next, __ATOMIC_RELAXED);
+}
+
+
+// Disable interrupts on this core and return the previous RFLAGS
+static inline uint64_t irq_save() {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Re-enable interrupts if they were enabled when irq_save() was called
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1 << 9)) {                 // RFLAGS.IF
+        asm volatile("sti" : : : "memory");
+    }
+}
+
+
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
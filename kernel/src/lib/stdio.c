@@ -11,29 +11,13 @@ Author       : Baponkar
 
 #include "../driver/vga/vga_term.h"
 #include "stdlib.h"
+#include "spinlock.h"
 
 #include "stdio.h"
 
-typedef struct {
-    bool locked;
-} spinlock_t;
-
-
-spinlock_t serial_lock;
-
-
-static void acquire(spinlock_t* lock) {
-    while (true) {  // Because a spinlock must wait until the lock becomes free.
-        if (lock->locked == false) {
-            lock->locked = true;
-            return;
-        }
-    }
-}
-
-static void release(spinlock_t* lock) {
-    lock->locked = false;
-}
+// Keeps lines from different cores apart. Interrupts stay off while it is held,
+// so a handler on the same core which prints can not spin on it forever.
+static spinlock_t serial_lock = SPINLOCK_INIT_NAMED("serial");
 
 // printing signless decimal number
 static void print_udec(uint64_t value) {
@@ -298,14 +282,14 @@ void vprintf(const char* format, va_list args) {
 
 // printing string ,character, numbers etc
 void printf(const char* format, ...) {
-    acquire(&serial_lock);
+    uint64_t flags = spin_lock_irqsave(&serial_lock);
     va_list args;
     va_start(args, format);
 
     vprintf(format, args);
 
     va_end(args);
-    release(&serial_lock);
+    spin_unlock_irqrestore(&serial_lock, flags);
 }
 
 // sprintf and vsprintf implementations
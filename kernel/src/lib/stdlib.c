@@ -7,7 +7,7 @@ Author       : Baponkar
 
 */
 
-#include "../memory/kheap.h"
+#include "../memory/slab.h"
 #include "../memory/vmm.h"
 
 #include "stdio.h"
@@ -132,6 +132,7 @@ long atol(const char *str) {
 /* ---------- Memory management ---------- */
 #define ALIGN8(x) (((x) + 7) & ~7)
 
+// Small blocks come from the slab size classes, big blocks fall through to kheap inside slab_alloc
 void *malloc(size_t size) {
     
     if (size == 0){
@@ -141,19 +142,17 @@ void *malloc(size_t size) {
     
     size = ALIGN8(size);
 
-    // Allocate space for header + user data
+#if MALLOC_DEBUG
+    // Allocate space for header + user data + tailer
     size_t total_size = HEADER_SIZE + size + TAILER_SIZE;
 
-    // if(total_size > )
-
-    malloc_header_t *header = (malloc_header_t*)kheap_alloc(total_size, ALLOCATE_DATA);
+    malloc_header_t *header = (malloc_header_t*)slab_alloc(total_size);
     if (!header) return NULL;
     memset(header, 0,  HEADER_SIZE);
     
     // Initialize header
     header->size = size;
     header->magic = MAGIC;
-    // next/prev can be used for heap management if needed
 
     void *ptr = (void *) ((uint8_t*)header + HEADER_SIZE);
     memset(ptr, 0, size);
@@ -164,14 +163,20 @@ void *malloc(size_t size) {
      // Initialize tailer
     tailer_ptr->size = size;
     tailer_ptr->magic = MAGIC;
-    
+#else
+    void *ptr = slab_alloc(size);
+    if (!ptr) return NULL;
+    if (size <= SLAB_MAX_SIZE) memset(ptr, 0, size);    // Large blocks are fresh kheap pages, already zeroed
+#endif
+
     return ptr;
 }
 
 void free(void *ptr) {
 
     if (ptr == NULL) return;
-    
+
+#if MALLOC_DEBUG
     // Get header from user pointer
     malloc_header_t *header = (malloc_header_t*)((uint8_t*)ptr - HEADER_SIZE);
     malloc_header_t *tailer = (malloc_header_t*)((uint8_t*)ptr + header->size);
@@ -182,23 +187,36 @@ void free(void *ptr) {
         return;
     }
     
-    size_t total_size = HEADER_SIZE + header->size + TAILER_SIZE;
     header->magic = 0;
     header->size = 0;
     tailer->magic = 0;
     
     // Free the entire block (header + user data + tailer)
-    kheap_free(header, total_size);
+    slab_free(header);
+#else
+    slab_free(ptr);
+#endif
+}
+
+// Usable size of a block returned by malloc
+static size_t malloc_usable_size(void *ptr) {
+#if MALLOC_DEBUG
+    malloc_header_t *header = (malloc_header_t*)((uint8_t*)ptr - HEADER_SIZE);
+    if (header->magic != MAGIC) {
+        printf("[Heap Error] Invalid realloc: corrupted header\n");
+        return 0;
+    }
+    return header->size;
+#else
+    return slab_size(ptr);
+#endif
 }
 
 
 void *calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > ((size_t)-1) / size) return NULL;   // Overflow
     size_t total = nmemb * size;
-    void *ptr = malloc(total);
-    if (ptr) {
-        memset(ptr, 0, total);
-    }
-    return ptr;
+    return malloc(total);                                        // malloc already returns zeroed memory
 }
 
 void *realloc(void *ptr, size_t size) {
@@ -209,25 +227,18 @@ void *realloc(void *ptr, size_t size) {
     }
     
     // Get original size from header
-    malloc_header_t *old_header = (malloc_header_t*)((uint8_t*)ptr - HEADER_SIZE);
-    
-    if (old_header->magic != MAGIC) {
-        printf("[Heap Error] Invalid realloc: corrupted header\n");
-        return NULL;
-    }
-    
-    size_t old_size = old_header->size;
+    size_t old_size = malloc_usable_size(ptr);
+    if (old_size == 0) return NULL;
     
-    // If same size, return original pointer
-    if (old_size == size) return ptr;
+    // If the block is already big enough, return original pointer
+    if (ALIGN8(size) <= old_size) return ptr;
     
     // Allocate new block
     void *new_ptr = malloc(size);
     if (!new_ptr) return NULL;
     
-    // Copy minimum of old and new size
-    size_t copy_size = (old_size < size) ? old_size : size;
-    memcpy(new_ptr, ptr, copy_size);
+    // Copy the old contents
+    memcpy(new_ptr, ptr, old_size);
     
     // Free old block
     free(ptr);
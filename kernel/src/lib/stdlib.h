@@ -25,6 +25,9 @@ typedef struct malloc_header {
 #define HEADER_SIZE sizeof(malloc_header_t)
 #define TAILER_SIZE sizeof(malloc_header_t)
 
+// Set to 1 to wrap every malloc block with a header and tailer magic check
+#define MALLOC_DEBUG 0
+
 
 void *malloc(size_t size);                  // Allocate memory
 void free(void *ptr);                       // Free allocated memory
@@ -1,70 +1,355 @@
 
 #include "../driver/vga/vga_term.h"
 #include "stdlib.h"
+#include "../sys/cpu/cpuid.h"
 
 #include "string.h"
 
-// Copy dat of src into dest
-void *memcpy(void *dest, const void *src, size_t n) {
-    uint8_t *d = (uint8_t *)dest;
-    const uint8_t *s = (const uint8_t *)src;
+// memcpy(), memset() and memcmp() run one of the implementations below, picked from the
+// CPU features on first use:
+//   words : 8 bytes per move, works everywhere
+//   sse2  : 64 bytes per loop in xmm registers, non-temporal stores for big buffers
+//   erms  : rep movsb / rep stosb, which the CPU itself runs in cache line chunks
+// Interrupt handlers copy memory too, so the SSE2 code saves the xmm registers it uses.
+// While CR0.TS is set the thread's SSE state is not loaded (sys/cpu/fpu.c), short buffers
+// then take the word loops instead of the #NM trap, the scheduler copies registers_t too.
 
-    for (size_t i = 0; i < n; i++) {
-        d[i] = s[i];
+#define MEM_SSE2_MIN    64              // Smaller sizes go to the word loops
+#define MEM_SSE2_TS_MIN (4 * 1024)      // With CR0.TS set only buffers this big are worth the trap
+#define MEM_ERMS_MIN    128             // rep movsb start up costs more than a short word loop
+#define MEM_NT_MIN      (512 * 1024)    // Bigger buffers bypass the cache, they would evict it anyway
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) mem_word_t;
+
+// Keep GCC from turning the loops below back into calls to memcpy() and memset()
+#define MEM_NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+
+// Whether the SSE registers may be used without raising #NM
+static inline bool sse_ready(size_t n) {
+    if (n >= MEM_SSE2_TS_MIN) return true;
+
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return !(cr0 & (1 << 3));           // CR0.TS
+}
+
+
+MEM_NO_LIBCALL static void *memcpy_words(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *) dest;
+    const uint8_t *s = (const uint8_t *) src;
+
+    for (; n >= 8; n -= 8, d += 8, s += 8) {
+        *(mem_word_t *) d = *(const mem_word_t *) s;
+    }
+    for (; n > 0; n--) {
+        *d++ = *s++;
     }
 
     return dest;
 }
 
-void *memset(void *s, int c, size_t n) {
-    // Checking This memory have Header or not
-    
-    uint8_t *p = (uint8_t *) s; // making uint8_t pointer from void pointer
+MEM_NO_LIBCALL static void *memset_words(void *s, int c, size_t n) {
+    uint8_t *p = (uint8_t *) s;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t) c;
 
-    for (size_t i = 0; i < n; i++) {
-        p[i] = (uint8_t) c;     // fill with c
+    for (; n >= 8; n -= 8, p += 8) {
+        *(mem_word_t *) p = pattern;
+    }
+    for (; n > 0; n--) {
+        *p++ = (uint8_t) c;
     }
 
     return s;
 }
 
+MEM_NO_LIBCALL static int memcmp_words(const void *s1, const void *s2, size_t n) {
+    const uint8_t *p1 = (const uint8_t *) s1;
+    const uint8_t *p2 = (const uint8_t *) s2;
 
+    // Skip equal words, the first differing byte is then found in the byte loop
+    for (; n >= 8; n -= 8, p1 += 8, p2 += 8) {
+        if (*(const mem_word_t *) p1 != *(const mem_word_t *) p2) break;
+    }
+    for (; n > 0; n--, p1++, p2++) {
+        if (*p1 != *p2) return *p1 < *p2 ? -1 : 1;
+    }
 
-// The memmove function copies n bytes from the memory area src to the memory area dest.
-void *memmove(void *dest, const void *src, size_t n) {
-    uint32_t *pdest = (uint32_t *) dest;
-    const uint32_t *psrc = (const uint32_t *) src;
-
-    // If src pointer location is located after dest
-    if (src > dest) {
-        for (size_t i = 0; i < n; i++) {
-            pdest[i] = psrc[i];
+    return 0;
+}
+
+
+static void *memcpy_sse2(void *dest, const void *src, size_t n) {
+    if (n < MEM_SSE2_MIN || !sse_ready(n)) return memcpy_words(dest, src, n);
+
+    uint8_t *d = (uint8_t *) dest;
+    const uint8_t *s = (const uint8_t *) src;
+
+    // Align the destination so the stores are aligned
+    size_t head = (16 - ((uint64_t) d & 15)) & 15;
+    memcpy_words(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t blocks = n / 64;
+    uint8_t saved[64] __attribute__((aligned(16)));
+
+    if (blocks) {
+        if (n >= MEM_NT_MIN) {
+            asm volatile(
+                "movdqa %%xmm0, 0(%[save])\n\t"
+                "movdqa %%xmm1, 16(%[save])\n\t"
+                "movdqa %%xmm2, 32(%[save])\n\t"
+                "movdqa %%xmm3, 48(%[save])\n\t"
+                "1:\n\t"
+                "movdqu 0(%[s]), %%xmm0\n\t"
+                "movdqu 16(%[s]), %%xmm1\n\t"
+                "movdqu 32(%[s]), %%xmm2\n\t"
+                "movdqu 48(%[s]), %%xmm3\n\t"
+                "movntdq %%xmm0, 0(%[d])\n\t"
+                "movntdq %%xmm1, 16(%[d])\n\t"
+                "movntdq %%xmm2, 32(%[d])\n\t"
+                "movntdq %%xmm3, 48(%[d])\n\t"
+                "add $64, %[s]\n\t"
+                "add $64, %[d]\n\t"
+                "dec %[cnt]\n\t"
+                "jnz 1b\n\t"
+                "sfence\n\t"
+                "movdqa 0(%[save]), %%xmm0\n\t"
+                "movdqa 16(%[save]), %%xmm1\n\t"
+                "movdqa 32(%[save]), %%xmm2\n\t"
+                "movdqa 48(%[save]), %%xmm3"
+                : [s] "+r"(s), [d] "+r"(d), [cnt] "+r"(blocks)
+                : [save] "r"(saved)
+                : "cc", "memory");
+        } else {
+            asm volatile(
+                "movdqa %%xmm0, 0(%[save])\n\t"
+                "movdqa %%xmm1, 16(%[save])\n\t"
+                "movdqa %%xmm2, 32(%[save])\n\t"
+                "movdqa %%xmm3, 48(%[save])\n\t"
+                "1:\n\t"
+                "movdqu 0(%[s]), %%xmm0\n\t"
+                "movdqu 16(%[s]), %%xmm1\n\t"
+                "movdqu 32(%[s]), %%xmm2\n\t"
+                "movdqu 48(%[s]), %%xmm3\n\t"
+                "movdqa %%xmm0, 0(%[d])\n\t"
+                "movdqa %%xmm1, 16(%[d])\n\t"
+                "movdqa %%xmm2, 32(%[d])\n\t"
+                "movdqa %%xmm3, 48(%[d])\n\t"
+                "add $64, %[s]\n\t"
+                "add $64, %[d]\n\t"
+                "dec %[cnt]\n\t"
+                "jnz 1b\n\t"
+                "movdqa 0(%[save]), %%xmm0\n\t"
+                "movdqa 16(%[save]), %%xmm1\n\t"
+                "movdqa 32(%[save]), %%xmm2\n\t"
+                "movdqa 48(%[save]), %%xmm3"
+                : [s] "+r"(s), [d] "+r"(d), [cnt] "+r"(blocks)
+                : [save] "r"(saved)
+                : "cc", "memory");
         }
-    // If src pointer location is located before dest
-    } else if (src < dest) {
-        for (size_t i = n; i > 0; i--) {
-            pdest[i-1] = psrc[i-1];
+    }
+
+    memcpy_words(d, s, n % 64);
+    return dest;
+}
+
+static void *memset_sse2(void *s, int c, size_t n) {
+    if (n < MEM_SSE2_MIN || !sse_ready(n)) return memset_words(s, c, n);
+
+    uint8_t *p = (uint8_t *) s;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t) c;
+
+    size_t head = (16 - ((uint64_t) p & 15)) & 15;
+    memset_words(p, c, head);
+    p += head;
+    n -= head;
+
+    size_t blocks = n / 64;
+    uint8_t saved[16] __attribute__((aligned(16)));
+
+    if (blocks) {
+        if (n >= MEM_NT_MIN) {
+            asm volatile(
+                "movdqa %%xmm0, (%[save])\n\t"
+                "movq %[pat], %%xmm0\n\t"
+                "punpcklqdq %%xmm0, %%xmm0\n\t"
+                "1:\n\t"
+                "movntdq %%xmm0, 0(%[p])\n\t"
+                "movntdq %%xmm0, 16(%[p])\n\t"
+                "movntdq %%xmm0, 32(%[p])\n\t"
+                "movntdq %%xmm0, 48(%[p])\n\t"
+                "add $64, %[p]\n\t"
+                "dec %[cnt]\n\t"
+                "jnz 1b\n\t"
+                "sfence\n\t"
+                "movdqa (%[save]), %%xmm0"
+                : [p] "+r"(p), [cnt] "+r"(blocks)
+                : [pat] "r"(pattern), [save] "r"(saved)
+                : "cc", "memory");
+        } else {
+            asm volatile(
+                "movdqa %%xmm0, (%[save])\n\t"
+                "movq %[pat], %%xmm0\n\t"
+                "punpcklqdq %%xmm0, %%xmm0\n\t"
+                "1:\n\t"
+                "movdqa %%xmm0, 0(%[p])\n\t"
+                "movdqa %%xmm0, 16(%[p])\n\t"
+                "movdqa %%xmm0, 32(%[p])\n\t"
+                "movdqa %%xmm0, 48(%[p])\n\t"
+                "add $64, %[p]\n\t"
+                "dec %[cnt]\n\t"
+                "jnz 1b\n\t"
+                "movdqa (%[save]), %%xmm0"
+                : [p] "+r"(p), [cnt] "+r"(blocks)
+                : [pat] "r"(pattern), [save] "r"(saved)
+                : "cc", "memory");
         }
     }
 
+    memset_words(p, c, n % 64);
+    return s;
+}
+
+static int memcmp_sse2(const void *s1, const void *s2, size_t n) {
+    if (n < MEM_SSE2_MIN || !sse_ready(n)) return memcmp_words(s1, s2, n);
+
+    const uint8_t *p1 = (const uint8_t *) s1;
+    const uint8_t *p2 = (const uint8_t *) s2;
+    size_t off = 0;
+    uint8_t saved[32] __attribute__((aligned(16)));
+
+    // Find the first 16 byte block which differs, the word loop finds the byte inside it
+    asm volatile(
+        "movdqa %%xmm0, 0(%[save])\n\t"
+        "movdqa %%xmm1, 16(%[save])\n\t"
+        "1:\n\t"
+        "cmp %[end], %[off]\n\t"
+        "jae 2f\n\t"
+        "movdqu (%[a], %[off]), %%xmm0\n\t"
+        "movdqu (%[b], %[off]), %%xmm1\n\t"
+        "pcmpeqb %%xmm1, %%xmm0\n\t"
+        "pmovmskb %%xmm0, %%eax\n\t"
+        "cmp $0xFFFF, %%eax\n\t"
+        "jne 2f\n\t"
+        "add $16, %[off]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        "movdqa 0(%[save]), %%xmm0\n\t"
+        "movdqa 16(%[save]), %%xmm1"
+        : [off] "+r"(off)
+        : [a] "r"(p1), [b] "r"(p2), [end] "r"(n & ~(size_t) 15), [save] "r"(saved)
+        : "rax", "cc", "memory");
+
+    return memcmp_words(p1 + off, p2 + off, n - off);
+}
+
+
+static void *memcpy_erms(void *dest, const void *src, size_t n) {
+    if (n < MEM_ERMS_MIN) return memcpy_words(dest, src, n);
+
+    void *d = dest;
+    asm volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
     return dest;
 }
 
+static void *memset_erms(void *s, int c, size_t n) {
+    if (n < MEM_ERMS_MIN) return memset_words(s, c, n);
 
+    void *p = s;
+    asm volatile("rep stosb" : "+D"(p), "+c"(n) : "a"(c) : "memory");
+    return s;
+}
 
 
-// compare two memory location with size n
-int memcmp(const void *s1, const void *s2, size_t n) {
-    const uint8_t *p1 = (const uint8_t *)s1;
-    const uint8_t *p2 = (const uint8_t *)s2;
+// Every implementation, the fastest last. repe cmpsb is slow, erms compares with SSE2.
+static const mem_ops_t mem_ops_all[] = {
+    { "words", memcpy_words, memset_words, memcmp_words },
+    { "sse2",  memcpy_sse2,  memset_sse2,  memcmp_sse2 },
+    { "erms",  memcpy_erms,  memset_erms,  memcmp_sse2 },
+};
 
-    for (size_t i = 0; i < n; i++) {
-        if (p1[i] != p2[i]) {
-            return p1[i] < p2[i] ? -1 : 1;
-        }
+static const mem_ops_t *mem_ops = NULL;
+
+
+static bool mem_ops_supported(const mem_ops_t *ops) {
+    if (ops->copy == memcpy_sse2) return has_sse2();
+    if (ops->copy == memcpy_erms) return has_erms() && has_sse2();
+    return true;
+}
+
+
+// Implementation memcpy(), memset() and memcmp() use, chosen on the first call
+const mem_ops_t *mem_ops_active() {
+    if (!mem_ops) {
+        int i = sizeof(mem_ops_all) / sizeof(mem_ops_all[0]) - 1;
+        while (i > 0 && !mem_ops_supported(&mem_ops_all[i])) i--;
+        mem_ops = &mem_ops_all[i];
     }
+    return mem_ops;
+}
 
-    return 0;
+// Fill list with the implementations this CPU can run, returns how many
+int mem_ops_list(const mem_ops_t **list, int max) {
+    int count = 0;
+    for (size_t i = 0; i < sizeof(mem_ops_all) / sizeof(mem_ops_all[0]) && count < max; i++) {
+        if (mem_ops_supported(&mem_ops_all[i])) list[count++] = &mem_ops_all[i];
+    }
+    return count;
+}
+
+
+// Copy dat of src into dest
+void *memcpy(void *dest, const void *src, size_t n) {
+    return mem_ops_active()->copy(dest, src, n);
+}
+
+void *memset(void *s, int c, size_t n) {
+    return mem_ops_active()->set(s, c, n);
+}
+
+
+
+// The memmove function copies n bytes from the memory area src to the memory area dest.
+MEM_NO_LIBCALL void *memmove(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *) dest;
+    const uint8_t *s = (const uint8_t *) src;
+
+    if (d == s || n == 0) return dest;
+
+    // No overlap, any copy works
+    if (d + n <= s || s + n <= d) {
+        return memcpy(dest, src, n);
+    }
+
+    // dest before src: a forward copy reads every word before it is overwritten
+    if (d < s) {
+        return memcpy_words(dest, src, n);
+    }
+
+    // dest after src: copy backwards from the end
+    d += n;
+    s += n;
+    for (; n >= 8; n -= 8) {
+        d -= 8;
+        s -= 8;
+        *(mem_word_t *) d = *(const mem_word_t *) s;
+    }
+    while (n--) {
+        *--d = *--s;
+    }
+
+    return dest;
+}
+
+
+
+
+// compare two memory location with size n
+int memcmp(const void *s1, const void *s2, size_t n) {
+    return mem_ops_active()->cmp(s1, s2, n);
 }
 
 
@@ -11,6 +11,17 @@ void *memmove(void *dest, const void *src, size_t n);   // moving first n bytes
 int   memcmp(const void *s1, const void *s2, size_t n); // Compare first n bytes of memory s1 and s2
 void *memchr(const void *s, int c, size_t n);           // Search c in first n bytes of pointer s
 
+// One implementation of memcpy(), memset() and memcmp(), picked from the CPU features on first use
+typedef struct mem_ops {
+    const char *name;
+    void *(*copy)(void *dest, const void *src, size_t n);
+    void *(*set)(void *s, int c, size_t n);
+    int (*cmp)(const void *s1, const void *s2, size_t n);
+} mem_ops_t;
+
+const mem_ops_t *mem_ops_active();                      // The implementation in use
+int mem_ops_list(const mem_ops_t **list, int max);      // Implementations this CPU can run
+
 
 void int_to_ascii(int n, char str[]);   // Integer to ASCII Code
 void reverse(char s[]);                 // String reverse
@@ -230,21 +230,17 @@ size_t strftime(char *s, size_t max, const char *format, const struct tm *tm) {
 }
 
 
+// Sleep on the calling core, cpu_id is kept for older callers
 void sleep_seconds(uint8_t cpu_id, uint64_t seconds) {
-    uint64_t start = get_uptime_seconds(cpu_id);
-    while ((get_uptime_seconds(cpu_id) - start) < seconds) {
-        // asm volatile("hlt"); // save CPU cycles
-    }
+    (void) cpu_id;
+    apic_usleep(seconds * 1000000);
 }
 
 
+// Sleep usec microseconds, woken by the APIC timer at the deadline
 void usleep(uint8_t cpu_id, uint64_t usec) {
-    uint64_t start_ms = get_uptime_seconds(cpu_id) * 1000; // convert seconds to ms
-    uint64_t target_ms = start_ms + usec / 1000;     // target time in ms
-
-    while ((get_uptime_seconds(cpu_id) * 1000) < target_ms) {
-        // asm volatile("hlt"); // reduce CPU usage
-    }
+    (void) cpu_id;
+    apic_usleep(usec);
 }
 
 
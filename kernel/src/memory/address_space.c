@@ -0,0 +1,302 @@
+/*
+Address Spaces and PCIDs
+
+Every process owns a PML4. The kernel half (PML4 entries 256 - 511) is copied
+from the kernel PML4 after those entries were given a PDPT each, so all address
+spaces share the kernel page tables below them. PML4 entry 0 holds the low user
+window the ELF loader writes to. A new address space shares it with the kernel,
+fork gives the child a copy-on-write copy like the rest of the lower half.
+
+When the CPU has PCIDs every address space gets its own tag and CR3 is loaded
+with the no-flush bit, so switching between processes keeps the TLB entries of
+both. A core which misses a shootdown because it runs another address space gets
+that PCID marked stale instead, and flushes it when it loads the PCID again.
+
+References:
+    https://wiki.osdev.org/TLB
+    https://www.felixcloutier.com/x86/invpcid
+    https://lwn.net/Articles/671299/
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/spinlock.h"
+#include "../sys/cpu/cpu.h"
+#include "../sys/cpu/cpuid.h"
+#include "detect_memory.h"
+#include "paging.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "meminfo.h"
+
+#include "address_space.h"
+
+extern bool debug_on;
+extern uint64_t bsp_cr3;
+
+address_space_t kernel_as = { .pml4_phys = 0, .pcid = PCID_KERNEL };
+
+static bool pcid_on = false;                    // CR4.PCIDE set on every core
+static bool invpcid_on = false;
+static volatile uint64_t tagged_spaces = 0;     // Live address spaces with a PCID of their own
+
+static spinlock_t pcid_lock = SPINLOCK_INIT_NAMED("pcid");
+static uint64_t pcid_used[PCID_COUNT / 64] = { 1 };     // PCID_KERNEL is never handed out
+
+static bool kernel_half_filled = false;
+
+
+static inline uint64_t read_cr4() {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4) {
+    asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+
+// Enable PCIDs on this core when the CPU has them. Called on every core after its paging is set up.
+void init_pcid() {
+    if (!kernel_as.pml4_phys) kernel_as.pml4_phys = bsp_cr3 & ~0xFFFULL;
+
+    if (!has_pcid()) {
+        if(debug_on) printf(" [-] PCID is not supported, address space switches flush the TLB\n");
+        return;
+    }
+
+    set_cr3_addr(get_cr3_addr());               // CR4.PCIDE can only be set while CR3[11:0] is zero
+    write_cr4(read_cr4() | CR4_PCIDE);
+
+    pcid_on = true;
+    invpcid_on = has_invpcid();
+
+    if(debug_on) printf(" [-] PCID enabled (INVPCID %s)\n", invpcid_on ? "available" : "not available");
+}
+
+
+bool pcid_enabled() {
+    return pcid_on;
+}
+
+// True when TLB entries may be tagged with more than one PCID, see tlb_flush_range()
+bool pcid_tagged() {
+    return pcid_on && __atomic_load_n(&tagged_spaces, __ATOMIC_ACQUIRE) > 0;
+}
+
+
+// Drop the TLB entries of every PCID on this core, global ones included
+void flush_tlb_all_contexts() {
+    if (invpcid_on) {
+        struct { uint64_t pcid; uint64_t addr; } desc = { 0, 0 };
+        asm volatile("invpcid %0, %1" : : "m"(desc), "r"((uint64_t) 2) : "memory");     // Type 2: all contexts
+        return;
+    }
+
+    // Toggling CR4.PGE invalidates all TLB entries of all PCIDs
+    uint64_t flags = irq_save();
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 ^ CR4_PGE);
+    write_cr4(cr4);
+    irq_restore(flags);
+}
+
+
+static int alloc_pcid() {
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    for (int i = 0; i < PCID_COUNT / 64; i++) {
+        if (pcid_used[i] == UINT64_MAX) continue;
+        for (int bit = 0; bit < 64; bit++) {
+            if (pcid_used[i] & (1ULL << bit)) continue;
+            pcid_used[i] |= 1ULL << bit;
+            spin_unlock_irqrestore(&pcid_lock, flags);
+            return i * 64 + bit;
+        }
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+    return -1;
+}
+
+static void free_pcid(uint16_t pcid) {
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    pcid_used[pcid / 64] &= ~(1ULL << (pcid % 64));
+    spin_unlock_irqrestore(&pcid_lock, flags);
+}
+
+
+// Mark pcid as holding stale TLB entries on a core, it is flushed there when next loaded
+void pcid_mark_stale(uint32_t cpu_id, uint16_t pcid) {
+    if (cpu_id >= MAX_CPUS) return;
+    __atomic_fetch_or(&cpu_datas[cpu_id].pcid_stale[pcid / 64], 1ULL << (pcid % 64), __ATOMIC_SEQ_CST);
+}
+
+// PCID of the address space a core is running
+uint16_t cpu_current_pcid(uint32_t cpu_id) {
+    if (cpu_id >= MAX_CPUS) return PCID_KERNEL;
+    address_space_t *as = __atomic_load_n(&cpu_datas[cpu_id].as, __ATOMIC_SEQ_CST);
+    return as ? as->pcid : PCID_KERNEL;
+}
+
+
+// Build a PML4 sharing the kernel half and the identity map with the kernel address space
+int create_address_space(address_space_t *as) {
+    if (!as) return -1;
+
+    if (!kernel_half_filled) {
+        if (fill_kernel_half(kernel_pml4) != 0) {
+            printf("[Error] AS: Failed to fill the kernel half of the kernel PML4\n");
+            return -1;
+        }
+        kernel_half_filled = true;
+    }
+
+    uint64_t pml4_phys = create_new_pml4();
+    if (!pml4_phys) {
+        printf("[Error] AS: Failed to allocate a PML4\n");
+        return -1;
+    }
+
+    uint64_t *entries = (uint64_t *) phys_to_vir(pml4_phys);
+    uint64_t *kernel_entries = (uint64_t *) kernel_pml4;
+    for (int i = 0; i < AS_SHARED_USER_ENTRIES; i++) {
+        entries[i] = kernel_entries[i];
+    }
+    for (int i = ENTRIES_PER_TABLE / 2; i < ENTRIES_PER_TABLE; i++) {
+        entries[i] = kernel_entries[i];
+    }
+
+    as->pml4_phys = pml4_phys;
+    as->pcid = PCID_KERNEL;
+    va_space_init(&as->uheap, AS_UHEAP_START, AS_UHEAP_END);
+    as->brk_start = 0;
+    as->brk = 0;
+    as->resident_pages = 0;
+
+    if (pcid_on) {
+        int pcid = alloc_pcid();
+        if (pcid < 0) {
+            printf("[Error] AS: Out of PCIDs\n");
+            pmm_free_frame(PHYS_ADDR_TO_BIT_NO(pml4_phys));
+            mem_account(MEM_PAGE_TABLES, -PAGE_SIZE);
+            return -1;
+        }
+        as->pcid = (uint16_t) pcid;
+        __atomic_fetch_add(&tagged_spaces, 1, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+
+// Whether PML4 entry 0 of pml4 is its own, given by fork, or still the kernel's
+static bool low_window_private(pml4_t *pml4) {
+    return pml4->entries[0].base_addr != kernel_pml4->entries[0].base_addr;     // Flags may change, the table stays
+}
+
+
+// Give child, freshly built by create_address_space(), a copy-on-write view of the lower
+// half of parent. parent must be loaded on this core, its writable pages turn read only.
+int fork_address_space(address_space_t *parent, address_space_t *child) {
+    if (!parent || !child || !child->pml4_phys || current_address_space() != parent) {
+        printf("[Error] AS: fork needs the loaded address space as parent\n");
+        return -1;
+    }
+
+    pml4_t *src = (pml4_t *) phys_to_vir(parent->pml4_phys);
+    pml4_t *dst = (pml4_t *) phys_to_vir(child->pml4_phys);
+
+    // Entry 0 too, the user image and stack live there. Pages which became read only
+    // may still be writable in a TLB, the batch shoots down exactly those.
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    int64_t pages = copy_pml4_entries_cow(src, dst, 0, ENTRIES_PER_TABLE / 2 - 1, &batch);
+    tlb_batch_flush(&batch);
+
+    if (pages < 0) return -1;                   // Shares taken so far are dropped by destroy_address_space()
+
+    vm_clone_regions(parent->pml4_phys, child->pml4_phys);
+    child->brk_start = parent->brk_start;
+    child->brk = parent->brk;
+    child->resident_pages = (uint64_t) pages;           // Shared copy-on-write pages count in both
+
+    va_space_destroy(&child->uheap);
+    return va_space_clone(&child->uheap, &parent->uheap);
+}
+
+
+// Free the private part of an address space. It must not be loaded on any core.
+void destroy_address_space(address_space_t *as) {
+    if (!as || !as->pml4_phys || as == &kernel_as) return;
+
+    vm_drop_regions(as->pml4_phys);
+    va_space_destroy(&as->uheap);
+
+    pml4_t *pml4 = (pml4_t *) phys_to_vir(as->pml4_phys);
+    free_pml4_entries(pml4, low_window_private(pml4) ? 0 : AS_SHARED_USER_ENTRIES, ENTRIES_PER_TABLE / 2 - 1);
+
+    pmm_free_frame(PHYS_ADDR_TO_BIT_NO(as->pml4_phys));
+    mem_account(MEM_PAGE_TABLES, -PAGE_SIZE);
+
+    if (as->pcid != PCID_KERNEL) {
+        // Cores may still hold entries tagged with this PCID, flush them before it is reused
+        for (uint32_t i = 0; i < MAX_CPUS; i++) {
+            if (cpu_datas[i].is_online) pcid_mark_stale(i, as->pcid);
+        }
+        free_pcid(as->pcid);
+        __atomic_fetch_sub(&tagged_spaces, 1, __ATOMIC_RELEASE);
+    }
+
+    as->pml4_phys = 0;
+    as->pcid = PCID_KERNEL;
+}
+
+
+// Space whose resident_pages a lower half page at va counts in. The low window belongs
+// to the kernel while a space still shares it.
+address_space_t *address_space_of(uint64_t va) {
+    address_space_t *as = current_address_space();
+    if (as != &kernel_as && PML4_INDEX(va) < AS_SHARED_USER_ENTRIES &&
+        !low_window_private((pml4_t *) phys_to_vir(as->pml4_phys))) {
+        return &kernel_as;
+    }
+    return as;
+}
+
+
+address_space_t *current_address_space() {
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu || !cpu->as) return &kernel_as;
+    return cpu->as;
+}
+
+
+// Load as on this core. Nothing happens when it is already loaded.
+void switch_address_space(address_space_t *as) {
+    if (!as || !as->pml4_phys) return;
+
+    cpu_data_t *cpu = get_cpu_data();
+    if (cpu && (cpu->as ? cpu->as : &kernel_as) == as) return;
+
+    uint64_t flags = irq_save();
+    uint64_t cr3 = as->pml4_phys;
+
+    if (cpu) {
+        // Publish the new address space before looking at the stale bits,
+        // a shootdown sender checks them in the opposite order
+        __atomic_store_n(&cpu->as, as, __ATOMIC_SEQ_CST);
+    }
+
+    if (pcid_on) {
+        cr3 |= as->pcid;
+
+        uint64_t bit = 1ULL << (as->pcid % 64);
+        bool stale = true;                      // Without per-CPU data flush to be safe
+        if (cpu) {
+            stale = __atomic_fetch_and(&cpu->pcid_stale[as->pcid / 64], ~bit, __ATOMIC_SEQ_CST) & bit;
+        }
+        if (!stale) cr3 |= CR3_NOFLUSH;
+    }
+
+    set_cr3_addr(cr3);
+    irq_restore(flags);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "va_range.h"
+
+#define PCID_COUNT              4096                // CR3 bits 0-11
+#define PCID_KERNEL             0                   // Tag of the boot (kernel) address space
+
+#define CR3_NOFLUSH             (1ULL << 63)        // Keep the TLB entries of the loaded PCID
+#define CR4_PGE                 (1ULL << 7)
+#define CR4_PCIDE               (1ULL << 17)
+
+// PML4 entry 0 holds the low user window (ELF image at 0x401000, kernel uheap at 0x500000).
+// A new address space shares it with the kernel PML4, a forked one gets a copy-on-write copy.
+#define AS_SHARED_USER_ENTRIES  1
+#define AS_UHEAP_START          0x8000000000ULL     // 512 GB, first private PML4 entry
+#define AS_UHEAP_END            0x00007FFFFFFFF000ULL
+
+typedef struct address_space {
+    uint64_t pml4_phys;         // Physical address of the PML4
+    uint16_t pcid;              // TLB tag, PCID_KERNEL when PCIDs are not used
+    va_space_t uheap;           // Free lower half heap addresses, empty (end 0) until first use
+    uint64_t brk_start;         // Program break window taken from uheap, 0 until first brk()
+    uint64_t brk;               // Current program break
+    uint64_t resident_pages;    // Lower half pages mapped by the VMM
+} address_space_t;
+
+extern address_space_t kernel_as;
+
+void init_pcid();
+
+int create_address_space(address_space_t *as);
+void destroy_address_space(address_space_t *as);
+int fork_address_space(address_space_t *parent, address_space_t *child);
+void switch_address_space(address_space_t *as);
+address_space_t *current_address_space();
+address_space_t *address_space_of(uint64_t va);
+
+bool pcid_enabled();
+bool pcid_tagged();
+uint16_t cpu_current_pcid(uint32_t cpu_id);
+void pcid_mark_stale(uint32_t cpu_id, uint16_t pcid);
+void flush_tlb_all_contexts();
@@ -206,7 +206,8 @@ void set_usable_mem(){
 
     // USABLE_START_PHYS_MEM = 0x100000;
 
-    USABLE_START_PHYS_MEM &= 0xFFFFFFFFFFFFF000;    // Making 4KB aligned
+    // Aligned up to a bitmap row, so PMM blocks can be aligned in physical memory (needed for huge pages)
+    USABLE_START_PHYS_MEM = (USABLE_START_PHYS_MEM + USABLE_START_ALIGN - 1) & ~((uint64_t)USABLE_START_ALIGN - 1);
     phys_mem_head = USABLE_START_PHYS_MEM;          // Set the physical memory head to the start of usable memory
 
     //Final usable_mem_length
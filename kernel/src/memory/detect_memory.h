@@ -31,6 +31,10 @@ extern uint64_t KERNEL_OFFSET;
 // Changable Physical Memory Head address
 extern volatile uint64_t phys_mem_head;
 
+// Alignment of USABLE_START_PHYS_MEM, one PMM bitmap row (64 frames = 256 KB).
+// pmm_alloc_pages() aligns bigger blocks in physical memory by itself.
+#define USABLE_START_ALIGN 0x40000
+
 // Usable Physical Memory Address
 extern uint64_t USABLE_START_PHYS_MEM;
 extern uint64_t USABLE_END_PHYS_MEM;
@@ -4,37 +4,82 @@
 #include "../bootloader/boot.h"
 #include "../memory/detect_memory.h"
 #include "vmm.h"
+#include "pmm.h"
+#include "paging.h"
+#include "tlb.h"
+#include "va_range.h"
+#include "meminfo.h"
 
 #include "kheap.h"
 
-#define PAGE_SIZE 0x1000
+#define HUGE_PAGE_ORDER 9       // 2 MB = 2^9 frames
 
-static uint64_t h_va_head = HIGHER_HALF_START_ADDR;
+// Free kernel heap addresses, freed ranges are merged and handed out again
+static va_space_t h_va_space;
+static bool h_va_ready = false;
+
+static va_space_t *kheap_space() {
+    if (!h_va_ready) {
+        va_space_init(&h_va_space, HIGHER_HALF_START_ADDR, HIGHER_HALF_END_ADDR & ~0xFFFULL);
+        h_va_ready = true;
+    }
+    return &h_va_space;
+}
+
+
+// Unmap the pages of [va, va + size) with one shootdown, the frames are freed after it
+static void unmap_range(uint64_t va, uint64_t size) {
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+        vm_unmap(va + off, &batch);
+    }
+
+    tlb_batch_flush(&batch);        // Invalidate everywhere, then free the frames
+}
 
 
 void *kheap_alloc(size_t size, uint8_t type) {
     // Align size to page size (4 KiB)
     size = (size + 0xFFF) & ~0xFFF;
 
-    // Check if we have enough space in the heap
-    if ((h_va_head + size) > HIGHER_HALF_END_ADDR) {
+    // Take one more page as padding between allocations to prevent overlapping
+    uint64_t va = size ? va_range_alloc(kheap_space(), size + PAGE_SIZE, PAGE_SIZE) : 0;
+    if (!va) {
         printf("Out of memory\n");
         return NULL; // Out of heap space
     }
 
     // Allocate virtual pages for the requested size
-    uint64_t va = h_va_head;
-    
-    while (h_va_head < va + size) {
-        vm_alloc(h_va_head, type);          // allocating by vm_alloc function
-        h_va_head += PAGE_SIZE;             // Increment by page size (size)
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+        vm_alloc(va + off, type);           // allocating by vm_alloc function
     }
+    mem_account(MEM_KHEAP, size);
 
-    // Add 4KB padding between allocations to prevent overlapping
-    h_va_head += PAGE_SIZE;
+    return (void *)va; // Return the start of the allocated region
+}
 
 
-    return (void *)va; // Return the start of the allocated region
+// Reserve size bytes without backing them, every page gets a zeroed frame on first touch.
+// Not for DMA buffers, a device never faults the pages in.
+void *kheap_reserve(size_t size, uint8_t type) {
+    size = (size + 0xFFF) & ~0xFFF;
+
+    // Keep the guard page after the region
+    uint64_t va = size ? va_range_alloc(kheap_space(), size + PAGE_SIZE, PAGE_SIZE) : 0;
+    if (!va) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+
+    if (!vm_reserve(va, size, type)) {
+        va_range_free(kheap_space(), va, size + PAGE_SIZE);
+        return NULL;
+    }
+    mem_account(MEM_KHEAP_RESERVED, size);
+
+    return (void *)va;
 }
 
 
@@ -48,15 +93,145 @@ void kheap_free(void *ptr, size_t size) {
     size = (size + 0xFFF) & ~0xFFF;
 
     uint64_t va = (uint64_t)ptr;    // Get the virtual address of the pointer
+    uint64_t range = size + PAGE_SIZE;
 
-    // Free the pages corresponding to the memory region
-    while (size > 0) {              // If size greater than zero
-        vm_free((uint64_t *)va);    // Free the virtual page
-        va += PAGE_SIZE;            // Increase Virtual Address by 4KB
-        size -= PAGE_SIZE;          // Decrease the size variable by 4KB
+    if (vm_release(va, size)) {     // Reserved region, only touched pages are mapped
+        va_range_free(kheap_space(), va, range);
+        mem_account(MEM_KHEAP_RESERVED, -(int64_t) size);
+        return;
+    }
+    mem_account(MEM_KHEAP, -(int64_t) size);
+
+    unmap_range(va, size);
+    va_range_free(kheap_space(), (uint64_t)ptr, range);   // Addresses are reusable once no TLB holds them
+}
+
+
+// Like kheap_alloc() but without the padding page, so any page of the block may be given back
+// on its own with kheap_free_pages(). For page caches like the slab allocator.
+void *kheap_alloc_pages(size_t size, uint8_t type) {
+    size = (size + 0xFFF) & ~0xFFF;
+
+    uint64_t va = size ? va_range_alloc(kheap_space(), size, PAGE_SIZE) : 0;
+    if (!va) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+        vm_alloc(va + off, type);
     }
+    mem_account(MEM_KHEAP, size);
+
+    return (void *)va;
+}
+
+
+// Free [ptr, ptr + size) of a kheap_alloc_pages() block, other pages of the block stay mapped
+void kheap_free_pages(void *ptr, size_t size) {
+    if (!ptr || size == 0) return;
+
+    size = (size + 0xFFF) & ~0xFFF;
+    mem_account(MEM_KHEAP, -(int64_t) size);
+
+    unmap_range((uint64_t) ptr, size);
+    va_range_free(kheap_space(), (uint64_t) ptr, size);   // Exactly these pages, no padding behind them
 }
 
+
+// Allocate size bytes with a non-present guard page right below them. Meant for stacks,
+// an overflow faults on the guard page instead of running into the allocation before it.
+void *kheap_alloc_guarded(size_t size, uint8_t type) {
+    size = (size + 0xFFF) & ~0xFFF;
+
+    // Guard page, then the stack, then the usual padding page
+    uint64_t va = size ? va_range_alloc(kheap_space(), size + 2 * PAGE_SIZE, PAGE_SIZE) : 0;
+    if (!va) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+        vm_alloc(va + PAGE_SIZE + off, type);
+    }
+    mem_account(MEM_KHEAP, size);
+
+    return (void *)(va + PAGE_SIZE);
+}
+
+
+void kheap_free_guarded(void *ptr, size_t size) {
+    if (!ptr || size == 0) return;
+
+    size = (size + 0xFFF) & ~0xFFF;
+    mem_account(MEM_KHEAP, -(int64_t) size);
+
+    unmap_range((uint64_t) ptr, size);
+    va_range_free(kheap_space(), (uint64_t) ptr - PAGE_SIZE, size + 2 * PAGE_SIZE);
+}
+
+static void unmap_huge_range(uint64_t start, uint64_t size) {
+    for (uint64_t va = start; va < start + size; va += HUGE_PAGE_SIZE_2M) {
+        uint64_t phys = unmap_huge_page(va, HUGE_PAGE_SIZE_2M);
+        if (!phys) {
+            printf("[Error] KHEAP: No huge page at %x\n", va);
+            continue;
+        }
+        tlb_shootdown(va, HUGE_PAGE_SIZE_2M / PAGE_SIZE);   // Before the frames can be reused
+        pmm_free_pages(phys, HUGE_PAGE_ORDER);
+        mem_account(MEM_KHEAP, -(int64_t) HUGE_PAGE_SIZE_2M);
+    }
+}
+
+// Allocate size bytes (rounded up to 2 MB) mapped with 2 MB pages.
+// Every 2 MB page is physically contiguous, which suits frame buffers and big disk buffers
+// and needs one TLB entry instead of 512.
+void *kheap_alloc_huge(size_t size, uint8_t type) {
+    size = (size + HUGE_PAGE_SIZE_2M - 1) & ~((uint64_t) HUGE_PAGE_SIZE_2M - 1);
+
+    uint64_t va = size ? va_range_alloc(kheap_space(), size + PAGE_SIZE, HUGE_PAGE_SIZE_2M) : 0;
+    if (!va) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+
+    uint64_t flags = PAGE_PRESENT;
+    if (type != ALLOCATE_CODE) flags |= PAGE_WRITE;
+
+    for (uint64_t off = 0; off < size; off += HUGE_PAGE_SIZE_2M) {
+        uint64_t phys = pmm_alloc_pages(HUGE_PAGE_ORDER);
+        if (!phys || map_huge_page(phys, va + off, HUGE_PAGE_SIZE_2M, flags) != 0) {
+            printf("[Error] KHEAP: Failed to map huge page at %x\n", va + off);
+            if (phys) pmm_free_pages(phys, HUGE_PAGE_ORDER);
+            if (off) unmap_huge_range(va, off);
+            va_range_free(kheap_space(), va, size + PAGE_SIZE);
+            return NULL;
+        }
+        mem_account(MEM_KHEAP, HUGE_PAGE_SIZE_2M);
+    }
+
+    return (void *) va;
+}
+
+
+void kheap_free_huge(void *ptr, size_t size) {
+    if (!ptr || size == 0) {
+        printf("ptr | size == 0\n");
+        return;
+    }
+
+    size = (size + HUGE_PAGE_SIZE_2M - 1) & ~((uint64_t) HUGE_PAGE_SIZE_2M - 1);
+
+    unmap_huge_range((uint64_t) ptr, size);
+    va_range_free(kheap_space(), (uint64_t) ptr, size + PAGE_SIZE);
+}
+
+
+void kheap_print_stats() {
+    va_space_print_stats("Kernel heap", kheap_space());
+}
+
+
 void test_kheap(){
 
     // First Creating a virtual pointer and assigning a value to it
@@ -6,6 +6,17 @@
 
 #include "vmm.h"
 
-void *kheap_alloc(size_t size, uint8_t type);
+void *kheap_alloc(size_t size, uint8_t type);           // Zeroed pages
 void kheap_free(void *ptr, size_t size);
+void *kheap_reserve(size_t size, uint8_t type);         // Backed on first touch
+
+void *kheap_alloc_pages(size_t size, uint8_t type);     // No padding page, freed page by page
+void kheap_free_pages(void *ptr, size_t size);
+
+void *kheap_alloc_guarded(size_t size, uint8_t type);   // Non-present page below, for stacks
+void kheap_free_guarded(void *ptr, size_t size);
+
+void *kheap_alloc_huge(size_t size, uint8_t type);     // 2 MB pages
+void kheap_free_huge(void *ptr, size_t size);
+void kheap_print_stats();
 void test_kheap();
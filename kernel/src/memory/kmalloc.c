@@ -1,20 +1,60 @@
 /*
 This file will manage static memory allocation
+
+Until the PMM is initialized kmalloc is a bump allocator on phys_mem_head.
+init_pmm() marks everything below phys_mem_head as used and calls kmalloc_handoff(),
+from then on every kmalloc allocation is a block of whole frames taken from the PMM,
+so kfree() can give any allocation back instead of only the last one.
 */
 
 #include "../lib/stdio.h"
 #include "detect_memory.h"
+#include "pmm.h"
+#include "meminfo.h"
 
 #include "kmalloc.h"
 
-#define FRAME_SIZE 4096
-
 extern volatile uint64_t phys_mem_head;
 
+static bool pmm_ready = false;      // kmalloc is served by the PMM
+static uint64_t boot_end = 0;       // End of the memory handed out by the bump allocator
+
+
+// Smallest PMM order whose block can hold sz bytes, -1 if it is too big
+static int size_to_order(uint64_t sz) {
+    uint64_t frames_needed = (sz + FRAME_SIZE - 1) / FRAME_SIZE;
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        if ((0x1ULL << order) >= frames_needed) return order;
+    }
+    return -1;
+}
+
+
+// Allocation after the handoff, always frame aligned
+static uint64_t pmm_kmalloc(uint64_t sz) {
+    int order = size_to_order(sz ? sz : 1);
+    if (order < 0) {
+        printf("[Error] kmalloc: %d bytes is bigger than the largest PMM block\n", sz);
+        return 0;
+    }
+    uint64_t ptr = pmm_alloc_pages((uint8_t) order);
+    if (ptr) mem_account(MEM_KMALLOC, (int64_t) FRAME_SIZE << order);
+    return ptr;
+}
+
+
+// Called by init_pmm() once the bitmap covers everything allocated so far
+void kmalloc_handoff() {
+    boot_end = (phys_mem_head + FRAME_SIZE - 1) & ~((uint64_t)FRAME_SIZE - 1);
+    pmm_ready = true;
+}
+
 
 // Low level memory allocation by usin base as phys_mem_head
 uint64_t kmalloc(uint64_t sz)                   // vanilla (normal).
 {
+    if(pmm_ready) return pmm_kmalloc(sz);
+
     if(phys_mem_head >= USABLE_END_PHYS_MEM) return 0;
     uint64_t ptr = (uint64_t) phys_mem_head;    // memory allocate in current placement address
     phys_mem_head += sz;                        // increase the placement address for next memory allocation
@@ -35,6 +75,8 @@ uint64_t kmalloc_a(uint64_t sz, int align)    // page aligned.
     bits need to be zero (otherwise they would interfere with the read/write/protection/accessed bits).
     */
 
+    if(pmm_ready) return pmm_kmalloc(sz);          // PMM blocks are always page aligned
+
     if(phys_mem_head >= USABLE_END_PHYS_MEM) {
         printf("kmalloc_a: Out of memory\n");
         return 0;
@@ -58,14 +100,14 @@ The kmalloc_p function is used to allocate memory while also optionally returnin
 of the allocated memory.
 */
 uint64_t kmalloc_p(uint64_t sz, uint64_t *phys){
-    
+
+    uint64_t ptr = kmalloc(sz);
+
     if (phys)
     {   // phys (parameter): This is a pointer to a uint64_t variable where 
         // the physical address of the allocated memory will be stored.
-        *phys = phys_mem_head;
+        *phys = ptr;
     }
-    uint64_t ptr = phys_mem_head;
-    ptr += sz;
     return ptr;
 }
 
@@ -75,6 +117,12 @@ and also ensure page boundary alignment
 */
 uint64_t kmalloc_ap(uint64_t sz, int align, uint64_t *phys)  // page aligned and returns a physical address.
 {
+    if (pmm_ready) {
+        uint64_t ptr = pmm_kmalloc(sz);
+        if (phys) *phys = ptr;
+        return ptr;
+    }
+
     if (align == 1 && (phys_mem_head & 0xFFF)) // If the address is not already page-aligned and want to make it page aligned
     {
         // Align it.
@@ -119,6 +167,17 @@ bool check_mem_alloc(void *ptr, uint64_t size){
 }
 
 uint64_t kmalloc_aligned(uint64_t sz, uint64_t alignment) {
+    if (pmm_ready) {
+        // A PMM block is aligned to its own size, so ask for at least alignment bytes
+        uint64_t ptr = pmm_kmalloc(sz > alignment ? sz : alignment);
+        if (ptr & (alignment - 1)) {
+            printf("[Error] kmalloc_aligned: PMM block %x is not %x aligned\n", ptr, alignment);
+            kfree((void *) ptr, sz > alignment ? sz : alignment);
+            return 0;
+        }
+        return ptr;
+    }
+
     if (phys_mem_head >= USABLE_END_PHYS_MEM){
          return 0;
     }
@@ -139,13 +198,39 @@ void kfree(void *ptr, uint64_t size) {
 
     uint64_t addr = (uint64_t)ptr;
 
-    // Only allow free if it's the last allocated block
-    if (addr + size == phys_mem_head) {
-        phys_mem_head = addr;
-    } else {
-        // Cannot free non-last allocation
-        printf("kfree: Cannot free (not last allocation)\n");
+    if (!pmm_ready) {
+        // Only allow free if it's the last allocated block
+        if (addr + size == phys_mem_head) {
+            phys_mem_head = addr;
+        } else {
+            // Cannot free non-last allocation
+            printf("kfree: Cannot free (not last allocation)\n");
+        }
+        return;
+    }
+
+    if (addr < USABLE_START_PHYS_MEM || addr + size > USABLE_END_PHYS_MEM) {
+        printf("[Error] kfree: %x is not a kmalloc address\n", addr);
+        return;
+    }
+
+    if (addr < boot_end) {
+        // Bump allocations share frames, only the frames fully inside this block are released
+        uint64_t start = (addr + FRAME_SIZE - 1) & ~((uint64_t)FRAME_SIZE - 1);
+        uint64_t end = (addr + size) & ~((uint64_t)FRAME_SIZE - 1);
+        for (uint64_t frame = start; frame < end; frame += FRAME_SIZE) {
+            pmm_free_pages(frame, 0);
+        }
+        return;
+    }
+
+    int order = size_to_order(size ? size : 1);
+    if (order < 0 || (addr & (FRAME_SIZE - 1))) {
+        printf("[Error] kfree: Invalid free of %x (%d bytes)\n", addr, size);
+        return;
     }
+    pmm_free_pages(addr, (uint8_t) order);
+    mem_account(MEM_KMALLOC, -((int64_t) FRAME_SIZE << order));
 }
 
 void test_kmalloc(){
@@ -165,5 +250,10 @@ void test_kmalloc(){
 
     uint64_t *ptr4 = (uint64_t *) kmalloc_ap(23, 1, (void *)ptr1);
     printf("ptr4 : %x\n", ptr4);
+
+    kfree(ptr4, 23);
+    kfree(ptr3, 26);
+    kfree(ptr2, 43);
+    kfree(ptr1, 64);
 }
 
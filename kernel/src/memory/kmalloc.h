@@ -14,6 +14,8 @@ uint64_t kmalloc_aligned(uint64_t sz, uint64_t alignment);
 bool check_mem_alloc(void *ptr, uint64_t size);
 void kfree(void *ptr, uint64_t size);
 
+void kmalloc_handoff();                                         // switch kmalloc over to the PMM
+
 void test_kmalloc();
 
 
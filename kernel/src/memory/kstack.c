@@ -0,0 +1,75 @@
+/*
+Kernel Stack Cache
+
+Thread stacks are KSTACK_SIZE kernel heap pages with a non-present guard page
+below them, so a stack overflow faults instead of overwriting the allocation
+before it. Mapping and unmapping a stack costs a page walk and a shootdown per
+page, so stacks of exited threads stay mapped in a small per-CPU cache and the
+next create_thread() on that core only pops one.
+
+A cached stack keeps the contents of its last thread.
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/spinlock.h"
+#include "../sys/cpu/cpu.h"
+#include "kheap.h"
+#include "vmm.h"
+
+#include "kstack.h"
+
+
+// The cache of the running core, NULL while per-CPU data can not be used yet
+static kstack_cache_t *this_cpu_cache() {
+    cpu_data_t *cpu = get_cpu_data();
+    return cpu ? &cpu->kstack_cache : NULL;
+}
+
+
+// Get a KSTACK_SIZE stack, returns its lowest address or NULL
+void *kstack_alloc() {
+    uint64_t flags = irq_save();                    // Stay on this core while using its cache
+
+    kstack_cache_t *cache = this_cpu_cache();
+    if (cache && cache->count > 0) {
+        void *stack = (void *) cache->stacks[--cache->count];
+        cache->hits++;
+        irq_restore(flags);
+        return stack;
+    }
+    if (cache) cache->misses++;
+
+    irq_restore(flags);
+
+    return kheap_alloc_guarded(KSTACK_SIZE, ALLOCATE_STACK);
+}
+
+
+// Give back a stack from kstack_alloc(). It must not be in use any more.
+void kstack_free(void *stack) {
+    if (!stack) return;
+
+    uint64_t flags = irq_save();
+
+    kstack_cache_t *cache = this_cpu_cache();
+    if (cache && cache->count < KSTACK_CACHE_SIZE) {
+        cache->stacks[cache->count++] = (uint64_t) stack;
+        cache->frees++;
+        irq_restore(flags);
+        return;
+    }
+
+    irq_restore(flags);
+
+    kheap_free_guarded(stack, KSTACK_SIZE);         // Cache is full, unmap it
+}
+
+
+void kstack_print_stats() {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (!cpu_datas[i].is_online) continue;
+        kstack_cache_t *cache = &cpu_datas[i].kstack_cache;
+        printf(" Kernel stacks CPU %d: %d cached, hits %d, misses %d, frees %d\n",
+            i, cache->count, cache->hits, cache->misses, cache->frees);
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define KSTACK_SIZE         0x4000      // 16 KB, every stack has a non-present guard page below it
+#define KSTACK_CACHE_SIZE   8           // Mapped stacks one CPU keeps for reuse
+
+// Free kernel stacks held by one CPU, lives in cpu_datas[] like the PMM frame cache
+typedef struct kstack_cache {
+    uint64_t count;                     // Stacks currently cached
+    uint64_t stacks[KSTACK_CACHE_SIZE]; // Stack bases (lowest address), used as a stack
+    uint64_t hits;                      // Allocations served from the cache
+    uint64_t misses;                    // Allocations which had to map a new stack
+    uint64_t frees;                     // Stacks put back into the cache
+} kstack_cache_t;
+
+void *kstack_alloc();
+void kstack_free(void *stack);
+
+void kstack_print_stats();
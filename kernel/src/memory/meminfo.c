@@ -0,0 +1,69 @@
+/*
+Memory Accounting
+
+The allocators add and subtract what they hand out in a few global counters,
+get_meminfo() puts them together with the PMM and slab numbers. The counters
+are updated with atomics, a snapshot is not consistent across counters.
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+#include "address_space.h"
+#include "pmm.h"
+#include "slab.h"
+
+#include "meminfo.h"
+
+static int64_t mem_counters[MEM_COUNTER_COUNT];
+
+static const char *mem_counter_names[MEM_COUNTER_COUNT] = {
+    "Kernel heap", "Kernel heap reserved", "User heap", "User heap reserved",
+    "kmalloc", "Page tables", "FS cache", "DMA buffers",
+};
+
+
+void mem_account(mem_counter_t counter, int64_t bytes) {
+    if (counter >= MEM_COUNTER_COUNT) return;
+    __atomic_add_fetch(&mem_counters[counter], bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t mem_counter(mem_counter_t counter) {
+    if (counter >= MEM_COUNTER_COUNT) return 0;
+    int64_t value = __atomic_load_n(&mem_counters[counter], __ATOMIC_RELAXED);
+    return value > 0 ? (uint64_t) value : 0;            // Frees of blocks allocated before counting started
+}
+
+
+void get_meminfo(meminfo_t *info) {
+    if (!info) return;
+    memset(info, 0, sizeof(meminfo_t));
+
+    pmm_stats_t pmm;
+    pmm_get_stats(&pmm);
+    info->total = pmm.total_frames * FRAME_SIZE;
+    info->used = pmm.used_frames * FRAME_SIZE;
+    info->free = pmm.free_frames * FRAME_SIZE;
+
+    info->kheap = mem_counter(MEM_KHEAP);
+    info->kheap_reserved = mem_counter(MEM_KHEAP_RESERVED);
+    info->uheap = mem_counter(MEM_UHEAP);
+    info->uheap_reserved = mem_counter(MEM_UHEAP_RESERVED);
+    slab_get_usage(&info->malloc, &info->malloc_footprint);
+    info->kmalloc = mem_counter(MEM_KMALLOC);
+    info->page_tables = mem_counter(MEM_PAGE_TABLES);
+    info->fs_cache = mem_counter(MEM_FS_CACHE);
+    info->dma = mem_counter(MEM_DMA);
+
+    info->resident = current_address_space()->resident_pages * FRAME_SIZE;
+}
+
+
+void print_mem_counters() {
+    for (int i = 0; i < MEM_COUNTER_COUNT; i++) {
+        printf(" %s: %d KB\n", mem_counter_names[i], mem_counter((mem_counter_t) i) / 1024);
+    }
+
+    uint64_t in_use, footprint;
+    slab_get_usage(&in_use, &footprint);
+    printf(" Kernel malloc: %d KB in use, %d KB of slab pages and large blocks\n", in_use / 1024, footprint / 1024);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Memory users counted by mem_account(). Some overlap: DMA buffers come from
+// the kernel heap, the FAT cache from kmalloc().
+typedef enum {
+    MEM_KHEAP,                  // Pages mapped by kheap_alloc() and kheap_alloc_huge()
+    MEM_KHEAP_RESERVED,         // Demand paged kheap_reserve() ranges, virtual size
+    MEM_UHEAP,                  // Pages mapped by uheap_alloc()
+    MEM_UHEAP_RESERVED,         // Demand paged user ranges (uheap_reserve, brk, mmap), virtual size
+    MEM_KMALLOC,                // PMM blocks handed out by kmalloc() after boot
+    MEM_PAGE_TABLES,            // Page table frames of all address spaces
+    MEM_FS_CACHE,               // File system caches
+    MEM_DMA,                    // Device DMA buffers
+    MEM_COUNTER_COUNT
+} mem_counter_t;
+
+// Snapshot returned by get_meminfo() and INT_SYSCALL_MEMINFO, all sizes in bytes
+typedef struct meminfo {
+    uint64_t total;             // Usable physical memory
+    uint64_t used;
+    uint64_t free;
+    uint64_t kheap;
+    uint64_t kheap_reserved;
+    uint64_t uheap;
+    uint64_t uheap_reserved;
+    uint64_t malloc;            // In use by the kernel malloc()
+    uint64_t malloc_footprint;  // Slab pages behind it, large blocks included
+    uint64_t kmalloc;
+    uint64_t page_tables;
+    uint64_t fs_cache;
+    uint64_t dma;
+    uint64_t resident;          // Resident pages of the calling process, in bytes
+} meminfo_t;
+
+void mem_account(mem_counter_t counter, int64_t bytes);
+uint64_t mem_counter(mem_counter_t counter);
+
+void get_meminfo(meminfo_t *info);
+void print_mem_counters();
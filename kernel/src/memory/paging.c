@@ -14,13 +14,16 @@ https://stackoverflow.com/questions/18431261/how-does-x86-paging-work
 
 
 #include "../memory/detect_memory.h"
-#include "kmalloc.h"                // kmalloc_a, kmalloc, kfree
 #include  "../lib/string.h"         // memset, memcpy, memmove
 #include  "../lib/stdio.h"          // printf
 #include "../lib/assert.h"
 
 #include "pmm.h"
 #include "vmm.h"
+#include "tlb.h"
+#include "meminfo.h"
+#include "zero_pool.h"
+#include "../sys/cpu/cpuid.h"      // has_1gb_pages
 
 #include "paging.h"
 
@@ -39,16 +42,17 @@ uint64_t bsp_cr3;
 // allocate a page with the free physical frame
 void alloc_frame(page_t *page, int user, int is_writeable) {
     
-    // idx is now the index of the first free frame.
-    uint64_t bit_no = free_frame_bit_no(); 
+    // Take a free frame from this core's frame cache, already marked as used
+    int64_t bit_no = pmm_alloc_frame();
+    if (bit_no < 0) {
+        bit_no = pmm_alloc_zeroed_frame();      // The last free frames may sit in the zero pool
+    }
 
-    if (bit_no == (uint64_t)-1) {
+    if (bit_no < 0) {
         printf("[Error] Paging: No free frames!");
         halt_kernel();
     }
 
-    set_frame(bit_no);                      // Mark the frame as used by passing the frame index
-
     page->present = 1;                      // Mark it as present.
     page->rw = is_writeable;                // Should the page be writeable?
     page->user = user;                      // Should the page be user-mode?
@@ -56,6 +60,22 @@ void alloc_frame(page_t *page, int user, int is_writeable) {
 }
 
 
+// Like alloc_frame(), the frame comes cleared (usually pre-zeroed by an idle core)
+void alloc_zeroed_frame(page_t *page, int user, int is_writeable) {
+    int64_t bit_no = pmm_alloc_zeroed_frame();
+
+    if (bit_no < 0) {
+        printf("[Error] Paging: No free frames!");
+        halt_kernel();
+    }
+
+    page->present = 1;
+    page->rw = is_writeable;
+    page->user = user;
+    page->frame = BIT_NO_TO_ADDR((uint64_t) bit_no) >> 12;
+}
+
+
 
 // Function to deallocate a frame.
 void free_frame(page_t *page)
@@ -72,7 +92,7 @@ void free_frame(page_t *page)
 
         uint64_t bit_no = PHYS_ADDR_TO_BIT_NO(frame_addr);   // Convert the physical frame address into a bit number
 
-        clear_frame(bit_no);                                 // Frame is now free again from bitmap.
+        pmm_free_frame(bit_no);                              // Frame goes back to this core's frame cache
 
         page->frame = 0;                                     // Page now doesn't have a frame.
     }
@@ -84,7 +104,7 @@ uint64_t get_cr3_addr() {
     uint64_t cr3;
     asm volatile("mov %%cr3, %0" : "=r"(cr3)); // Read the CR3 register
 
-    return cr3;
+    return cr3 & ~0xFFFULL;                    // Drop the PCID (or PWT/PCD) bits
 }
 
 void set_cr3_addr(uint64_t cr3) {
@@ -216,53 +236,112 @@ void init_ap_paging(int core_id) {
     }
 }
 
-// Function to allocate a new page
-static page_t *alloc_page(){
-    page_t *pg = (page_t *) kmalloc_a(sizeof(page_t), 1);
-        
-    if(!pg){
-        printf("[Error] Paging: Failed to allocate page\n");
-        return NULL;            // Allocation failed
+// Page table pages are single PMM frames. Like the rest of the paging code they are
+// accessed through their physical address.
+static void *alloc_table() {
+    int64_t bit_no = pmm_alloc_zeroed_frame();
+    if (bit_no < 0) {
+        return NULL;
+    }
+    void *table = (void *) BIT_NO_TO_ADDR((uint64_t) bit_no);
+    mem_account(MEM_PAGE_TABLES, PAGE_SIZE);
+    return table;
+}
+
+// Give a page table page back to the PMM, after the batch flush when a batch is given
+static void free_table(uint64_t table_phys, uint64_t va, tlb_batch_t *batch) {
+    if (table_phys < USABLE_START_PHYS_MEM || table_phys >= USABLE_END_PHYS_MEM) {
+        return;                 // Set up by Limine, not owned by the PMM
+    }
+    mem_account(MEM_PAGE_TABLES, -PAGE_SIZE);
+    if (batch) {
+        tlb_batch_add(batch, va, table_phys);
+        return;
     }
-    memset(pg, 0, sizeof(pg));  // Zero out the page structure
-    return pg;
+    pmm_free_frame(PHYS_ADDR_TO_BIT_NO(table_phys));
+}
+
+static bool table_is_empty(uint64_t *entries) {
+    for (int i = 0; i < ENTRIES_PER_TABLE; i++) {
+        if (entries[i]) return false;
+    }
+    return true;
 }
 
 // Function to allocate a new page table
 static pt_t* alloc_pt() {
-    pt_t* pt = (pt_t*)kmalloc_a(sizeof(pt_t), 1);
+    pt_t* pt = (pt_t*) alloc_table();
     if(!pt) {
         printf("[Error] Paging: Failed to allocate PT\n");
         return NULL;            // Allocation failed
     }
-    memset(pt, 0, sizeof(pt_t)); // Zero out the page table
     return pt;
 }
 
 // Function to allocate a new page directory
 static pd_t* alloc_pd() {
-    pd_t* pd = (pd_t*)kmalloc_a(sizeof(pd_t), 1);
+    pd_t* pd = (pd_t*) alloc_table();
     if (!pd){
         printf("[Error] Paging: Failed to allocate PD\n");
         return NULL;            // Allocation failed
     }
-    memset(pd, 0, sizeof(pd_t)); // Zero out the page directory
     return pd;
 }
 
 // Function to allocate a new page directory pointer table
 static pdpt_t* alloc_pdpt() {
-    pdpt_t* pdpt = (pdpt_t*)kmalloc_a(sizeof(pdpt_t), 1);
+    pdpt_t* pdpt = (pdpt_t*) alloc_table();
 
     if (!pdpt) {
         printf("[Error] Paging: Failed to allocate PDPT\n");
         return NULL;                    // Allocation failed
     }
-    memset(pdpt, 0, sizeof(pdpt_t));    // Zero out the PDPT
     return pdpt;
 }
 
 
+static bool cpu_has_1gb_pages() {
+    static int supported = -1;                  // Unknown until first asked
+    if (supported < 0) supported = has_1gb_pages() ? 1 : 0;
+    return supported;
+}
+
+
+// Replace a 1 GB or 2 MB page by a table of 512 entries of the next smaller size which map
+// the same memory with the same flags, so a part of it can be changed on its own.
+static int split_huge_entry(dir_entry_t *entry, uint64_t page_size, uint64_t va) {
+    uint64_t *table = (uint64_t *) alloc_table();
+    if (!table) {
+        printf("[Error] Paging: Failed to split huge page at %x\n", va);
+        return -1;
+    }
+
+    uint64_t old = *(uint64_t *) entry;
+    uint64_t base = old & 0x000FFFFFFFFFF000ULL & ~(page_size - 1);     // Bit 12 is PAT in huge entries
+    uint64_t child_size = page_size / ENTRIES_PER_TABLE;
+    uint64_t flags = old & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER | 0x18 | 0x100 | (0x1ULL << 63));   // + PWT, PCD, G, NX
+
+    if (child_size == HUGE_PAGE_SIZE_2M) {
+        flags |= PAGE_HUGE | (old & 0x1000);    // PAT stays at bit 12
+    } else if (old & 0x1000) {
+        flags |= 0x80;                          // PAT moves to bit 7 in a PTE
+    }
+
+    uint64_t *entries = (uint64_t *) phys_to_vir((uint64_t) table);
+    for (uint64_t i = 0; i < ENTRIES_PER_TABLE; i++) {
+        entries[i] = (base + i * child_size) | flags;
+    }
+
+    *(uint64_t *) entry = (uint64_t) table | (old & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER | (0x1ULL << 63)));
+
+    tlb_shootdown(va & ~(page_size - 1), page_size / PAGE_SIZE);
+    return 0;
+}
+
+
+// The 4 KB page entry of va. With make 0 this is only a lookup: NULL when nothing is
+// mapped there or va lies in a 2 MB or 1 GB page. Otherwise missing tables and the page
+// are created and a huge page around va is split.
 page_t* get_page(uint64_t va, int make, pml4_t* pml4) {
 
     if (!pml4) {
@@ -276,6 +355,7 @@ page_t* get_page(uint64_t va, int make, pml4_t* pml4) {
     uint64_t pt_index   = PT_INDEX(va);
 
     int user = (va >= HIGHER_HALF_START_ADDR) ? 0 : 1; // User mode if the address is in lower half
+    bool changed = false;                               // A present entry was modified, TLB must be flushed
 
     dir_entry_t* pml4_entry = (dir_entry_t*) ((uint64_t) &pml4->entries[pml4_index]);
 
@@ -285,10 +365,13 @@ page_t* get_page(uint64_t va, int make, pml4_t* pml4) {
         if (!pdpt) return NULL;
         pml4_entry->present = 1;
         pml4_entry->rw = 1;
-        pml4_entry->user = user;;
+        pml4_entry->user = user;
         pml4_entry->base_addr = (uint64_t)pdpt >> 12;
     }
-    pml4_entry->user = user; // Set user bit for the PML4 entry
+    if (make && pml4_entry->user != user) {          // Set user bit for the PML4 entry
+        pml4_entry->user = user;
+        changed = true;
+    }
 
     pdpt_t* pdpt = (pdpt_t*)(pml4_entry->base_addr << 12);
     dir_entry_t* pdpt_entry = (dir_entry_t*)phys_to_vir((uint64_t) &pdpt->entries[pdpt_index]);
@@ -302,7 +385,13 @@ page_t* get_page(uint64_t va, int make, pml4_t* pml4) {
         pdpt_entry->user = user;
         pdpt_entry->base_addr = (uint64_t)pd >> 12;
     }
-    pdpt_entry->user = user; // Set user bit for the PDPT entry
+    if (pdpt_entry->huge && (!make || split_huge_entry(pdpt_entry, HUGE_PAGE_SIZE_1G, va) != 0)) {
+        return NULL;                                // 1 GB page, a 4 KB page inside needs a PD
+    }
+    if (make && pdpt_entry->user != user) {          // Set user bit for the PDPT entry
+        pdpt_entry->user = user;
+        changed = true;
+    }
 
     pd_t* pd = (pd_t*)(pdpt_entry->base_addr << 12);
     dir_entry_t* pd_entry = (dir_entry_t*) phys_to_vir((uint64_t)&pd->entries[pd_index]);
@@ -316,19 +405,31 @@ page_t* get_page(uint64_t va, int make, pml4_t* pml4) {
         pd_entry->user = user;
         pd_entry->base_addr = (uint64_t)pt >> 12;
     }
-    pd_entry->user = user; // Set user bit for the PD entry
+    if (pd_entry->huge && (!make || split_huge_entry(pd_entry, HUGE_PAGE_SIZE_2M, va) != 0)) {
+        return NULL;                                // 2 MB page, a 4 KB page inside needs a PT
+    }
+    if (make && pd_entry->user != user) {          // Set user bit for the PD entry
+        pd_entry->user = user;
+        changed = true;
+    }
 
     pt_t* pt = (pt_t*)(pd_entry->base_addr << 12);
     page_t* page = (page_t *)phys_to_vir((uint64_t)&pt->pages[pt_index]);
 
-    if (!page->present) {
-        alloc_frame(page, user, 1);            // kernel space, read-write
+    if (!page->present && make) {
+        if (make == PAGE_MAKE_ZEROED) {
+            alloc_zeroed_frame(page, user, 1);
+        } else {
+            alloc_frame(page, user, 1);        // kernel space, read-write
+        }
         if (!page->frame) return NULL;
-        page->user = user;
+        page->user = user;                     // Not present before, nothing to invalidate
+    }
+
+    if (changed) {
+        tlb_shootdown(va & ~((uint64_t) PAGE_SIZE - 1), 1);
     }
 
-    flush_tlb_all();
-    
     return page;
 }
 
@@ -358,6 +459,193 @@ void flush_tlb_all() {
 }
 
 
+// Free the PT, PD and PDPT above va once nothing is mapped through them any more.
+// Kernel half PDPTs are kept so the kernel PML4 entries never change.
+// With a batch the table pages are only freed once no core can walk them any more.
+void free_empty_tables(uint64_t va, pml4_t *pml4, tlb_batch_t *batch) {
+    if (!pml4) return;
+
+    dir_entry_t *pml4_entry = &pml4->entries[PML4_INDEX(va)];
+    if (!pml4_entry->present) return;
+
+    uint64_t pdpt_phys = (uint64_t) pml4_entry->base_addr << 12;
+    dir_entry_t *pdpt_entry = (dir_entry_t *) phys_to_vir((uint64_t) &((pdpt_t *) pdpt_phys)->entries[PDPT_INDEX(va)]);
+    if (!pdpt_entry->present || pdpt_entry->huge) return;      // Not present or 1 GB page
+
+    uint64_t pd_phys = (uint64_t) pdpt_entry->base_addr << 12;
+    dir_entry_t *pd_entry = (dir_entry_t *) phys_to_vir((uint64_t) &((pd_t *) pd_phys)->entries[PD_INDEX(va)]);
+    if (!pd_entry->present || pd_entry->huge) return;          // Not present or 2 MB page
+
+    uint64_t pt_phys = (uint64_t) pd_entry->base_addr << 12;
+
+    if (!table_is_empty((uint64_t *) phys_to_vir(pt_phys))) return;
+    *(uint64_t *) pd_entry = 0;
+    free_table(pt_phys, va, batch);
+
+    if (!table_is_empty((uint64_t *) phys_to_vir(pd_phys))) return;
+    *(uint64_t *) pdpt_entry = 0;
+    free_table(pd_phys, va, batch);
+
+    if (va >= HIGHER_HALF_START_ADDR) return;
+    if (!table_is_empty((uint64_t *) phys_to_vir(pdpt_phys))) return;
+    *(uint64_t *) pml4_entry = 0;
+    free_table(pdpt_phys, va, batch);
+}
+
+
+// Give PML4 entries 256 - 511 a PDPT each, so later kernel mappings never add a PML4 entry
+// and address spaces which copied the kernel half keep seeing all of it.
+int fill_kernel_half(pml4_t *pml4) {
+    for (int i = ENTRIES_PER_TABLE / 2; i < ENTRIES_PER_TABLE; i++) {
+        dir_entry_t *entry = &pml4->entries[i];
+        if (entry->present) continue;
+
+        pdpt_t *pdpt = alloc_pdpt();
+        if (!pdpt) return -1;
+        entry->present = 1;
+        entry->rw = 1;
+        entry->user = 0;
+        entry->base_addr = (uint64_t) pdpt >> 12;
+    }
+    return 0;
+}
+
+
+// Free every table and frame mapped through PML4 entries first to last (inclusive).
+// The address space must not be loaded on any core.
+void free_pml4_entries(pml4_t *pml4, int first, int last) {
+    for (int i = first; i <= last; i++) {
+        dir_entry_t *pml4_entry = &pml4->entries[i];
+        if (!pml4_entry->present) continue;
+
+        uint64_t pdpt_phys = (uint64_t) pml4_entry->base_addr << 12;
+        dir_entry_t *pdpt = (dir_entry_t *) phys_to_vir(pdpt_phys);
+
+        for (int j = 0; j < ENTRIES_PER_TABLE; j++) {
+            if (!pdpt[j].present || pdpt[j].huge) continue;     // 1 GB pages are never handed out by the PMM
+
+            uint64_t pd_phys = (uint64_t) pdpt[j].base_addr << 12;
+            dir_entry_t *pd = (dir_entry_t *) phys_to_vir(pd_phys);
+
+            for (int k = 0; k < ENTRIES_PER_TABLE; k++) {
+                if (!pd[k].present) continue;
+                if (pd[k].huge) {
+                    uint64_t phys = (uint64_t) pd[k].base_addr << 12;
+                    if (phys >= USABLE_START_PHYS_MEM && phys < USABLE_END_PHYS_MEM) {
+                        pmm_free_pages(phys, 9);                // 2 MB = 2^9 frames
+                    }
+                    continue;
+                }
+
+                uint64_t pt_phys = (uint64_t) pd[k].base_addr << 12;
+                page_t *pt = (page_t *) phys_to_vir(pt_phys);
+
+                for (int l = 0; l < ENTRIES_PER_TABLE; l++) {
+                    uint64_t frame = (uint64_t) pt[l].frame << 12;
+                    if (!pt[l].present || frame < USABLE_START_PHYS_MEM || frame >= USABLE_END_PHYS_MEM) continue;
+                    pmm_free_frame(PHYS_ADDR_TO_BIT_NO(frame));     // Only drops a share of a COW frame
+                }
+                free_table(pt_phys, 0, NULL);
+            }
+            free_table(pd_phys, 0, NULL);
+        }
+        free_table(pdpt_phys, 0, NULL);
+        *(uint64_t *) pml4_entry = 0;
+    }
+}
+
+
+// Share every page mapped through PML4 entries first to last of src with dst.
+// Writable pages become read only + PAGE_COW in both, frames get one more owner.
+// Pages of src which turned read only are collected in batch, the caller flushes it.
+// Returns the number of pages dst maps now, or -1.
+int64_t copy_pml4_entries_cow(pml4_t *src, pml4_t *dst, int first, int last, tlb_batch_t *batch) {
+    int64_t pages = 0;
+
+    for (int i = first; i <= last; i++) {
+        tlb_batch_flush(batch);                     // One shootdown per PML4 entry, ranges stay small
+
+        if (!src->entries[i].present) continue;
+
+        // New tables start empty, an entry is only copied once its table exists,
+        // so a failed copy never leaves dst pointing at the tables of src
+        uint64_t pdpt_phys = (uint64_t) alloc_table();
+        if (!pdpt_phys) return -1;
+        dst->entries[i] = src->entries[i];
+        dst->entries[i].base_addr = pdpt_phys >> 12;
+
+        dir_entry_t *src_pdpt = (dir_entry_t *) phys_to_vir((uint64_t) src->entries[i].base_addr << 12);
+        dir_entry_t *dst_pdpt = (dir_entry_t *) phys_to_vir(pdpt_phys);
+
+        for (int j = 0; j < ENTRIES_PER_TABLE; j++) {
+            if (!src_pdpt[j].present) continue;
+            if (src_pdpt[j].huge) {
+                printf("[Error] Paging: Can not share the 1 GB page at PML4 %d PDPT %d\n", i, j);
+                return -1;
+            }
+
+            uint64_t pd_phys = (uint64_t) alloc_table();
+            if (!pd_phys) return -1;
+            dst_pdpt[j] = src_pdpt[j];
+            dst_pdpt[j].base_addr = pd_phys >> 12;
+
+            dir_entry_t *src_pd = (dir_entry_t *) phys_to_vir((uint64_t) src_pdpt[j].base_addr << 12);
+            dir_entry_t *dst_pd = (dir_entry_t *) phys_to_vir(pd_phys);
+
+            for (int k = 0; k < ENTRIES_PER_TABLE; k++) {
+                if (!src_pd[k].present) continue;
+                if (src_pd[k].huge) {
+                    printf("[Error] Paging: Can not share the 2 MB page at PML4 %d PDPT %d PD %d\n", i, j, k);
+                    return -1;
+                }
+
+                uint64_t pt_phys = (uint64_t) alloc_table();
+                if (!pt_phys) return -1;
+                dst_pd[k] = src_pd[k];
+                dst_pd[k].base_addr = pt_phys >> 12;
+
+                page_t *src_pt = (page_t *) phys_to_vir((uint64_t) src_pd[k].base_addr << 12);
+                page_t *dst_pt = (page_t *) phys_to_vir(pt_phys);
+
+                for (int l = 0; l < ENTRIES_PER_TABLE; l++) {
+                    if (!src_pt[l].present) continue;
+                    pages++;
+
+                    uint64_t frame = (uint64_t) src_pt[l].frame << 12;
+                    if (frame < USABLE_START_PHYS_MEM || frame >= USABLE_END_PHYS_MEM) {
+                        dst_pt[l] = src_pt[l];      // Not owned by the PMM, shared as it is
+                        continue;
+                    }
+
+                    if (!pmm_share_frame(PHYS_ADDR_TO_BIT_NO(frame))) {
+                        // Too many owners already, dst gets a copy of its own
+                        int64_t bit_no = pmm_alloc_frame();
+                        if (bit_no < 0) return -1;
+                        uint64_t copy = BIT_NO_TO_ADDR((uint64_t) bit_no);
+                        memcpy((void *) phys_to_vir(copy), (void *) phys_to_vir(frame), PAGE_SIZE);
+                        dst_pt[l] = src_pt[l];
+                        dst_pt[l].frame = copy >> 12;
+                        if (src_pt[l].cow) {
+                            dst_pt[l].cow = 0;
+                            dst_pt[l].rw = 1;
+                        }
+                        continue;
+                    }
+
+                    if (src_pt[l].rw) {
+                        src_pt[l].rw = 0;
+                        src_pt[l].cow = 1;
+                        tlb_batch_add(batch, ((uint64_t) i << 39) | ((uint64_t) j << 30) | ((uint64_t) k << 21) | ((uint64_t) l << 12), 0);
+                    }
+                    dst_pt[l] = src_pt[l];
+                }
+            }
+        }
+    }
+    return pages;
+}
+
+
 void map_virtual_memory(void *phys_addr, size_t size, uint64_t flags) {
     uint64_t pml4_index, pdpt_index, pd_index, pt_index;
     uint64_t *pml4, *pdpt, *pd, *pt;
@@ -367,7 +655,9 @@ void map_virtual_memory(void *phys_addr, size_t size, uint64_t flags) {
     uint64_t virt = phys_to_vir(phys);   // HHDM mapping
 
     // Assume we already have the base PML4 loaded in CR3
-    pml4 = (uint64_t *)get_cr3_addr();  
+    pml4 = (uint64_t *)phys_to_vir(get_cr3_addr());
+
+    bool replaced = false;              // An existing mapping was overwritten
 
     // Iterate through the address range to map
     for (size_t offset = 0; offset < size; offset += PAGE_SIZE) {
@@ -382,44 +672,69 @@ void map_virtual_memory(void *phys_addr, size_t size, uint64_t flags) {
 
         // Get or create PDPT
         if (!(pml4[pml4_index] & PAGE_PRESENT)) {
-            pdpt = (uint64_t *)kmalloc_a(PAGE_SIZE, 1);
-            memset(pdpt, 0, PAGE_SIZE);
-            pml4[pml4_index] = ((uint64_t)vir_to_phys((uint64_t)pdpt) | flags);
+            uint64_t pdpt_phys = (uint64_t)alloc_table();     // Cleared, handed out by physical address
+            if (!pdpt_phys) return;
+            pml4[pml4_index] = (pdpt_phys | flags);
+            pdpt = (uint64_t *)phys_to_vir(pdpt_phys);
         } else {
             pdpt = (uint64_t *)phys_to_vir((uint64_t)pml4[pml4_index] & ~0xFFF);
         }
 
+        if ((pdpt[pdpt_index] & PAGE_PRESENT) && (pdpt[pdpt_index] & PAGE_HUGE)) {
+            if (split_huge_entry((dir_entry_t *) &pdpt[pdpt_index], HUGE_PAGE_SIZE_1G, current_virt) != 0) return;
+        }
+
         // Get or create PD
         if (!(pdpt[pdpt_index] & PAGE_PRESENT)) {
-            pd = (uint64_t *)kmalloc_a(PAGE_SIZE, 1);
-            memset(pd, 0, PAGE_SIZE);
-            pdpt[pdpt_index] = ((uint64_t)vir_to_phys((uint64_t)pd) | flags);
+            uint64_t pd_phys = (uint64_t)alloc_table();     // Cleared, handed out by physical address
+            if (!pd_phys) return;
+            pdpt[pdpt_index] = (pd_phys | flags);
+            pd = (uint64_t *)phys_to_vir(pd_phys);
         } else {
             pd = (uint64_t *)phys_to_vir((uint64_t)pdpt[pdpt_index] & ~0xFFF);
         }
 
+        // Use one 2 MB page when the rest of the range covers an aligned 2 MB block
+        if (!(current_phys & (HUGE_PAGE_SIZE_2M - 1)) && !(current_virt & (HUGE_PAGE_SIZE_2M - 1)) &&
+            size - offset >= HUGE_PAGE_SIZE_2M && (!(pd[pd_index] & PAGE_PRESENT) || (pd[pd_index] & PAGE_HUGE))) {
+            uint64_t entry = current_phys | flags | PAGE_HUGE;
+            if ((pd[pd_index] & PAGE_PRESENT) && pd[pd_index] != entry) replaced = true;
+            pd[pd_index] = entry;
+            offset += HUGE_PAGE_SIZE_2M - PAGE_SIZE;
+            continue;
+        }
+
+        if ((pd[pd_index] & PAGE_PRESENT) && (pd[pd_index] & PAGE_HUGE)) {
+            if (split_huge_entry((dir_entry_t *) &pd[pd_index], HUGE_PAGE_SIZE_2M, current_virt) != 0) return;
+        }
+
         // Get or create PT
         if (!(pd[pd_index] & PAGE_PRESENT)) {
-            pt = (uint64_t *)kmalloc_a(PAGE_SIZE, 1);
-            memset(pt, 0, PAGE_SIZE);
-            pd[pd_index] = ((uint64_t)vir_to_phys((uint64_t)pt) | flags);
+            uint64_t pt_phys = (uint64_t)alloc_table();     // Cleared, handed out by physical address
+            if (!pt_phys) return;
+            pd[pd_index] = (pt_phys | flags);
+            pt = (uint64_t *)phys_to_vir(pt_phys);
         } else {
             pt = (uint64_t *)phys_to_vir((uint64_t)pd[pd_index] & ~0xFFF);
         }
 
         // Final mapping of the page
-        pt[pt_index] = (current_phys | flags);
+        uint64_t entry = (current_phys | flags);
+        if ((pt[pt_index] & PAGE_PRESENT) && pt[pt_index] != entry) replaced = true;
+        pt[pt_index] = entry;
     }
 
-    // Ensure changes to page tables are reflected in the CPU
-    flush_tlb_all();
+    // New entries are never cached, only replaced ones have to be invalidated
+    if (replaced) {
+        tlb_shootdown(virt, (size + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
 }
 
 
 
 uint64_t create_new_pml4() {
-    uint64_t pml4_ptr_phys = (uint64_t) kmalloc_a(sizeof(pml4_t), 1);
-    memset((void*)pml4_ptr_phys, 0, sizeof(pml4_t)); // Clear PML4 table
+    uint64_t pml4_ptr_phys = (uint64_t) alloc_table();   // Cleared PML4 table
+    if (!pml4_ptr_phys) return 0;
 
     // Map the PML4 into the page tables
     map_virtual_memory((void*)pml4_ptr_phys, sizeof(pml4_t), PAGE_WRITE | PAGE_PRESENT);
@@ -433,11 +748,14 @@ uint64_t create_new_pml4() {
 
 // ---------------------------------------------------------------------------------------
 
-// Map a single page: map the given physical page to the given virtual address with flags.
-// Returns 0 on success, -1 on error.
-int map_page(uint64_t phys_page, uint64_t virt_addr, uint64_t flags) {
-    if ((phys_page & 0xFFF) || (virt_addr & 0xFFF)) {
-        printf("[Error] map_page: addresses must be page-aligned\n");
+#define MAPPING_BLOCKED -2     // A page table is in the way of a huge page
+
+// Install one 4 KB, 2 MB or 1 GB mapping without TLB maintenance.
+// Returns 1 when a present entry was replaced (needs a flush), 0 for a new entry,
+// MAPPING_BLOCKED when a huge page would hide an existing page table and -1 on error.
+static int set_mapping(uint64_t phys_page, uint64_t virt_addr, uint64_t page_size, uint64_t flags) {
+    if ((phys_page & (page_size - 1)) || (virt_addr & (page_size - 1))) {
+        printf("[Error] map_page: addresses must be aligned to the page size %x\n", page_size);
         return -1;
     }
 
@@ -454,14 +772,16 @@ int map_page(uint64_t phys_page, uint64_t virt_addr, uint64_t flags) {
     uint64_t pd_index   = PD_INDEX(virt_addr);
     uint64_t pt_index   = PT_INDEX(virt_addr);
 
+    // Huge entries carry the leaf flags, PAT is not used so bit 12 stays clear
+    uint64_t huge_entry = phys_page | (flags & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER)) | PAGE_HUGE;
+
     dir_entry_t *pml4_entry = &pml4->entries[pml4_index];
 
     // Allocate PDPT if not present
     if (!pml4_entry->present) {
         pdpt_t *new_pdpt = alloc_pdpt();
         if (!new_pdpt) return -1;
-        memset(new_pdpt, 0, sizeof(pdpt_t));
-        uint64_t new_pdpt_phys = vir_to_phys((uint64_t)new_pdpt);
+        uint64_t new_pdpt_phys = (uint64_t)new_pdpt;          // Table pages are handed out by physical address
         pml4_entry->base_addr = new_pdpt_phys >> 12;
         pml4_entry->present = 1;
         pml4_entry->rw = 1;
@@ -472,12 +792,20 @@ int map_page(uint64_t phys_page, uint64_t virt_addr, uint64_t flags) {
     pdpt_t *pdpt = (pdpt_t *) phys_to_vir(((uint64_t)pml4_entry->base_addr) << 12);
     dir_entry_t *pdpt_entry = &pdpt->entries[pdpt_index];
 
+    if (page_size == HUGE_PAGE_SIZE_1G) {
+        uint64_t old_entry = *(uint64_t *) pdpt_entry;
+        if (pdpt_entry->present && !pdpt_entry->huge) return MAPPING_BLOCKED;
+        *(uint64_t *) pdpt_entry = huge_entry;
+        return ((old_entry & PAGE_PRESENT) && old_entry != huge_entry) ? 1 : 0;
+    }
+
+    if (pdpt_entry->huge && split_huge_entry(pdpt_entry, HUGE_PAGE_SIZE_1G, virt_addr) != 0) return -1;
+
     // Allocate PD if not present
     if (!pdpt_entry->present) {
         pd_t *new_pd = alloc_pd();
         if (!new_pd) return -1;
-        memset(new_pd, 0, sizeof(pd_t));
-        uint64_t new_pd_phys = vir_to_phys((uint64_t)new_pd);
+        uint64_t new_pd_phys = (uint64_t)new_pd;          // Table pages are handed out by physical address
         pdpt_entry->base_addr = new_pd_phys >> 12;
         pdpt_entry->present = 1;
         pdpt_entry->rw = 1;
@@ -487,12 +815,20 @@ int map_page(uint64_t phys_page, uint64_t virt_addr, uint64_t flags) {
     pd_t *pd = (pd_t *) phys_to_vir(((uint64_t)pdpt_entry->base_addr) << 12);
     dir_entry_t *pd_entry = &pd->entries[pd_index];
 
+    if (page_size == HUGE_PAGE_SIZE_2M) {
+        uint64_t old_entry = *(uint64_t *) pd_entry;
+        if (pd_entry->present && !pd_entry->huge) return MAPPING_BLOCKED;
+        *(uint64_t *) pd_entry = huge_entry;
+        return ((old_entry & PAGE_PRESENT) && old_entry != huge_entry) ? 1 : 0;
+    }
+
+    if (pd_entry->huge && split_huge_entry(pd_entry, HUGE_PAGE_SIZE_2M, virt_addr) != 0) return -1;
+
     // Allocate PT if not present
     if (!pd_entry->present) {
         pt_t *new_pt = alloc_pt();
         if (!new_pt) return -1;
-        memset(new_pt, 0, sizeof(pt_t));
-        uint64_t new_pt_phys = vir_to_phys((uint64_t)new_pt);
+        uint64_t new_pt_phys = (uint64_t)new_pt;          // Table pages are handed out by physical address
         pd_entry->base_addr = new_pt_phys >> 12;
         pd_entry->present = 1;
         pd_entry->rw = 1;
@@ -502,6 +838,8 @@ int map_page(uint64_t phys_page, uint64_t virt_addr, uint64_t flags) {
     pt_t *pt = (pt_t *) phys_to_vir(((uint64_t)pd_entry->base_addr) << 12);
     page_t *page = &pt->pages[pt_index];
 
+    uint64_t old_entry = *(uint64_t *) page;
+
     // Install the mapping: store physical frame (>>12) into page entry and set flags
     page->frame = phys_page >> 12;
     page->present = (flags & PAGE_PRESENT) ? 1 : 0;
@@ -512,30 +850,109 @@ int map_page(uint64_t phys_page, uint64_t virt_addr, uint64_t flags) {
     page->nx = (flags & PAGE_NX) ? 1 : 0;
 #endif
 
-    // Make sure CPU notices the change
-    flush_tlb(virt_addr);
+    return ((old_entry & PAGE_PRESENT) && old_entry != *(uint64_t *) page) ? 1 : 0;
+}
+
+
+// Map a single page: map the given physical page to the given virtual address with flags.
+// Returns 0 on success, -1 on error.
+int map_page(uint64_t phys_page, uint64_t virt_addr, uint64_t flags) {
+    int ret = set_mapping(phys_page, virt_addr, PAGE_SIZE, flags);
+    if (ret < 0) return -1;
+
+    // Only a replaced entry can be cached by any core
+    if (ret > 0) tlb_shootdown(virt_addr, 1);
 
     return 0;
 }
 
+
+// Map one 2 MB or 1 GB page. Both addresses must be aligned to page_size.
+// Returns 0 on success, -1 on error or when a page table is already mapped there.
+int map_huge_page(uint64_t phys_page, uint64_t virt_addr, uint64_t page_size, uint64_t flags) {
+    if (page_size != HUGE_PAGE_SIZE_2M && page_size != HUGE_PAGE_SIZE_1G) {
+        printf("[Error] map_huge_page: invalid page size %x\n", page_size);
+        return -1;
+    }
+    if (page_size == HUGE_PAGE_SIZE_1G && !cpu_has_1gb_pages()) {
+        printf("[Error] map_huge_page: CPU has no 1 GB pages\n");
+        return -1;
+    }
+
+    int ret = set_mapping(phys_page, virt_addr, page_size, flags);
+    if (ret < 0) return -1;
+
+    if (ret > 0) tlb_shootdown(virt_addr, page_size / PAGE_SIZE);
+
+    return 0;
+}
+
+
+// Remove a 2 MB or 1 GB mapping and return its physical address, 0 if there is none.
+// The TLB is not flushed, the caller has to shoot the range down before reusing the memory.
+uint64_t unmap_huge_page(uint64_t virt_addr, uint64_t page_size) {
+    pml4_t *pml4 = (pml4_t *) phys_to_vir(get_cr3_addr() & ~0xFFFULL);
+
+    dir_entry_t *pml4_entry = &pml4->entries[PML4_INDEX(virt_addr)];
+    if (!pml4_entry->present) return 0;
+
+    pdpt_t *pdpt = (pdpt_t *) phys_to_vir(((uint64_t)pml4_entry->base_addr) << 12);
+    dir_entry_t *entry = &pdpt->entries[PDPT_INDEX(virt_addr)];
+
+    if (page_size == HUGE_PAGE_SIZE_2M && entry->present && !entry->huge) {
+        pd_t *pd = (pd_t *) phys_to_vir(((uint64_t)entry->base_addr) << 12);
+        entry = &pd->entries[PD_INDEX(virt_addr)];
+    }
+
+    if (!entry->present || !entry->huge) return 0;
+
+    uint64_t phys = ((uint64_t) entry->base_addr << 12) & ~(page_size - 1);
+    *(uint64_t *) entry = 0;
+    return phys;
+}
+
+
 // Map an entire range (page-aligned). convenience wrapper.
+// Every step uses the largest page (1 GB, 2 MB or 4 KB) which both addresses are aligned to
+// and which fits in the rest of the range.
 int map_range(uint64_t phys_start, uint64_t virt_start, size_t size, uint64_t flags) {
     if ((phys_start & 0xFFF) || (virt_start & 0xFFF)) {
         printf("[Error] map_range: addresses must be page-aligned\n");
         return -1;
     }
-    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (size_t i = 0; i < pages; ++i) {
-        uint64_t p = phys_start + (i * PAGE_SIZE);
-        uint64_t v = virt_start + (i * PAGE_SIZE);
-        if (map_page(p, v, flags) != 0) {
+    size = (size + PAGE_SIZE - 1) & ~((uint64_t) PAGE_SIZE - 1);
+
+    bool replaced = false;
+    int ret = 0;
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t p = phys_start + done;
+        uint64_t v = virt_start + done;
+        uint64_t page_size = PAGE_SIZE;
+        int r;
+
+        if (cpu_has_1gb_pages() && !((p | v) & (HUGE_PAGE_SIZE_1G - 1)) && size - done >= HUGE_PAGE_SIZE_1G) {
+            page_size = HUGE_PAGE_SIZE_1G;
+        } else if (!((p | v) & (HUGE_PAGE_SIZE_2M - 1)) && size - done >= HUGE_PAGE_SIZE_2M) {
+            page_size = HUGE_PAGE_SIZE_2M;
+        }
+
+        // A page table already in place keeps the smaller pages
+        while ((r = set_mapping(p, v, page_size, flags)) == MAPPING_BLOCKED) {
+            page_size = (page_size == HUGE_PAGE_SIZE_1G) ? HUGE_PAGE_SIZE_2M : PAGE_SIZE;
+        }
+
+        if (r < 0) {
             printf("[Error] map_range: failed mapping at phys=%x virt=%x\n", p, v);
-            return -1;
+            ret = -1;
+            break;
         }
+        if (r > 0) replaced = true;
+        done += page_size;
     }
-    // global TLB flush is optional, we already invalidate per page
-    flush_tlb_all();
-    return 0;
+    // One flush for the whole range, a full flush when it is above TLB_FLUSH_THRESHOLD
+    if (replaced) tlb_shootdown(virt_start, size / PAGE_SIZE);
+    return ret;
 }
 
 
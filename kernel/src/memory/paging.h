@@ -28,6 +28,7 @@ CR3 |- Page Directory Pointer Table (PDPT)-|-Page Table (PT) => Pages
 #include <stdbool.h>
 
 #include "../util/util.h"
+#include "tlb.h"
 
 
 #define PAGE_SIZE    4096
@@ -35,6 +36,11 @@ CR3 |- Page Directory Pointer Table (PDPT)-|-Page Table (PT) => Pages
 #define PAGE_PRESENT 0x1
 #define PAGE_WRITE   0x2
 #define PAGE_USER    0x4
+#define PAGE_HUGE    0x80           // PS bit, PD entry maps 2 MB or PDPT entry maps 1 GB
+#define PAGE_COW     0x200          // Available bit 9, copy the frame on the next write
+
+#define HUGE_PAGE_SIZE_2M 0x200000
+#define HUGE_PAGE_SIZE_1G 0x40000000
 
 // 512 entries per table
 #define ENTRIES_PER_TABLE 512
@@ -56,7 +62,9 @@ struct dir_entry { // 64 bit
     uint64_t pwt          : 1;  
     uint64_t pcd          : 1;
     uint64_t accessed     : 1;
-    uint64_t reserved_1   : 3;  // all zeros
+    uint64_t dirty        : 1;  // huge pages only
+    uint64_t huge         : 1;  // PS, entry maps a 2 MB (PD) or 1 GB (PDPT) page instead of a table
+    uint64_t global       : 1;  // huge pages only
     uint64_t available_1  : 3;  // zero
     uint64_t base_addr    : 40; // Table base address
     uint64_t available_2  : 11; // zero
@@ -75,7 +83,8 @@ typedef struct page { // 64 bit
     uint64_t dirty     : 1;
     uint64_t pat       : 1;
     uint64_t global    : 1;
-    uint64_t ignored   : 3;
+    uint64_t cow       : 1;     // Available bit 9, shared read only until the next write
+    uint64_t ignored   : 2;
     uint64_t frame     : 40;
     uint64_t reserved  : 11;
     uint64_t nx        : 1;
@@ -108,17 +117,26 @@ extern uint64_t V_KMEM_UP_BASE;
 extern uint64_t V_KMEM_LOW_BASE;
 
 uint64_t get_cr3_addr();
+void set_cr3_addr(uint64_t cr3);
 
 void alloc_frame(page_t *page, int user, int is_writeable);
+void alloc_zeroed_frame(page_t *page, int user, int is_writeable);
 void free_frame(page_t *page);
 
 void init_bs_paging();
 void init_bs_paging_with_new_pml4();
 void init_ap_paging(int core_id);
 
+#define PAGE_MAKE_ZEROED 2      // get_page() make value: a new page gets a zeroed frame
+
 page_t* get_page(uint64_t va, int make, pml4_t* pml4);
 
 
+void free_empty_tables(uint64_t va, pml4_t *pml4, tlb_batch_t *batch);
+int fill_kernel_half(pml4_t *pml4);
+void free_pml4_entries(pml4_t *pml4, int first, int last);
+int64_t copy_pml4_entries_cow(pml4_t *src, pml4_t *dst, int first, int last, tlb_batch_t *batch);
+
 void flush_tlb(uint64_t address);
 void flush_tlb_all();
 
@@ -129,6 +147,8 @@ uint64_t create_new_pml4();
 
 //------------------------------
 int map_page(uint64_t phys_page, uint64_t virt_addr, uint64_t flags);
+int map_huge_page(uint64_t phys_page, uint64_t virt_addr, uint64_t page_size, uint64_t flags);
+uint64_t unmap_huge_page(uint64_t virt_addr, uint64_t page_size);
 int map_range(uint64_t phys_start, uint64_t virt_start, size_t size, uint64_t flags);
 
 
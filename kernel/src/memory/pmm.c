@@ -11,6 +11,9 @@
 
 #include "../util/util.h"
 
+#include "../lib/spinlock.h"
+#include "../sys/cpu/cpu.h"
+
 #include "pmm.h"
 
 extern bool debug_on;
@@ -18,17 +21,95 @@ extern bool debug_on;
 extern uint64_t USABLE_LENGTH_PHYS_MEM;
 
 // This file will set or free a 4KB physical Frame.
-// one row of bitmap can store information(free/use) of 8 * 4 KB = 32 Kb memory page(8 pages)
+// one row of bitmap can store information(free/use) of 64 * 4 KB = 256 KB memory (64 frames)
 // A bitset of frames - used or free.
+//
+// Two summary levels sit on top of the bitmap so a free frame is found without scanning it:
+//   l1_full  : one bit per frames[] row, set when the row has no free frame
+//   l1_empty : one bit per frames[] row, set when the row has no used frame
+//   l2_full  : one bit per l1_full row, set when all 64 rows below it are full
+// One l2_full row covers 1 GB, so finding a free frame costs a few ctz instructions.
+//
+// The bitmap is shared by all cores and protected by pmm_lock. Single frames normally go through
+// a small per-CPU cache in cpu_datas[] which refills from and drains to the bitmap in batches,
+// so pmm_alloc_frame() and pmm_free_frame() only take the lock once per PMM_CACHE_BATCH frames.
 
 uint64_t *frames; // start of bitset frames
 uint64_t nframes; // Total numbers of frames
 
+static uint64_t nwords;         // Rows in frames[]
+static uint64_t *l1_full;       // Summary of full frames[] rows
+static uint64_t *l1_empty;      // Summary of empty frames[] rows
+static uint64_t nl1;            // Rows in l1_full[] and l1_empty[]
+static uint64_t *l2_full;       // Summary of full l1_full[] rows
+static uint64_t nl2;            // Rows in l2_full[]
+
+static uint64_t hint;           // frames[] row to try first, last row an allocation or free touched
+static uint64_t used_frames;    // Frames currently marked as used (cached frames count as used)
+
+static spinlock_t pmm_lock = SPINLOCK_INIT_NAMED("pmm");    // Protects the bitmap, its summaries and the counters above
+
+// Extra owners of a frame, 0 for a frame with a single owner. Copy-on-write mappings
+// share frames, pmm_free_frame() only frees a frame once its last owner lets go.
+static volatile uint16_t *frame_shares;
+
 extern volatile uint64_t phys_mem_head; // head of physical memory
 
+#define FRAME_ALIGN_UP(addr) (((uint64_t)(addr) + FRAME_SIZE - 1) & ~((uint64_t)FRAME_SIZE - 1))
 
-// set the value of frames array by using bit no
-void set_frame(uint64_t bit_no) {
+
+// Counting set bits without libgcc (no popcnt on baseline x86-64)
+static inline uint64_t count_bits(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+}
+
+
+// Refresh the summary bits after frames[idx] changed
+static void update_summary(uint64_t idx) {
+    uint64_t row = frames[idx];
+    uint64_t i1 = idx / BITMAP_SIZE;
+    uint64_t b1 = 0x1ULL << (idx % BITMAP_SIZE);
+
+    if (row == 0xFFFFFFFFFFFFFFFF) l1_full[i1] |= b1; else l1_full[i1] &= ~b1;
+    if (row == 0) l1_empty[i1] |= b1; else l1_empty[i1] &= ~b1;
+
+    uint64_t i2 = i1 / BITMAP_SIZE;
+    uint64_t b2 = 0x1ULL << (i1 % BITMAP_SIZE);
+
+    if (l1_full[i1] == 0xFFFFFFFFFFFFFFFF) l2_full[i2] |= b2; else l2_full[i2] &= ~b2;
+}
+
+
+// Mark count frames starting from bit_no as used or free
+static void mark_range(uint64_t bit_no, uint64_t count, bool used) {
+    while (count > 0) {
+        uint64_t idx = INDEX_FROM_BIT_NO(bit_no);
+        uint64_t off = OFFSET_FROM_BIT_NO(bit_no);
+        uint64_t n = BITMAP_SIZE - off;
+        if (n > count) n = count;
+
+        uint64_t mask = (n == BITMAP_SIZE) ? 0xFFFFFFFFFFFFFFFF : (((0x1ULL << n) - 1) << off);
+
+        if (used) {
+            used_frames += n - count_bits(frames[idx] & mask);
+            frames[idx] |= mask;
+        } else {
+            used_frames -= count_bits(frames[idx] & mask);
+            frames[idx] &= ~mask;
+        }
+        update_summary(idx);
+
+        bit_no += n;
+        count -= n;
+    }
+}
+
+
+// set the value of frames array by using bit no, pmm_lock must be held
+static void set_frame_bit(uint64_t bit_no) {
 
     if (bit_no >= nframes) {
         printf("[PMM ERROR] bit_no=%llu >= nframes=%llu\n", bit_no, nframes);
@@ -39,15 +120,16 @@ void set_frame(uint64_t bit_no) {
     uint64_t bitmap_idx = INDEX_FROM_BIT_NO(bit_no);
     uint64_t bitmap_off = OFFSET_FROM_BIT_NO(bit_no);
 
-    frames[bitmap_idx] |= (0x1 << bitmap_off);       // Set the bit
+    if (!(frames[bitmap_idx] & (0x1ULL << bitmap_off))) used_frames++;
 
-    phys_mem_head += FRAME_SIZE;                     // Move the physical memory head to the next frame
+    frames[bitmap_idx] |= (0x1ULL << bitmap_off);    // Set the bit
+    update_summary(bitmap_idx);
 }
 
 
 
-// Static function to clear a bit in the frames bitset
-void clear_frame(uint64_t bit_no)
+// Static function to clear a bit in the frames bitset, pmm_lock must be held
+static void clear_frame_bit(uint64_t bit_no)
 {
     if (bit_no >= nframes) {
         printf("[PMM ERROR] bit_no=%llu >= nframes=%llu\n", bit_no, nframes);
@@ -63,8 +145,26 @@ void clear_frame(uint64_t bit_no)
         return;
     }
 
-    // frames[bitmap_idx] &= (0 << bitmap_off);                // clears bit of frames
+    if (frames[bitmap_idx] & (0x1ULL << bitmap_off)) used_frames--;
+
     frames[bitmap_idx] &= ~(0x1ULL << bitmap_off);
+    update_summary(bitmap_idx);
+
+    hint = bitmap_idx;                                // Recently freed frame is likely still in cache
+}
+
+
+void set_frame(uint64_t bit_no) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    set_frame_bit(bit_no);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+
+void clear_frame(uint64_t bit_no) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    clear_frame_bit(bit_no);
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
 
 
@@ -74,60 +174,454 @@ uint64_t test_frame(uint64_t bit_no)
     if (bit_no >= nframes) {
         printf("[PMM ERROR] bit_no=%llu >= nframes=%llu\n", bit_no, nframes);
     }
-   assert(bit_no < nframes); 
+   assert(bit_no < nframes);
    uint64_t bitmap_idx = INDEX_FROM_BIT_NO(bit_no);
    uint64_t bitmap_off = OFFSET_FROM_BIT_NO(bit_no);
    return (frames[bitmap_idx] & (0x1ULL << bitmap_off));    // returns 0 or 1
 }
 
 
-// Static function to find the first free frame.
+// Finding a frames[] row with at least one free frame by walking down the summary levels
+static int64_t find_free_row() {
+    if (hint < nwords && frames[hint] != 0xFFFFFFFFFFFFFFFF) {
+        return (int64_t) hint;
+    }
+
+    for (uint64_t i2 = 0; i2 < nl2; i2++) {
+        if (l2_full[i2] == 0xFFFFFFFFFFFFFFFF) continue;
+
+        uint64_t i1 = i2 * BITMAP_SIZE + __builtin_ctzll(~l2_full[i2]);
+        uint64_t idx = i1 * BITMAP_SIZE + __builtin_ctzll(~l1_full[i1]);
+
+        return (int64_t) idx;
+    }
+
+    return -1;
+}
+
+
+// Static function to find the first free frame, pmm_lock must be held.
 // The below function will return a valid bit number or invalid bit no -1
-int64_t free_frame_bit_no()
+static int64_t find_free_frame()
 {
-    int64_t free_bit = (int64_t)-1;
-    bool found = false;
-
-    for (uint64_t bitmap_idx = 0; (bitmap_idx <= INDEX_FROM_BIT_NO(nframes - 1)) && !found; bitmap_idx++)
-    {
-        if (frames[bitmap_idx] != 0xFFFFFFFFFFFFFFFF) // if all bits not set, i.e. there has at least one bit is clear
-        {    
-            for (uint64_t bitmap_off = 0; bitmap_off < BITMAP_SIZE; bitmap_off++)
-            {
-                uint64_t toTest = (uint64_t) 0x1ULL << bitmap_off; // Ensure the shift is handled as a 64-bit value.ULL means Unsigned Long Long 
-
-                if ( !(frames[bitmap_idx] & toTest) ) // if corresponding bit is zero
-                {
-                    free_bit = CONVERT_BIT_NO(bitmap_idx, bitmap_off); // return corresponding bit number i.e frame index
-                    found = true;
-                    break;
+    int64_t idx = find_free_row();
+    if (idx < 0) {
+        return -1;      // Return an invalid frame index to indicate failure.
+    }
+
+    hint = (uint64_t) idx;
+
+    int64_t free_bit = (int64_t) CONVERT_BIT_NO((uint64_t) idx, (uint64_t) __builtin_ctzll(~frames[idx]));
+
+    assert(free_bit < (int64_t) nframes); // no free bit bigger than nframes
+
+    return free_bit;
+}
+
+
+int64_t free_frame_bit_no() {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    int64_t bit_no = find_free_frame();
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return bit_no;
+}
+
+
+// Move up to PMM_CACHE_BATCH free frames from the bitmap into the cache, returns the number moved
+static uint64_t cache_refill(pmm_cache_t *cache) {
+    uint64_t moved = 0;
+
+    spin_lock(&pmm_lock);
+    while (moved < PMM_CACHE_BATCH) {
+        int64_t bit_no = find_free_frame();
+        if (bit_no < 0) break;
+        set_frame_bit((uint64_t) bit_no);
+        cache->frames[cache->count++] = (uint64_t) bit_no;
+        moved++;
+    }
+    spin_unlock(&pmm_lock);
+
+    if (moved) cache->refills++;
+    return moved;
+}
+
+
+// Give the oldest PMM_CACHE_BATCH frames of the cache back to the bitmap
+static void cache_drain(pmm_cache_t *cache) {
+    uint64_t n = (cache->count < PMM_CACHE_BATCH) ? cache->count : PMM_CACHE_BATCH;
+
+    spin_lock(&pmm_lock);
+    for (uint64_t i = 0; i < n; i++) {
+        clear_frame_bit(cache->frames[i]);
+    }
+    spin_unlock(&pmm_lock);
+
+    // Keep the most recently freed (cache hot) frames on top of the stack
+    for (uint64_t i = n; i < cache->count; i++) {
+        cache->frames[i - n] = cache->frames[i];
+    }
+    cache->count -= n;
+    cache->drains++;
+}
+
+
+// The cache of the running core, NULL while per-CPU caches can not be used yet
+static pmm_cache_t *this_cpu_cache() {
+    cpu_data_t *cpu = get_cpu_data();
+    return cpu ? &cpu->pmm_cache : NULL;
+}
+
+
+// Allocate one frame and return its bit number or -1.
+// Served from the per-CPU cache when possible, the global bitmap is only locked on refill.
+int64_t pmm_alloc_frame() {
+    if (!frames) return -1;
+
+    uint64_t flags = irq_save();                    // Stay on this core and keep IRQs out of the cache
+
+    pmm_cache_t *cache = this_cpu_cache();
+    if (cache) {
+        if (cache->count > 0) {
+            cache->hits++;
+        } else if (cache_refill(cache) == 0) {
+            irq_restore(flags);
+            return -1;                              // Bitmap is exhausted as well
+        }
+        uint64_t bit_no = cache->frames[--cache->count];
+        irq_restore(flags);
+        return (int64_t) bit_no;
+    }
+
+    spin_lock(&pmm_lock);
+    int64_t bit_no = find_free_frame();
+    if (bit_no >= 0) {
+        set_frame_bit((uint64_t) bit_no);
+    }
+    spin_unlock(&pmm_lock);
+
+    irq_restore(flags);
+    return bit_no;
+}
+
+
+// Add an owner to an allocated frame. False when the share count is full, the caller copies the frame then.
+bool pmm_share_frame(uint64_t bit_no) {
+    if (!frame_shares || bit_no >= nframes) return false;
+
+    uint16_t shares = __atomic_load_n(&frame_shares[bit_no], __ATOMIC_ACQUIRE);
+    while (shares < UINT16_MAX) {
+        if (__atomic_compare_exchange_n(&frame_shares[bit_no], &shares, shares + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Drop one extra owner of a frame. Returns false when the caller was the only owner.
+bool pmm_put_frame_share(uint64_t bit_no) {
+    if (!frame_shares || bit_no >= nframes) return false;
+
+    uint16_t shares = __atomic_load_n(&frame_shares[bit_no], __ATOMIC_ACQUIRE);
+    while (shares > 0) {
+        if (__atomic_compare_exchange_n(&frame_shares[bit_no], &shares, shares - 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Number of extra owners of a frame
+uint16_t pmm_frame_shares(uint64_t bit_no) {
+    if (!frame_shares || bit_no >= nframes) return 0;
+    return __atomic_load_n(&frame_shares[bit_no], __ATOMIC_ACQUIRE);
+}
+
+
+// Drop one owner of a frame returned by pmm_alloc_frame(), it is freed when the last owner lets go
+void pmm_free_frame(uint64_t bit_no) {
+    if (bit_no >= nframes) {
+        printf("[PMM ERROR] free of bit_no=%llu >= nframes=%llu\n", bit_no, nframes);
+        return;
+    }
+
+    if (pmm_put_frame_share(bit_no)) return;       // Still mapped somewhere else
+
+    uint64_t flags = irq_save();
+
+    pmm_cache_t *cache = this_cpu_cache();
+    if (cache) {
+        if (cache->count == PMM_CACHE_SIZE) {
+            cache_drain(cache);
+        }
+        cache->frames[cache->count++] = bit_no;
+        cache->frees++;
+        irq_restore(flags);
+        return;
+    }
+
+    spin_lock(&pmm_lock);
+    clear_frame_bit(bit_no);
+    spin_unlock(&pmm_lock);
+
+    irq_restore(flags);
+}
+
+
+// Finding count (<= 64) free frames aligned to count inside one frames[] row
+static int64_t find_run_in_row(uint64_t count) {
+    uint64_t mask = (count == BITMAP_SIZE) ? 0xFFFFFFFFFFFFFFFF : ((0x1ULL << count) - 1);
+
+    for (uint64_t i1 = 0; i1 < nl1; i1++) {
+        uint64_t avail = ~l1_full[i1];              // Rows which still have a free frame
+
+        while (avail) {
+            uint64_t idx = i1 * BITMAP_SIZE + __builtin_ctzll(avail);
+            avail &= avail - 1;
+            if (idx >= nwords) break;
+
+            uint64_t row = frames[idx];
+            for (uint64_t off = 0; off < BITMAP_SIZE; off += count) {
+                if (!(row & (mask << off))) {
+                    return (int64_t) CONVERT_BIT_NO(idx, off);
                 }
-                continue; // If the current bit is set, continue to the next bit in the bitmap.
             }
         }
-        continue;   // If all bits in the current bitmap are set, continue to the next bitmap index.
-   }
-   
-   assert(free_bit < nframes); // no free bit bigger than nframes
+    }
+
+    return -1;
+}
+
+
+// Finding rows (<= 64) completely free rows whose physical address is aligned to their size.
+// USABLE_START_PHYS_MEM is only aligned to one row, so the first aligned row may be a few rows in.
+static int64_t find_empty_rows(uint64_t rows) {
+    uint64_t mask = (rows == BITMAP_SIZE) ? 0xFFFFFFFFFFFFFFFF : ((0x1ULL << rows) - 1);
+    uint64_t first_row = USABLE_START_PHYS_MEM / (BITMAP_SIZE * FRAME_SIZE);
+    uint64_t phase = (rows - first_row % rows) % rows;     // Rows are a power of two dividing 64
+
+    for (uint64_t i1 = 0; i1 < nl1; i1++) {
+        uint64_t empty = l1_empty[i1];
+        if (!empty) continue;
 
-   return free_bit; // Return an invalid frame index to indicate failure.
+        for (uint64_t off = phase; off + rows <= BITMAP_SIZE; off += rows) {
+            if ((empty & (mask << off)) == (mask << off)) {
+                uint64_t idx = i1 * BITMAP_SIZE + off;
+                if (idx + rows > nwords) break;
+                return (int64_t) CONVERT_BIT_NO(idx, 0);
+            }
+        }
+    }
+
+    return -1;
+}
+
+
+// Allocate 2^order physically contiguous frames and return the physical address of the first one.
+// The block is aligned to its own size in physical memory: within a bitmap row, as
+// USABLE_START_PHYS_MEM is row aligned, and by find_empty_rows() beyond. Returns 0 on failure.
+uint64_t pmm_alloc_pages(uint8_t order) {
+    if (order > PMM_MAX_ORDER || !frames) {
+        return 0;
+    }
+
+    uint64_t count = 0x1ULL << order;
+    int64_t bit_no;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    if (order == 0) {
+        bit_no = find_free_frame();
+    } else if (count <= BITMAP_SIZE) {
+        bit_no = find_run_in_row(count);
+    } else {
+        bit_no = find_empty_rows(count / BITMAP_SIZE);
+    }
+
+    if (bit_no >= 0) {
+        mark_range((uint64_t) bit_no, count, true);
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (bit_no < 0) {
+        printf("[PMM ERROR] No free block of order %d\n", order);
+        return 0;
+    }
+
+    return BIT_NO_TO_ADDR((uint64_t) bit_no);
+}
+
+
+// Free a block returned by pmm_alloc_pages() with the same order
+void pmm_free_pages(uint64_t phys_addr, uint8_t order) {
+    if (order > PMM_MAX_ORDER || phys_addr < USABLE_START_PHYS_MEM || (phys_addr & (FRAME_SIZE - 1))) {
+        printf("[PMM ERROR] Invalid free of %x (order %d)\n", phys_addr, order);
+        return;
+    }
+
+    uint64_t count = 0x1ULL << order;
+    uint64_t bit_no = PHYS_ADDR_TO_BIT_NO(phys_addr);
+
+    if (bit_no + count > nframes) {
+        printf("[PMM ERROR] Free of %x (order %d) is outside of managed memory\n", phys_addr, order);
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    mark_range(bit_no, count, false);
+    hint = INDEX_FROM_BIT_NO(bit_no);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+
+// Free frames in the bitmap, frames sitting in per-CPU caches count as used
+uint64_t pmm_free_frames() {
+    return nframes - __atomic_load_n(&used_frames, __ATOMIC_RELAXED);
+}
+
+
+// Walk the bitmap and collect usage and fragmentation statistics
+void pmm_get_stats(pmm_stats_t *stats) {
+    if (!stats) return;
+
+    memset(stats, 0, sizeof(pmm_stats_t));
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    stats->total_frames = nframes;
+    stats->used_frames = used_frames;
+    stats->free_frames = nframes - used_frames;
+
+    uint64_t run = 0;
+    for (uint64_t bit_no = 0; bit_no <= nframes; bit_no++) {
+        bool used = true;                           // The position after the last frame closes the last run
+
+        if (bit_no < nframes) {
+            uint64_t row = frames[INDEX_FROM_BIT_NO(bit_no)];
+            if (OFFSET_FROM_BIT_NO(bit_no) == 0 && bit_no + BITMAP_SIZE <= nframes && (row == 0 || row == 0xFFFFFFFFFFFFFFFF)) {
+                if (row == 0) {                      // Whole row free
+                    run += BITMAP_SIZE;
+                    bit_no += BITMAP_SIZE - 1;
+                    continue;
+                }
+                used = true;
+                bit_no += BITMAP_SIZE - 1;           // Whole row used, close the run below
+            } else {
+                used = (row >> OFFSET_FROM_BIT_NO(bit_no)) & 0x1;
+            }
+        }
+
+        if (!used) {
+            run++;
+            continue;
+        }
+
+        if (run > 0) {
+            uint64_t order = 63 - __builtin_clzll(run);
+            if (order > PMM_MAX_ORDER) order = PMM_MAX_ORDER;
+
+            stats->free_runs++;
+            stats->runs_by_order[order]++;
+            if (run > stats->largest_free_run) stats->largest_free_run = run;
+            run = 0;
+        }
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    if (stats->free_frames > 0) {
+        stats->fragmentation = 100 - (stats->largest_free_run * 100) / stats->free_frames;
+    }
+}
+
+
+void pmm_print_stats() {
+    pmm_stats_t stats;
+    pmm_get_stats(&stats);
+
+    printf(" PMM Frames: total %d, used %d, free %d\n", stats.total_frames, stats.used_frames, stats.free_frames);
+    printf(" PMM Free runs: %d, largest run %d frames, fragmentation %d%%\n",
+        stats.free_runs, stats.largest_free_run, stats.fragmentation);
+
+    printf(" PMM Free runs by order:");
+    for (int order = 0; order <= PMM_MAX_ORDER; order++) {
+        printf(" %d:%d", order, stats.runs_by_order[order]);
+    }
+    printf("\n");
+
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (!cpu_datas[i].is_online) continue;
+        pmm_cache_t *cache = &cpu_datas[i].pmm_cache;
+        printf(" PMM CPU %d cache: %d frames, hits %d, frees %d, refills %d, drains %d\n",
+            i, cache->count, cache->hits, cache->frees, cache->refills, cache->drains);
+    }
 }
 
 
 
 void init_pmm(){
 
+    if (frames != NULL) {
+        return;     // Already initialized by the bootstrap core
+    }
+
     nframes = (uint64_t) (USABLE_LENGTH_PHYS_MEM) / FRAME_SIZE;         // Total number of frames in the memory
 
+    nwords = (nframes + BITMAP_SIZE - 1) / BITMAP_SIZE;
+    nl1 = (nwords + BITMAP_SIZE - 1) / BITMAP_SIZE;
+    nl2 = (nl1 + BITMAP_SIZE - 1) / BITMAP_SIZE;
+
+    uint64_t total_words = nwords + (2 * nl1) + nl2;
+
     // printf(" Total nframes: %d\n", nframes);
 
-    frames = (uint64_t*) kmalloc_a(sizeof(uint64_t) * (nframes + 63) / BITMAP_SIZE, 1); // Allocate memory for the bitmap array
+    frames = (uint64_t*) kmalloc_a(sizeof(uint64_t) * total_words, 1); // Allocate memory for the bitmap array and its summaries
     if(frames == NULL){
         printf("[Error] PMM: Failed to allocate memory for frames\n");
         return;
     }
     // clear the memory of frames array
-    memset(frames, 0, sizeof(uint64_t) * (nframes + 63) / BITMAP_SIZE);                           
+    memset(frames, 0, sizeof(uint64_t) * total_words);
+
+    frame_shares = (volatile uint16_t *) kmalloc_a(sizeof(uint16_t) * nframes, 1);
+    if (frame_shares == NULL) {
+        printf("[Error] PMM: Failed to allocate memory for frame share counts\n");
+        return;
+    }
+    memset((void *) frame_shares, 0, sizeof(uint16_t) * nframes);
+
+    l1_full  = frames + nwords;
+    l1_empty = l1_full + nl1;
+    l2_full  = l1_empty + nl1;
+
+    // Bits past the last frame are permanently used so they are never handed out
+    if (nframes % BITMAP_SIZE) {
+        frames[nwords - 1] = ~((0x1ULL << (nframes % BITMAP_SIZE)) - 1);
+    }
+    for (uint64_t idx = nwords; idx < nl1 * BITMAP_SIZE; idx++) {
+        l1_full[idx / BITMAP_SIZE] |= 0x1ULL << (idx % BITMAP_SIZE);
+    }
+    for (uint64_t i1 = nl1; i1 < nl2 * BITMAP_SIZE; i1++) {
+        l2_full[i1 / BITMAP_SIZE] |= 0x1ULL << (i1 % BITMAP_SIZE);
+    }
+    for (uint64_t idx = 0; idx < nwords; idx++) {
+        update_summary(idx);
+    }
+
+    used_frames = 0;
+    hint = 0;
+
+    // The bitmap and everything kmalloc handed out before it live at the start of usable memory,
+    // keep those frames away from alloc_frame()
+    uint64_t boot_frames = (FRAME_ALIGN_UP(phys_mem_head) - USABLE_START_PHYS_MEM) / FRAME_SIZE;
+    if (boot_frames > nframes) boot_frames = nframes;
+    mark_range(0, boot_frames, true);
+
+    kmalloc_handoff();      // Everything after the boot frames is now allocated through the PMM
 
     if(debug_on) printf("[PMM] Successfully initialized PMM!\n");
 }
@@ -138,8 +632,20 @@ void test_pmm(){
     printf(" Frames Pointer Address : %x\n", (uint64_t) frames);
     printf(" Total Frames : %d\n", nframes);
     printf(" After frames allocation next free address pointer: %x\n", phys_mem_head);
-}
 
+    uint64_t single = pmm_alloc_pages(0);
+    uint64_t block = pmm_alloc_pages(4);        // 16 contiguous frames
+    printf(" Order 0 block: %x, Order 4 block: %x\n", single, block);
 
+    int64_t cached[8];
+    for (int i = 0; i < 8; i++) cached[i] = pmm_alloc_frame();
+    printf(" Cached frames: %x .. %x\n", BIT_NO_TO_ADDR(cached[0]), BIT_NO_TO_ADDR(cached[7]));
 
+    pmm_print_stats();
 
+    for (int i = 0; i < 8; i++) {
+        if (cached[i] >= 0) pmm_free_frame((uint64_t) cached[i]);
+    }
+    pmm_free_pages(single, 0);
+    pmm_free_pages(block, 4);
+}
@@ -2,6 +2,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "detect_memory.h"
 
 #define FRAME_SIZE 4096     // 4 KB
@@ -23,14 +24,55 @@
 // Finding the maximum frame index from the memory size.
 #define MAX_FRAME_INDEX(memory_size) (memory_size / (BITMAP_SIZE * FRAME_SIZE))
 
+// Largest block handed out by pmm_alloc_pages(): 2^10 frames = 4 MB
+#define PMM_MAX_ORDER 10
+
+// Per-CPU frame cache (magazine) sizes
+#define PMM_CACHE_SIZE  64      // Frames one CPU may hold in its cache
+#define PMM_CACHE_BATCH 32      // Frames moved between a cache and the global bitmap at once
+
 extern uint64_t *frames; // start of bitset frames
 extern uint64_t nframes; // Total frames
 
+typedef struct pmm_stats {
+    uint64_t total_frames;                      // Frames managed by the PMM
+    uint64_t used_frames;                       // Frames marked as used
+    uint64_t free_frames;                       // Frames available
+    uint64_t free_runs;                         // Number of maximal runs of free frames
+    uint64_t largest_free_run;                  // Length of the longest free run in frames
+    uint64_t runs_by_order[PMM_MAX_ORDER + 1];  // Free runs of length [2^order, 2^(order+1)), last entry is open ended
+    uint64_t fragmentation;                     // 0 - 100, how much free memory is outside the largest run
+} pmm_stats_t;
+
+// Free frames held privately by one CPU, lives in cpu_datas[] so the fast path touches no shared state
+typedef struct pmm_cache {
+    uint64_t count;                             // Frames currently cached
+    uint64_t frames[PMM_CACHE_SIZE];            // Cached frame bit numbers, used as a stack
+    uint64_t hits;                              // Allocations served from the cache
+    uint64_t frees;                             // Frees put back into the cache
+    uint64_t refills;                           // Batches taken from the global bitmap
+    uint64_t drains;                            // Batches given back to the global bitmap
+} pmm_cache_t;
+
 void set_frame(uint64_t frame_addr);
 void clear_frame(uint64_t frame_addr);
 uint64_t test_frame(uint64_t frame_addr);
 int64_t free_frame_bit_no();
 
+int64_t pmm_alloc_frame();
+void pmm_free_frame(uint64_t bit_no);
+
+bool pmm_share_frame(uint64_t bit_no);
+bool pmm_put_frame_share(uint64_t bit_no);
+uint16_t pmm_frame_shares(uint64_t bit_no);
+
+uint64_t pmm_alloc_pages(uint8_t order);
+void pmm_free_pages(uint64_t phys_addr, uint8_t order);
+
+uint64_t pmm_free_frames();
+void pmm_get_stats(pmm_stats_t *stats);
+void pmm_print_stats();
+
 void init_pmm();
 
 void test_pmm();
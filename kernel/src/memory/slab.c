@@ -0,0 +1,345 @@
+/*
+Slab / Size-Class Allocator
+
+Small kernel allocations are served from one page slabs split into fixed size
+objects (16 B to 1 KiB). Allocations bigger than SLAB_MAX_SIZE fall through to
+kheap_alloc() with a small header at the start of the pages.
+
+Both kinds of block keep a magic value at the start of their page, so slab_free()
+finds the owner of any pointer by masking it down to the page boundary.
+
+All cores share the caches under slab_lock. It is dropped around kheap calls,
+which may wait for TLB shootdowns from the other cores.
+
+References:
+    https://www.kernel.org/doc/gorman/html/understand/understand011.html
+    https://en.wikipedia.org/wiki/Slab_allocation
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+#include "../lib/spinlock.h"
+#include "vmm.h"
+#include "kheap.h"
+
+#include "slab.h"
+
+#define PAGE_SIZE 0x1000
+#define PAGE_MASK (~((uint64_t)PAGE_SIZE - 1))
+
+#define SLAB_OBJ_OFFSET ((sizeof(slab_t) + 15) & ~15ULL)   // Objects start 16 byte aligned after the header
+
+static slab_cache_t slab_caches[SLAB_CLASS_COUNT] = {
+    { .obj_size = 16   },
+    { .obj_size = 32   },
+    { .obj_size = 64   },
+    { .obj_size = 128  },
+    { .obj_size = 256  },
+    { .obj_size = 512  },
+    { .obj_size = 1024 },
+};
+
+static spinlock_t slab_lock = SPINLOCK_INIT_NAMED("slab");  // Guards the caches, the page cache and the counters
+
+static void *free_pages = NULL;         // Cached empty slab pages, linked through their first word
+static uint64_t free_page_count = 0;
+
+static uint64_t large_allocs = 0;       // Total large allocations served by kheap
+static uint64_t large_in_use = 0;       // Large blocks currently allocated
+static uint64_t large_bytes = 0;        // Bytes currently allocated in large blocks
+static uint64_t large_pages = 0;        // Pages behind the large blocks
+
+
+// Finding the smallest size class which can hold size bytes
+static int size_to_class(size_t size) {
+    size_t class_size = SLAB_MIN_SIZE;
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        if (size <= class_size) return i;
+        class_size <<= 1;
+    }
+    return -1;
+}
+
+
+// Taking an empty page from the cached pages, refilling from kheap if needed.
+// slab_lock is held, flags are its saved RFLAGS for dropping it around kheap_alloc().
+static void *get_slab_page(uint64_t *flags) {
+    if (!free_pages) {
+        spin_unlock_irqrestore(&slab_lock, *flags);
+        // Pages of one chunk are freed one by one, so the chunk has no padding page
+        uint8_t *chunk = (uint8_t *) kheap_alloc_pages(SLAB_REFILL_PAGES * PAGE_SIZE, ALLOCATE_DATA);
+        *flags = spin_lock_irqsave(&slab_lock);
+        if (!chunk) {
+            printf("[Error] SLAB: Failed to refill slab pages!\n");
+            return NULL;
+        }
+        for (int i = 0; i < SLAB_REFILL_PAGES; i++) {
+            void *page = chunk + (i * PAGE_SIZE);
+            *(void **)page = free_pages;
+            free_pages = page;
+            free_page_count++;
+        }
+    }
+
+    void *page = free_pages;
+    free_pages = *(void **)page;
+    free_page_count--;
+    return page;
+}
+
+
+// Giving an empty page back to the cache, returns it when enough are cached
+// and the caller has to kheap_free_pages() it after dropping slab_lock
+static void *put_slab_page(void *page) {
+    if (free_page_count >= SLAB_MAX_FREE_PAGES) return page;
+
+    *(void **)page = free_pages;
+    free_pages = page;
+    free_page_count++;
+    return NULL;
+}
+
+
+static void list_remove(slab_t **head, slab_t *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *head = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static void list_push(slab_t **head, slab_t *slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+
+// Creating a new slab for the given cache and splitting it into free objects, slab_lock is held
+static slab_t *create_slab(int class_idx, uint64_t *flags) {
+    slab_cache_t *cache = &slab_caches[class_idx];
+
+    slab_t *slab = (slab_t *) get_slab_page(flags);
+    if (!slab) return NULL;
+
+    slab->magic = SLAB_MAGIC;
+    slab->class_idx = (uint16_t) class_idx;
+    slab->obj_size = (uint16_t) cache->obj_size;
+    slab->total = (uint16_t) ((PAGE_SIZE - SLAB_OBJ_OFFSET) / cache->obj_size);
+    slab->in_use = 0;
+    slab->reserved = 0;
+    slab->free_list = NULL;
+    slab->next = NULL;
+    slab->prev = NULL;
+
+    // Building the free list backwards so objects are handed out in address order
+    uint8_t *base = (uint8_t *) slab + SLAB_OBJ_OFFSET;
+    for (int i = slab->total - 1; i >= 0; i--) {
+        void *obj = base + (i * cache->obj_size);
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+
+static void *large_alloc(size_t size) {
+    slab_large_t *header = (slab_large_t *) kheap_alloc(sizeof(slab_large_t) + size, ALLOCATE_DATA);
+    if (!header) return NULL;
+
+    header->magic = SLAB_LARGE_MAGIC;
+    header->reserved = 0;
+    header->size = size;
+
+    uint64_t flags = spin_lock_irqsave(&slab_lock);
+    large_allocs++;
+    large_in_use++;
+    large_bytes += size;
+    large_pages += (sizeof(slab_large_t) + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    spin_unlock_irqrestore(&slab_lock, flags);
+
+    return (void *) ((uint8_t *) header + sizeof(slab_large_t));
+}
+
+
+void *slab_alloc(size_t size) {
+    if (size == 0) return NULL;
+
+    int class_idx = size_to_class(size);
+    if (class_idx < 0) {
+        return large_alloc(size);
+    }
+
+    slab_cache_t *cache = &slab_caches[class_idx];
+    uint64_t flags = spin_lock_irqsave(&slab_lock);
+
+    slab_t *slab = cache->partial;
+    if (!slab) {
+        slab = create_slab(class_idx, &flags);
+        if (!slab) {
+            spin_unlock_irqrestore(&slab_lock, flags);
+            return NULL;
+        }
+        list_push(&cache->partial, slab);
+    }
+
+    void *obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+    slab->in_use++;
+
+    if (slab->in_use == slab->total) {       // Slab is now full
+        list_remove(&cache->partial, slab);
+        list_push(&cache->full, slab);
+    }
+
+    cache->allocs++;
+    cache->in_use++;
+
+    spin_unlock_irqrestore(&slab_lock, flags);
+
+    return obj;
+}
+
+
+void slab_free(void *ptr) {
+    if (!ptr) return;
+
+    uint32_t magic = *(uint32_t *) ((uint64_t) ptr & PAGE_MASK);
+
+    if (magic == SLAB_LARGE_MAGIC) {
+        slab_large_t *header = (slab_large_t *) ((uint8_t *) ptr - sizeof(slab_large_t));
+        if (header->magic != SLAB_LARGE_MAGIC) {
+            printf("[Error] SLAB: Invalid large block free at %x\n", (uint64_t) ptr);
+            return;
+        }
+        size_t size = header->size;
+        header->magic = 0;
+
+        uint64_t flags = spin_lock_irqsave(&slab_lock);
+        large_in_use--;
+        large_bytes -= size;
+        large_pages -= (sizeof(slab_large_t) + size + PAGE_SIZE - 1) / PAGE_SIZE;
+        spin_unlock_irqrestore(&slab_lock, flags);
+
+        kheap_free(header, sizeof(slab_large_t) + size);
+        return;
+    }
+
+    if (magic != SLAB_MAGIC) {
+        printf("[Error] SLAB: Free of unknown pointer %x\n", (uint64_t) ptr);
+        return;
+    }
+
+    slab_t *slab = (slab_t *) ((uint64_t) ptr & PAGE_MASK);
+    slab_cache_t *cache = &slab_caches[slab->class_idx];
+
+    // Rejecting pointers which are not at an object boundary
+    uint64_t offset = (uint64_t) ptr - ((uint64_t) slab + SLAB_OBJ_OFFSET);
+    if (((uint64_t) ptr < (uint64_t) slab + SLAB_OBJ_OFFSET) || (offset % slab->obj_size) != 0) {
+        printf("[Error] SLAB: Misaligned free at %x\n", (uint64_t) ptr);
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&slab_lock);
+
+    bool was_full = (slab->in_use == slab->total);
+
+    *(void **)ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->in_use--;
+
+    cache->frees++;
+    cache->in_use--;
+
+    if (was_full) {
+        list_remove(&cache->full, slab);
+        list_push(&cache->partial, slab);
+    }
+
+    // Keeping one empty slab per cache to avoid thrashing on alloc/free pairs
+    void *release = NULL;
+    if (slab->in_use == 0 && (slab->next || slab->prev)) {
+        list_remove(&cache->partial, slab);
+        slab->magic = 0;
+        cache->slabs--;
+        release = put_slab_page(slab);
+    }
+
+    spin_unlock_irqrestore(&slab_lock, flags);
+
+    if (release) kheap_free_pages(release, PAGE_SIZE);
+}
+
+
+// Usable size of an allocated block
+size_t slab_size(void *ptr) {
+    if (!ptr) return 0;
+
+    uint32_t magic = *(uint32_t *) ((uint64_t) ptr & PAGE_MASK);
+
+    if (magic == SLAB_LARGE_MAGIC) {
+        slab_large_t *header = (slab_large_t *) ((uint8_t *) ptr - sizeof(slab_large_t));
+        return header->size;
+    }
+
+    if (magic == SLAB_MAGIC) {
+        slab_t *slab = (slab_t *) ((uint64_t) ptr & PAGE_MASK);
+        return slab->obj_size;
+    }
+
+    return 0;
+}
+
+
+// Bytes handed out and bytes of pages held, empty cached slab pages included
+void slab_get_usage(uint64_t *in_use, uint64_t *footprint) {
+    uint64_t flags = spin_lock_irqsave(&slab_lock);
+    uint64_t used = large_bytes;
+    uint64_t pages = large_pages + free_page_count;
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        used += slab_caches[i].in_use * slab_caches[i].obj_size;
+        pages += slab_caches[i].slabs;
+    }
+    spin_unlock_irqrestore(&slab_lock, flags);
+
+    if (in_use) *in_use = used;
+    if (footprint) *footprint = pages * PAGE_SIZE;
+}
+
+
+void slab_print_stats() {
+    printf("Slab Allocator Statistics:\n");
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        slab_cache_t *cache = &slab_caches[i];
+        printf(" [%d B] slabs: %d, in use: %d, allocs: %d, frees: %d\n",
+            cache->obj_size, cache->slabs, cache->in_use, cache->allocs, cache->frees);
+    }
+    printf(" Large blocks: %d in use (%d bytes), total allocs: %d\n", large_in_use, large_bytes, large_allocs);
+    printf(" Cached empty slab pages: %d\n", free_page_count);
+}
+
+
+void test_slab() {
+    printf("Test of slab allocator\n");
+
+    void *small[8];
+    for (int i = 0; i < 8; i++) {
+        small[i] = slab_alloc(24);
+        printf(" small[%d] : %x (usable %d)\n", i, (uint64_t) small[i], slab_size(small[i]));
+    }
+
+    void *sector = slab_alloc(512);
+    printf(" sector buffer : %x (usable %d)\n", (uint64_t) sector, slab_size(sector));
+
+    void *big = slab_alloc(3 * PAGE_SIZE);
+    printf(" large block : %x (usable %d)\n", (uint64_t) big, slab_size(big));
+
+    for (int i = 0; i < 8; i++) slab_free(small[i]);
+    slab_free(sector);
+    slab_free(big);
+
+    slab_print_stats();
+}
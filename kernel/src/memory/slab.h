@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SLAB_MAGIC          0x51AB51ABU     // Page start of a size-class slab
+#define SLAB_LARGE_MAGIC    0x1A56E000U     // Page start of a large (kheap backed) block
+
+#define SLAB_MIN_SIZE       16              // Smallest size class
+#define SLAB_MAX_SIZE       1024            // Largest size class, bigger requests go to kheap
+#define SLAB_CLASS_COUNT    7               // 16, 32, 64, 128, 256, 512, 1024
+
+#define SLAB_REFILL_PAGES   16              // Pages taken from kheap at once for new slabs
+#define SLAB_MAX_FREE_PAGES 32              // Empty slab pages kept cached before returning to kheap
+
+// Every slab is exactly one page so the owning slab of an object is found by masking the address.
+typedef struct slab {
+    uint32_t magic;                 // SLAB_MAGIC
+    uint16_t class_idx;             // Index into slab_caches[]
+    uint16_t obj_size;              // Object size of this slab
+    uint16_t total;                 // Number of objects in this slab
+    uint16_t in_use;                // Number of allocated objects
+    uint32_t reserved;
+    void *free_list;                // Singly linked list of free objects
+    struct slab *next;              // Next slab in the cache list
+    struct slab *prev;              // Previous slab in the cache list
+} slab_t;
+
+// Header placed at the start of every large allocation, keeps user data 16 byte aligned
+typedef struct slab_large {
+    uint32_t magic;                 // SLAB_LARGE_MAGIC
+    uint32_t reserved;
+    size_t size;                    // Requested size in bytes
+} slab_large_t;
+
+typedef struct slab_cache {
+    size_t obj_size;                // Object size served by this cache
+    slab_t *partial;                // Slabs with at least one free object
+    slab_t *full;                   // Slabs without free objects
+    uint64_t slabs;                 // Slabs currently owned by this cache
+    uint64_t allocs;                // Total allocations served
+    uint64_t frees;                 // Total frees served
+    uint64_t in_use;                // Objects currently allocated
+} slab_cache_t;
+
+void *slab_alloc(size_t size);
+void slab_free(void *ptr);
+size_t slab_size(void *ptr);
+void slab_get_usage(uint64_t *in_use, uint64_t *footprint);
+
+void slab_print_stats();
+void test_slab();
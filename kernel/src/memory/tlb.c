@@ -0,0 +1,216 @@
+/*
+TLB Invalidation and Shootdown
+
+Local flushes use invlpg per page and fall back to a CR3 reload above
+TLB_FLUSH_THRESHOLD pages. When other cores are online a shootdown sends one
+IPI per core for the whole range and waits until every core has flushed it.
+
+With PCIDs a core only takes the IPI when it runs the address space the range
+belongs to. Every other core gets the PCID marked stale and flushes it when it
+loads it again. Kernel half and low window entries may be shared by several
+PCIDs, so those are dropped from every context.
+
+Only one shootdown is in flight at a time. A core that waits for the
+shootdown lock keeps serving requests aimed at itself, so two cores starting
+a shootdown at the same time can not deadlock each other.
+
+References:
+    https://wiki.osdev.org/TLB
+    https://www.kernel.org/doc/html/latest/arch/x86/tlb.html
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/spinlock.h"
+#include "../util/util.h"
+#include "../arch/interrupt/irq_manage.h"
+#include "../arch/interrupt/apic/apic.h"
+#include "../sys/cpu/cpu.h"
+#include "detect_memory.h"
+#include "paging.h"
+#include "pmm.h"
+#include "address_space.h"
+
+#include "tlb.h"
+
+#define TLB_SHOOTDOWN_SPIN_LIMIT 100000000  // pause loops before a core is reported as not answering
+
+static spinlock_t shootdown_lock = SPINLOCK_INIT_NAMED("tlb_shootdown");
+static volatile uint64_t shootdown_start;           // Range of the shootdown in flight
+static volatile uint64_t shootdown_pages;
+static volatile uint16_t shootdown_pcid;            // Address space the range belongs to
+static volatile uint8_t shootdown_wait[MAX_CPUS];   // Set by the sender, cleared by the target after flushing
+
+
+static tlb_stats_t *this_cpu_stats() {
+    cpu_data_t *cpu = get_cpu_data();
+    return cpu ? &cpu->tlb_stats : NULL;
+}
+
+
+void tlb_flush_page(uint64_t va) {
+    tlb_flush_range(va, 1);
+}
+
+
+// Kernel half, and PML4 entry 0 unless the space was forked, are mapped by the same tables in every address space
+static bool va_is_shared(uint64_t va) {
+    return (va >> 47) || PML4_INDEX(va) < AS_SHARED_USER_ENTRIES;
+}
+
+
+// Invalidate pages starting at start on this core only
+void tlb_flush_range(uint64_t start, uint64_t pages) {
+    if (pages == 0) return;
+
+    tlb_stats_t *stats = this_cpu_stats();
+
+    // invlpg only reaches the loaded PCID, other PCIDs may cache shared mappings too
+    if (va_is_shared(start) && pcid_tagged()) {
+        flush_tlb_all_contexts();
+        if (stats) stats->full_flushes++;
+        return;
+    }
+
+    if (pages > TLB_FLUSH_THRESHOLD) {
+        flush_tlb_all();
+        if (stats) stats->full_flushes++;
+        return;
+    }
+
+    for (uint64_t i = 0; i < pages; i++) {
+        flush_tlb(start + i * PAGE_SIZE);
+    }
+    if (stats) stats->page_flushes += pages;
+}
+
+
+// Flush the range requested for this core, if any. Called by cores spinning with
+// interrupts off on a lock whose holder may be waiting for them.
+void tlb_serve_shootdown() {
+    uint32_t cpu_id = get_lapic_id();
+    if (cpu_id >= MAX_CPUS || !__atomic_load_n(&shootdown_wait[cpu_id], __ATOMIC_ACQUIRE)) return;
+
+    if (pcid_enabled() && !va_is_shared(shootdown_start) && cpu_current_pcid(cpu_id) != shootdown_pcid) {
+        pcid_mark_stale(cpu_id, shootdown_pcid);        // Switched away since the IPI was sent
+    } else {
+        tlb_flush_range(shootdown_start, shootdown_pages);
+    }
+
+    tlb_stats_t *stats = this_cpu_stats();
+    if (stats) stats->shootdowns_received++;
+
+    __atomic_store_n(&shootdown_wait[cpu_id], 0, __ATOMIC_RELEASE);
+}
+
+
+static void tlb_shootdown_handler(registers_t *regs) {
+    (void) regs;
+    tlb_serve_shootdown();
+}
+
+
+// Invalidate pages starting at start on every online core
+void tlb_shootdown(uint64_t start, uint64_t pages) {
+    if (pages == 0) return;
+
+    tlb_flush_range(start, pages);
+
+    cpu_data_t *self = get_cpu_data();
+    if (!self) return;                      // Other cores are not running yet
+
+    uint64_t flags = irq_save();
+
+    while (!spin_trylock(&shootdown_lock)) {
+        tlb_serve_shootdown();              // The lock holder may be waiting for us
+        asm volatile("pause");
+    }
+
+    uint16_t pcid = cpu_current_pcid(self->lapic_id);
+    bool per_space = pcid_enabled() && !va_is_shared(start);
+
+    shootdown_start = start;
+    shootdown_pages = pages;
+    shootdown_pcid = pcid;
+
+    uint32_t targets = 0;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (i == self->lapic_id || !cpu_datas[i].is_online) continue;
+
+        if (per_space && cpu_current_pcid(i) != pcid) {
+            pcid_mark_stale(i, pcid);
+            if (cpu_current_pcid(i) != pcid) continue;  // Still elsewhere, it flushes when it switches back
+        }
+
+        __atomic_store_n(&shootdown_wait[i], 1, __ATOMIC_RELEASE);
+        lapic_send_ipi((uint8_t) i, TLB_SHOOTDOWN_VECTOR);
+        targets++;
+    }
+
+    for (uint32_t i = 0; i < MAX_CPUS && targets > 0; i++) {
+        uint64_t spins = 0;
+        while (__atomic_load_n(&shootdown_wait[i], __ATOMIC_ACQUIRE)) {
+            if (++spins == TLB_SHOOTDOWN_SPIN_LIMIT) {
+                printf("[Error] TLB: CPU %d did not answer shootdown of %x\n", i, start);
+                shootdown_wait[i] = 0;
+                break;
+            }
+            asm volatile("pause");
+        }
+    }
+
+    if (targets > 0) self->tlb_stats.shootdowns_sent++;
+
+    spin_unlock(&shootdown_lock);
+    irq_restore(flags);
+}
+
+
+void tlb_batch_init(tlb_batch_t *batch) {
+    batch->start = UINT64_MAX;
+    batch->end = 0;
+    batch->count = 0;
+}
+
+
+// Add an unmapped page to the batch, frame_phys (0 for none) is freed after the flush
+void tlb_batch_add(tlb_batch_t *batch, uint64_t va, uint64_t frame_phys) {
+    if (frame_phys && batch->count == TLB_BATCH_MAX) {
+        tlb_batch_flush(batch);
+    }
+
+    va &= ~((uint64_t) PAGE_SIZE - 1);
+    if (va < batch->start) batch->start = va;
+    if (va + PAGE_SIZE > batch->end) batch->end = va + PAGE_SIZE;
+
+    if (frame_phys) batch->frames[batch->count++] = frame_phys;
+}
+
+
+void tlb_batch_flush(tlb_batch_t *batch) {
+    if (batch->end > batch->start) {
+        tlb_shootdown(batch->start, (batch->end - batch->start) / PAGE_SIZE);
+    }
+
+    for (uint64_t i = 0; i < batch->count; i++) {
+        uint64_t frame = batch->frames[i];
+        if (frame < USABLE_START_PHYS_MEM || frame >= USABLE_END_PHYS_MEM) continue;   // Not owned by the PMM
+        pmm_free_frame(PHYS_ADDR_TO_BIT_NO(frame));
+    }
+
+    tlb_batch_init(batch);
+}
+
+
+void init_tlb_shootdown() {
+    irq_install(TLB_SHOOTDOWN_IRQ, &tlb_shootdown_handler);
+}
+
+
+void tlb_print_stats() {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (!cpu_datas[i].is_online) continue;
+        tlb_stats_t *stats = &cpu_datas[i].tlb_stats;
+        printf(" TLB CPU %d: invlpg %d, full flushes %d, shootdowns sent %d, received %d\n",
+            i, stats->page_flushes, stats->full_flushes, stats->shootdowns_sent, stats->shootdowns_received);
+    }
+}
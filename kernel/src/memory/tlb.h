@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TLB_FLUSH_THRESHOLD     32          // Above this many pages one CR3 reload is cheaper than invlpg per page
+#define TLB_BATCH_MAX           32          // Frames a tlb_batch_t holds back until the mapping is gone everywhere
+
+#define TLB_SHOOTDOWN_IRQ       19          // IRQ 19 => vector 51, installed on every core
+#define TLB_SHOOTDOWN_VECTOR    51
+
+// Collects unmapped pages so all cores are invalidated with one shootdown.
+// Frames (and page table pages) are only given back to the PMM after that,
+// so no core can still reach a frame through a stale TLB entry once it is reused.
+typedef struct tlb_batch {
+    uint64_t start;                         // Lowest virtual address in the batch
+    uint64_t end;                           // End of the highest page in the batch
+    uint64_t count;                         // Frames waiting in frames[]
+    uint64_t frames[TLB_BATCH_MAX];         // Physical frames to free after the flush
+} tlb_batch_t;
+
+typedef struct tlb_stats {
+    uint64_t page_flushes;                  // Pages invalidated with invlpg
+    uint64_t full_flushes;                  // Whole TLB flushes (CR3 reload)
+    uint64_t shootdowns_sent;               // Shootdowns this core started
+    uint64_t shootdowns_received;           // Shootdown IPIs this core served
+} tlb_stats_t;
+
+void tlb_flush_page(uint64_t va);
+void tlb_flush_range(uint64_t start, uint64_t pages);
+void tlb_shootdown(uint64_t start, uint64_t pages);
+void tlb_serve_shootdown();
+
+void tlb_batch_init(tlb_batch_t *batch);
+void tlb_batch_add(tlb_batch_t *batch, uint64_t va, uint64_t frame_phys);
+void tlb_batch_flush(tlb_batch_t *batch);
+
+void init_tlb_shootdown();
+void tlb_print_stats();
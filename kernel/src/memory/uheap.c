@@ -3,40 +3,69 @@
 #include "../lib/stdio.h"
 #include "../bootloader/boot.h"
 #include "../memory/detect_memory.h"
+#include "../lib/spinlock.h"
 #include "vmm.h"
+#include "address_space.h"
+#include "meminfo.h"
 
 #include "uheap.h"
 
 #define PAGE_SIZE 0x1000
 
-static volatile uint64_t l_va_head = 0x500000 + LOWER_HALF_START_ADDR;
+#define UHEAP_START (0x500000 + LOWER_HALF_START_ADDR)     // Heap start of the kernel address space
+
+
+// Every address space hands out its own heap addresses
+static va_space_t *uheap_space() {
+    address_space_t *as = current_address_space();
+    if (as == &kernel_as && !as->uheap.end) va_space_init(&as->uheap, UHEAP_START, AS_UHEAP_END);
+    return &as->uheap;
+}
 
 
 void *uheap_alloc(size_t size, uint8_t type) {
     // Align size to page size (4 KiB)
     size = (size + 0xFFF) & ~0xFFF;
 
-    // Check if we have enough space in the heap
-    if ((l_va_head + size) > LOWER_HALF_END_ADDR) {
+    // Take one more page as padding between allocations to prevent overlapping
+    uint64_t va = size ? va_range_alloc(uheap_space(), size + PAGE_SIZE, PAGE_SIZE) : 0;
+    if (!va) {
         printf("Out of memory\n");
         return NULL;                    // Out of heap space
     }
 
     // Allocate virtual pages for the requested size
-    uint64_t va = l_va_head;
-    
-    while (l_va_head < va + size) {
-        vm_alloc(l_va_head, type);            // allocating by vm_alloc function
-        l_va_head+= PAGE_SIZE;          // Increment by page size (size)
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+        vm_alloc(va + off, type);       // allocating by vm_alloc function
     }
-
-    // Add 4KB padding between allocations to prevent overlapping
-    l_va_head += PAGE_SIZE;
+    mem_account(MEM_UHEAP, size);
 
     return (void *)va; // Return the start of the allocated region
 }
 
 
+// Reserve size bytes without backing them, every page gets a zeroed frame on first touch.
+// Not for DMA buffers, a device never faults the pages in.
+void *uheap_reserve(size_t size, uint8_t type) {
+    size = (size + 0xFFF) & ~0xFFF;
+
+    // Keep the guard page after the region
+    uint64_t va = size ? va_range_alloc(uheap_space(), size + PAGE_SIZE, PAGE_SIZE) : 0;
+    if (!va) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+
+    if (!vm_reserve(va, size, type)) {
+        va_range_free(uheap_space(), va, size + PAGE_SIZE);
+        return NULL;
+    }
+    mem_account(MEM_UHEAP_RESERVED, size);
+
+    return (void *)va;
+}
+
+
 void uheap_free(void *ptr, size_t size) {
     if (!ptr || size == 0) {
         printf("ptr | size == 0\n");
@@ -47,13 +76,147 @@ void uheap_free(void *ptr, size_t size) {
     size = (size + 0xFFF) & ~0xFFF;
 
     uint64_t va = (uint64_t)ptr;    // Get the virtual address of the pointer
+    uint64_t range = size + PAGE_SIZE;
+
+    if (vm_release(va, size)) {     // Reserved region, only touched pages are mapped
+        va_range_free(uheap_space(), va, range);
+        mem_account(MEM_UHEAP_RESERVED, -(int64_t) size);
+        return;
+    }
+    mem_account(MEM_UHEAP, -(int64_t) size);
+
+    tlb_batch_t batch;              // One shootdown for the whole region
+    tlb_batch_init(&batch);
 
     // Free the pages corresponding to the memory region
     while (size > 0) {              // If size greater than zero
-        vm_free((uint64_t *)va);    // Free the virtual page
+        vm_unmap(va, &batch);       // Unmap the virtual page
         va += PAGE_SIZE;            // Increase Virtual Address by 4KB
         size -= PAGE_SIZE;          // Decrease the size variable by 4KB
     }
+
+    tlb_batch_flush(&batch);        // Invalidate everywhere, then free the frames
+
+    va_range_free(uheap_space(), (uint64_t)ptr, range);   // Addresses are reusable once no TLB holds them
+}
+
+
+static spinlock_t brk_lock = SPINLOCK_INIT_NAMED("brk");     // Interrupts stay on, shrinking waits for a shootdown
+
+// Move the program break of the current address space to addr, 0 only asks for it.
+// The break lives in a UHEAP_BRK_MAX window which is demand paged up to the break.
+// Returns the new break, the old one when addr can not be used and 0 on failure.
+uint64_t uheap_brk(uint64_t addr) {
+    address_space_t *as = current_address_space();
+    spin_lock(&brk_lock);
+
+    if (!as->brk_start) {
+        uint64_t start = va_range_alloc(uheap_space(), UHEAP_BRK_MAX + PAGE_SIZE, PAGE_SIZE);
+        if (!start) {
+            spin_unlock(&brk_lock);
+            printf("[Error] UHEAP: No room for the program break\n");
+            return 0;
+        }
+        as->brk_start = start;
+        as->brk = start;
+    }
+
+    uint64_t brk = as->brk;
+    if (addr == 0 || addr < as->brk_start || addr > as->brk_start + UHEAP_BRK_MAX) {
+        spin_unlock(&brk_lock);
+        return brk;
+    }
+
+    uint64_t old_size = ((brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) - as->brk_start;
+    uint64_t new_size = ((addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) - as->brk_start;
+
+    bool ok = true;
+    if (new_size != old_size) {
+        ok = old_size ? vm_resize(as->brk_start, new_size)           // Shrinking unmaps the pages above
+                      : vm_reserve(as->brk_start, new_size, ALLOCATE_DATA);
+    }
+    if (ok) {
+        as->brk = addr;
+        mem_account(MEM_UHEAP_RESERVED, (int64_t) new_size - (int64_t) old_size);
+    }
+
+    brk = as->brk;
+    spin_unlock(&brk_lock);
+    return brk;
+}
+
+
+// Move the program break by increment. Returns the old break or -1.
+uint64_t uheap_sbrk(int64_t increment) {
+    uint64_t old = uheap_brk(0);
+    if (!old) return (uint64_t) -1;
+    if (increment == 0) return old;
+
+    return (uheap_brk(old + increment) == old + increment) ? old : (uint64_t) -1;
+}
+
+
+// Map length bytes of zeroed memory (MAP_ANONYMOUS) or of the open file fp from offset on.
+// The file is read here, pages are only backed when touched.
+// File mappings are read only, so MAP_SHARED and MAP_PRIVATE behave the same.
+// Returns the address or 0.
+uint64_t uheap_mmap(size_t length, int prot, int flags, int disk_no, void *fp, uint64_t offset) {
+    size_t size = (length + 0xFFF) & ~0xFFF;
+    if (size == 0 || !(flags & (MAP_SHARED | MAP_PRIVATE))) {
+        printf("[Error] UHEAP: Invalid mmap of %d bytes\n", length);
+        return 0;
+    }
+
+    vm_file_t *file = NULL;
+    if (!(flags & MAP_ANONYMOUS)) {
+        if ((prot & PROT_WRITE) || (offset & 0xFFF)) {
+            printf("[Error] UHEAP: File mappings are read only and page aligned\n");
+            return 0;
+        }
+        file = vm_file_open(disk_no, fp);
+        if (!file) return 0;
+    }
+
+    // Keep the guard page after the mapping
+    uint64_t va = va_range_alloc(uheap_space(), size + PAGE_SIZE, PAGE_SIZE);
+    if (!va) {
+        printf("Out of memory\n");
+        vm_file_put(file);
+        return 0;
+    }
+
+    bool ok = file ? vm_reserve_file(va, size, file, offset)
+                   : vm_reserve(va, size, (prot & PROT_WRITE) ? ALLOCATE_DATA : ALLOCATE_CODE);
+    if (!ok) {
+        vm_file_put(file);
+        va_range_free(uheap_space(), va, size + PAGE_SIZE);
+        return 0;
+    }
+    mem_account(MEM_UHEAP_RESERVED, size);
+
+    return va;
+}
+
+
+// Remove a whole mapping made by uheap_mmap(). Returns 0 or -1.
+int uheap_munmap(uint64_t addr, size_t length) {
+    address_space_t *as = current_address_space();
+    size_t size = (length + 0xFFF) & ~0xFFF;
+
+    if (!addr || addr == as->brk_start || vm_region_size(addr) != size) {
+        printf("[Error] UHEAP: munmap of %x needs a whole mapping\n", addr);
+        return -1;
+    }
+
+    vm_release(addr, size);
+    va_range_free(uheap_space(), addr, size + PAGE_SIZE);
+    mem_account(MEM_UHEAP_RESERVED, -(int64_t) size);
+    return 0;
+}
+
+
+void uheap_print_stats() {
+    va_space_print_stats("User heap", uheap_space());
 }
 
 
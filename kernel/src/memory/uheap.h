@@ -4,7 +4,25 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#define UHEAP_LAZY_MIN 0x10000      // Syscall allocations from this size are demand paged
+#define UHEAP_BRK_MAX  0x40000000   // 1 GB window for the program break of an address space
+
+// mmap() protection and flags, same values as Linux
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_ANONYMOUS   0x20
+
 void *uheap_alloc(size_t size, uint8_t type);
 void uheap_free(void *ptr, size_t size);
+void *uheap_reserve(size_t size, uint8_t type);         // Backed on first touch
+uint64_t uheap_brk(uint64_t addr);
+uint64_t uheap_sbrk(int64_t increment);
+uint64_t uheap_mmap(size_t length, int prot, int flags, int disk_no, void *fp, uint64_t offset);
+int uheap_munmap(uint64_t addr, size_t length);
+void uheap_print_stats();
 
 
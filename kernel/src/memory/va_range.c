@@ -0,0 +1,388 @@
+/*
+Virtual Address Range Allocator
+
+Hands out page aligned virtual ranges from a va_space_t and takes them back,
+so freed kernel and user heap ranges are reused instead of the heap pointer
+only moving forward.
+
+The free ranges are kept in two treaps sharing the same nodes. The address
+tree finds the neighbours of a freed range to merge with, the size tree finds
+the smallest range that fits (best fit). Nodes come from whole PMM frames so
+the allocator never calls back into the heaps it serves.
+
+References:
+    https://www.kernel.org/doc/html/latest/core-api/memory-allocation.html
+    https://www.usenix.org/legacy/event/usenix01/full_papers/bonwick/bonwick.pdf   (vmem)
+    https://en.wikipedia.org/wiki/Treap
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/spinlock.h"
+#include "pmm.h"
+#include "vmm.h"
+
+#include "va_range.h"
+
+#define VA_TREE_ADDR 0
+#define VA_TREE_SIZE 1
+
+#define VA_PAGE_SIZE 0x1000
+
+static va_range_t *node_pool = NULL;            // Unused nodes, linked through link[0][0]
+static spinlock_t node_lock = SPINLOCK_INIT_NAMED("va_node");
+static uint32_t prio_seed = 2463534242U;
+
+
+static uint32_t next_prio() {
+    // xorshift32, only has to look random to keep the treaps balanced
+    uint32_t x = __atomic_load_n(&prio_seed, __ATOMIC_RELAXED);
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    __atomic_store_n(&prio_seed, x, __ATOMIC_RELAXED);
+    return x;
+}
+
+
+static va_range_t *alloc_node() {
+    uint64_t flags = spin_lock_irqsave(&node_lock);
+
+    if (!node_pool) {
+        int64_t bit_no = pmm_alloc_frame();
+        if (bit_no < 0) {
+            spin_unlock_irqrestore(&node_lock, flags);
+            printf("[Error] VA: No frame for range nodes\n");
+            return NULL;
+        }
+        va_range_t *nodes = (va_range_t *) phys_to_vir(BIT_NO_TO_ADDR((uint64_t) bit_no));
+        for (uint64_t i = 0; i < VA_PAGE_SIZE / sizeof(va_range_t); i++) {
+            nodes[i].link[0][0] = node_pool;
+            node_pool = &nodes[i];
+        }
+    }
+
+    va_range_t *node = node_pool;
+    node_pool = node->link[0][0];
+
+    spin_unlock_irqrestore(&node_lock, flags);
+
+    node->link[0][0] = node->link[0][1] = NULL;
+    node->link[1][0] = node->link[1][1] = NULL;
+    node->prio = next_prio();
+    return node;
+}
+
+static void free_node(va_range_t *node) {
+    uint64_t flags = spin_lock_irqsave(&node_lock);
+    node->link[0][0] = node_pool;
+    node_pool = node;
+    spin_unlock_irqrestore(&node_lock, flags);
+}
+
+
+// Order of a and b in tree t
+static bool less(int t, va_range_t *a, va_range_t *b) {
+    if (t == VA_TREE_SIZE && a->size != b->size) return a->size < b->size;
+    return a->start < b->start;
+}
+
+// Split root into nodes ordered before key (l) and the rest (r)
+static void split(int t, va_range_t *root, va_range_t *key, va_range_t **l, va_range_t **r) {
+    if (!root) {
+        *l = *r = NULL;
+        return;
+    }
+    if (less(t, root, key)) {
+        split(t, root->link[t][1], key, &root->link[t][1], r);
+        *l = root;
+    } else {
+        split(t, root->link[t][0], key, l, &root->link[t][0]);
+        *r = root;
+    }
+}
+
+static va_range_t *merge(int t, va_range_t *l, va_range_t *r) {
+    if (!l) return r;
+    if (!r) return l;
+    if (l->prio > r->prio) {
+        l->link[t][1] = merge(t, l->link[t][1], r);
+        return l;
+    }
+    r->link[t][0] = merge(t, l, r->link[t][0]);
+    return r;
+}
+
+static void tree_insert(va_space_t *space, int t, va_range_t *node) {
+    va_range_t *l, *r;
+    node->link[t][0] = node->link[t][1] = NULL;
+    split(t, space->root[t], node, &l, &r);
+    space->root[t] = merge(t, merge(t, l, node), r);
+}
+
+static void tree_remove(va_space_t *space, int t, va_range_t *node) {
+    va_range_t **link = &space->root[t];
+    while (*link && *link != node) {
+        link = &(*link)->link[t][less(t, *link, node) ? 1 : 0];
+    }
+    if (*link) *link = merge(t, node->link[t][0], node->link[t][1]);
+}
+
+
+static void insert_range(va_space_t *space, va_range_t *node) {
+    tree_insert(space, VA_TREE_ADDR, node);
+    tree_insert(space, VA_TREE_SIZE, node);
+    space->free_ranges++;
+}
+
+static void remove_range(va_space_t *space, va_range_t *node) {
+    tree_remove(space, VA_TREE_ADDR, node);
+    tree_remove(space, VA_TREE_SIZE, node);
+    space->free_ranges--;
+}
+
+
+static uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+// Smallest free range that can hold size bytes at the given alignment
+static va_range_t *find_fit(va_range_t *node, uint64_t size, uint64_t align) {
+    if (!node) return NULL;
+
+    if (node->size < size) return find_fit(node->link[VA_TREE_SIZE][1], size, align);
+
+    va_range_t *best = find_fit(node->link[VA_TREE_SIZE][0], size, align);
+    if (best) return best;
+
+    uint64_t start = align_up(node->start, align);
+    if (start >= node->start && start - node->start + size <= node->size) return node;
+
+    return find_fit(node->link[VA_TREE_SIZE][1], size, align);
+}
+
+
+void va_space_init(va_space_t *space, uint64_t start, uint64_t end) {
+    space->lock = (spinlock_t) SPINLOCK_INIT;
+    space->start = start;
+    space->end = end;
+    space->root[VA_TREE_ADDR] = NULL;
+    space->root[VA_TREE_SIZE] = NULL;
+    space->free_bytes = 0;
+    space->free_ranges = 0;
+    space->allocs = 0;
+    space->frees = 0;
+
+    va_range_t *node = alloc_node();
+    if (!node) return;
+    node->start = start;
+    node->size = end - start;
+    insert_range(space, node);
+    space->free_bytes = node->size;
+}
+
+
+static void destroy_tree(va_range_t *node) {
+    if (!node) return;
+    destroy_tree(node->link[VA_TREE_ADDR][0]);
+    destroy_tree(node->link[VA_TREE_ADDR][1]);
+    free_node(node);
+}
+
+// Give all nodes back, the space has to be initialised again before use
+void va_space_destroy(va_space_t *space) {
+    uint64_t flags = spin_lock_irqsave(&space->lock);
+    destroy_tree(space->root[VA_TREE_ADDR]);
+    space->root[VA_TREE_ADDR] = NULL;
+    space->root[VA_TREE_SIZE] = NULL;
+    space->free_bytes = 0;
+    space->free_ranges = 0;
+    space->end = space->start;
+    spin_unlock_irqrestore(&space->lock, flags);
+}
+
+
+static int clone_tree(va_space_t *dst, va_range_t *node) {
+    if (!node) return 0;
+    if (clone_tree(dst, node->link[VA_TREE_ADDR][0]) != 0) return -1;
+
+    va_range_t *copy = alloc_node();
+    if (!copy) return -1;
+    copy->start = node->start;
+    copy->size = node->size;
+    insert_range(dst, copy);
+    dst->free_bytes += copy->size;
+
+    return clone_tree(dst, node->link[VA_TREE_ADDR][1]);
+}
+
+// Make dst track the same free ranges as src (for fork)
+int va_space_clone(va_space_t *dst, va_space_t *src) {
+    dst->lock = (spinlock_t) SPINLOCK_INIT;
+    dst->start = src->start;
+    dst->end = src->end;
+    dst->root[VA_TREE_ADDR] = NULL;
+    dst->root[VA_TREE_SIZE] = NULL;
+    dst->free_bytes = 0;
+    dst->free_ranges = 0;
+    dst->allocs = 0;
+    dst->frees = 0;
+
+    uint64_t flags = spin_lock_irqsave(&src->lock);
+    int ret = clone_tree(dst, src->root[VA_TREE_ADDR]);
+    spin_unlock_irqrestore(&src->lock, flags);
+
+    return ret;
+}
+
+
+// Take size bytes (rounded up to pages) aligned to align (a power of two, at least a page).
+// Returns 0 when no free range is big enough.
+uint64_t va_range_alloc(va_space_t *space, uint64_t size, uint64_t align) {
+    if (size == 0) return 0;
+    size = align_up(size, VA_PAGE_SIZE);
+    if (align < VA_PAGE_SIZE) align = VA_PAGE_SIZE;
+
+    uint64_t flags = spin_lock_irqsave(&space->lock);
+
+    va_range_t *node = find_fit(space->root[VA_TREE_SIZE], size, align);
+    if (!node) {
+        spin_unlock_irqrestore(&space->lock, flags);
+        return 0;
+    }
+
+    uint64_t start = align_up(node->start, align);
+    uint64_t head = start - node->start;                    // Left over before the aligned start
+    uint64_t tail = node->size - head - size;               // Left over after the allocation
+
+    // Nodes for both left overs are needed before anything is changed
+    va_range_t *tail_node = NULL;
+    if (head && tail) {
+        tail_node = alloc_node();
+        if (!tail_node) {
+            spin_unlock_irqrestore(&space->lock, flags);
+            return 0;
+        }
+    }
+
+    remove_range(space, node);
+
+    if (head) {
+        node->size = head;
+        insert_range(space, node);
+        if (tail) {
+            tail_node->start = start + size;
+            tail_node->size = tail;
+            insert_range(space, tail_node);
+        }
+    } else if (tail) {
+        node->start = start + size;
+        node->size = tail;
+        insert_range(space, node);
+    } else {
+        free_node(node);
+    }
+
+    space->free_bytes -= size;
+    space->allocs++;
+
+    spin_unlock_irqrestore(&space->lock, flags);
+    return start;
+}
+
+
+// Give [start, start + size) back, merging it with free neighbours
+bool va_range_free(va_space_t *space, uint64_t start, uint64_t size) {
+    if (size == 0) return false;
+    size = align_up(size, VA_PAGE_SIZE);
+    uint64_t end = start + size;
+
+    if (start < space->start || end > space->end || end < start) {
+        printf("[Error] VA: Free of %x outside the space\n", start);
+        return false;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&space->lock);
+
+    // Closest free ranges below and above start
+    va_range_t *prev = NULL, *next = NULL;
+    va_range_t *node = space->root[VA_TREE_ADDR];
+    while (node) {
+        if (node->start < start) {
+            prev = node;
+            node = node->link[VA_TREE_ADDR][1];
+        } else {
+            next = node;
+            node = node->link[VA_TREE_ADDR][0];
+        }
+    }
+
+    if ((prev && prev->start + prev->size > start) || (next && next->start < end)) {
+        spin_unlock_irqrestore(&space->lock, flags);
+        printf("[Error] VA: Double free of range %x - %x\n", start, end);
+        return false;
+    }
+
+    bool join_prev = prev && prev->start + prev->size == start;
+    bool join_next = next && next->start == end;
+
+    if (join_prev && join_next) {
+        remove_range(space, prev);
+        remove_range(space, next);
+        prev->size += size + next->size;
+        free_node(next);
+        insert_range(space, prev);
+    } else if (join_prev) {
+        remove_range(space, prev);              // The size key changes
+        prev->size += size;
+        insert_range(space, prev);
+    } else if (join_next) {
+        remove_range(space, next);
+        next->start = start;
+        next->size += size;
+        insert_range(space, next);
+    } else {
+        va_range_t *fresh = alloc_node();
+        if (!fresh) {
+            spin_unlock_irqrestore(&space->lock, flags);
+            return false;                       // The range is lost, but nothing is corrupted
+        }
+        fresh->start = start;
+        fresh->size = size;
+        insert_range(space, fresh);
+    }
+
+    space->free_bytes += size;
+    space->frees++;
+
+    spin_unlock_irqrestore(&space->lock, flags);
+    return true;
+}
+
+
+void va_space_get_stats(va_space_t *space, va_stats_t *stats) {
+    uint64_t flags = spin_lock_irqsave(&space->lock);
+
+    va_range_t *largest = space->root[VA_TREE_SIZE];
+    while (largest && largest->link[VA_TREE_SIZE][1]) largest = largest->link[VA_TREE_SIZE][1];
+
+    stats->total_bytes = space->end - space->start;
+    stats->free_bytes = space->free_bytes;
+    stats->used_bytes = stats->total_bytes - space->free_bytes;
+    stats->free_ranges = space->free_ranges;
+    stats->largest_free = largest ? largest->size : 0;
+
+    spin_unlock_irqrestore(&space->lock, flags);
+
+    // Space sizes stay below 2^48, times 100 still fits
+    stats->fragmentation = stats->free_bytes ? 100 - (stats->largest_free * 100 / stats->free_bytes) : 0;
+}
+
+
+void va_space_print_stats(const char *name, va_space_t *space) {
+    va_stats_t stats;
+    va_space_get_stats(space, &stats);
+
+    printf(" %s VA: used %x, free %x in %d ranges, largest %x, fragmentation %d%%, allocs %d, frees %d\n",
+        name, stats.used_bytes, stats.free_bytes, stats.free_ranges, stats.largest_free,
+        stats.fragmentation, space->allocs, space->frees);
+}
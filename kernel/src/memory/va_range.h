@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../lib/spinlock.h"
+
+// Free virtual address range. Every range sits in two treaps at once:
+// one ordered by address (to merge neighbours on free) and one by size (best fit).
+typedef struct va_range {
+    uint64_t start;
+    uint64_t size;
+    uint32_t prio;                          // Treap priority, shared by both trees
+    struct va_range *link[2][2];            // [VA_TREE_ADDR / VA_TREE_SIZE][left / right]
+} va_range_t;
+
+typedef struct va_space {
+    spinlock_t lock;
+    uint64_t start;                         // Managed range [start, end)
+    uint64_t end;
+    va_range_t *root[2];                    // Address ordered and size ordered trees
+    uint64_t free_bytes;
+    uint64_t free_ranges;
+    uint64_t allocs;                        // Allocations served
+    uint64_t frees;                         // Ranges given back
+} va_space_t;
+
+typedef struct va_stats {
+    uint64_t total_bytes;
+    uint64_t used_bytes;
+    uint64_t free_bytes;
+    uint64_t free_ranges;                   // Holes the free space is split into
+    uint64_t largest_free;                  // Biggest single free range
+    uint64_t fragmentation;                 // 0 - 100, how much free space is outside the largest range
+} va_stats_t;
+
+void va_space_init(va_space_t *space, uint64_t start, uint64_t end);
+void va_space_destroy(va_space_t *space);
+int va_space_clone(va_space_t *dst, va_space_t *src);
+
+uint64_t va_range_alloc(va_space_t *space, uint64_t size, uint64_t align);
+bool va_range_free(va_space_t *space, uint64_t start, uint64_t size);
+
+void va_space_get_stats(va_space_t *space, va_stats_t *stats);
+void va_space_print_stats(const char *name, va_space_t *space);
@@ -10,12 +10,19 @@ is designed to work with a paging system and includes error handling for various
 
 #include "detect_memory.h"
 #include "../lib/stdio.h"
+#include "../lib/string.h"
+#include "../lib/spinlock.h"
+#include "../lib/stdlib.h"
+#include "../vfs/vfs.h"
 #include "paging.h"
+#include "pmm.h"
+#include "kheap.h"
+#include "address_space.h"
 
 #include "vmm.h"
 
 
-// Allocate a virtual page at the specified virtual address
+// Allocate a virtual page at the specified virtual address, backed by a zeroed frame
 void vm_alloc(uint64_t va, uint8_t type) {  
 
     pml4_t *current_pml4 = (pml4_t *) get_cr3_addr(); // Get the current PML4 table
@@ -25,7 +32,13 @@ void vm_alloc(uint64_t va, uint8_t type) {
         return;
     }
 
-    page_t *page = get_page(va, 1, current_pml4);     // if not present then create the page
+    // An existing mapping may be cached in the TLB, a new one can not be
+    page_t *page = get_page(va, 0, current_pml4);
+    bool was_present = page && page->present;
+
+    if (!was_present) {
+        page = get_page(va, PAGE_MAKE_ZEROED, current_pml4);     // creates the page with a zeroed frame
+    }
 
     if (!page) {
         // Handle error if page creation fails
@@ -33,12 +46,13 @@ void vm_alloc(uint64_t va, uint8_t type) {
         return;
     }
 
-    if(page->present && page->frame << 12 >= USABLE_START_PHYS_MEM){
-        // Page is already present and valid
-        // printf("[Error] page is present with higher physical frame address asigned by limine!\n");
+    if (was_present) {
+        // Page is already mapped (e.g. by limine), give it a frame of its own
+        alloc_zeroed_frame(page, va < HIGHER_HALF_START_ADDR ? 1 : 0, 1);
+    } else {
+        page->user = va < HIGHER_HALF_START_ADDR ? 1 : 0;
+        if (va < HIGHER_HALF_START_ADDR) __atomic_add_fetch(&address_space_of(va)->resident_pages, 1, __ATOMIC_RELAXED);
     }
-    
-    alloc_frame(page, va >= HIGHER_HALF_START_ADDR ? 1 : 0, 1);
 
     switch (type) {
         case ALLOCATE_CODE:
@@ -58,20 +72,15 @@ void vm_alloc(uint64_t va, uint8_t type) {
             return;
     }
 
-
-    flush_tlb(va); // Flush the TLB for the new page
+    if (was_present) {
+        tlb_shootdown(va, 1);       // Drop the old translation on every core
+    }
 }
 
 
-// Free a virtual page at the specified virtual address
-void vm_free(uint64_t *ptr) {
-
-    if (!ptr) {
-        printf("Inside of vm_free: invalid ptr\n");
-        return; // Invalid pointer
-    }
-    
-    uint64_t va = (uint64_t)ptr;
+// Unmap a virtual page. The frame and any emptied page tables are freed by tlb_batch_flush(),
+// after every core has dropped the translation.
+void vm_unmap(uint64_t va, tlb_batch_t *batch) {
 
     pml4_t *current_pml4 = (pml4_t *) get_cr3_addr(); // Get the current PML4 table
     
@@ -87,18 +96,411 @@ void vm_free(uint64_t *ptr) {
         return; // Page not present or invalid
     }
 
-    // Free the physical frame
-    free_frame(page);
+    uint64_t frame_phys = (uint64_t) page->frame << 12;
+
+    // Clear the whole page table entry
+    *(uint64_t *) page = 0;
+
+    if (va < HIGHER_HALF_START_ADDR) __atomic_sub_fetch(&address_space_of(va)->resident_pages, 1, __ATOMIC_RELAXED);
+
+    tlb_batch_add(batch, va, frame_phys);
+
+    free_empty_tables(va, current_pml4, batch);     // Page table pages go back to the PMM when empty
+}
+
+
+// Free a virtual page at the specified virtual address
+void vm_free(uint64_t *ptr) {
+
+    if (!ptr) {
+        printf("Inside of vm_free: invalid ptr\n");
+        return; // Invalid pointer
+    }
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    vm_unmap((uint64_t) ptr, &batch);
+    tlb_batch_flush(&batch);
+}
+
+// Demand paged regions: reserved virtual ranges which get a zeroed frame on first touch.
+static vm_region_t vm_regions[VM_REGION_MAX];
+static spinlock_t vm_region_lock = SPINLOCK_INIT_NAMED("vm_region");
+static spinlock_t cow_lock = SPINLOCK_INIT_NAMED("cow");              // Serialises copy-on-write faults
+
+
+// Take vm_region_lock with interrupts off. The holder may split a huge page or change a
+// mapping and wait for every core to flush it, so shootdowns are answered while spinning.
+static uint64_t region_lock() {
+    uint64_t flags = irq_save();
+    while (!spin_trylock(&vm_region_lock)) {
+        tlb_serve_shootdown();
+        asm volatile("pause");
+    }
+    return flags;
+}
+
+
+static vm_region_t *find_region(uint64_t va) {
+    for (int i = 0; i < VM_REGION_MAX; i++) {
+        vm_region_t *region = &vm_regions[i];
+        if (!region->used || va < region->start || va >= region->end) continue;
+        if (region->pml4 && region->pml4 != get_cr3_addr()) continue;     // Lower half region of another address space
+        return region;
+    }
+    return NULL;
+}
+
+
+// Register [start, start + size) to be backed on first touch
+bool vm_reserve(uint64_t start, size_t size, uint8_t type) {
+    if (size == 0 || type < ALLOCATE_CODE || type > ALLOCATE_STACK) {
+        printf("[Error] VMM: Invalid region reservation!\n");
+        return false;
+    }
+
+    uint64_t flags = region_lock();
+
+    for (int i = 0; i < VM_REGION_MAX; i++) {
+        vm_region_t *region = &vm_regions[i];
+        if (region->used) continue;
+
+        region->start = start & ~((uint64_t) PAGE_SIZE - 1);
+        region->end = (start + size + PAGE_SIZE - 1) & ~((uint64_t) PAGE_SIZE - 1);
+        region->type = type;
+        region->pml4 = is_kernel_virt_addr(start) ? 0 : get_cr3_addr();
+        region->next_fault = region->start;
+        region->faults = 0;
+        region->file = NULL;
+        region->file_offset = 0;
+        region->used = true;
+
+        spin_unlock_irqrestore(&vm_region_lock, flags);
+        return true;
+    }
+
+    spin_unlock_irqrestore(&vm_region_lock, flags);
+    printf("[Error] VMM: No free region slot for %x!\n", start);
+    return false;
+}
+
+
+// Unmap the populated pages of a reserved region and forget it.
+// Returns false when start does not begin a reserved region.
+bool vm_release(uint64_t start, size_t size) {
+    uint64_t flags = region_lock();
+
+    vm_region_t *region = find_region(start);
+    if (!region || region->start != (start & ~((uint64_t) PAGE_SIZE - 1))) {
+        spin_unlock_irqrestore(&vm_region_lock, flags);
+        return false;
+    }
+
+    uint64_t end = region->end;
+    if (size && start + size < end) {
+        printf("[Error] VMM: Partial release of region %x, releasing all of it\n", start);
+    }
+    vm_file_t *file = region->file;
+    region->used = false;
+
+    spin_unlock_irqrestore(&vm_region_lock, flags);
+
+    vm_file_put(file);                  // Kernel heap frees may take the region lock
+
+    pml4_t *current_pml4 = (pml4_t *) get_cr3_addr();
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    for (uint64_t va = start & ~((uint64_t) PAGE_SIZE - 1); va < end; va += PAGE_SIZE) {
+        page_t *page = get_page(va, 0, current_pml4);
+        if (page && page->present) vm_unmap(va, &batch);      // Never touched pages have nothing to free
+    }
+    tlb_batch_flush(&batch);
+
+    return true;
+}
+
+
+// Move the end of the reserved region beginning at start, pages past a lowered end are unmapped.
+// A size of 0 releases the region.
+bool vm_resize(uint64_t start, size_t size) {
+    if (size == 0) return vm_release(start, 0);
+
+    uint64_t flags = region_lock();
+
+    vm_region_t *region = find_region(start);
+    if (!region || region->start != (start & ~((uint64_t) PAGE_SIZE - 1))) {
+        spin_unlock_irqrestore(&vm_region_lock, flags);
+        return false;
+    }
+
+    uint64_t old_end = region->end;
+    uint64_t new_end = (region->start + size + PAGE_SIZE - 1) & ~((uint64_t) PAGE_SIZE - 1);
+    region->end = new_end;
+    if (region->next_fault > new_end) region->next_fault = new_end;
+
+    spin_unlock_irqrestore(&vm_region_lock, flags);
+
+    if (new_end >= old_end) return true;
+
+    pml4_t *current_pml4 = (pml4_t *) get_cr3_addr();
+
+    tlb_batch_t batch;
+    tlb_batch_init(&batch);
+    for (uint64_t va = new_end; va < old_end; va += PAGE_SIZE) {
+        page_t *page = get_page(va, 0, current_pml4);
+        if (page && page->present) vm_unmap(va, &batch);
+    }
+    tlb_batch_flush(&batch);
+
+    return true;
+}
+
+
+// Size of the reserved region beginning at start, 0 when there is none
+uint64_t vm_region_size(uint64_t start) {
+    uint64_t flags = region_lock();
+    vm_region_t *region = find_region(start);
+    uint64_t size = (region && region->start == start) ? region->end - region->start : 0;
+    spin_unlock_irqrestore(&vm_region_lock, flags);
+    return size;
+}
+
+
+// Read an open file for file backed regions, the caller keeps its own handle
+vm_file_t *vm_file_open(int disk_no, void *fp) {
+    int size = vfs_get_fsize(disk_no, fp);
+    if (size < 0) return NULL;
+
+    vm_file_t *file = (vm_file_t *) malloc(sizeof(vm_file_t));
+    if (!file) return NULL;
+
+    file->data = NULL;
+    file->size = (uint64_t) size;
+    file->refs = 1;
+
+    if (size > 0) {
+        file->data = (char *) kheap_alloc((size_t) size, ALLOCATE_DATA);
+        if (!file->data || vfs_pread(disk_no, fp, 0, file->data, size) < 0) {
+            printf("[Error] VMM: Failed to read the file to map\n");
+            vm_file_put(file);
+            return NULL;
+        }
+    }
+    return file;
+}
+
+// Drop a reference, never with vm_region_lock held
+void vm_file_put(vm_file_t *file) {
+    if (!file || __atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+    if (file->data) kheap_free(file->data, file->size);
+    free(file);
+}
+
+
+// Register [start, start + size) to be filled from file at offset on first touch, read only.
+// The region takes over the reference of the caller.
+bool vm_reserve_file(uint64_t start, size_t size, vm_file_t *file, uint64_t offset) {
+    if (!file || (offset & (PAGE_SIZE - 1))) return false;
+    if (!vm_reserve(start, size, ALLOCATE_CODE)) return false;
+
+    uint64_t flags = region_lock();
+    vm_region_t *region = find_region(start);
+    region->file = file;
+    region->file_offset = offset;
+    spin_unlock_irqrestore(&vm_region_lock, flags);
+
+    return true;
+}
+
+
+// Forget the lower half regions of an address space which is being torn down
+void vm_drop_regions(uint64_t pml4_phys) {
+    for (int i = 0; i < VM_REGION_MAX; i++) {
+        uint64_t flags = region_lock();
+        vm_file_t *file = NULL;
+        if (vm_regions[i].used && vm_regions[i].pml4 == pml4_phys) {
+            file = vm_regions[i].file;
+            vm_regions[i].used = false;
+        }
+        spin_unlock_irqrestore(&vm_region_lock, flags);
+
+        vm_file_put(file);
+    }
+}
+
+
+// Give a forked address space the lower half regions of its parent
+void vm_clone_regions(uint64_t parent_pml4, uint64_t child_pml4) {
+    uint64_t flags = region_lock();
+    for (int i = 0; i < VM_REGION_MAX; i++) {
+        if (!vm_regions[i].used || vm_regions[i].pml4 != parent_pml4) continue;
+
+        for (int j = 0; j < VM_REGION_MAX; j++) {
+            if (vm_regions[j].used) continue;
+            vm_regions[j] = vm_regions[i];
+            vm_regions[j].pml4 = child_pml4;
+            vm_regions[j].faults = 0;
+            if (vm_regions[j].file) __atomic_add_fetch(&vm_regions[j].file->refs, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&vm_region_lock, flags);
+}
+
+
+// Back one page of a region with a zeroed frame
+static bool populate_page(uint64_t va, uint8_t type) {
+    pml4_t *current_pml4 = (pml4_t *) get_cr3_addr();
+
+    vm_alloc(va, type);
+
+    page_t *page = get_page(va, 0, current_pml4);
+    return page && page->present;           // vm_alloc() hands out zeroed frames
+}
+
+
+// Write to a copy-on-write page: copy the frame, or take it over when no one else maps it any more
+static int vm_handle_cow(uint64_t va, uint64_t err_code) {
+    if (!(err_code & 0x2) || (err_code & 0x8)) return 0;       // Only plain write faults
+
+    pml4_t *current_pml4 = (pml4_t *) get_cr3_addr();
+
+    uint64_t flags = spin_lock_irqsave(&cow_lock);
+
+    page_t *page = get_page(va, 0, current_pml4);
+    if (!page || !page->present || ((err_code & 0x4) && !page->user)) {    // User writes to kernel pages stay faults
+        spin_unlock_irqrestore(&cow_lock, flags);
+        return 0;
+    }
+
+    if (!page->cow) {
+        // Another core resolved it while our TLB still had the read only entry
+        int resolved = page->rw && (page->user || !(err_code & 0x4));
+        spin_unlock_irqrestore(&cow_lock, flags);
+        if (resolved) tlb_flush_page(va);
+        return resolved;
+    }
+
+    uint64_t old_phys = (uint64_t) page->frame << 12;
+    uint64_t old_bit = PHYS_ADDR_TO_BIT_NO(old_phys);
+    bool copied = false;
+
+    if (pmm_frame_shares(old_bit) > 0) {
+        int64_t bit_no = pmm_alloc_frame();
+        if (bit_no < 0) {
+            spin_unlock_irqrestore(&cow_lock, flags);
+            printf("[Error] VMM: No free frame to copy %x on write\n", va);
+            return 0;
+        }
+        uint64_t new_phys = BIT_NO_TO_ADDR((uint64_t) bit_no);
+        memcpy((void *) phys_to_vir(new_phys), (void *) phys_to_vir(old_phys), PAGE_SIZE);
+        page->frame = new_phys >> 12;
+        copied = true;
+    }
+    page->cow = 0;
+    page->rw = 1;
+
+    spin_unlock_irqrestore(&cow_lock, flags);
+
+    if (copied) {
+        tlb_shootdown(va, 1);
+        pmm_free_frame(old_bit);                // Drops our share once no core can reach the old frame
+    } else {
+        tlb_flush_page(va);                     // Only gained write access, other cores fault once and see it
+    }
+
+    return 1;
+}
 
-    // Clear the page table entry
-    page->present = 0;
-    page->rw = 0;
-    page->user = 0;
-    page->frame = 0;
 
-    flush_tlb(va);
+// Fill up to pages pages from va on with file data, vm_region_lock is held.
+// The file was read when it was mapped, so the disk is never touched here.
+static uint64_t fault_file_pages(vm_region_t *region, uint64_t va, uint64_t pages) {
+    vm_file_t *file = region->file;
+    pml4_t *current_pml4 = (pml4_t *) get_cr3_addr();
+    uint64_t mapped = 0;
+
+    for (uint64_t i = 0; i < pages && va + i * PAGE_SIZE < region->end; i++) {
+        uint64_t cur = va + i * PAGE_SIZE;
+        if (i > 0) {
+            page_t *page = get_page(cur, 0, current_pml4);
+            if (page && page->present) break;
+        }
+        if (!populate_page(cur, region->type)) break;
+
+        // Past the end of the file stays zero
+        uint64_t offset = region->file_offset + (cur - region->start);
+        if (offset < file->size) {
+            uint64_t len = file->size - offset < PAGE_SIZE ? file->size - offset : PAGE_SIZE;
+            page_t *page = get_page(cur, 0, current_pml4);
+            memcpy((void *) phys_to_vir((uint64_t) page->frame << 12), file->data + offset, len);
+        }
+        mapped++;
+    }
+    return mapped;
 }
 
+
+// Called from the page fault handler. Returns 1 when the fault was resolved by mapping
+// a page of a reserved region or copying a copy-on-write page, 0 when it is a real fault.
+int vm_handle_fault(uint64_t fault_addr, uint64_t err_code) {
+    bool user_fault = err_code & 0x4;
+    if (user_fault && fault_addr >= HIGHER_HALF_START_ADDR) return 0;      // User code touching the kernel
+
+    if (err_code & 0x1) {                   // Protection violation on a present page
+        return vm_handle_cow(fault_addr & ~((uint64_t) PAGE_SIZE - 1), err_code);
+    }
+
+    uint64_t va = fault_addr & ~((uint64_t) PAGE_SIZE - 1);
+
+    uint64_t flags = region_lock();
+
+    vm_region_t *region = find_region(va);
+    if (!region || (user_fault && region->pml4 == 0)) {      // Kernel regions are never backed for user mode
+        spin_unlock_irqrestore(&vm_region_lock, flags);
+        return 0;
+    }
+
+    pml4_t *current_pml4 = (pml4_t *) get_cr3_addr();
+    page_t *page = get_page(va, 0, current_pml4);
+    if (page && page->present) {            // Another core mapped it first
+        spin_unlock_irqrestore(&vm_region_lock, flags);
+        return 1;
+    }
+
+    // A fault right after the last populated page looks like a sequential walk,
+    // map a few pages ahead so the walk does not fault on every page
+    uint64_t pages = (va == region->next_fault) ? 1 + VM_FAULT_AHEAD : 1;
+
+    uint64_t mapped = 0;
+    if (region->file) {
+        mapped = fault_file_pages(region, va, pages);
+    } else {
+        for (uint64_t i = 0; i < pages && va + i * PAGE_SIZE < region->end; i++) {
+            uint64_t cur = va + i * PAGE_SIZE;
+            if (i > 0) {
+                page = get_page(cur, 0, current_pml4);
+                if (page && page->present) break;
+            }
+            if (!populate_page(cur, region->type)) break;
+            mapped++;
+        }
+    }
+
+    region->next_fault = va + mapped * PAGE_SIZE;
+    region->faults++;
+
+    spin_unlock_irqrestore(&vm_region_lock, flags);
+
+    if (mapped == 0) {
+        printf("[Error] VMM: Failed to back %x on demand\n", va);
+        return 0;
+    }
+    return 1;
+}
+
+
 bool is_user_virt_addr(uint64_t va){
     if(va >= LOWER_HALF_START_ADDR && va < HIGHER_HALF_START_ADDR){
         return true;
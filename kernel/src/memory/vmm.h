@@ -6,6 +6,9 @@ https://chatgpt.com/share/675fa60d-c044-8001-aef6-d23b3d62ab62
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+#include "tlb.h"
 
 enum allocation_type {
     ALLOCATE_CODE = 0x1,   // Allocate for code
@@ -13,8 +16,46 @@ enum allocation_type {
     ALLOCATE_STACK = 0x3,  // Allocate for stack
 };
 
+#define VM_REGION_MAX   256     // Demand paged regions which can be reserved at once
+#define VM_FAULT_AHEAD  4       // Extra pages mapped on a sequential fault
+
+// Contents of the file behind file backed regions, shared by the regions of forked address spaces.
+// Read in once when the mapping is made: the page fault handler runs with interrupts off and
+// must not wait for the disk, whose lock sleeps.
+typedef struct vm_file {
+    char *data;                 // Kernel heap copy of the file, NULL when it is empty
+    uint64_t size;
+    uint32_t refs;
+} vm_file_t;
+
+// Reserved virtual range, pages are mapped on first touch by vm_handle_fault()
+typedef struct vm_region {
+    uint64_t start;             // Page aligned
+    uint64_t end;               // Exclusive, page aligned
+    uint64_t next_fault;        // Page after the last populated one, for fault ahead
+    uint64_t faults;            // Faults served by this region
+    uint64_t pml4;              // Owning address space, 0 for kernel half regions
+    vm_file_t *file;            // Read only file backing, NULL for zero filled pages
+    uint64_t file_offset;       // File offset of start
+    uint8_t type;               // enum allocation_type
+    bool used;
+} vm_region_t;
+
 void vm_alloc(uint64_t va, uint8_t type);
 void vm_free(uint64_t *ptr);
+void vm_unmap(uint64_t va, tlb_batch_t *batch);
+
+bool vm_reserve(uint64_t start, size_t size, uint8_t type);
+bool vm_release(uint64_t start, size_t size);
+bool vm_resize(uint64_t start, size_t size);
+uint64_t vm_region_size(uint64_t start);
+void vm_drop_regions(uint64_t pml4_phys);
+void vm_clone_regions(uint64_t parent_pml4, uint64_t child_pml4);
+int vm_handle_fault(uint64_t fault_addr, uint64_t err_code);
+
+vm_file_t *vm_file_open(int disk_no, void *fp);
+void vm_file_put(vm_file_t *file);
+bool vm_reserve_file(uint64_t start, size_t size, vm_file_t *file, uint64_t offset);
 
 uint64_t phys_to_vir(uint64_t pa);
 uint64_t vir_to_phys(uint64_t va);
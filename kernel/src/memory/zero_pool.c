@@ -0,0 +1,117 @@
+/*
+Pre-zeroed Frame Pool
+
+Page tables, heap pages and demand faulted pages all need cleared frames. Idle
+application cores clear frames in the background and keep them in a small pool,
+so pmm_alloc_zeroed_frame() usually returns a frame without touching it.
+
+The idle cores clear with non-temporal stores (movnti), the zeroes go straight
+to memory and do not push the working set of that core out of its caches. The
+frame is only read again by whoever allocates it.
+
+References:
+    https://www.felixcloutier.com/x86/movnti
+    https://lwn.net/Articles/252125/
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/string.h"
+#include "../lib/spinlock.h"
+#include "detect_memory.h"
+#include "pmm.h"
+#include "vmm.h"
+
+#include "zero_pool.h"
+
+static spinlock_t pool_lock = SPINLOCK_INIT_NAMED("zero_pool");        // Protects pool[] and pool_count
+static uint64_t pool[ZERO_POOL_SIZE];                // Bit numbers of zeroed frames, used as a stack
+static uint64_t pool_count = 0;
+
+static uint64_t pool_hits = 0;
+static uint64_t pool_misses = 0;
+static uint64_t pool_zeroed = 0;
+
+
+// Clear a frame without pulling it into the cache. The sfence orders the weakly
+// ordered stores before the frame is published in the pool.
+static void zero_frame_nt(void *frame) {
+    uint64_t *p = (uint64_t *) frame;
+    for (uint64_t i = 0; i < FRAME_SIZE / sizeof(uint64_t); i += 4) {
+        asm volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)"
+            : : "r"(p + i), "r"(0ULL) : "memory");
+    }
+    asm volatile("sfence" : : : "memory");
+}
+
+
+// Allocate one zeroed frame and return its bit number or -1.
+// Comes from the pool when an idle core filled it, otherwise the frame is cleared here.
+int64_t pmm_alloc_zeroed_frame() {
+    uint64_t flags = spin_lock_irqsave(&pool_lock);
+    if (pool_count > 0) {
+        uint64_t bit_no = pool[--pool_count];
+        spin_unlock_irqrestore(&pool_lock, flags);
+        __atomic_add_fetch(&pool_hits, 1, __ATOMIC_RELAXED);
+        return (int64_t) bit_no;
+    }
+    spin_unlock_irqrestore(&pool_lock, flags);
+
+    int64_t bit_no = pmm_alloc_frame();
+    if (bit_no < 0) return -1;
+
+    memset((void *) phys_to_vir(BIT_NO_TO_ADDR((uint64_t) bit_no)), 0, FRAME_SIZE);
+    __atomic_add_fetch(&pool_misses, 1, __ATOMIC_RELAXED);
+    return bit_no;
+}
+
+
+// Clear up to ZERO_POOL_BATCH frames into the pool. Called by idle cores with interrupts on,
+// the pool leaves the last ZERO_POOL_RESERVE free frames to the PMM.
+void zero_pool_refill() {
+    for (int i = 0; i < ZERO_POOL_BATCH; i++) {
+        if (__atomic_load_n(&pool_count, __ATOMIC_RELAXED) >= ZERO_POOL_SIZE) return;
+        if (pmm_free_frames() <= ZERO_POOL_RESERVE) return;
+
+        int64_t bit_no = pmm_alloc_frame();
+        if (bit_no < 0) return;
+
+        zero_frame_nt((void *) phys_to_vir(BIT_NO_TO_ADDR((uint64_t) bit_no)));
+
+        uint64_t flags = spin_lock_irqsave(&pool_lock);
+        if (pool_count >= ZERO_POOL_SIZE) {
+            spin_unlock_irqrestore(&pool_lock, flags);
+            pmm_free_frame((uint64_t) bit_no);      // Another core filled the last slot
+            return;
+        }
+        pool[pool_count++] = (uint64_t) bit_no;
+        spin_unlock_irqrestore(&pool_lock, flags);
+
+        __atomic_add_fetch(&pool_zeroed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+void zero_pool_get_stats(zero_pool_stats_t *stats) {
+    if (!stats) return;
+
+    stats->count = __atomic_load_n(&pool_count, __ATOMIC_RELAXED);
+    stats->hits = __atomic_load_n(&pool_hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&pool_misses, __ATOMIC_RELAXED);
+    stats->zeroed = __atomic_load_n(&pool_zeroed, __ATOMIC_RELAXED);
+
+    uint64_t total = stats->hits + stats->misses;
+    stats->hit_rate = total ? (stats->hits * 100) / total : 0;
+}
+
+
+void zero_pool_print_stats() {
+    zero_pool_stats_t stats;
+    zero_pool_get_stats(&stats);
+
+    printf(" Zero pool: %d / %d frames, hits %d, misses %d, hit rate %d%%, zeroed by idle cores %d\n",
+        stats.count, ZERO_POOL_SIZE, stats.hits, stats.misses, stats.hit_rate, stats.zeroed);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ZERO_POOL_SIZE      512         // Zeroed frames kept ready, 2 MB
+#define ZERO_POOL_BATCH     32          // Frames one idle wake-up clears at most
+#define ZERO_POOL_RESERVE   1024        // Free frames the pool never takes from the PMM
+
+typedef struct zero_pool_stats {
+    uint64_t count;                     // Zeroed frames in the pool
+    uint64_t hits;                      // Zeroed allocations served from the pool
+    uint64_t misses;                    // Zeroed allocations which had to clear a frame themselves
+    uint64_t zeroed;                    // Frames cleared by idle cores
+    uint64_t hit_rate;                  // 0 - 100
+} zero_pool_stats_t;
+
+int64_t pmm_alloc_zeroed_frame();
+void zero_pool_refill();
+
+void zero_pool_get_stats(zero_pool_stats_t *stats);
+void zero_pool_print_stats();
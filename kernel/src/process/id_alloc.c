@@ -0,0 +1,47 @@
+/*
+ID Allocator
+
+Process and thread IDs come from a bitmap instead of an ever growing counter,
+so they stay below PID_MAX / TID_MAX and index small hash tables. The search
+continues after the last ID handed out and skips 64 IDs per step, a free one
+is found quickly as long as the table is not nearly full.
+*/
+
+#include "id_alloc.h"
+
+
+// Take the next free ID after the last one, -1 when every ID is in use
+int64_t id_alloc(id_alloc_t *ids) {
+    if (ids->used >= ids->max) return -1;
+
+    size_t words = ids->max / 64;
+    size_t word = ids->next / 64;
+    uint64_t mask = ~0ULL << (ids->next % 64);         // Only bits at or after next in the first word
+
+    for (size_t i = 0; i <= words; i++) {
+        uint64_t free_bits = ~ids->bitmap[word] & mask;
+        if (free_bits) {
+            size_t id = word * 64 + __builtin_ctzll(free_bits);
+            ids->bitmap[word] |= 1ULL << (id % 64);
+            ids->used++;
+            ids->next = (id + 1) % ids->max;
+            return (int64_t) id;
+        }
+
+        word = (word + 1) % words;
+        mask = ~0ULL;
+    }
+
+    return -1;
+}
+
+
+void id_free(id_alloc_t *ids, size_t id) {
+    if (id >= ids->max) return;
+
+    uint64_t bit = 1ULL << (id % 64);
+    if (!(ids->bitmap[id / 64] & bit)) return;         // Not handed out, nothing to undo
+
+    ids->bitmap[id / 64] &= ~bit;
+    ids->used--;
+}
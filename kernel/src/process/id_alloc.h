@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Bitmap of the IDs in use. IDs are handed out round robin, so a freed ID is reused only
+// after the others, and a stale PID in a pkill rarely hits a new process.
+// Not locked, callers serialise it with the lock of the table the IDs index.
+typedef struct {
+    uint64_t *bitmap;           // One bit per ID, set while it is in use
+    size_t max;                 // IDs run from 0 to max - 1, a multiple of 64
+    size_t next;                // Where the search for a free ID starts
+    size_t used;                // IDs handed out
+} id_alloc_t;
+
+#define ID_ALLOC_INIT(bits, count) { .bitmap = (bits), .max = (count), .next = 0, .used = 0 }
+
+int64_t id_alloc(id_alloc_t *ids);
+void id_free(id_alloc_t *ids, size_t id);
@@ -0,0 +1,94 @@
+/*
+Mutexes
+
+A mutex is a flag taken with a compare-and-swap plus a wait queue. An
+uncontended lock and unlock never touch the queue. A thread that finds it held
+sleeps on the queue until the holder releases it, then races for it again, so
+a thread arriving at the right moment may overtake the sleepers.
+
+Callers which can not block (the idle thread, threads in a system call from
+user mode, code running with interrupts off) spin like on a spinlock instead.
+
+    https://docs.kernel.org/locking/mutex-design.html
+    https://wiki.osdev.org/Synchronization_Primitives
+*/
+
+#include "../lib/stdio.h"
+#include "scheduler.h"
+
+#include "mutex.h"
+
+
+void mutex_init(mutex_t *mutex) {
+    if (!mutex) return;
+
+    *mutex = (mutex_t) MUTEX_INIT;
+}
+
+
+// Condition for the wait queue, must not take the mutex itself since it is checked repeatedly
+static bool mutex_free(void *arg) {
+    mutex_t *mutex = (mutex_t *) arg;
+    return __atomic_load_n(&mutex->locked, __ATOMIC_RELAXED) == 0;
+}
+
+
+static bool mutex_try_acquire(mutex_t *mutex) {
+    uint32_t expected = 0;
+    return __atomic_compare_exchange_n(&mutex->locked, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+bool mutex_trylock(mutex_t *mutex) {
+    if (!mutex_try_acquire(mutex)) return false;
+
+    mutex->owner = sched_current_thread();
+#if LOCK_STATS
+    lock_stat_acquired(&mutex->stat, 0);
+#endif
+    return true;
+}
+
+
+void mutex_lock(mutex_t *mutex) {
+    uint64_t waits = 0;
+
+    while (!mutex_try_acquire(mutex)) {
+        if (sched_can_block()) {
+            wait_event(&mutex->waiters, mutex_free, mutex);
+        } else {
+            asm volatile("pause");
+        }
+        waits++;
+    }
+
+    mutex->owner = sched_current_thread();
+#if LOCK_STATS
+    lock_stat_acquired(&mutex->stat, waits);
+#else
+    (void) waits;
+#endif
+}
+
+
+void mutex_unlock(mutex_t *mutex) {
+    if (!__atomic_load_n(&mutex->locked, __ATOMIC_RELAXED)) {
+        printf("[Error] Mutex: unlocking a mutex which is not held\n");
+        return;
+    }
+
+    mutex->owner = NULL;
+    __atomic_exchange_n(&mutex->locked, 0, __ATOMIC_SEQ_CST);   // Full barrier, the peek below must not pass it
+
+    // Sleepers queue themselves before checking the flag. One that loses the race to a new
+    // arrival goes back to sleep until the next unlock.
+    if (__atomic_load_n(&mutex->waiters.head, __ATOMIC_RELAXED)) {
+        wake_up_one(&mutex->waiters);
+    }
+}
+
+
+// Whether the calling thread holds mutex
+bool mutex_held(mutex_t *mutex) {
+    return __atomic_load_n(&mutex->locked, __ATOMIC_RELAXED) && mutex->owner == sched_current_thread();
+}
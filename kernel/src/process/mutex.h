@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "wait_queue.h"
+#include "../lib/spinlock.h"
+
+// Sleeping lock for long critical sections, e.g. around disk I/O.
+// Contended threads block on the wait queue instead of spinning, so it must not be
+// taken from interrupt handlers or while a spinlock is held.
+typedef struct {
+    volatile uint32_t locked;   // 1 while held, taken with a compare-and-swap
+    thread_t *owner;            // Holder, for error checks and debugging
+    wait_queue_t waiters;       // Threads sleeping until the mutex is released
+#if LOCK_STATS
+    lock_stat_t stat;           // Only touched by the holder
+#endif
+} mutex_t;
+
+#if LOCK_STATS
+#define MUTEX_INIT_NAMED(n) { .locked = 0, .owner = NULL, .waiters = WAIT_QUEUE_INIT, .stat = { .name = (n) } }
+#else
+#define MUTEX_INIT_NAMED(n) { .locked = 0, .owner = NULL, .waiters = WAIT_QUEUE_INIT }
+#endif
+#define MUTEX_INIT MUTEX_INIT_NAMED(NULL)
+
+void mutex_init(mutex_t *mutex);
+bool mutex_trylock(mutex_t *mutex);
+void mutex_lock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+bool mutex_held(mutex_t *mutex);
@@ -17,48 +17,73 @@ https://wiki.osdev.org/Brendan%27s_Multi-tasking_Tutorial
 #include "../lib/string.h"
 #include "../lib/stdio.h"
 #include "../lib/string.h"
+#include "../lib/rwlock.h"
 #include "../memory/kheap.h"
 #include "../memory/vmm.h"
 #include "../util/util.h"
+#include "../sys/timer/tsc.h"
 #include "thread.h"
+#include "scheduler.h"
 #include "types.h"
+#include "id_alloc.h"
 #include "process.h"
 
 
-extern void restore_cpu_state(registers_t* registers);
+process_t *processes_list = NULL;   // List of all processes, newest first
+static rwlock_t processes_lock = RWLOCK_INIT_NAMED("processes"); // Guards the list, the PID table and its IDs
 
-size_t next_free_pid = 0;           // Available free process id
-process_t *current_process;         // Current running process
-process_t *processes_list = NULL;   // List of all processes
+static uint64_t pid_bitmap[PID_MAX / 64];
+static id_alloc_t pid_ids = ID_ALLOC_INIT(pid_bitmap, PID_MAX);
+static process_t *pid_table[PID_HASH_SIZE];   // PIDs are handed out in order, so the low bits spread them well
 
-// Adding Process into process_list
-static void add_process(process_t* proc) {
-    if (!proc) return;
+// Give the process a PID and add it to the process list and the PID table
+static bool add_process(process_t* proc) {
+    if (!proc) return false;
+
+    uint64_t flags = write_lock_irqsave(&processes_lock);
+    int64_t pid = id_alloc(&pid_ids);
+    if (pid < 0) {
+        write_unlock_irqrestore(&processes_lock, flags);
+        printf("[Error] Process: All %d PIDs are in use\n", PID_MAX);
+        return false;
+    }
+    proc->pid = (size_t) pid;
 
+    proc->prev = NULL;
     proc->next = processes_list;    // add the head of process list
+    if (processes_list) processes_list->prev = proc;
     processes_list = proc;          // change into process list with new process
+
+    process_t** bucket = &pid_table[proc->pid & (PID_HASH_SIZE - 1)];
+    proc->hash_next = *bucket;
+    *bucket = proc;
+    write_unlock_irqrestore(&processes_lock, flags);
+    return true;
 }
 
-// Removing process from process_list
+// Removing process from process_list and the PID table, its PID may be reused afterwards
 static void remove_process(process_t* proc) {
     if (!proc) return;
 
-    // Remove the process from the global process list
-    process_t* prev = NULL;
-    process_t* current = processes_list;
+    uint64_t flags = write_lock_irqsave(&processes_lock);
+    if (proc->prev) {
+        proc->prev->next = proc->next;
+    } else {
+        processes_list = proc->next;    // Removing First Process from linked list
+    }
+    if (proc->next) proc->next->prev = proc->prev;
+    proc->next = proc->prev = NULL;
 
-    while (current) {               // If current is not null
-        if (current == proc) {      // If given proc is equal to current
-            if (prev) {             // If the previous process of current is not null
-                prev->next = current->next; // Removing current process from linked list
-            } else {                // If the current is head of process_list
-                processes_list = current->next; // Removing First Process from linked list
-            }
+    for (process_t** link = &pid_table[proc->pid & (PID_HASH_SIZE - 1)]; *link; link = &(*link)->hash_next) {
+        if (*link == proc) {
+            *link = proc->hash_next;
             break;
         }
-        prev = current;             // Store the previous process before shifting next process
-        current = current->next;    // going from head to tail
     }
+    proc->hash_next = NULL;
+
+    id_free(&pid_ids, proc->pid);
+    write_unlock_irqrestore(&processes_lock, flags);
 }
 
 
@@ -71,18 +96,30 @@ process_t* create_process(const char* name) {
         return NULL;                // Return NULL if memory allocation fails
     } 
     
-    // Assign the next available PID
-    proc->pid = next_free_pid++;    // pick and assigne process id
     proc->status = READY;           // Changed the status into READY
     strncpy(proc->name, name, NAME_MAX_LEN - 1); // Copy name
     proc->name[NAME_MAX_LEN - 1] = '\0'; // Ensure null-termination
     proc->next = NULL;              // The next process of this is Null
+    proc->prev = NULL;
+    proc->hash_next = NULL;
     proc->threads = NULL;           // Currents threads are null
+    proc->threads_tail = NULL;
     proc->current_thread = proc->threads;
+    proc->threads_lock = (spinlock_t) SPINLOCK_INIT;
     proc->cpu_time = 0;
 
-    // Add the process to the global process list
-    add_process(proc);
+    if (create_address_space(&proc->as) != 0) {
+        printf("Process address space creation Failed!\n");
+        kheap_free(proc, sizeof(process_t));
+        return NULL;
+    }
+
+    // Assign the next available PID and add the process to the global process list
+    if (!add_process(proc)) {
+        destroy_address_space(&proc->as);
+        kheap_free(proc, sizeof(process_t));
+        return NULL;
+    }
 
     printf("Created Process: %s (PID: %d)\n", proc->name, proc->pid);
 
@@ -92,84 +129,103 @@ process_t* create_process(const char* name) {
 
 // Delete process from memory
 void delete_process(process_t* proc) {
-    printf("Start Deleting Process PID: %d\n", proc->pid);
     if (!proc) return;
 
+    // The calling thread can not free itself, so neither its process nor the tables it runs on
+    thread_t* current = sched_current_thread();
+    if (current && current->parent == proc) {
+        printf("[Error] Process: %s (PID: %d) can not delete itself\n", proc->name, proc->pid);
+        return;
+    }
+    printf("Start Deleting Process PID: %d\n", proc->pid);
+
     // Remove the process from the global process list
     remove_process(proc);
 
-    // Free the process and its threads
-    while (true)
-    {
-        thread_t* thread = proc->threads; // First Thread of the thread linked list
-        if (!thread) break; // No more threads to delete
-        proc->threads = thread->next;
+    // Free the process and its threads. The head is read under threads_lock, which can not be
+    // held across delete_thread(): it unlinks the thread itself and may wait for its core.
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&proc->threads_lock);
+        thread_t* thread = proc->threads;
+        spin_unlock_irqrestore(&proc->threads_lock, flags);
+
+        if (!thread) break;
         delete_thread(thread);
     }
 
+    // Never free the page tables this core is walking
+    if (current_address_space() == &proc->as) switch_address_space(&kernel_as);
+    destroy_address_space(&proc->as);
+
     printf("Deleting Process: %s (PID: %d)\n", proc->name, proc->pid);
     kheap_free(proc, sizeof(process_t));
 }
 
 
-registers_t* schedule(registers_t* registers) {
-    void *prev_registers = (void *)(uintptr_t)registers;
-    if (!current_process || !current_process->current_thread) return NULL;
+// Duplicate parent into a new process sharing its pages copy-on-write.
+// The child gets one thread which resumes from regs with rax = 0.
+process_t* fork_process(process_t* parent, registers_t* regs) {
+    if (!parent || !regs) return NULL;
 
-    __asm__ volatile("cli");   // Clearing Interrupt
-    // printf("Starting mem copy\n");
-    memcpy((void *)&current_process->current_thread->registers, (void *)prev_registers, sizeof(registers_t)); // Save current thread state
-    // printf("mem copy Ended\n");
-    // __asm__ volatile("sti");   // Starting Interrupt
-    
+    process_t* child = create_process(parent->name);
+    if (!child) return NULL;
 
-    current_process->current_thread->status = READY;
-
-    thread_t* current_thread = current_process->current_thread;
-    thread_t* next_thread = current_thread->next;
-
-    if(!next_thread) next_thread = current_process->threads;
-
-    // Round-robin search for next READY thread
-    // while (next_thread != current_thread) {
-    //     if (next_thread->status == READY){
-    //         break;
-    //     }
-    //     next_thread = next_thread->next;
-    // }
-  
-    // printf("Next:%s\n", next_thread->name);
+    if (fork_address_space(&parent->as, &child->as) != 0) {
+        printf("Fork of Process %s (PID: %d) Failed!\n", parent->name, parent->pid);
+        delete_process(child);
+        return NULL;
+    }
 
-    // Update current thread and set status
-    next_thread->status = RUNNING;
-    current_process->current_thread = next_thread;
+    const char* name = parent->current_thread ? parent->current_thread->name : parent->name;
+    if (!fork_thread(child, name, regs)) {
+        delete_process(child);
+        return NULL;
+    }
 
-    asm volatile("sti");   // Starting Interrupt
-    return (registers_t *)(uintptr_t) &current_process->current_thread->registers;
+    return child;
 }
 
+
 process_t* get_process_by_pid(size_t pid) {
-    process_t* current = processes_list;
-    while (current) {
-        if (current->pid == pid) {
-            return current;
-        }
-        current = current->next;
+    uint64_t flags = read_lock_irqsave(&processes_lock);
+    process_t* current = pid_table[pid & (PID_HASH_SIZE - 1)];
+    while (current && current->pid != pid) {
+        current = current->hash_next;
     }
-    return NULL; // Not found
+    read_unlock_irqrestore(&processes_lock, flags);
+    return current; // NULL if not found
 }
 
+// Process of the thread running on this core, the newest process while only kernel threads run
 process_t * get_current_process() {
-    return processes_list; // Return the current process
+    thread_t* thread = sched_current_thread();
+    if (thread && thread->parent) return thread->parent;
+    return processes_list;
+}
+
+
+// TSC cycles in milliseconds, 0 while the TSC frequency is unknown
+static uint64_t cycles_to_ms(uint64_t cycles) {
+    return cpu_frequency_hz >= 1000 ? cycles / (cpu_frequency_hz / 1000) : 0;
 }
 
 
 void print_process_list() {
-    process_t* current = processes_list;
     printf("Current Running Process:\n");
+
+    uint64_t flags = read_lock_irqsave(&processes_lock);
+    process_t* current = processes_list;
     while (current) {
-        printf("PID: %d, Name: %s, Status: %d\n", current->pid, current->name, current->status);
+        printf("PID: %d, Name: %s, Status: %d, Resident: %d KB, CPU time: %d ms\n", current->pid, current->name,
+            current->status, current->as.resident_pages * 4, cycles_to_ms(current->cpu_time));
+        uint64_t thread_flags = spin_lock_irqsave(&current->threads_lock);
+        for (thread_t* thread = current->threads; thread; thread = thread->next) {
+            printf("  TID: %d, Name: %s, Status: %d, Nice: %d, CPU %d, CPU time: %d ms\n", thread->tid, thread->name,
+                thread->status, thread->nice, thread->cpu, cycles_to_ms(thread->cpu_time));
+        }
+        spin_unlock_irqrestore(&current->threads_lock, thread_flags);
         current = current->next;
     }
+    read_unlock_irqrestore(&processes_lock, flags);
 }
 
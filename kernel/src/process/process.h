@@ -7,8 +7,12 @@
 
 #include "types.h"          // for process_t and thread_t structures
 #include "../util/util.h"   // for registers_t
+#include "../memory/address_space.h"
+#include "../lib/spinlock.h"
 
 #define NAME_MAX_LEN 64
+#define PID_MAX         32768       // PIDs run from 0 to PID_MAX - 1 and are reused, a multiple of 64
+#define PID_HASH_SIZE   256         // Buckets of the PID table, a power of two
 
 // Process or Thread Status
 typedef enum { // 4 bytes
@@ -19,30 +23,33 @@ typedef enum { // 4 bytes
 } status_t;
 
 
-typedef struct process {        // 112 byte
+typedef struct process {        // 368 byte
     size_t pid;                 // Process ID
     status_t status;            // Process status
     char name[NAME_MAX_LEN];    // Process name
     struct process* next;       // Linked list for processes
+    struct process* prev;
+    struct process* hash_next;  // Chain of its PID table bucket, see process.c
 
     thread_t* threads;          // List of threads in the process
+    thread_t* threads_tail;     // Last thread, new ones are appended
     thread_t* current_thread;   // Current running thread
+    spinlock_t threads_lock;    // Guards threads, threads_tail and current_thread
     
-    uint64_t cpu_time;          // Track CPU time per process
+    uint64_t cpu_time;          // Run time of all its threads in TSC cycles
+
+    address_space_t as;         // Own PML4, kernel half shared
 } process_t;
 
 
 
-extern size_t next_free_pid;        //Available free process id
-extern process_t *current_process;  // Current running process pointer
 extern process_t *processes_list;   // List of all processes
 
 process_t* create_process(const char* name);
 void delete_process(process_t* proc);
+process_t* fork_process(process_t* parent, registers_t* regs);
 
 process_t* get_process_by_pid(size_t pid);
 process_t* get_current_process();
 
-registers_t* schedule(registers_t* registers);
-
 void print_process_list();
\ No newline at end of file
@@ -0,0 +1,691 @@
+/*
+SMP Scheduler
+
+Every core has its own run queue in cpu_datas[] and its own APIC timer, which
+fires at the end of the running thread's slice. The tick asks for a
+reschedule, irq_handler() then calls sched_irq_exit() which saves the
+interrupted thread and loads the next one into the same interrupt frame, so
+the iretq returns into the next thread.
+
+Threads are picked fairly: run time is measured with the TSC and added to the
+thread's vruntime scaled by the weight of its nice level, and the queue is
+kept sorted so the thread with the smallest vruntime runs next. A queued
+thread which is SCHED_WAKEUP_GRAN_US behind the running one takes over on the
+next interrupt of any kind, so a shell which yields while waiting for keys
+gets the core as soon as the keyboard interrupt arrives.
+
+New threads go to the least loaded core. A core whose queue is empty steals
+the first ready thread of the busiest core, and runs its idle thread (the
+context it booted with) if there is nothing to steal. An idle core has no
+slice and so no tick: it is woken by an IPI when a thread is queued for it,
+or when a busy core with waiting threads ends a slice, so it can steal.
+
+The frame of a switched out thread is still on the core's stack until the
+iretq, so thread->on_cpu stays set until the core's next interrupt and no
+other core may take the thread before that. An idle core has no tick, so
+sched_remove_thread() sends it an IPI to get there. A switch waits for the
+outermost interrupt exit, and for a frame on the thread's own stack: a
+thread in a system call is on the core's TSS stack and keeps the core until
+it returns to user mode.
+
+A thread blocks by marking itself SLEEPING and yielding, schedule() then
+leaves it off the run queue. Until that yield it keeps the core, so a wakeup
+which comes first just finds it READY. Sleepers with a deadline also sit on
+their core's sleepers list, the APIC timer of that core wakes them. Wakers
+queue the thread back on the core it slept on. See wait_queue.c.
+
+    https://wiki.osdev.org/Scheduling_Algorithms
+    https://github.com/dreamportdev/Osdev-Notes/blob/master/05_Scheduling/02_Scheduler.md
+    https://docs.kernel.org/scheduler/sched-design-CFS.html
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/stdlib.h"
+#include "../lib/string.h"
+#include "../sys/cpu/cpu.h"
+#include "../sys/cpu/fpu.h"
+#include "../memory/address_space.h"
+#include "../memory/kstack.h"
+#include "../sys/timer/tsc.h"
+#include "../sys/timer/apic_timer.h"
+#include "../arch/interrupt/apic/ipi.h"
+#include "../syscall/int_syscall_manager.h"     // INT_SYSCALL_YIELD
+#include "process.h"
+#include "thread.h"
+#include "wait_queue.h"
+
+#include "scheduler.h"
+
+
+// Weight of every nice level, each level is about 10% more or less CPU time than the next
+static const uint32_t nice_weights[SCHED_NICE_MAX - SCHED_NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,     // -20
+    29154, 23254, 18705, 14949, 11916,     // -15
+     9548,  7620,  6100,  4904,  3906,     // -10
+     3121,  2501,  1991,  1586,  1277,     //  -5
+     1024,   820,   655,   526,   423,     //   0
+      335,   272,   215,   172,   137,     //   5
+      110,    87,    70,    56,    45,     //  10
+       36,    29,    23,    18,    15,     //  15
+};
+
+
+// Charge the TSC cycles since the last charge to thread, its process and, unless it is idle, its vruntime
+static void charge(run_queue_t *rq, thread_t *thread, uint64_t now) {
+    uint64_t delta = now - thread->exec_start;
+    thread->exec_start = now;
+
+    thread->cpu_time += delta;
+    if (thread->parent) __atomic_add_fetch(&thread->parent->cpu_time, delta, __ATOMIC_RELAXED);   // Its threads run on several cores
+
+    if (thread != rq->idle) {
+        thread->vruntime += delta * SCHED_NICE_0_WEIGHT / nice_weights[thread->nice - SCHED_NICE_MIN];
+    }
+}
+
+
+// Move min_vruntime up to the smallest vruntime of the queue and running, the thread
+// which runs next (NULL for idle). The queue lock is held.
+static void update_min_vruntime(run_queue_t *rq, thread_t *running) {
+    uint64_t min = UINT64_MAX;
+    if (running && running != rq->idle) min = running->vruntime;
+    if (rq->head && rq->head->vruntime < min) min = rq->head->vruntime;
+
+    if (min != UINT64_MAX && min > rq->min_vruntime) rq->min_vruntime = min;
+}
+
+
+// Insert a READY thread behind the ones with the same or smaller vruntime, the queue lock is held
+static void rq_insert(run_queue_t *rq, thread_t *thread) {
+    thread_t **link = &rq->head;
+    while (*link && (*link)->vruntime <= thread->vruntime) link = &(*link)->rq_next;
+
+    thread->rq_next = *link;
+    *link = thread;
+    rq->count++;
+}
+
+// Unlink thread which follows prev (NULL for the head), the queue lock is held
+static void rq_unlink(run_queue_t *rq, thread_t *prev, thread_t *thread) {
+    if (prev) prev->rq_next = thread->rq_next;
+    else rq->head = thread->rq_next;
+    thread->rq_next = NULL;
+    rq->count--;
+}
+
+// Insert a SLEEPING thread by its deadline, the queue lock is held
+static void sleeper_insert(run_queue_t *rq, thread_t *thread) {
+    thread_t **link = &rq->sleepers;
+    while (*link && (*link)->wake_at <= thread->wake_at) link = &(*link)->sleep_next;
+
+    thread->sleep_next = *link;
+    *link = thread;
+}
+
+// The queue lock is held, thread may not be on the list
+static void sleeper_unlink(run_queue_t *rq, thread_t *thread) {
+    for (thread_t **link = &rq->sleepers; *link; link = &(*link)->sleep_next) {
+        if (*link == thread) {
+            *link = thread->sleep_next;
+            thread->sleep_next = NULL;
+            return;
+        }
+    }
+}
+
+
+// Take the first thread core cpu_id may run and mark it RUNNING on that core, the queue
+// lock is held. Threads deleted while queued are dropped on the way.
+static thread_t *rq_pop(run_queue_t *rq, uint32_t cpu_id) {
+    thread_t *prev = NULL;
+    thread_t *thread = rq->head;
+
+    while (thread) {
+        thread_t *next = thread->rq_next;
+
+        // Still on the stack of the core which switched it out
+        if (__atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE) && thread->cpu != cpu_id) {
+            prev = thread;
+            thread = next;
+            continue;
+        }
+
+        rq_unlink(rq, prev, thread);
+
+        status_t expected = READY;
+        if (__atomic_compare_exchange_n(&thread->status, &expected, RUNNING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            thread->cpu = cpu_id;
+            __atomic_store_n(&thread->on_cpu, 1, __ATOMIC_RELEASE);     // Before the lock drops, see sched_remove_thread()
+            return thread;
+        }
+        thread = next;                      // DEAD, sched_remove_thread() frees it
+    }
+
+    return NULL;
+}
+
+
+// Queued plus running threads of a core, read without the lock
+static uint32_t cpu_load(cpu_data_t *cpu) {
+    uint32_t load = __atomic_load_n(&cpu->rq.count, __ATOMIC_RELAXED);
+    return cpu->rq.current && cpu->rq.current != cpu->rq.idle ? load + 1 : load;
+}
+
+
+// Take a ready thread from the busiest other core
+static thread_t *steal_thread(uint32_t cpu_id) {
+    cpu_data_t *victim = NULL;
+    uint32_t victim_load = 0;
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpu_data_t *cpu = &cpu_datas[i];
+        if (i == cpu_id || !cpu->is_online || !cpu->rq.idle || cpu->rq.count == 0) continue;
+
+        uint32_t load = cpu_load(cpu);
+        if (load > victim_load) {
+            victim = cpu;
+            victim_load = load;
+        }
+    }
+    if (!victim) return NULL;
+
+    spin_lock(&victim->rq.lock);
+    thread_t *thread = rq_pop(&victim->rq, cpu_id);
+    uint64_t victim_min = victim->rq.min_vruntime;
+    spin_unlock(&victim->rq.lock);
+
+    // Keep its lead or lag over the victim's threads relative to the threads here
+    if (thread) {
+        run_queue_t *rq = &cpu_datas[cpu_id].rq;
+        uint64_t lag = thread->vruntime > victim_min ? thread->vruntime - victim_min : 0;
+        thread->vruntime = rq->min_vruntime + lag;
+    }
+
+    return thread;
+}
+
+
+// Vruntime lead a queued thread needs over the running one to preempt it, in TSC cycles
+static uint64_t wakeup_gran() {
+    return cpu_frequency_hz / 1000000 * SCHED_WAKEUP_GRAN_US;
+}
+
+
+// Queue a thread woken on this run queue, the queue lock is held. It gets a little credit
+// against min_vruntime, so it runs soon without its sleep turning into a long lead.
+static void enqueue_woken(run_queue_t *rq, thread_t *thread) {
+    uint64_t floor = rq->min_vruntime > wakeup_gran() ? rq->min_vruntime - wakeup_gran() : 0;
+    if (thread->vruntime < floor) thread->vruntime = floor;
+
+    rq_insert(rq, thread);
+}
+
+
+// Make the running context of this core its idle thread and start scheduling here.
+// Called once per core after its per-CPU data is online, before its timer runs.
+void sched_init_cpu() {
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu) {
+        printf("[Error] SCHED: Per-CPU data is not ready\n");
+        return;
+    }
+
+    thread_t *idle = (thread_t *) malloc(sizeof(thread_t));    // Zeroed, registers are saved on the first switch
+    if (!idle) {
+        printf("[Error] SCHED: No memory for the idle thread of CPU %d\n", cpu->lapic_id);
+        return;
+    }
+
+    thread_register(idle);                      // Only fails with every TID taken, idle keeps TID 0 then
+    idle->status = RUNNING;
+    strncpy(idle->name, "idle", THREAD_NAME_MAX_LEN - 1);
+    idle->cpu = cpu->lapic_id;
+    idle->on_cpu = 1;
+    idle->exec_start = read_tsc();
+
+    if (!fpu_init_thread(idle)) {
+        printf("[Error] SCHED: No memory for the FPU state of CPU %d\n", cpu->lapic_id);
+    }
+    fpu_adopt(idle);                            // The boot context's SSE registers become its state
+
+#if LOCK_STATS
+    cpu->rq.lock.stat.name = "runqueue";       // One line per core in lockstat
+#endif
+
+    uint64_t flags = irq_save();
+    cpu->rq.current = idle;
+    cpu->rq.idle = idle;
+    irq_restore(flags);
+}
+
+
+// Queue a READY thread on the least loaded core which is scheduling
+void sched_add_thread(thread_t *thread) {
+    if (!thread) return;
+
+    cpu_data_t *target = NULL;
+    uint32_t target_load = UINT32_MAX;
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpu_data_t *cpu = &cpu_datas[i];
+        if (!cpu->is_online || !cpu->rq.idle) continue;
+
+        uint32_t load = cpu_load(cpu);
+        if (load < target_load) {
+            target = cpu;
+            target_load = load;
+        }
+    }
+
+    // No core schedules yet, the thread waits on the first one which will
+    for (uint32_t i = 0; !target && i < MAX_CPUS; i++) {
+        if (cpu_datas[i].is_online) target = &cpu_datas[i];
+    }
+    if (!target) target = &cpu_datas[0];
+
+    thread->cpu = target->lapic_id;
+
+    uint64_t flags = spin_lock_irqsave(&target->rq.lock);
+    if (thread->vruntime < target->rq.min_vruntime) thread->vruntime = target->rq.min_vruntime;   // No credit for time it did not exist
+    rq_insert(&target->rq, thread);
+    spin_unlock_irqrestore(&target->rq.lock, flags);
+
+    // Idle cores do not tick. A core which looks busy may just be going idle, so it gets the IPI too.
+    if (target->rq.idle) send_wakeup_ipi(target->lapic_id);
+}
+
+
+// Mark thread DEAD and make sure no core uses it any more, so it can be freed.
+// Returns false for the calling thread, which can not free itself.
+bool sched_remove_thread(thread_t *thread) {
+    if (!thread) return false;
+
+    if (thread == sched_current_thread()) {
+        printf("[Error] SCHED: Thread %s (TID: %d) can not remove itself\n", thread->name, thread->tid);
+        return false;
+    }
+
+    status_t old = __atomic_exchange_n(&thread->status, DEAD, __ATOMIC_ACQ_REL);
+
+    // Sleepers stay on the core they slept on, wakers skip DEAD ones
+    if (old == SLEEPING) {
+        run_queue_t *rq = &cpu_datas[thread->cpu].rq;
+        uint64_t flags = spin_lock_irqsave(&rq->lock);
+        sleeper_unlink(rq, thread);
+        spin_unlock_irqrestore(&rq->lock, flags);
+
+        wait_queue_remove(thread);
+    }
+
+    // Queued threads keep their core, only rq_pop() moves them and it skips DEAD ones
+    if (old == READY) {
+        run_queue_t *rq = &cpu_datas[thread->cpu].rq;
+        uint64_t flags = spin_lock_irqsave(&rq->lock);
+
+        thread_t *prev = NULL;
+        for (thread_t *t = rq->head; t; prev = t, t = t->rq_next) {
+            if (t == thread) {
+                rq_unlink(rq, prev, thread);
+                break;
+            }
+        }
+
+        spin_unlock_irqrestore(&rq->lock, flags);
+    }
+
+    // A running thread is not queued again once DEAD, wait until its core is off its stack.
+    // That core notices in its next interrupt, an idle one has no tick and gets an IPI.
+    for (uint64_t spins = 0; __atomic_load_n(&thread->on_cpu, __ATOMIC_ACQUIRE); spins++) {
+        uint32_t cpu_id = thread->cpu;
+        if (spins % SCHED_KICK_SPINS == 0 && cpu_id != get_core_id()) send_wakeup_ipi(cpu_id);
+        asm volatile("pause");
+    }
+
+    return true;
+}
+
+
+// The thread running on this core, NULL before the scheduler runs here
+thread_t *sched_current_thread() {
+    uint64_t flags = irq_save();
+    cpu_data_t *cpu = get_cpu_data();
+    thread_t *thread = cpu ? cpu->rq.current : NULL;
+    irq_restore(flags);
+
+    return thread;
+}
+
+
+// Whether this core runs its idle thread, also before the scheduler runs here
+bool sched_running_idle() {
+    uint64_t flags = irq_save();
+    cpu_data_t *cpu = get_cpu_data();
+    bool idle = !cpu || !cpu->rq.idle || cpu->rq.current == cpu->rq.idle;
+    irq_restore(flags);
+
+    return idle;
+}
+
+
+// Whether the calling thread may block: interrupts are on and it is a thread with its own
+// kernel stack. Threads in a system call from user mode are on the core's TSS stack, which
+// the next thread would reuse, and the idle thread has nothing to switch back to.
+bool sched_can_block() {
+    uint64_t flags = irq_save();
+    cpu_data_t *cpu = get_cpu_data();
+    thread_t *thread = cpu && cpu->rq.idle ? cpu->rq.current : NULL;
+    bool can_block = thread && thread != cpu->rq.idle && thread->stack_base;
+    irq_restore(flags);
+
+    return can_block && (flags & (1 << 9));
+}
+
+
+// Mark the calling thread SLEEPING, woken by sched_wake_thread() or at deadline (TSC, 0 for
+// none). It keeps running until it yields, and must end with sched_finish_sleep() either way.
+void sched_prepare_sleep(uint64_t deadline) {
+    uint64_t flags = irq_save();
+    cpu_data_t *cpu = get_cpu_data();
+    run_queue_t *rq = &cpu->rq;
+    thread_t *thread = rq->current;
+
+    spin_lock(&rq->lock);
+    thread->wake_at = deadline;
+    status_t expected = RUNNING;
+    bool sleeping = __atomic_compare_exchange_n(&thread->status, &expected, SLEEPING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    if (sleeping && deadline) sleeper_insert(rq, thread);
+    spin_unlock(&rq->lock);
+
+    if (sleeping && deadline) apic_timer_wakeup_at(deadline);
+    irq_restore(flags);
+}
+
+
+// Make the calling thread RUNNING again after sched_prepare_sleep(), whether it blocked or not
+void sched_finish_sleep() {
+    uint64_t flags = irq_save();
+    cpu_data_t *cpu = get_cpu_data();
+    run_queue_t *rq = &cpu->rq;
+    thread_t *thread = rq->current;
+
+    spin_lock(&rq->lock);
+
+    status_t status = __atomic_load_n(&thread->status, __ATOMIC_ACQUIRE);
+    if (status == SLEEPING) {                   // Did not block
+        sleeper_unlink(rq, thread);
+        __atomic_compare_exchange_n(&thread->status, &status, RUNNING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    } else if (status == READY) {               // Woken before it blocked, it is still queued here
+        thread_t *prev = NULL;
+        for (thread_t *t = rq->head; t; prev = t, t = t->rq_next) {
+            if (t == thread) {
+                rq_unlink(rq, prev, thread);
+                break;
+            }
+        }
+        __atomic_compare_exchange_n(&thread->status, &status, RUNNING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    thread->wake_at = 0;
+
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+}
+
+
+// Make a SLEEPING thread READY on the core it slept on. Returns false if it was not sleeping.
+// Safe from interrupt handlers.
+bool sched_wake_thread(thread_t *thread) {
+    if (!thread) return false;
+
+    for (;;) {
+        uint32_t cpu_id = __atomic_load_n(&thread->cpu, __ATOMIC_ACQUIRE);
+        run_queue_t *rq = &cpu_datas[cpu_id].rq;
+
+        uint64_t flags = spin_lock_irqsave(&rq->lock);
+        if (thread->cpu != cpu_id) {            // Moved before it slept again
+            spin_unlock_irqrestore(&rq->lock, flags);
+            continue;
+        }
+
+        status_t expected = SLEEPING;
+        bool woken = __atomic_compare_exchange_n(&thread->status, &expected, READY, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        if (woken) {
+            sleeper_unlink(rq, thread);
+            enqueue_woken(rq, thread);
+        }
+        spin_unlock_irqrestore(&rq->lock, flags);
+
+        // A waker on the same core is an IRQ handler or a running thread, the IRQ exit or its next slice picks it
+        if (woken && cpu_id != get_core_id()) send_wakeup_ipi(cpu_id);
+        return woken;
+    }
+}
+
+
+// Wake the sleepers of this core whose deadline passed and arm the timer for the next one.
+// Called by the APIC timer with interrupts off.
+void sched_wake_expired(uint64_t now) {
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu || !cpu->rq.idle) return;
+
+    run_queue_t *rq = &cpu->rq;
+    spin_lock(&rq->lock);
+
+    while (rq->sleepers && rq->sleepers->wake_at <= now) {
+        thread_t *thread = rq->sleepers;
+        rq->sleepers = thread->sleep_next;
+        thread->sleep_next = NULL;
+
+        status_t expected = SLEEPING;
+        if (__atomic_compare_exchange_n(&thread->status, &expected, READY, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            enqueue_woken(rq, thread);
+        }
+    }
+    uint64_t next = rq->sleepers ? rq->sleepers->wake_at : 0;
+
+    spin_unlock(&rq->lock);
+
+    if (next) apic_timer_wakeup_at(next);
+}
+
+
+// Set the nice level of thread, clamped to SCHED_NICE_MIN..SCHED_NICE_MAX. Returns the new level.
+int sched_set_nice(thread_t *thread, int nice) {
+    if (!thread) return 0;
+
+    if (nice < SCHED_NICE_MIN) nice = SCHED_NICE_MIN;
+    if (nice > SCHED_NICE_MAX) nice = SCHED_NICE_MAX;
+    thread->nice = (int8_t) nice;       // Applies from its next charge
+
+    return nice;
+}
+
+
+// Change the nice level of the calling thread, INT_SYSCALL_NICE. Returns the new level.
+int sched_nice(int increment) {
+    thread_t *thread = sched_current_thread();
+    if (!thread) return 0;
+
+    return sched_set_nice(thread, thread->nice + increment);
+}
+
+
+// Give the rest of the slice to other threads of this core, from a kernel thread
+void sched_yield() {
+    uint64_t rax = INT_SYSCALL_YIELD;
+    asm volatile("int $0x80" : "+a"(rax) : : "memory");
+}
+
+
+// INT_SYSCALL_YIELD, the switch happens when the system call returns
+void sched_yield_current() {
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu || !cpu->rq.idle) return;
+
+    cpu->rq.yield = true;
+    cpu->rq.need_resched = true;
+}
+
+
+// Wake one idle core so it steals from this one, idle cores do not tick to look for work themselves
+static void kick_idle_cpu(uint32_t cpu_id) {
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        cpu_data_t *cpu = &cpu_datas[i];
+        if (i == cpu_id || !cpu->is_online || !cpu->rq.idle) continue;
+
+        if (cpu->rq.current == cpu->rq.idle && cpu->rq.count == 0) {
+            send_wakeup_ipi(i);
+            return;
+        }
+    }
+}
+
+
+// End of the running thread's slice on this core, interrupts are off
+void sched_tick() {
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu || !cpu->rq.idle) return;
+
+    charge(&cpu->rq, cpu->rq.current, read_tsc());
+
+    cpu->rq.ticks++;
+    cpu->rq.need_resched = true;        // Slice is over, schedule() keeps the thread if it is still the fairest
+
+    if (cpu->rq.count > 0) kick_idle_cpu(cpu->lapic_id);
+}
+
+
+// Whether a queued thread is far enough behind the running one to take over now.
+// Always true on an idle core, schedule() looks for threads to steal as well.
+static bool check_preempt(run_queue_t *rq) {
+    thread_t *current = rq->current;
+    if (current == rq->idle) return true;
+    if (!rq->head) return false;
+
+    charge(rq, current, read_tsc());
+
+    spin_lock(&rq->lock);
+    bool preempt = rq->head && rq->head->vruntime + wakeup_gran() < current->vruntime;
+    spin_unlock(&rq->lock);
+
+    return preempt;
+}
+
+
+// The thread switched out last time is off this core's stack once the core took another
+// interrupt, other cores may run or free it from now on. Interrupts are off.
+static void release_prev(run_queue_t *rq) {
+    if (!rq->prev) return;
+
+    __atomic_store_n(&rq->prev->on_cpu, 0, __ATOMIC_RELEASE);
+    rq->prev = NULL;
+}
+
+
+// Save the interrupted thread and pick the next one for this core.
+// Returns the registers to resume, or NULL to keep running the interrupted thread.
+registers_t* schedule(registers_t* registers) {
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu || !cpu->rq.idle) return NULL;
+
+    run_queue_t *rq = &cpu->rq;
+    uint32_t cpu_id = cpu->lapic_id;
+
+    release_prev(rq);
+
+    thread_t *current = rq->current;
+    memcpy((void *)&current->registers, (void *)registers, sizeof(registers_t));
+
+    uint64_t now = read_tsc();
+    charge(rq, current, now);
+
+    bool yield = rq->yield;
+    rq->yield = false;
+
+    // Going to sleep but not blocked yet, only its own yield may switch it out or a wakeup could be lost
+    if (!yield && __atomic_load_n(&current->status, __ATOMIC_ACQUIRE) == SLEEPING) {
+        apic_timer_set_slice(true);
+        return NULL;
+    }
+
+    spin_lock(&rq->lock);
+
+    // Back into the queue, unless it was deleted meanwhile, went to sleep, or a waker queued it already
+    status_t expected = RUNNING;
+    bool requeue = current != rq->idle &&
+        __atomic_compare_exchange_n(&current->status, &expected, READY, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+    // A yielding thread goes back only after the pick, so anything else runs first
+    if (requeue && !yield) rq_insert(rq, current);
+    thread_t *next = rq_pop(rq, cpu_id);
+    if (requeue && yield) rq_insert(rq, current);
+
+    update_min_vruntime(rq, next);
+    spin_unlock(&rq->lock);
+
+    if (!next) {
+        next = steal_thread(cpu_id);
+        if (next) rq->steals++;
+    }
+    if (!next) next = rq->idle;         // Also after a yield with nothing else ready, the next interrupt picks the yielder again
+
+    next->exec_start = now;
+    apic_timer_set_slice(next != rq->idle);     // No ticks while idle
+
+    if (next == current) return NULL;
+
+    fpu_switch(next);                   // Saves current if it used SIMD, next loads its state on first use
+
+    rq->prev = current;                 // Its on_cpu is cleared by the next interrupt here
+    next->on_cpu = 1;                   // Already set unless it is the idle thread
+    rq->current = next;
+    rq->switches++;
+
+    if (next->parent) next->parent->current_thread = next;
+    switch_address_space(next->parent ? &next->parent->as : &kernel_as);    // No-op while the process stays the same
+
+    return (registers_t *)(uintptr_t) &next->registers;
+}
+
+
+// Whether the interrupted frame may be saved and resumed later: user mode, or kernel mode on the
+// thread's own stack. A system call runs on the core's TSS stack which the next thread reuses.
+static bool frame_switchable(run_queue_t *rq, registers_t *regs) {
+    thread_t *current = rq->current;
+    if ((regs->iret_cs & 3) != 0 || current == rq->idle) return true;
+
+    return current->stack_base && regs->iret_rsp >= current->stack_base &&
+        regs->iret_rsp < current->stack_base + KSTACK_SIZE;
+}
+
+
+// Last step of every IRQ: switch threads if the tick or a yield asked for it, or a queued
+// thread is far behind, by loading the next thread's registers into the frame iretq returns through
+void sched_irq_exit(registers_t *regs) {
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu || !cpu->rq.idle) return;
+
+    release_prev(&cpu->rq);
+    if (!cpu->rq.need_resched && !check_preempt(&cpu->rq)) return;
+
+    // Nested in another interrupt or on a shared stack, the outermost exit switches
+    if (cpu->irq_depth > 1 || !frame_switchable(&cpu->rq, regs)) {
+        cpu->rq.need_resched = true;
+        return;
+    }
+    cpu->rq.need_resched = false;
+
+    registers_t *next = schedule(regs);
+    if (next) memcpy((void *)regs, (void *)next, sizeof(registers_t));
+}
+
+
+void sched_print_stats() {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpu_data_t *cpu = &cpu_datas[i];
+        if (!cpu->is_online || !cpu->rq.idle) continue;
+
+        thread_t *current = cpu->rq.current;
+        printf(" CPU %d: running %s (TID: %d), %d queued, ticks %d, switches %d, steals %d\n",
+            i, current->name, current->tid, cpu->rq.count, cpu->rq.ticks, cpu->rq.switches, cpu->rq.steals);
+    }
+}
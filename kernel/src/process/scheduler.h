@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "../lib/spinlock.h"
+#include "../util/util.h"
+
+#define SCHED_NICE_MIN      -20         // Highest priority
+#define SCHED_NICE_MAX      19          // Lowest priority
+#define SCHED_NICE_0_WEIGHT 1024        // Weight of nice 0, vruntime advances at TSC speed
+#define SCHED_WAKEUP_GRAN_US 1000       // A queued thread this far behind preempts on any interrupt
+#define SCHED_NICE_SHELL    -5          // Keeps the kernel shell ahead of busy threads
+#define SCHED_KICK_SPINS    100000      // Pause loops between IPIs to a core which still holds a deleted thread
+
+// Threads waiting for one core, lives in cpu_datas[] next to the other per-CPU state
+typedef struct run_queue {
+    spinlock_t lock;            // Guards head, count and min_vruntime, cores stealing work take it too
+    thread_t *head;             // READY threads sorted by vruntime, linked through rq_next
+    uint32_t count;             // Queued threads, the running one is not counted
+    uint64_t min_vruntime;      // Never decreases, new and migrated threads start from it
+    thread_t *current;          // Running thread, the idle thread when nothing else is ready
+    thread_t *idle;             // Boot context of the core, NULL until sched_init_cpu()
+    thread_t *prev;             // Switched out by the last schedule(), see on_cpu in thread_t
+    thread_t *sleepers;         // SLEEPING threads of this core with a deadline, earliest first
+    bool need_resched;          // Set by the timer tick, acted on when the interrupt returns
+    bool yield;                 // The running thread gives up the rest of its slice
+    uint64_t ticks;             // Timer ticks seen by the scheduler
+    uint64_t switches;          // Context switches
+    uint64_t steals;            // Threads taken from other cores
+} run_queue_t;
+
+void sched_init_cpu();
+
+void sched_add_thread(thread_t *thread);
+bool sched_remove_thread(thread_t *thread);
+thread_t *sched_current_thread();
+bool sched_running_idle();
+
+bool sched_can_block();
+void sched_prepare_sleep(uint64_t deadline);
+void sched_finish_sleep();
+bool sched_wake_thread(thread_t *thread);
+void sched_wake_expired(uint64_t now);
+
+int sched_set_nice(thread_t *thread, int nice);
+int sched_nice(int increment);
+void sched_yield();
+void sched_yield_current();
+
+void sched_tick();
+registers_t *schedule(registers_t *registers);
+void sched_irq_exit(registers_t *regs);
+
+void sched_print_stats();
@@ -112,15 +112,13 @@ void thread12_func(void* arg) {
 
 
 void print_all_threads_name(process_t *p){
-    thread_t * t = p->threads;
-    for(uint64_t tid = 0; tid < next_free_tid; tid++){
+    for(thread_t * t = p->threads; t; t = t->next){
         printf("Thread Name : %s | *thread: %x | rsp: %x | thread_next: %x\n", 
             t->name,
             (uint64_t)t, 
             t->registers.iret_rsp, 
             (uint64_t)t->next
         );
-        t = t->next;
     }
 }
 
@@ -158,42 +156,30 @@ void init_processes() {
 
     // Create a thread with an argument
     thread_t* thread2 = create_thread(process, "Thread2", (void *) &thread2_func, NULL);
-    if (!thread1) {
+    if (!thread2) {
         printf("Failed to create Thread3\n");
         return;
     }
 
     thread_t* thread10 = create_thread(process1, "Thread10", (void *) &thread10_func, NULL);
-    if (!thread0) {
+    if (!thread10) {
         printf("Failed to get init thread\n");
         return;
     }
 
     // Create a thread with an argument
     thread_t* thread11 = create_thread(process1, "Thread11", (void *) &thread11_func, NULL);
-    if (!thread1) {
+    if (!thread11) {
         printf("Failed to create Thread1\n");
         return;
     }
 
     // Create a thread with an argument
     thread_t* thread12 = create_thread(process1, "Thread12", (void *) &thread12_func, NULL);
-    if (!thread1) {
+    if (!thread12) {
         printf("Failed to create Thread3\n");
         return;
     }
 
-    // Set the current process
-    current_process = process;
-    processes_list = process;
-
-    current_process->next = process1;
-    processes_list = process1;
-
-    thread0->next = thread1;
-    thread1->next = thread2;
-
-    thread10->next = thread11;
-    thread11->next = thread12;
-    thread12->next = thread10;
-}
\ No newline at end of file
+    // Every created thread is already queued, the timer ticks start them
+}
@@ -1,16 +1,23 @@
 
 #include "../lib/string.h"
 #include "../lib/stdio.h"
+#include "../lib/stdlib.h"
+#include "../lib/rwlock.h"
 #include "../memory/kheap.h"
+#include "../memory/kstack.h"
 #include "../memory/vmm.h"
 #include "process.h"
+#include "scheduler.h"
+#include "wait_queue.h"
 #include "types.h"
+#include "id_alloc.h"
 #include "../sys/timer/apic_timer.h"
+#include "../sys/cpu/fpu.h"
 
 #include "thread.h"
 
 
-#define THREAD_STACK_SIZE 0x4000 // 16 KB
+#define THREAD_STACK_SIZE KSTACK_SIZE // 16 KB
 
 #define KERNEL_CS  0x08
 #define KERNEL_SS  0x10
@@ -19,30 +26,75 @@
   
 #define FLAGS      0x202
 
-size_t next_free_tid = 0;
+static rwlock_t threads_lock = RWLOCK_INIT_NAMED("threads");     // Guards the TID table and its IDs
+static uint64_t tid_bitmap[TID_MAX / 64];
+static id_alloc_t tid_ids = ID_ALLOC_INIT(tid_bitmap, TID_MAX);
+static thread_t *tid_table[TID_HASH_SIZE];
+static wait_queue_t exit_queue = WAIT_QUEUE_INIT;      // thread_join() callers, woken by thread_exit()
 
 
-// Adding the thread in threads
+// Give the thread a TID and make it findable by get_thread_by_tid(), false when every TID is in use
+bool thread_register(thread_t* thread) {
+    if (!thread) return false;
+
+    uint64_t flags = write_lock_irqsave(&threads_lock);
+    int64_t tid = id_alloc(&tid_ids);
+    if (tid < 0) {
+        write_unlock_irqrestore(&threads_lock, flags);
+        printf("[Error] Thread: All %d TIDs are in use\n", TID_MAX);
+        return false;
+    }
+    thread->tid = (size_t) tid;
+
+    thread_t** bucket = &tid_table[thread->tid & (TID_HASH_SIZE - 1)];
+    thread->hash_next = *bucket;
+    *bucket = thread;
+    write_unlock_irqrestore(&threads_lock, flags);
+    return true;
+}
+
+// Take the thread out of the TID table, its TID may be reused afterwards
+static void thread_unregister(thread_t* thread) {
+    uint64_t flags = write_lock_irqsave(&threads_lock);
+    for (thread_t** link = &tid_table[thread->tid & (TID_HASH_SIZE - 1)]; *link; link = &(*link)->hash_next) {
+        if (*link == thread) {
+            *link = thread->hash_next;
+            id_free(&tid_ids, thread->tid);
+            break;
+        }
+    }
+    thread->hash_next = NULL;
+    write_unlock_irqrestore(&threads_lock, flags);
+}
+
+thread_t* get_thread_by_tid(size_t tid) {
+    uint64_t flags = read_lock_irqsave(&threads_lock);
+    thread_t* thread = tid_table[tid & (TID_HASH_SIZE - 1)];
+    while (thread && thread->tid != tid) {
+        thread = thread->hash_next;
+    }
+    read_unlock_irqrestore(&threads_lock, flags);
+    return thread;  // NULL if not found
+}
+
+
+// Append the thread to its parent's thread list
 static void add_thread(thread_t* thread) {
     if (!thread || !thread->parent) return; // If the given thread is null then return from here 
 
     process_t* parent = thread->parent;
 
-    if (parent->threads == NULL) {          // If threads is null
-        parent->threads = thread;           // Set threads with given thread
-        parent->current_thread = thread;    // Set current_thread with given thread
-    } else {                                // If there already present thread
-        // Detect last thread
-        thread_t* last = parent->threads;   // Set last with first thread
-        while (last) {                      // If last is not null
-            if(!last->next){                // If next thread of last is null
-                break;
-            }
-            last = last->next;              // If next thread is not null then set last with next thread
-        }
-        last->next = thread;                // Found last thread and set last thread's next with given thread
+    uint64_t flags = spin_lock_irqsave(&parent->threads_lock);
+    thread->next = NULL;
+    thread->prev = parent->threads_tail;
+    if (parent->threads_tail) {
+        parent->threads_tail->next = thread;
+    } else {
+        parent->threads = thread;           // First thread of the process
     }
+    parent->threads_tail = thread;
     parent->current_thread = thread;        // Set parent's current thread with given last thread
+    spin_unlock_irqrestore(&parent->threads_lock, flags);
 }
 
 
@@ -54,26 +106,25 @@ static void remove_thread(thread_t* thread) {
 
     process_t* parent = thread->parent;
     if (!parent){
-        return;;
+        return;
     }
 
-    while (true) {
-        if (parent->threads == thread) {            // If thread is equal to first thread
-            parent->threads = thread->next;         // Remove the given thread from linked list of threads
-            break;
-        } else {                                    // If thread is not equal to the first thread
-            thread_t* current = parent->threads;    // Set current with first thread from threads 
-            while (current) {                       // If current is not equal null
-                if (current->next == thread) {      // If next thread of current thread is equal to the given thread
-                    current->next = thread->next;   // Remove the given thread from linked list
-                    break;
-                }
-                current = current->next;            // Loop to all threads
-            }
-        }
-        break;
+    uint64_t flags = spin_lock_irqsave(&parent->threads_lock);
+    if (thread->prev) {
+        thread->prev->next = thread->next;
+    } else {
+        parent->threads = thread->next;
     }
-    thread->next = NULL;                            // Clear the next pointer of the removed thread
+    if (thread->next) {
+        thread->next->prev = thread->prev;
+    } else {
+        parent->threads_tail = thread->prev;
+    }
+    if (parent->current_thread == thread) parent->current_thread = parent->threads_tail;
+    spin_unlock_irqrestore(&parent->threads_lock, flags);
+
+    thread->next = NULL;                            // Clear the links of the removed thread
+    thread->prev = NULL;
     thread->parent = NULL;                          // Clear the parent pointer   
 }
 
@@ -82,13 +133,10 @@ static void remove_thread(thread_t* thread) {
 // Creating a new thread and add into parent process
 thread_t* create_thread(process_t* parent, const char* name, void (*function)(void*), void* arg) {
 
-    thread_t* thread = (thread_t*) kheap_alloc(sizeof(thread_t), ALLOCATE_CODE); // Allocate memory for the thread
+    thread_t* thread = (thread_t*) malloc(sizeof(thread_t)); // Allocate memory for the thread
 
-    if (!thread) return NULL;
-    memset((void*)thread, 0, sizeof(thread_t)); // Initialize the thread to 0
+    if (!thread) return NULL;                   // malloc() memory is already zeroed
 
-    // Assign the next available TID
-    thread->tid = next_free_tid++;
     thread->status = READY;
     strncpy(thread->name, name, THREAD_NAME_MAX_LEN - 1);
     thread->name[THREAD_NAME_MAX_LEN - 1] = '\0'; // Ensure null-termination
@@ -97,12 +145,26 @@ thread_t* create_thread(process_t* parent, const char* name, void (*function)(vo
     thread->next = 0;
     thread->cpu_time = 0;
 
-    // Allocate a stack for the thread
-    void* stack = kheap_alloc(THREAD_STACK_SIZE, ALLOCATE_STACK); // Allocate memory for the thread's stack
+    // Take a stack for the thread, usually a cached one of an exited thread
+    void* stack = kstack_alloc();
 
     if (!stack) {           // If stack allocation fails, free the thread
-        kheap_free((void*)thread, sizeof(thread_t));
-        next_free_tid--;    // Revert the TID counter if stack allocation fails
+        free(thread);
+        return NULL;
+    }
+
+    thread->stack_base = (uint64_t) stack;
+
+    if (!fpu_init_thread(thread)) {             // Every thread may use SSE, the kernel is built with it
+        kstack_free(stack);
+        free(thread);
+        return NULL;
+    }
+
+    if (!thread_register(thread)) {             // Assign the next available TID
+        fpu_free_thread(thread);
+        kstack_free(stack);
+        free(thread);
         return NULL;
     }
 
@@ -116,6 +178,7 @@ thread_t* create_thread(process_t* parent, const char* name, void (*function)(vo
     thread->registers.rbp = 0;                          // Base pointer = 0
 
     add_thread(thread);                                 // Add the thread to the parent process's thread list
+    sched_add_thread(thread);                           // Runs on the least loaded core
 
     printf("Created Thread: %s (TID: %d) at %x | rip : %x | rsp : %x\n", 
         thread->name, 
@@ -129,21 +192,86 @@ thread_t* create_thread(process_t* parent, const char* name, void (*function)(vo
 }
 
 
+// Creating a thread which resumes from the saved registers of another one, used by fork.
+// It keeps running on the user stack of the copied address space, so it gets no kernel stack.
+thread_t* fork_thread(process_t* parent, const char* name, registers_t* regs) {
+
+    thread_t* thread = (thread_t*) malloc(sizeof(thread_t));
+
+    if (!thread) return NULL;
+
+    thread->status = READY;
+    strncpy(thread->name, name, THREAD_NAME_MAX_LEN - 1);
+    thread->name[THREAD_NAME_MAX_LEN - 1] = '\0';
+
+    thread->parent = parent;
+    thread->next = 0;
+    thread->cpu_time = 0;
+    thread->stack_base = 0;
+
+    if (!fpu_fork_thread(sched_current_thread(), thread)) {    // The child continues with the same SSE state
+        free(thread);
+        return NULL;
+    }
+
+    if (!thread_register(thread)) {
+        fpu_free_thread(thread);
+        free(thread);
+        return NULL;
+    }
+
+    memcpy((void*)&thread->registers, (void*)regs, sizeof(registers_t));
+    thread->registers.rax = 0;                          // fork() returns 0 in the child
+
+    add_thread(thread);
+    sched_add_thread(thread);
+
+    return thread;
+}
+
+
 void delete_thread(thread_t* thread) {
     if (!thread) return;
     printf("Start Deleting Thread: %s (TID: %d)\n", thread->name, thread->tid);
+    if (!sched_remove_thread(thread)) return;   // Still running, it can not be freed
     remove_thread(thread); // Remove the thread from the process's thread list
 
     // Storing following datta before clearing stack memory
-    char * name;
+    char name[THREAD_NAME_MAX_LEN];
     memcpy((void*)name, (void*)thread->name, THREAD_NAME_MAX_LEN);
     size_t tid = thread->tid;
+    thread_unregister(thread);
 
     // Free the thread's stack memory
-    kheap_free((void*)(thread->registers.iret_rsp - THREAD_STACK_SIZE), THREAD_STACK_SIZE ); 
+    if (thread->stack_base) kstack_free((void*)thread->stack_base);
+    fpu_free_thread(thread);
     // Free the thread memory
-    kheap_free((void*)thread, sizeof(thread_t));                                                  
+    free(thread);                                                  
     
     printf("Thread Deleted: %s (TID: %d)\n", name, tid);                        
 }
 
+
+// Condition for thread_join()
+static bool thread_dead(void *arg) {
+    return __atomic_load_n(&((thread_t *) arg)->status, __ATOMIC_ACQUIRE) == DEAD;
+}
+
+// Sleep until thread has called thread_exit(), it may then be deleted
+void thread_join(thread_t* thread) {
+    if (thread) wait_event(&exit_queue, thread_dead, thread);
+}
+
+
+// Stop the calling thread. It is not scheduled again, delete_thread() frees it later.
+void thread_exit() {
+    thread_t* thread = sched_current_thread();
+    if (thread) {
+        __atomic_store_n(&thread->status, DEAD, __ATOMIC_RELEASE);
+        wake_up(&exit_queue);
+    }
+
+    for (;;) {
+        asm volatile("hlt");    // Until the next tick switches away
+    }
+}
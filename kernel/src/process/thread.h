@@ -11,23 +11,47 @@
 
 
 #define THREAD_NAME_MAX_LEN 64
+#define TID_MAX         65536       // TIDs run from 0 to TID_MAX - 1 and are reused, a multiple of 64
+#define TID_HASH_SIZE   1024        // Buckets of the TID table, a power of two
 
-struct thread {                     // Allocated size 312 byte
+struct thread {                     // Allocated size 416 byte
     size_t tid;                     // Thread ID
     status_t status;                // Thread status
     char name[THREAD_NAME_MAX_LEN]; // Thread name
     process_t* parent;              // Reference to parent process
-    struct thread* next;            // Linked list for threads
-    uint64_t cpu_time;              // Track CPU time per thread
+    struct thread* next;            // Thread list of the parent, guarded by its threads_lock
+    struct thread* prev;
+    struct thread* hash_next;       // Chain of its TID table bucket, see thread.c
+    uint64_t cpu_time;              // Run time in TSC cycles, charged by the scheduler
     registers_t registers;          // Thread registers
+    uint64_t stack_base;            // Kernel stack from kstack_alloc(), 0 when the thread has none
+
+    struct thread* rq_next;         // Run queue link, see scheduler.c
+    uint32_t cpu;                   // Core whose run queue holds the thread, or which runs it
+    uint8_t on_cpu;                 // Running, or its frame may still be on the stack of core cpu
+    int8_t nice;                    // SCHED_NICE_MIN to SCHED_NICE_MAX, 0 by default
+    uint64_t vruntime;              // Run time weighted by nice, the smallest runs next
+    uint64_t exec_start;            // TSC when the thread was last charged
+
+    wait_queue_t* wait_queue;       // Queue it sleeps on, NULL for a plain sleep
+    struct thread* wait_next;       // Wait queue link, see wait_queue.c
+    struct thread* sleep_next;      // Timed sleepers of its core, sorted by wake_at
+    uint64_t wake_at;               // TSC deadline of a SLEEPING thread, 0 for none
+
+    void* fpu_area;                 // Saved FPU/SSE/AVX state, see sys/cpu/fpu.c
+    uint32_t fpu_cpu;               // Core which loaded the state last, FPU_NO_CPU if none
 };
 
 
 
-extern size_t next_free_tid;
-
 thread_t* create_thread(process_t* parent, const char* name, void (*function)(void*), void* arg);
+thread_t* fork_thread(process_t* parent, const char* name, registers_t* regs);
 void delete_thread(thread_t* thread);
+void thread_exit();
+void thread_join(thread_t* thread);
+
+bool thread_register(thread_t* thread);
+thread_t* get_thread_by_tid(size_t tid);
 
 
 
@@ -6,8 +6,10 @@
 
 struct process;
 struct thread;
+struct wait_queue;
 
 typedef struct process process_t;
 typedef struct thread thread_t;
+typedef struct wait_queue wait_queue_t;
 
 
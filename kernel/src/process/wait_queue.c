@@ -0,0 +1,196 @@
+/*
+Wait Queues
+
+A thread waits for a condition by adding itself to a wait queue, marking
+itself SLEEPING and checking the condition once more before it blocks, so a
+waker which changes the condition and then calls wake_up() can not be missed.
+Wakers may run in interrupt handlers.
+
+Threads which can not block (the idle thread, threads in a system call from
+user mode, code running with interrupts off) wait in place instead: they halt
+until the next interrupt, or spin when interrupts are off.
+
+    https://wiki.osdev.org/Blocking_Process
+    https://docs.kernel.org/kernel-hacking/hacking.html
+*/
+
+#include "../lib/stdio.h"
+#include "../sys/timer/tsc.h"
+#include "../sys/timer/apic_timer.h"
+#include "scheduler.h"
+#include "thread.h"
+
+#include "wait_queue.h"
+
+
+void wait_queue_init(wait_queue_t *wq) {
+    if (!wq) return;
+
+    wq->lock = (spinlock_t) SPINLOCK_INIT;
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+
+// Append thread, the queue lock is held
+static void wq_append(wait_queue_t *wq, thread_t *thread) {
+    thread->wait_next = NULL;
+    if (wq->tail) wq->tail->wait_next = thread;
+    else wq->head = thread;
+    wq->tail = thread;
+    thread->wait_queue = wq;
+}
+
+// Unlink thread if it is still queued, the queue lock is held
+static void wq_unlink(wait_queue_t *wq, thread_t *thread) {
+    thread_t *prev = NULL;
+    for (thread_t *t = wq->head; t; prev = t, t = t->wait_next) {
+        if (t != thread) continue;
+
+        if (prev) prev->wait_next = t->wait_next;
+        else wq->head = t->wait_next;
+        if (wq->tail == t) wq->tail = prev;
+        break;
+    }
+    thread->wait_next = NULL;
+    thread->wait_queue = NULL;
+}
+
+
+// Take thread off the wait queue it sleeps on, if any
+void wait_queue_remove(thread_t *thread) {
+    if (!thread) return;
+
+    wait_queue_t *wq = __atomic_load_n(&thread->wait_queue, __ATOMIC_ACQUIRE);
+    if (!wq) return;
+
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    if (thread->wait_queue == wq) wq_unlink(wq, thread);
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+
+// Wait in place until cond holds or deadline (TSC, 0 for none) passes, for callers which can not block
+static bool wait_in_place(bool (*cond)(void *), void *arg, uint64_t deadline) {
+    for (;;) {
+        uint64_t flags = irq_save();                // cond must not change between the check and hlt
+        if (cond && cond(arg)) {
+            irq_restore(flags);
+            return true;
+        }
+        if (deadline && read_tsc() >= deadline) {
+            irq_restore(flags);
+            return false;
+        }
+
+        if (!(flags & (1 << 9))) {
+            asm volatile("pause");                  // Nothing can interrupt us, keep polling
+            continue;
+        }
+
+        if (deadline) apic_timer_wakeup_at(deadline);
+        asm volatile("sti; hlt");                   // Any interrupt may have changed cond
+    }
+}
+
+
+// Sleep until cond(arg) is true, wq is woken, or timeout_us passes (0 waits forever).
+// cond may be NULL for a plain sleep on a NULL wq. Returns the last value of cond.
+bool wait_event_timeout(wait_queue_t *wq, bool (*cond)(void *), void *arg, uint64_t timeout_us) {
+    uint64_t deadline = timeout_us ? read_tsc() + usec_to_tsc(timeout_us) : 0;
+
+    if (!sched_can_block()) return wait_in_place(cond, arg, deadline);
+
+    thread_t *thread = sched_current_thread();
+
+    for (;;) {
+        if (cond && cond(arg)) return true;
+        if (deadline && read_tsc() >= deadline) return false;
+
+        if (wq) {
+            uint64_t flags = spin_lock_irqsave(&wq->lock);
+            wq_append(wq, thread);
+            spin_unlock_irqrestore(&wq->lock, flags);
+        }
+        sched_prepare_sleep(deadline);
+
+        // A wakeup from here on makes the thread READY again and the yield returns at once
+        if (!(cond && cond(arg))) sched_yield();
+
+        sched_finish_sleep();
+        if (wq) wait_queue_remove(thread);
+    }
+}
+
+
+void wait_event(wait_queue_t *wq, bool (*cond)(void *), void *arg) {
+    wait_event_timeout(wq, cond, arg, 0);
+}
+
+
+// Check cond with growing sleeps in between, for devices whose completion interrupt is not
+// wired up. Returns false if it is still false after timeout_us.
+bool wait_poll(bool (*cond)(void *), void *arg, uint64_t timeout_us) {
+    uint64_t deadline = read_tsc() + usec_to_tsc(timeout_us);
+    uint64_t interval = WAIT_POLL_MIN_US;
+
+    while (!cond(arg)) {
+        if (read_tsc() >= deadline) return cond(arg);
+
+        wait_event_timeout(NULL, cond, arg, interval);
+        if (interval < WAIT_POLL_MAX_US) interval *= 2;
+    }
+
+    return true;
+}
+
+
+// Sleep until the TSC reaches deadline
+void sleep_until(uint64_t deadline) {
+    if (sched_can_block()) {
+        while (read_tsc() < deadline) {
+            sched_prepare_sleep(deadline);
+            sched_yield();                          // Returns once the APIC timer woke it
+            sched_finish_sleep();
+        }
+        return;
+    }
+
+    wait_in_place(NULL, NULL, deadline);
+}
+
+
+// Wake every thread sleeping on wq. Returns how many were woken.
+uint32_t wake_up(wait_queue_t *wq) {
+    if (!wq) return 0;
+
+    uint32_t woken = 0;
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+
+    while (wq->head) {
+        thread_t *thread = wq->head;
+        wq_unlink(wq, thread);
+        if (sched_wake_thread(thread)) woken++;     // Not sleeping any more: it timed out or checks cond now
+    }
+
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
+
+
+// Wake the first thread still sleeping on wq. Returns false if there was none.
+bool wake_up_one(wait_queue_t *wq) {
+    if (!wq) return false;
+
+    bool woken = false;
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+
+    while (wq->head && !woken) {
+        thread_t *thread = wq->head;
+        wq_unlink(wq, thread);
+        woken = sched_wake_thread(thread);
+    }
+
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return woken;
+}
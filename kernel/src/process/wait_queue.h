@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "../lib/spinlock.h"
+
+#define WAIT_POLL_MIN_US    20          // First sleep between polls, shorter ones would spin
+#define WAIT_POLL_MAX_US    1000        // Polls back off to this
+
+// Threads sleeping until an event, usually signalled from an interrupt handler
+struct wait_queue {
+    spinlock_t lock;            // Guards head and tail
+    thread_t *head;             // Sleepers in arrival order, linked through wait_next
+    thread_t *tail;
+};
+
+#define WAIT_QUEUE_INIT { .lock = SPINLOCK_INIT, .head = NULL, .tail = NULL }
+
+void wait_queue_init(wait_queue_t *wq);
+void wait_queue_remove(thread_t *thread);
+
+bool wait_event_timeout(wait_queue_t *wq, bool (*cond)(void *), void *arg, uint64_t timeout_us);
+void wait_event(wait_queue_t *wq, bool (*cond)(void *), void *arg);
+bool wait_poll(bool (*cond)(void *), void *arg, uint64_t timeout_us);
+void sleep_until(uint64_t deadline);
+
+uint32_t wake_up(wait_queue_t *wq);
+bool wake_up_one(wait_queue_t *wq);
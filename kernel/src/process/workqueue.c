@@ -0,0 +1,203 @@
+/*
+Deferred Work
+
+Interrupt handlers acknowledge their device and leave the rest as a work_t,
+so interrupts stay off for as short as possible.
+
+Softirqs: queue_softirq() appends the work to a list of the running core.
+irq_handler() runs that list after the EOI, before it returns to the
+interrupted thread. Interrupts are still off, but the device may raise the
+next one, and work stays on the core the interrupt came to, in order. For
+short work which must not wait for the scheduler, like keystrokes.
+
+Workers: queue_work() appends the work to one global queue, served by kernel
+threads of the "Kernel Workers" process. They sleep on a wait queue, run with
+interrupts on and may block, and the scheduler spreads them over the cores.
+For longer work like walking a receive ring. A softirq list which keeps
+refilling is handed to the workers after SOFTIRQ_MAX_ROUNDS drains.
+
+References:
+    https://www.kernel.org/doc/html/latest/core-api/workqueue.html
+    https://lwn.net/Articles/520076/
+    https://wiki.osdev.org/Interrupt_Service_Routines
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/spinlock.h"
+#include "../sys/cpu/cpu.h"
+#include "process.h"
+#include "thread.h"
+#include "wait_queue.h"
+
+#include "workqueue.h"
+
+extern bool debug_on;
+
+static spinlock_t work_lock = SPINLOCK_INIT_NAMED("workqueue");    // Guards work_head and work_tail
+static work_t *work_head = NULL;            // Waiting for a worker, oldest first
+static work_t *work_tail = NULL;
+static wait_queue_t work_wait = WAIT_QUEUE_INIT;    // Idle workers sleep here
+
+static process_t *worker_process = NULL;
+static uint32_t worker_count = 0;
+static uint64_t works_queued = 0;           // Counters for `ps`
+static uint64_t works_done = 0;
+
+
+// Claim work for a queue, false if it waits in one already
+static bool claim(work_t *work) {
+    uint32_t expected = 0;
+    return __atomic_compare_exchange_n(&work->pending, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static void run_work(work_t *work) {
+    __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);     // Queued again from here on, it runs once more
+    work->fn(work->arg);
+}
+
+
+// Run work in a worker thread on any core, from any context. Before init_workqueue() it waits for the workers.
+bool queue_work(work_t *work) {
+    if (!work || !work->fn || !claim(work)) return false;
+
+    uint64_t flags = spin_lock_irqsave(&work_lock);
+    work->next = NULL;
+    if (work_tail) work_tail->next = work;
+    else work_head = work;
+    work_tail = work;
+    works_queued++;
+    spin_unlock_irqrestore(&work_lock, flags);
+
+    wake_up_one(&work_wait);
+    return true;
+}
+
+
+// Run work on this core when the interrupt being handled returns, for interrupt handlers
+bool queue_softirq(work_t *work) {
+    if (!work || !work->fn) return false;
+
+    uint64_t flags = irq_save();
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu) {
+        irq_restore(flags);
+        return queue_work(work);            // Per-CPU data is not up yet
+    }
+
+    if (!claim(work)) {
+        irq_restore(flags);
+        return false;
+    }
+
+    work->next = NULL;                      // Only this core touches its list, with interrupts off
+    if (cpu->softirq_tail) cpu->softirq_tail->next = work;
+    else cpu->softirq_head = work;
+    cpu->softirq_tail = work;
+    irq_restore(flags);
+    return true;
+}
+
+
+// Run the softirq list of this core, irq_handler() calls it with interrupts off after the EOI
+void softirq_run() {
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu || !cpu->softirq_head || cpu->in_softirq) return;
+
+    cpu->in_softirq = true;                 // Work which enables interrupts must not nest here
+
+    for (int round = 0; round < SOFTIRQ_MAX_ROUNDS && cpu->softirq_head; round++) {
+        work_t *work = cpu->softirq_head;
+        cpu->softirq_head = NULL;           // Work queued by the work itself runs in the next round
+        cpu->softirq_tail = NULL;
+
+        while (work) {
+            work_t *next = work->next;
+            run_work(work);
+            cpu->softirqs++;
+            work = next;
+        }
+    }
+
+    // Still refilling, let the interrupted thread go on and the workers take the rest
+    work_t *work = cpu->softirq_head;
+    cpu->softirq_head = NULL;
+    cpu->softirq_tail = NULL;
+    while (work) {
+        work_t *next = work->next;
+        __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);
+        queue_work(work);
+        work = next;
+    }
+
+    cpu->in_softirq = false;
+}
+
+
+// Condition of work_wait
+static bool work_available(void *arg) {
+    (void) arg;
+    return __atomic_load_n(&work_head, __ATOMIC_ACQUIRE) != NULL;
+}
+
+static void worker_main(void *arg) {
+    (void) arg;
+
+    for (;;) {
+        wait_event(&work_wait, work_available, NULL);
+
+        uint64_t flags = spin_lock_irqsave(&work_lock);
+        work_t *work = work_head;
+        if (work) {
+            work_head = work->next;
+            if (!work_head) work_tail = NULL;
+        }
+        spin_unlock_irqrestore(&work_lock, flags);
+
+        if (!work) continue;                // Another worker was faster
+
+        run_work(work);
+        __atomic_fetch_add(&works_done, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+// Start the worker threads, once the scheduler runs on every core
+void init_workqueue() {
+    if (worker_process) return;
+
+    uint32_t cores = 0;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        if (cpu_datas[i].is_online) cores++;
+    }
+    uint32_t count = cores < WORKQUEUE_MAX_WORKERS ? cores : WORKQUEUE_MAX_WORKERS;
+    if (count == 0) count = 1;
+
+    worker_process = create_process("Kernel Workers");
+    if (!worker_process) {
+        printf("[Error] Workqueue: Failed to create the worker process\n");
+        return;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!create_thread(worker_process, "kworker", &worker_main, NULL)) {
+            printf("[Error] Workqueue: Failed to create worker %d\n", i);
+            break;
+        }
+        worker_count++;
+    }
+
+    if (work_available(NULL)) wake_up(&work_wait);     // Queued before the workers existed
+
+    if (debug_on) printf(" Workqueue: %d workers started\n", worker_count);
+}
+
+
+void workqueue_print_stats() {
+    uint64_t softirqs = 0;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        softirqs += cpu_datas[i].softirqs;
+    }
+
+    printf(" Deferred work: %d workers, %llu queued, %llu done, %llu softirqs\n",
+        worker_count, works_queued, works_done, softirqs);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WORKQUEUE_MAX_WORKERS   4       // Worker threads, one per online core up to this many
+#define SOFTIRQ_MAX_ROUNDS      4       // Softirq list drains per interrupt, later work goes to the workers
+
+// Work an interrupt handler leaves for later. Usually static in the driver and queued by every
+// interrupt, queueing work which is still pending does nothing, so interrupts coalesce.
+// pending is cleared before fn runs, so fn may run on two cores at once if it is queued again
+// meanwhile. fn guards its own data against that.
+typedef struct work {
+    void (*fn)(void *);
+    void *arg;
+    struct work *next;          // Softirq list of a core or the worker queue
+    volatile uint32_t pending;  // Queued and not started yet
+} work_t;
+
+#define WORK_INIT(f, a) { .fn = (f), .arg = (a), .next = NULL, .pending = 0 }
+
+void init_workqueue();
+
+bool queue_softirq(work_t *work);
+bool queue_work(work_t *work);
+void softirq_run();
+
+void workqueue_print_stats();
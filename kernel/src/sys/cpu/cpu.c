@@ -40,6 +40,8 @@
 #include "../../memory/pmm.h"
 #include "../../memory/Uheap.h"
 #include "../../memory/vmm.h"
+#include "../../memory/address_space.h"
+#include "../../memory/zero_pool.h"
 
 #include "../../util/util.h"
 #include "../acpi/acpi.h"
@@ -76,6 +78,8 @@ struct limine_smp_info **cpus;  // Pointer to an array of pointers to smp_info s
 
 cpu_data_t cpu_datas[MAX_CPUS];  // Array indexed by CPU ID (APIC ID)
 
+static volatile bool percpu_ready = false;  // LAPIC ids can be read, see get_cpu_data()
+
 extern madt_t *madt;
 
 
@@ -155,11 +159,14 @@ void start_bootstrap_cpu_core() {
 
     init_apic();                // Initialize the APIC & IOAPIC for the bootstrap core
 
+    percpu_ready = true;        // get_cpu_data() needs the LAPIC id
+
     bsp_apic_int_init();        // Initialize APIC Interrupts
 
     // init_pmm();                 // Initialize Physical Memory Manager for the bootstrap core
 
     init_bs_paging();           // Initialize paging for the bootstrap core
+    init_pcid();                // Tag TLB entries per address space if the CPU can
 
 
     int_syscall_init();         // Initialize int based system calls for the bootstrap core    
@@ -172,7 +179,12 @@ void start_bootstrap_cpu_core() {
     if(debug_on) printf(" Bootstrap CPU %d initialized...\n\n", bsp_lapic_id);
 
     
-    init_apic_timer(100);       // Initialize the APIC timer for the bootstrap core with 100 ms/ 0.1 s interval
+    sched_init_cpu();           // kmain becomes the idle thread of the bootstrap core
+
+    init_apic_timer(100);       // Initialize the APIC timer for the bootstrap core with 100 ms/ 0.1 s slices
+
+    // The PIT was only needed to calibrate the TSC and APIC timer, its ticks would wake the idle bootstrap core
+    ioapic_route_irq(0, bsp_lapic_id, 32, IOAPIC_MASKED);
     
     // asm volatile("cli");  
     // disable_pit_timer();     // Disable PIT timer interrupts
@@ -181,6 +193,32 @@ void start_bootstrap_cpu_core() {
 }
 
 
+// Run the function given to this core by cpu_run_idle(), if any
+static void run_idle_work(cpu_data_t *cpu) {
+    void (*fn)(void *) = __atomic_load_n(&cpu->idle_fn, __ATOMIC_ACQUIRE);
+    if (!fn) return;
+
+    fn(cpu->idle_arg);
+    __atomic_store_n(&cpu->idle_fn, NULL, __ATOMIC_RELEASE);
+}
+
+
+// Let an idle AP run fn(arg) from its idle loop, a wakeup IPI starts it.
+// Returns false for the calling core, offline cores and cores still busy with earlier work.
+// Only one core may hand out work at a time.
+bool cpu_run_idle(uint32_t cpu_id, void (*fn)(void *), void *arg) {
+    if (!fn || cpu_id >= MAX_CPUS || !cpu_datas[cpu_id].is_online || cpu_id == get_lapic_id()) return false;
+
+    cpu_data_t *cpu = &cpu_datas[cpu_id];
+    if (__atomic_load_n(&cpu->idle_fn, __ATOMIC_ACQUIRE)) return false;
+
+    cpu->idle_arg = arg;
+    __atomic_store_n(&cpu->idle_fn, fn, __ATOMIC_RELEASE);     // Publishes idle_arg as well
+    send_wakeup_ipi(cpu_id);
+    return true;
+}
+
+
 void target_cpu_task(struct limine_smp_info *smp_info) {
 
     if(smp_info == NULL){
@@ -218,22 +256,35 @@ void target_cpu_task(struct limine_smp_info *smp_info) {
     // Initialize Physical Memory Manager
     init_pmm(); // Already done in start_bootstrap_cpu_core()
     init_ap_paging(core_id);
+    init_pcid();
 
     // Initialize the FPU and SSE for this core
     if(has_fpu()){
         enable_fpu_and_sse();
     }
 
-    init_apic_timer(100);       // Initialize the APIC timer for the ap core
+    init_apic_timer(100);       // Initialize the APIC timer for the ap core, 100 ms slices
 
     cpu_datas[core_id].is_online = 1; // Mark this core as online
     if(debug_on) printf(" CPU %d (LAPIC ID: %x) is online\n", core_id, core_id);
 
+    sched_init_cpu();           // The loop below becomes the idle thread of this core
+
     asm volatile("sti"); // Enable interrupts
 
-    // Halt the AP as we have nothing else to do currently
+    // Idle thread: runs when the run queue is empty and nothing can be stolen. Between
+    // interrupts it runs work handed over by cpu_run_idle() and keeps the zeroed frame pool filled.
+    // The timer does not tick here, the core sleeps until a sleep expires or an IPI wakes it.
     for (;;) {
-        asm volatile("hlt");
+        run_idle_work(&cpu_datas[core_id]);
+        zero_pool_refill();
+
+        asm volatile("cli");
+        if (__atomic_load_n(&cpu_datas[core_id].idle_fn, __ATOMIC_ACQUIRE)) {
+            asm volatile("sti");
+            continue;
+        }
+        asm volatile("sti; hlt");   // sti takes effect after hlt starts, no wakeup is lost in between
     }
 }
 
@@ -281,6 +332,17 @@ void init_all_cpu_cores() {
 }
 
 
+// cpu_data of the running core, NULL before the LAPIC is up or while the core is still booting
+cpu_data_t *get_cpu_data() {
+    if (!percpu_ready) return NULL;
+
+    uint32_t cpu_id = get_lapic_id();
+    if (cpu_id >= MAX_CPUS || !cpu_datas[cpu_id].is_online) return NULL;
+
+    return &cpu_datas[cpu_id];
+}
+
+
 void switch_to_core(uint32_t target_lapic_id) {
     if (smp_response == NULL) return;
 
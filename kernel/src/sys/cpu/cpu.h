@@ -8,6 +8,11 @@
 #include "../../../../ext_lib/limine-9.2.3/limine.h"
 #include "../../arch/gdt/gdt.h"
 #include "../../arch/gdt/tss.h"
+#include "../../memory/pmm.h"
+#include "../../memory/tlb.h"
+#include "../../memory/address_space.h"
+#include "../../memory/kstack.h"
+#include "../../process/scheduler.h"
 
 #define MAX_CPUS   256            // Maximum number of CPUs supported
 #define STACK_SIZE 4096 * 4       // 16 KB per core
@@ -28,11 +33,37 @@ typedef struct {
 
     uint8_t is_online;
     struct limine_smp_info *smp_info;
+
+    pmm_cache_t pmm_cache;      // Per-CPU free frame cache
+    tlb_stats_t tlb_stats;      // TLB flush and shootdown counters
+
+    address_space_t *as;        // Loaded address space, NULL for kernel_as
+    uint64_t pcid_stale[PCID_COUNT / 64];  // PCIDs to flush when next loaded on this core
+
+    kstack_cache_t kstack_cache;    // Per-CPU cache of free kernel stacks
+
+    void (*idle_fn)(void *);        // Work handed to this idle AP by cpu_run_idle()
+    void *idle_arg;
+
+    thread_t *fpu_owner;            // Thread whose FPU/SSE state is in the registers, see sys/cpu/fpu.c
+    uint64_t fpu_saves;             // Extended states saved on a switch or interrupt entry
+    uint64_t fpu_restores;          // Extended states loaded by the #NM trap
+    uint32_t irq_depth;             // Interrupts being handled on this core, see fpu_irq_enter()
+
+    struct work *softirq_head;      // Work left by interrupt handlers of this core, see process/workqueue.c
+    struct work *softirq_tail;
+    bool in_softirq;                // softirq_run() is running the list
+    uint64_t softirqs;              // Work items run by softirq_run()
+
+    run_queue_t rq;                 // Threads of this core, see process/scheduler.c
 } cpu_data_t;
 
 
 extern cpu_data_t cpu_datas[MAX_CPUS];  // Array indexed by CPU ID (APIC ID)
 
+cpu_data_t *get_cpu_data();
+bool cpu_run_idle(uint32_t cpu_id, void (*fn)(void *), void *arg);
+
 void switch_to_core(uint32_t target_lapic_id);
 
 void init_bs_cpu_core();                // pic interrupt, gdt, tss, apic, paging, fpu
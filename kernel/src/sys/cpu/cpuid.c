@@ -16,6 +16,7 @@ EBX, ECX, and EDX registers:
 #include "../../lib/stdio.h"
 
 #include "cpuid.h"
+#include "fpu.h"
 
 extern bool debug_on;
 
@@ -223,12 +224,54 @@ bool has_sse2() {
     return (edx & (1 << 26));  // SSE2 is bit 26 of EDX
 }
 
-bool has_avs() {
+bool has_avx() {
     uint32_t eax, ebx, ecx, edx;
     cpuid(1, &eax, &ebx, &ecx, &edx);
     return (ecx & (1 << 28));  // AVX is bit 28 of ECX
 }
 
+// Check if the CPU can map 1 GB pages
+bool has_1gb_pages() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 26));  // Page1GB is bit 26 of EDX
+}
+
+// Check if the CPU can tag TLB entries with a process context id
+bool has_pcid() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (ecx & (1 << 17));  // PCID is bit 17 of ECX
+}
+
+// Check if the CPU has the INVPCID instruction
+bool has_invpcid() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));  // Leaf 7 needs subleaf 0
+    return (ebx & (1 << 10));  // INVPCID is bit 10 of EBX
+}
+
+// Check if the CPU has Enhanced REP MOVSB/STOSB (fast rep movsb for any alignment)
+bool has_erms() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+    return (ebx & (1 << 9));   // ERMS is bit 9 of EBX
+}
+
+// Check if the LAPIC timer can fire at a TSC value written to IA32_TSC_DEADLINE
+bool has_tsc_deadline() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (ecx & (1 << 24));  // TSC-Deadline is bit 24 of ECX
+}
+
+// Check if the CPU has XSAVE/XRSTOR and the XCR0 register
+bool has_xsave() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (ecx & (1 << 26));  // XSAVE is bit 26 of ECX
+}
+
 // Check if the CPU has an FPU
 bool has_fpu() {
     uint32_t eax, ebx, ecx, edx;
@@ -266,6 +309,8 @@ void enable_fpu_and_sse() {
 
     asm volatile ("fninit");    // Initialize the FPU
 
+    fpu_init_cpu();             // XSAVE components saved per thread, see fpu.c
+
     if(debug_on) printf(" FPU and SSE enabled\n");
 }
 
@@ -0,0 +1,295 @@
+/*
+Lazy FPU / SSE Context Switching
+
+The kernel and user programs use SSE, but an interrupt frame only holds the
+general purpose registers. Every thread therefore has an extended state area
+which is saved with XSAVEOPT (or FXSAVE when the CPU has no XSAVE) and loaded
+with XRSTOR (or FXRSTOR).
+
+Switching is lazy. schedule() sets CR0.TS when the next thread's state is not
+in the registers, and its first x87/SSE instruction raises #NM, which loads the
+state. A thread that used SIMD during its slice is saved when it is switched
+out, so it may continue on any core. Threads that never touch SIMD cost one
+CR0 read per switch. A thread that comes back to a core whose registers still
+hold its state (fpu_owner) runs on without a trap.
+
+The kernel itself is built with -msse2, so any handler may use the xmm
+registers. fpu_irq_enter() therefore saves the interrupted thread's state to
+its area before the handler runs and gives up ownership, the thread loads it
+again through #NM on its next SIMD instruction. A nested interrupt, or one that
+arrives while no thread owns the registers (early boot), saves them on the
+stack and restores them on exit instead.
+
+References:
+    https://wiki.osdev.org/SSE#Saving_the_SSE_state
+    https://www.felixcloutier.com/x86/xsaveopt
+    https://www.felixcloutier.com/x86/fxsave
+    Intel SDM Vol. 1, Chapter 13 "Managing State Using the XSAVE Feature Set"
+*/
+
+#include "../../lib/stdio.h"
+#include "../../lib/string.h"
+#include "../../lib/stdlib.h"
+#include "../../lib/spinlock.h"
+#include "../../process/thread.h"
+#include "cpuid.h"
+#include "cpu.h"
+
+#include "fpu.h"
+
+#define CR0_TS          (1 << 3)        // Task Switched, x87/SSE instructions raise #NM while set
+#define CR4_OSXSAVE     (1 << 18)       // Enables XSETBV/XGETBV and the XSAVE family
+
+extern bool debug_on;
+
+static bool use_xsave = false;          // XSAVE/XRSTOR, otherwise FXSAVE/FXRSTOR
+static bool use_xsaveopt = false;       // XSAVEOPT skips components unchanged since the last XRSTOR
+static uint64_t xcr0 = XCR0_X87 | XCR0_SSE;
+static uint32_t state_size = FPU_FXSAVE_SIZE;
+
+
+static inline uint64_t read_cr0() {
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint64_t cr0) {
+    asm volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline void cpuid_count(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(subleaf));
+}
+
+// The 64 byte aligned state inside the allocation
+static inline void *state_of(thread_t *thread) {
+    return (void *) (((uintptr_t) thread->fpu_area + FPU_ALIGN - 1) & ~(uintptr_t) (FPU_ALIGN - 1));
+}
+
+
+// XSAVEOPT only for areas last loaded by XRSTOR or fully saved before, see fpu_adopt()
+static void save_state(void *state, bool optimise) {
+    uint32_t lo = (uint32_t) xcr0;
+    uint32_t hi = (uint32_t) (xcr0 >> 32);
+
+    if (!use_xsave) {
+        asm volatile("fxsave64 (%0)" : : "r"(state) : "memory");
+    } else if (use_xsaveopt && optimise) {
+        asm volatile("xsaveopt64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+    } else {
+        asm volatile("xsave64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+    }
+}
+
+static void restore_state(void *state) {
+    uint32_t lo = (uint32_t) xcr0;
+    uint32_t hi = (uint32_t) (xcr0 >> 32);
+
+    if (use_xsave) {
+        asm volatile("xrstor64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+    } else {
+        asm volatile("fxrstor64 (%0)" : : "r"(state) : "memory");
+    }
+}
+
+
+// Set up XCR0 on this core and size the state areas, after enable_fpu_and_sse()
+void fpu_init_cpu() {
+    if (has_xsave()) {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx);
+
+        uint64_t supported = ((uint64_t) edx << 32) | eax;
+        xcr0 = supported & (XCR0_X87 | XCR0_SSE | XCR0_AVX);   // The kernel does not use the AVX-512 state
+
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_OSXSAVE));
+        asm volatile("xsetbv" : : "c"(0), "a"((uint32_t) xcr0), "d"((uint32_t) (xcr0 >> 32)));
+
+        cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx);           // EBX is the size for the XCR0 just set
+        state_size = ebx;
+
+        cpuid_count(0xD, 1, &eax, &ebx, &ecx, &edx);
+        use_xsaveopt = eax & (1 << 0);
+        use_xsave = true;
+    }
+
+    if (debug_on) printf(" FPU: %s, %d byte state, XCR0 %x\n",
+        use_xsave ? (use_xsaveopt ? "XSAVEOPT" : "XSAVE") : "FXSAVE", state_size, xcr0);
+}
+
+
+// Give thread a state area with every exception masked, it starts from the init state
+bool fpu_init_thread(thread_t *thread) {
+    if (!thread) return false;
+
+    thread->fpu_area = malloc(state_size + FPU_ALIGN);     // malloc() aligns to 16 bytes only
+    if (!thread->fpu_area) return false;
+
+    uint8_t *state = (uint8_t *) state_of(thread);
+    memset(state, 0, state_size);                           // Also a valid, empty XSAVE header
+    *(uint16_t *) (state + 0) = FPU_DEFAULT_FCW;
+    *(uint32_t *) (state + 24) = FPU_DEFAULT_MXCSR;        // Loaded by XRSTOR even for init state SSE
+
+    thread->fpu_cpu = FPU_NO_CPU;
+    return true;
+}
+
+
+// Give child a copy of parent's current state, for fork
+bool fpu_fork_thread(thread_t *parent, thread_t *child) {
+    if (!fpu_init_thread(child)) return false;
+    if (!parent || !parent->fpu_area) return true;
+
+    uint64_t flags = irq_save();
+    cpu_data_t *cpu = get_cpu_data();
+
+    if (cpu && cpu->fpu_owner == parent && !(read_cr0() & CR0_TS)) {
+        save_state(state_of(child), false);                 // Live in the registers, newer than the area
+    } else {
+        memcpy(state_of(child), state_of(parent), state_size);
+    }
+
+    irq_restore(flags);
+    return true;
+}
+
+
+// Forget thread on every core and free its state, it must not run anywhere
+void fpu_free_thread(thread_t *thread) {
+    if (!thread || !thread->fpu_area) return;
+
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        thread_t *expected = thread;
+        __atomic_compare_exchange_n(&cpu_datas[i].fpu_owner, &expected, NULL, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+
+    free(thread->fpu_area);
+    thread->fpu_area = NULL;
+}
+
+
+// The registers of this core hold thread's state from now on, used for the idle thread which
+// was running before the scheduler started here
+void fpu_adopt(thread_t *thread) {
+    uint64_t flags = irq_save();
+    cpu_data_t *cpu = get_cpu_data();
+
+    if (cpu && thread && thread->fpu_area) {
+        save_state(state_of(thread), false);       // The area matches the registers from here on
+        cpu->fpu_owner = thread;
+        thread->fpu_cpu = cpu->lapic_id;
+    }
+
+    irq_restore(flags);
+}
+
+
+// schedule() switches this core to next, interrupts are off
+void fpu_switch(thread_t *next) {
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu) return;
+
+    uint64_t cr0 = read_cr0();
+
+    // TS clear means the owner, the thread switched out, ran SIMD code in its slice or kept its
+    // state loaded. Save it, so it may continue on another core.
+    if (!(cr0 & CR0_TS) && cpu->fpu_owner && cpu->fpu_owner->fpu_area) {
+        save_state(state_of(cpu->fpu_owner), true);
+        cpu->fpu_saves++;
+    }
+
+    // Still loaded here and not used elsewhere since, then next runs without a trap
+    bool loaded = cpu->fpu_owner == next && next->fpu_cpu == cpu->lapic_id;
+
+    if (loaded && (cr0 & CR0_TS)) {
+        asm volatile("clts");
+    } else if (!loaded && !(cr0 & CR0_TS)) {
+        write_cr0(cr0 | CR0_TS);
+    }
+}
+
+
+// Interrupt entry, before the handler runs, interrupts are off.
+// Returns with CR0.TS clear so the handler may use SSE.
+void fpu_irq_enter(fpu_irq_state_t *state) {
+    state->saved = false;
+
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu) return;
+
+    bool ts = read_cr0() & CR0_TS;
+    thread_t *owner = cpu->fpu_owner;
+    state->thread = cpu->rq.current;
+
+    if (cpu->irq_depth++ == 0 && owner) {
+        // Nothing else saves a thread that keeps its state loaded, do it now
+        if (!ts && owner->fpu_area) {
+            save_state(state_of(owner), true);
+            cpu->fpu_saves++;
+        }
+        owner->fpu_cpu = FPU_NO_CPU;
+        cpu->fpu_owner = NULL;
+    } else if (!ts) {
+        asm volatile("fxsave64 (%0)" : : "r"(state->regs) : "memory");    // The outer handler's or nobody's
+        state->saved = true;
+    }
+
+    if (ts) asm volatile("clts");
+}
+
+
+// Interrupt exit, after sched_irq_exit() picked the thread the iretq returns to
+void fpu_irq_exit(fpu_irq_state_t *state) {
+    cpu_data_t *cpu = get_cpu_data();
+    if (!cpu || cpu->irq_depth == 0) return;
+
+    uint32_t depth = --cpu->irq_depth;
+
+    if (state->saved && (depth > 0 || state->thread == cpu->rq.current)) {
+        asm volatile("clts");
+        asm volatile("fxrstor64 (%0)" : : "r"(state->regs) : "memory");
+    } else if (depth == 0) {
+        write_cr0(read_cr0() | CR0_TS);         // The thread loads its state on first use
+    }
+}
+
+
+// #NM: the running thread used x87/SSE for the first time since it was switched in
+void fpu_trap(registers_t *regs) {
+    (void) regs;
+    asm volatile("clts");
+
+    cpu_data_t *cpu = get_cpu_data();
+    if (cpu && cpu->irq_depth > 0) return;          // A handler after fpu_switch(), the registers are its own
+
+    thread_t *thread = cpu && cpu->rq.idle ? cpu->rq.current : NULL;
+    if (!thread) return;                            // TS was not set by the scheduler
+
+    if (!thread->fpu_area) {
+        cpu->fpu_owner = NULL;                      // Nobody's state, saved by no one
+        return;
+    }
+
+    if (cpu->fpu_owner == thread && thread->fpu_cpu == cpu->lapic_id) return;
+
+    // The previous owner was saved when it was switched out, its registers may be overwritten
+    restore_state(state_of(thread));
+    cpu->fpu_owner = thread;
+    thread->fpu_cpu = cpu->lapic_id;
+    cpu->fpu_restores++;
+}
+
+
+void fpu_print_info() {
+    uint64_t saves = 0, restores = 0;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        saves += cpu_datas[i].fpu_saves;
+        restores += cpu_datas[i].fpu_restores;
+    }
+
+    printf(" FPU: %s, %d byte state per thread, %llu saves, %llu lazy restores\n",
+        use_xsave ? (use_xsaveopt ? "XSAVEOPT" : "XSAVE") : "FXSAVE", state_size, saves, restores);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "../../process/types.h"
+#include "../../util/util.h"
+
+#define FPU_ALIGN           64              // XSAVE needs 64 byte alignment, FXSAVE 16
+#define FPU_FXSAVE_SIZE     512             // Legacy x87 + SSE area
+#define FPU_NO_CPU          0xFFFFFFFF      // thread_t.fpu_cpu of a thread whose state is only in memory
+
+#define FPU_DEFAULT_FCW     0x037F          // All x87 exceptions masked, 64 bit precision
+#define FPU_DEFAULT_MXCSR   0x1F80          // All SSE exceptions masked, round to nearest
+
+#define XCR0_X87            (1 << 0)
+#define XCR0_SSE            (1 << 1)
+#define XCR0_AVX            (1 << 2)
+
+// Registers of the interrupted context, kept on the handler's stack by fpu_irq_enter()
+typedef struct fpu_irq_state {
+    uint8_t regs[FPU_FXSAVE_SIZE] __attribute__((aligned(16)));
+    thread_t *thread;                       // Running when the interrupt arrived
+    bool saved;                             // regs holds live state, fpu_irq_exit() loads it back
+} fpu_irq_state_t;
+
+void fpu_init_cpu();
+
+bool fpu_init_thread(thread_t *thread);
+bool fpu_fork_thread(thread_t *parent, thread_t *child);
+void fpu_free_thread(thread_t *thread);
+
+void fpu_adopt(thread_t *thread);
+void fpu_switch(thread_t *next);
+void fpu_trap(registers_t *regs);
+
+void fpu_irq_enter(fpu_irq_state_t *state);
+void fpu_irq_exit(fpu_irq_state_t *state);
+
+void fpu_print_info();
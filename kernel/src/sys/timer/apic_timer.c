@@ -1,6 +1,12 @@
 /*
 APIC TIMER:
 
+The timer runs one-shot, in TSC-deadline mode if the CPU has it. Each core
+programs it for the nearer of two deadlines: the end of the running thread's
+slice and the earliest pending sleep. A core running its idle thread has no
+slice, so it sleeps in hlt until a sleep expires or another core wakes it with
+an IPI, instead of taking an interrupt every interval.
+
 https://wiki.osdev.org/APIC_Timer
 https://github.com/dreamportdev/Osdev-Notes/blob/master/02_Architecture/08_Timers.md
 
@@ -11,6 +17,8 @@ https://github.com/dreamportdev/Osdev-Notes/blob/master/02_Architecture/08_Timer
 #include "../../process/types.h"
 #include "../../process/thread.h"
 #include "../../process/process.h"
+#include "../../process/scheduler.h"
+#include "../../process/wait_queue.h"
 
 #include "../../arch/interrupt/pic/pic.h"
 #include "../../arch/interrupt/apic/apic.h"
@@ -24,6 +32,8 @@ https://github.com/dreamportdev/Osdev-Notes/blob/master/02_Architecture/08_Timer
 
 #include "../../util/util.h"
 
+#include "../cpu/cpuid.h"                       // has_tsc_deadline
+
 #include "tsc.h"
 #include "pit_timer.h"
 
@@ -45,6 +55,9 @@ extern bool debug_on;
 
 #define APIC_LVT_TIMER_MODE_PERIODIC (1 << 17)  // Periodic mode bit
 #define APIC_LVT_TIMER_MODE_ONESHOT  (0 << 0 )  // One shot mode bit
+#define APIC_LVT_TIMER_MODE_TSC_DEADLINE (1 << 18)  // Fires when the TSC reaches IA32_TSC_DEADLINE
+
+#define IA32_TSC_DEADLINE_MSR        0x6E0      // Writing 0 disarms the timer
 #define APIC_LVT_INT_MASKED          (1 << 16)  // Mask interrupt
 
 // Divider values
@@ -58,7 +71,21 @@ extern bool debug_on;
 #define DIV_BY_1    0b111   // 0x7
  
 #define MAX_CPUS 256
-volatile uint64_t apic_ticks[MAX_CPUS] = {0};
+volatile uint64_t apic_ticks[MAX_CPUS] = {0};   // Timer interrupts taken by each core
+
+// Deadlines of one core in TSC cycles, 0 when not set. Only the owning core touches
+// them, with interrupts off.
+typedef struct {
+    bool running;               // init_apic_timer() ran on this core
+    uint64_t slice_end;         // End of the running thread's slice, 0 while idle
+    uint64_t wakeup;            // Earliest pending sleep on this core
+    uint64_t armed;             // Deadline the timer is programmed for
+} apic_timer_state_t;
+
+static apic_timer_state_t timer_state[MAX_CPUS];
+
+static bool tsc_deadline_mode = false;          // Set once on the bootstrap core, the APs use the same mode
+static uint64_t slice_cycles = 0;               // Slice length given to init_apic_timer()
 
 volatile bool apic_calibrated = false;
 volatile uint64_t apic_timer_ticks_per_ms = 0;
@@ -143,23 +170,65 @@ void apic_start_oneshot_timer(uint32_t initial_count) {
 }
 
 
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t) value), "d"((uint32_t)(value >> 32)));
+}
+
+
+// Program the timer of this core for the nearer of its deadlines, or stop it if there is none.
+// Interrupts are off.
+static void apic_timer_reprogram(apic_timer_state_t *state) {
+    uint64_t deadline = state->slice_end;
+    if (state->wakeup && (!deadline || state->wakeup < deadline)) deadline = state->wakeup;
+    if (deadline == state->armed) return;
+
+    state->armed = deadline;
+
+    if (tsc_deadline_mode) {
+        wrmsr(IA32_TSC_DEADLINE_MSR, deadline);     // A deadline already passed fires at once
+        return;
+    }
+
+    if (!deadline) {
+        apic_write(APIC_TIMER_INITCNT_REGISTER, 0);
+        return;
+    }
+
+    // Counts are 32 bit, a longer wait ends early and the handler programs the rest
+    uint64_t now = read_tsc();
+    uint64_t cycles = deadline > now ? deadline - now : 0;
+    uint64_t count = cycles * apic_timer_ticks_per_ms / (cpu_frequency_hz / 1000);
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+
+    apic_write(APIC_TIMER_INITCNT_REGISTER, (uint32_t) count);
+}
+
 
 void apic_timer_handler(registers_t *regs) {
+    (void) regs;
 
     uint32_t cpu_id = get_core_id(); // Implement this using APIC ID or CPU-local ID
+    apic_timer_state_t *state = &timer_state[cpu_id];
 
-    if(apic_ticks[cpu_id] >= MAX_APIC_TICKS) {
-        apic_ticks[cpu_id] = 0;     // Starts Recount
-    }
+    apic_ticks[cpu_id]++;
+
+    uint64_t now = read_tsc();
+    state->armed = 0;                               // One-shot, it fired
 
-    apic_ticks[cpu_id] += apic_timer_ticks_per_ms;
+    if (state->wakeup && now >= state->wakeup) {
+        state->wakeup = 0;
+        sched_wake_expired(now);                    // Arms the next sleeper's deadline
+    }
 
-    if(apic_ticks[cpu_id] % 100 == 0){
-        // printf("apic_ticks[%d]: %d\n", cpu_id, apic_ticks[cpu_id]);
-        // serial_printf("apic_ticks[%d]: %d\n", cpu_id, apic_ticks[cpu_id]);
+    if (state->slice_end && now >= state->slice_end) {
+        state->slice_end = 0;
+        sched_tick();                               // The switch happens in irq_handler() after the EOI
     }
 
     apic_send_eoi();
+
+    apic_timer_reprogram(state);                    // Early wakeups and deadlines of other sleepers
 }
 
 
@@ -179,9 +248,9 @@ void init_apic_timer(uint32_t interval_ms) {// Start APIC timer with a large cou
 
     irq_install(APIC_IRQ, (void *)&apic_timer_handler);
 
-    apic_start_oneshot_timer(0xFFFFFFFF);   // Set APIC timer to max count
-    
     if(apic_timer_ticks_per_ms == 0) {
+        apic_start_oneshot_timer(0xFFFFFFFF);   // Set APIC timer to max count
+
         // calibrate_apic_timer_tsc();      // Calibrate APIC timer using TSC
         calibrate_apic_timer_pit();         // Calibrate APIC timer using PIT
 
@@ -189,44 +258,77 @@ void init_apic_timer(uint32_t interval_ms) {// Start APIC timer with a large cou
         printf(" APIC Timer calibrated with %d ticks/ms\n", apic_timer_ticks_per_ms);
     }
 
-    uint32_t apic_count = apic_timer_ticks_per_ms * interval_ms;
-    
-    // Set APIC Timer for periodic interrupts
-    apic_write(APIC_LVT_TIMER_REGISTER, APIC_TIMER_VECTOR | APIC_LVT_TIMER_MODE_PERIODIC);  // Vector 48, Periodic Mode
-    apic_write(APIC_TIMER_DIV_REGISTER , DIV_BY_16);                                        // Set divisor by 16
-    apic_write(APIC_TIMER_INITCNT_REGISTER, apic_timer_ticks_per_ms * interval_ms);         // Set initial count for timer
+    if (slice_cycles == 0) {
+        tsc_deadline_mode = has_tsc_deadline();
+        slice_cycles = usec_to_tsc((uint64_t) interval_ms * 1000);
+    }
+
+    // Armed by the first slice or sleep of this core
+    if (tsc_deadline_mode) {
+        apic_write(APIC_LVT_TIMER_REGISTER, APIC_TIMER_VECTOR | APIC_LVT_TIMER_MODE_TSC_DEADLINE);
+        wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+    } else {
+        apic_start_oneshot_timer(0);            // Count 0 keeps it stopped
+    }
+
+    apic_timer_state_t *state = &timer_state[cpu_id];
+    state->slice_end = 0;
+    state->wakeup = 0;
+    state->armed = 0;
+    state->running = true;
 
     asm volatile("sti");
 
-    if(debug_on) printf(" APIC Timer initialized with %d ms interval in CPU: %d.\n", interval_ms, get_lapic_id());
+    if(debug_on) printf(" APIC Timer initialized with %d ms slices (%s) in CPU: %d.\n", interval_ms,
+        tsc_deadline_mode ? "TSC deadline" : "one-shot", get_lapic_id());
 }
 
 
+// Start a new slice for the thread this core switches to, or stop slicing when it goes idle.
+// Called by the scheduler with interrupts off.
+void apic_timer_set_slice(bool running) {
+    uint32_t cpu_id = get_core_id();
+    apic_timer_state_t *state = &timer_state[cpu_id];
+    if (!state->running) return;
 
-void apic_delay(uint32_t milliseconds) {  
-    uint32_t cpu_id = get_core_id(); 
+    state->slice_end = running ? read_tsc() + slice_cycles : 0;
+    apic_timer_reprogram(state);
+}
 
-    uint64_t start_ticks = apic_ticks[cpu_id];
-    uint64_t target_ticks = start_ticks +  milliseconds * apic_timer_ticks_per_ms; 
 
-    while (apic_ticks[cpu_id] < target_ticks) {
-        asm volatile("hlt");
-        printf("Inside of apic_delay: ticks = %d, start_ticks: %d, target_ticks: %d\n",
-        apic_ticks[cpu_id], start_ticks, target_ticks);
-        printf("apic_timer_ticks_per_ms: %d\n", apic_timer_ticks_per_ms);
-    }
+// Make sure this core takes an interrupt once the TSC reaches deadline. Interrupts are off.
+void apic_timer_wakeup_at(uint64_t deadline) {
+    uint32_t cpu_id = get_core_id();
+    apic_timer_state_t *state = &timer_state[cpu_id];
+    if (!state->running) return;
+
+    if (!state->wakeup || deadline < state->wakeup) state->wakeup = deadline;
+    apic_timer_reprogram(state);
 }
 
 
+// Sleep at least the given microseconds. The thread blocks until the APIC timer wakes it,
+// or halts in place where it can not block. Short sleeps spin.
+void apic_usleep(uint64_t microseconds) {
+    uint64_t deadline = read_tsc() + usec_to_tsc(microseconds);
 
-size_t get_apic_ticks() {
-    uint32_t cpu_id = get_core_id(); 
-    return apic_ticks[cpu_id];
-}
+    if (microseconds < APIC_TIMER_MIN_SLEEP_US || !timer_state[get_core_id()].running) {
+        while (read_tsc() < deadline) asm volatile("pause");
+        return;
+    }
 
+    sleep_until(deadline);
+}
 
 
+void apic_delay(uint32_t milliseconds) {  
+    apic_usleep((uint64_t) milliseconds * 1000);
+}
 
 
 
+size_t get_apic_ticks() {
+    uint32_t cpu_id = get_core_id(); 
+    return apic_ticks[cpu_id];
+}
 
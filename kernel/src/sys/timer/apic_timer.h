@@ -4,11 +4,17 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#define APIC_TIMER_MIN_SLEEP_US 20      // Shorter sleeps spin, a timer interrupt costs about as much
+
 uint8_t get_core_id();
 void calibrate_apic_timer_pit();
 void calibrate_apic_timer_tsc();
 
 void init_apic_timer(uint32_t interval_ms);
+void apic_timer_set_slice(bool running);
+void apic_timer_wakeup_at(uint64_t deadline);
+
+void apic_usleep(uint64_t microseconds);
 void apic_delay(uint32_t milliseconds);
 
 size_t get_apic_ticks();
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "../../driver/io/ports.h"
 #include "../../arch/interrupt/apic/apic.h"
 #include "../../memory/kheap.h"
+#include "../../process/workqueue.h"
 
 #include "rtc.h"
 
@@ -65,6 +66,15 @@ static void enable_rtc_irq() {
 
 
 
+// Printing takes the serial lock and is slow, a worker does it
+static void rtc_report(void *arg) {
+    (void) arg;
+    printf("RTC Tick: %u\n", rtc_ticks);
+}
+
+static work_t rtc_report_work = WORK_INIT(rtc_report, NULL);
+
+
 static void rtc_interrupt_handler() {
     // Acknowledge the interrupt
     outb(RTC_COMMAND_PORT, RTC_REG_C);
@@ -75,7 +85,7 @@ static void rtc_interrupt_handler() {
 
     // Print every 100 ticks (adjust as needed)
     if (rtc_ticks % 100 == 0) {
-        printf("RTC Tick: %u\n", rtc_ticks);
+        queue_work(&rtc_report_work);
     }
 
     apic_send_eoi();
@@ -28,12 +28,17 @@ static inline uint64_t rdmsr(uint32_t msr) {
     return ((uint64_t)high << 32) | low;
 }
 
-static uint64_t read_tsc() {
+uint64_t read_tsc() {
     uint32_t low, high;
     asm volatile ("rdtsc" : "=a"(low), "=d"(high)); // Read TSC
     return ((uint64_t)high << 32) | low;
 }
 
+// TSC cycles in the given microseconds, 0 before init_tsc()
+uint64_t usec_to_tsc(uint64_t microseconds) {
+    return microseconds * (cpu_frequency_hz / 1000000);
+}
+
 static uint64_t get_cpu_freq_msr() {
 
     uint64_t start_tsc, end_tsc;
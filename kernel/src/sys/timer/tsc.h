@@ -4,6 +4,8 @@
 
 extern uint64_t cpu_frequency_hz;
 
+uint64_t read_tsc();
+uint64_t usec_to_tsc(uint64_t microseconds);
 void tsc_sleep(uint64_t microseconds);
 
 void init_tsc();
@@ -20,13 +20,17 @@ References:
 
 #include "../process/process.h"
 #include "../process/thread.h"
+#include "../process/scheduler.h"
 
 #include "../arch/interrupt/irq_manage.h"
 #include "../util/util.h"
 #include "../driver/keyboard/ring_buffer.h"
+#include "../driver/keyboard/keyboard.h"    // keyboard_wait
 #include "../memory/kheap.h"
 #include "../memory/uheap.h"
 #include "../memory/paging.h"
+#include "../memory/detect_memory.h" // HIGHER_HALF_START_ADDR
+#include "../memory/meminfo.h"
 
 
 #include "../vfs/vfs.h"
@@ -68,7 +72,8 @@ static int copy_from_user(char *kernel_dst, const char *user_src, size_t max_len
 }
 
 
-// rax, rdi, rsi, rdx, r10, r8, r9 
+// rax store system call number
+// arguments in rdi, rsi, rdx, r10, r8, r9
 static uint64_t system_call(uint64_t rax, uint64_t rdi, uint64_t rsi, uint64_t rdx, uint64_t r10, uint64_t r8, uint64_t r9){
     
     uint64_t out;
@@ -202,11 +207,9 @@ registers_t *int_systemcall_handler(registers_t *regs) {
                 while (read_count < size - 1) {
                     uint8_t ch;
 
-                    // Wait for input in ring buffer
-                    while (is_ring_buffer_empty(keyboard_buffer)){
-                        asm volatile("sti");
-                        asm volatile("hlt");  // Sleep CPU until next interrupt
-                    }
+                    // Wait for input in ring buffer, callers from user mode halt in place
+                    asm volatile("sti");
+                    wait_event(&keyboard_wait, keyboard_has_input, NULL);
 
                     if (ring_buffer_pop(keyboard_buffer, &ch) == 0){
 
@@ -309,7 +312,9 @@ registers_t *int_systemcall_handler(registers_t *regs) {
                     regs->rax = (uint64_t)(-1); // error
                     break;
                 }
-                uint64_t ptr = (uint64_t) uheap_alloc(size, type);
+                // Big buffers are often touched sparsely, back them on first touch
+                uint64_t ptr = (size >= UHEAP_LAZY_MIN) ? (uint64_t) uheap_reserve(size, type)
+                                                        : (uint64_t) uheap_alloc(size, type);
 
                 if(!ptr) {
                     printf("Memory allocation failed!\n");
@@ -338,6 +343,60 @@ registers_t *int_systemcall_handler(registers_t *regs) {
                 break;
             }
 
+            case INT_SYSCALL_BRK: {     // 0x76 : Set the program break, 0 returns the current one
+                uint64_t brk = uheap_brk(regs->rdi);
+                regs->rax = brk ? brk : (uint64_t)(-1);
+                break;
+            }
+
+            case INT_SYSCALL_SBRK: {    // 0x77 : Move the program break, returns the old one
+                regs->rax = uheap_sbrk((int64_t) regs->rdi);
+                break;
+            }
+
+            case INT_SYSCALL_MMAP: {    // 0x78 : Map anonymous memory or a read only file
+                size_t length = regs->rdi;
+                int prot = (int) regs->rsi;
+                int flags = (int) regs->rdx;
+                int disk_no = (int) regs->r10;
+                void *fp = (void *) regs->r8;
+                uint64_t offset = regs->r9;
+
+                uint64_t addr = uheap_mmap(length, prot, flags, disk_no, fp, offset);
+                regs->rax = addr ? addr : (uint64_t)(-1);
+                break;
+            }
+
+            case INT_SYSCALL_MUNMAP: {  // 0x79 : Remove a whole mapping
+                regs->rax = (uint64_t) uheap_munmap(regs->rdi, (size_t) regs->rsi);
+                break;
+            }
+
+            case INT_SYSCALL_MEMINFO: { // 0x7A : Fill a meminfo_t
+                uint64_t user_info = regs->rdi;
+                if (!user_info || !is_user_virt_addr(user_info) ||
+                    user_info + sizeof(meminfo_t) > HIGHER_HALF_START_ADDR) {   // Must not reach kernel memory
+                    regs->rax = (uint64_t)(-1);
+                    break;
+                }
+                meminfo_t info;
+                get_meminfo(&info);
+                memcpy((void *) user_info, &info, sizeof(meminfo_t));
+                regs->rax = 0;
+                break;
+            }
+
+            case INT_SYSCALL_NICE: {    // 0x7B : Change the nice level of the calling thread
+                regs->rax = (uint64_t)(int64_t) sched_nice((int) regs->rdi);    // Returns the new level
+                break;
+            }
+
+            case INT_SYSCALL_YIELD: {   // 0x7C : Let other threads of this core run
+                sched_yield_current();
+                regs->rax = 0;
+                break;
+            }
+
             // ------------------------- Process Manage ----------------------------
             case INT_CREATE_PROCESS: {
                 const char* process_name = (const char *)regs->rdi;
@@ -393,6 +452,19 @@ registers_t *int_systemcall_handler(registers_t *regs) {
                 break;
             }
 
+            case INT_SYSCALL_FORK: {    // 0x75 : Duplicate the current process copy-on-write
+                process_t *child = fork_process(get_current_process(), regs);
+
+                if(!child){
+                    printf("Fork failed!\n");
+                    regs->rax = (uint64_t)(-1); // error
+                    break;
+                }
+
+                regs->rax = (uint64_t) child->pid;  // The child's thread resumes with rax = 0
+                break;
+            }
+
             // ------------------------- Thread Manage -----------------------------
             case INT_CREATE_THREAD: {
                 process_t *parent = (process_t *) regs->rdi;
@@ -105,16 +105,21 @@ enum int_syscall_number {
 
     INT_SYSCALL_PUTCHAR          = 113,
 
-    INT_SYSCALL_UNMOUNT = 116
+    INT_SYSCALL_UNMOUNT = 116,
+
+    INT_SYSCALL_FORK            = 117,  // 0x75
+    INT_SYSCALL_BRK             = 118,  // 0x76
+    INT_SYSCALL_SBRK            = 119,  // 0x77
+    INT_SYSCALL_MMAP            = 120,  // 0x78
+    INT_SYSCALL_MUNMAP          = 121,  // 0x79
+    INT_SYSCALL_MEMINFO         = 122,  // 0x7A
+    INT_SYSCALL_NICE            = 123,  // 0x7B
+    INT_SYSCALL_YIELD           = 124,  // 0x7C
  
 };
 
 void int_syscall_init();
 
-// rax store system call number
-// arguments in rdi, rsi, rdx, r10, r8, r9 
-static uint64_t system_call(uint64_t rax, uint64_t rdi, uint64_t rsi, uint64_t rdx, uint64_t r10, uint64_t r8, uint64_t r9);
-
 void int_syscall_test();
 
 
@@ -0,0 +1,458 @@
+/*
+Kernel Microbenchmarks
+
+Timed with the TSC. Results are printed in MB/s when the TSC frequency is known,
+otherwise in cycles per KB. Interrupts stay on, so numbers from a busy system
+are noisy; run them a few times.
+
+The allocator benchmark times every single alloc and free, so its cycle
+counts include the rdtsc pair (a few dozen cycles). Each run prints one line
+on screen and one "BENCH key=value ..." line on the serial port for scripts.
+Overhead is the growth of the allocator's footprint over the bytes asked for,
+it is only measured on one core and can go negative when the allocator
+already held free memory.
+
+    https://www.felixcloutier.com/x86/rdtsc
+*/
+
+#include "../lib/stdio.h"
+#include "../lib/stdlib.h"
+#include "../lib/string.h"
+#include "../memory/kheap.h"
+#include "../memory/uheap.h"
+#include "../memory/pmm.h"
+#include "../memory/slab.h"
+#include "../memory/vmm.h"
+#include "../memory/meminfo.h"
+#include "../arch/interrupt/apic/apic.h"
+#include "../driver/io/serial.h"
+#include "../sys/cpu/cpu.h"
+#include "../sys/timer/tsc.h"
+
+#include "bench.h"
+
+
+uint64_t bench_cycles() {
+    uint32_t low, high;
+    asm volatile("lfence\n\trdtsc" : "=a"(low), "=d"(high) : : "memory");     // lfence: earlier work is done
+    return ((uint64_t) high << 32) | low;
+}
+
+
+static uint64_t bench_iterations(size_t size) {
+    uint64_t iters = BENCH_BYTES / size;
+    return iters < 4 ? 4 : iters;
+}
+
+// Print bytes moved in cycles
+static void bench_print_rate(const char *name, uint64_t bytes, uint64_t cycles) {
+    if (cycles == 0) cycles = 1;
+    if (cpu_frequency_hz) {
+        printf(", %s %d MB/s", name, (bytes / cycles) * (cpu_frequency_hz / 1000000)
+            + ((bytes % cycles) * (cpu_frequency_hz / 1000000)) / cycles);
+    } else {
+        printf(", %s %d cycles/KB", name, (cycles * 1024) / (bytes ? bytes : 1));
+    }
+}
+
+
+// Buffer for bench_mem() in 2 MB pages, so the big copies measure memory and not TLB misses.
+// Falls back to 4 KB pages when no 2 MB block is free.
+static uint8_t *bench_buffer_alloc(bool *huge) {
+    void *buf = kheap_alloc_huge(BENCH_MAX_SIZE + 64, ALLOCATE_DATA);
+    *huge = buf != NULL;
+    if (!buf) buf = kheap_alloc(BENCH_MAX_SIZE + 64, ALLOCATE_DATA);
+    return (uint8_t *) buf;
+}
+
+static void bench_buffer_free(uint8_t *buf, bool huge) {
+    if (!buf) return;
+    if (huge) {
+        kheap_free_huge(buf, BENCH_MAX_SIZE + 64);
+    } else {
+        kheap_free(buf, BENCH_MAX_SIZE + 64);
+    }
+}
+
+
+// Compare every mem* implementation this CPU runs on buffer sizes from BENCH_MIN_SIZE to BENCH_MAX_SIZE
+void bench_mem() {
+    bool src_huge, dst_huge;
+    uint8_t *src = bench_buffer_alloc(&src_huge);
+    uint8_t *dst = bench_buffer_alloc(&dst_huge);
+    if (!src || !dst) {
+        printf("[Error] BENCH: No memory for the buffers\n");
+        bench_buffer_free(src, src_huge);
+        bench_buffer_free(dst, dst_huge);
+        return;
+    }
+
+    const mem_ops_t *ops[4];
+    int count = mem_ops_list(ops, 4);
+
+    printf(" mem* in use: %s, TSC %d Hz\n", mem_ops_active()->name, cpu_frequency_hz);
+
+    for (uint64_t i = 0; i < BENCH_MAX_SIZE + 64; i++) src[i] = (uint8_t) i;
+
+    for (size_t size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 4) {
+        uint64_t iters = bench_iterations(size);
+        uint64_t bytes = iters * size;
+
+        printf(" %d B copy", size);
+        for (int i = 0; i < count; i++) {
+            uint64_t start = bench_cycles();
+            for (uint64_t n = 0; n < iters; n++) ops[i]->copy(dst, src, size);
+            bench_print_rate(ops[i]->name, bytes, bench_cycles() - start);
+        }
+
+        printf("\n %d B set ", size);
+        for (int i = 0; i < count; i++) {
+            uint64_t start = bench_cycles();
+            for (uint64_t n = 0; n < iters; n++) ops[i]->set(dst, (int) n, size);
+            bench_print_rate(ops[i]->name, bytes, bench_cycles() - start);
+        }
+
+        printf("\n %d B cmp ", size);
+        ops[0]->copy(dst, src, size);                 // Equal buffers, every byte is compared
+        for (int i = 0; i < count; i++) {
+            uint64_t start = bench_cycles();
+            for (uint64_t n = 0; n < iters; n++) ops[i]->cmp(dst, src, size);
+            bench_print_rate(ops[i]->name, bytes, bench_cycles() - start);
+        }
+
+        // Overlapping, dest after src: the backward path
+        uint64_t start = bench_cycles();
+        for (uint64_t n = 0; n < iters; n++) memmove(dst + 8, dst, size);
+        printf("\n %d B move", size);
+        bench_print_rate("overlap", bytes, bench_cycles() - start);
+        printf("\n");
+    }
+
+    bench_buffer_free(src, src_huge);
+    bench_buffer_free(dst, dst_huge);
+}
+
+
+// One allocator under test, footprint() is the memory it holds in bytes
+typedef struct bench_allocator {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*free)(void *ptr, size_t size);
+    uint64_t (*footprint)();
+    size_t fixed_size;          // Size of the fixed size patterns
+    size_t max_size;            // Random sizes are BENCH_MIN_SIZE to max_size
+    bool smp;                   // Safe to call from several cores at once
+} bench_allocator_t;
+
+typedef enum {
+    BENCH_FIXED_LIFO,           // Fixed size, freed newest first
+    BENCH_FIXED_FIFO,           // Fixed size, freed oldest first
+    BENCH_RANDOM,               // Random sizes, freed in random order
+} bench_pattern_t;
+
+static const char *bench_pattern_names[] = {"fixed-lifo", "fixed-fifo", "random"};
+
+// Start barrier of a multi-core run
+typedef struct bench_group {
+    uint32_t workers;
+    uint32_t ready;
+    uint32_t done;
+} bench_group_t;
+
+// State of one core's run, the arrays hold BENCH_ALLOC_OPS entries
+typedef struct bench_run {
+    const bench_allocator_t *allocator;
+    bench_pattern_t pattern;
+    uint64_t seed;
+    bench_group_t *group;
+    void **ptrs;
+    uint64_t *sizes;
+    uint64_t *alloc_cycles;
+    uint64_t *free_cycles;
+    uint64_t alloc_total;       // Cycles of all allocations
+    uint64_t free_total;        // Cycles of all frees
+    uint64_t requested;         // Bytes asked for
+    uint64_t footprint_before;
+    uint64_t footprint_peak;    // Footprint with every block allocated
+    uint64_t failed;            // Allocations which returned NULL
+} bench_run_t;
+
+
+static void *bench_malloc(size_t size) {
+    return malloc(size);
+}
+
+static void bench_malloc_free(void *ptr, size_t size) {
+    (void) size;
+    free(ptr);
+}
+
+static uint64_t bench_malloc_footprint() {
+    uint64_t in_use, footprint;
+    slab_get_usage(&in_use, &footprint);
+    return footprint;
+}
+
+static void *bench_kheap_alloc(size_t size) {
+    return kheap_alloc(size, ALLOCATE_DATA);
+}
+
+static uint64_t bench_kheap_footprint() {
+    return mem_counter(MEM_KHEAP) + mem_counter(MEM_PAGE_TABLES);
+}
+
+static void *bench_uheap_alloc(size_t size) {
+    return uheap_alloc(size, ALLOCATE_DATA);
+}
+
+static uint64_t bench_uheap_footprint() {
+    return mem_counter(MEM_UHEAP) + mem_counter(MEM_PAGE_TABLES);
+}
+
+// PMM blocks are never touched, the "pointer" is the physical address.
+// The footprint is what the blocks handed out hold after rounding to 2^order frames.
+static uint64_t bench_pmm_bytes = 0;
+
+static uint8_t bench_pmm_order(size_t size) {
+    uint8_t order = 0;
+    while (((uint64_t) FRAME_SIZE << order) < size && order < PMM_MAX_ORDER) order++;
+    return order;
+}
+
+static void *bench_pmm_alloc(size_t size) {
+    uint8_t order = bench_pmm_order(size);
+    uint64_t phys;
+
+    if (order == 0) {
+        int64_t bit_no = pmm_alloc_frame();
+        phys = bit_no < 0 ? 0 : BIT_NO_TO_ADDR(bit_no);
+    } else {
+        phys = pmm_alloc_pages(order);
+    }
+    if (phys) __atomic_add_fetch(&bench_pmm_bytes, (uint64_t) FRAME_SIZE << order, __ATOMIC_RELAXED);
+
+    return (void *) phys;
+}
+
+static void bench_pmm_free(void *ptr, size_t size) {
+    uint8_t order = bench_pmm_order(size);
+
+    if (order == 0) pmm_free_frame(PHYS_ADDR_TO_BIT_NO(ptr));
+    else pmm_free_pages((uint64_t) ptr, order);
+    __atomic_sub_fetch(&bench_pmm_bytes, (uint64_t) FRAME_SIZE << order, __ATOMIC_RELAXED);
+}
+
+static uint64_t bench_pmm_footprint() {
+    return __atomic_load_n(&bench_pmm_bytes, __ATOMIC_RELAXED);
+}
+
+static const bench_allocator_t bench_allocators[] = {
+    {"malloc", bench_malloc,      bench_malloc_free, bench_malloc_footprint, 64,         2048,        true},
+    {"kheap",  bench_kheap_alloc, kheap_free,        bench_kheap_footprint,  FRAME_SIZE, 64 * 1024,   true},
+    {"uheap",  bench_uheap_alloc, uheap_free,        bench_uheap_footprint,  FRAME_SIZE, 64 * 1024,   false},    // Heap of the current address space
+    {"pmm",    bench_pmm_alloc,   bench_pmm_free,    bench_pmm_footprint,    FRAME_SIZE, 64 * 1024,   true},
+};
+
+
+// xorshift64, every core gets its own state
+static uint64_t bench_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static int bench_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+
+// Allocate BENCH_ALLOC_OPS blocks, then free them all, timing every call
+static void bench_alloc_run(bench_run_t *run) {
+    const bench_allocator_t *allocator = run->allocator;
+    uint64_t state = run->seed;
+
+    run->requested = 0;
+    run->failed = 0;
+    for (int i = 0; i < BENCH_ALLOC_OPS; i++) {
+        run->sizes[i] = run->pattern == BENCH_RANDOM
+            ? BENCH_MIN_SIZE + bench_random(&state) % (allocator->max_size - BENCH_MIN_SIZE + 1)
+            : allocator->fixed_size;
+        run->requested += run->sizes[i];
+    }
+
+    run->footprint_before = allocator->footprint();
+
+    uint64_t start = bench_cycles();
+    for (int i = 0; i < BENCH_ALLOC_OPS; i++) {
+        uint64_t t = bench_cycles();
+        run->ptrs[i] = allocator->alloc(run->sizes[i]);
+        run->alloc_cycles[i] = bench_cycles() - t;
+        if (!run->ptrs[i]) run->failed++;
+    }
+    run->alloc_total = bench_cycles() - start;
+
+    run->footprint_peak = allocator->footprint();
+
+    // Put the blocks into free order, then free from the front
+    for (int i = 0; i < BENCH_ALLOC_OPS / 2 && run->pattern == BENCH_FIXED_LIFO; i++) {
+        int j = BENCH_ALLOC_OPS - 1 - i;
+        void *ptr = run->ptrs[i]; run->ptrs[i] = run->ptrs[j]; run->ptrs[j] = ptr;
+        uint64_t size = run->sizes[i]; run->sizes[i] = run->sizes[j]; run->sizes[j] = size;
+    }
+    for (int i = BENCH_ALLOC_OPS - 1; i > 0 && run->pattern == BENCH_RANDOM; i--) {
+        int j = bench_random(&state) % (i + 1);
+        void *ptr = run->ptrs[i]; run->ptrs[i] = run->ptrs[j]; run->ptrs[j] = ptr;
+        uint64_t size = run->sizes[i]; run->sizes[i] = run->sizes[j]; run->sizes[j] = size;
+    }
+
+    start = bench_cycles();
+    for (int i = 0; i < BENCH_ALLOC_OPS; i++) {
+        uint64_t t = bench_cycles();
+        if (run->ptrs[i]) allocator->free(run->ptrs[i], run->sizes[i]);
+        run->free_cycles[i] = bench_cycles() - t;
+    }
+    run->free_total = bench_cycles() - start;
+}
+
+
+// Entry of every core in a multi-core run, also handed to the APs through cpu_run_idle()
+static void bench_alloc_worker(void *arg) {
+    bench_run_t *run = (bench_run_t *) arg;
+    bench_group_t *group = run->group;
+
+    __atomic_add_fetch(&group->ready, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&group->ready, __ATOMIC_ACQUIRE) < __atomic_load_n(&group->workers, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+
+    bench_alloc_run(run);
+
+    __atomic_add_fetch(&group->done, 1, __ATOMIC_ACQ_REL);
+}
+
+
+// Operations per second of ops calls taking cycles, 0 while the TSC frequency is unknown
+static uint64_t bench_ops_per_sec(uint64_t ops, uint64_t cycles) {
+    if (!cpu_frequency_hz) return 0;
+    return ops * cpu_frequency_hz / (cycles ? cycles : 1);
+}
+
+
+// Print the result of runs[0..cpus), the sample arrays of all runs are back to back
+static void bench_alloc_report(bench_run_t *runs, uint64_t cpus) {
+    const bench_allocator_t *allocator = runs[0].allocator;
+    uint64_t samples = cpus * BENCH_ALLOC_OPS;
+    uint64_t alloc_ops_s = 0, free_ops_s = 0, failed = 0;
+
+    for (uint64_t i = 0; i < cpus; i++) {
+        alloc_ops_s += bench_ops_per_sec(BENCH_ALLOC_OPS, runs[i].alloc_total);
+        free_ops_s += bench_ops_per_sec(BENCH_ALLOC_OPS, runs[i].free_total);
+        failed += runs[i].failed;
+    }
+
+    qsort(runs[0].alloc_cycles, samples, sizeof(uint64_t), bench_compare_u64);
+    qsort(runs[0].free_cycles, samples, sizeof(uint64_t), bench_compare_u64);
+    uint64_t alloc_p50 = runs[0].alloc_cycles[samples / 2], alloc_p99 = runs[0].alloc_cycles[samples * 99 / 100];
+    uint64_t free_p50 = runs[0].free_cycles[samples / 2], free_p99 = runs[0].free_cycles[samples * 99 / 100];
+
+    int64_t overhead = -1;
+    if (cpus == 1 && runs[0].requested) {
+        int64_t grown = (int64_t) (runs[0].footprint_peak - runs[0].footprint_before);
+        overhead = (grown - (int64_t) runs[0].requested) * 100 / (int64_t) runs[0].requested;
+    }
+
+    size_t size = runs[0].pattern == BENCH_RANDOM ? allocator->max_size : allocator->fixed_size;
+    printf(" %s %s %d B x%d: alloc %d/s p50 %d p99 %d, free %d/s p50 %d p99 %d",
+        allocator->name, bench_pattern_names[runs[0].pattern], size, cpus,
+        alloc_ops_s, alloc_p50, alloc_p99, free_ops_s, free_p50, free_p99);
+    if (cpus == 1) printf(", overhead %d%%", (int) overhead);
+    if (failed) printf(", %d failed", failed);
+    printf("\n");
+
+    serial_printf("BENCH alloc=%s pattern=%s size=%lu cpus=%lu ops=%lu failed=%lu "
+        "alloc_ops_s=%lu alloc_p50=%lu alloc_p99=%lu free_ops_s=%lu free_p50=%lu free_p99=%lu overhead_pct=%ld\n",
+        allocator->name, bench_pattern_names[runs[0].pattern], (uint64_t) size, cpus, samples, failed,
+        alloc_ops_s, alloc_p50, alloc_p99, free_ops_s, free_p50, free_p99, overhead);
+}
+
+
+// Run every pattern of every allocator on this core, then the fixed LIFO pattern
+// on all online cores at once for the allocators which allow it
+void bench_alloc() {
+    uint64_t online = 0;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (cpu_datas[i].is_online) online++;
+    }
+    if (online == 0) online = 1;
+
+    uint64_t array_size = online * BENCH_ALLOC_OPS * sizeof(uint64_t);
+    uint64_t runs_size = online * sizeof(bench_run_t);
+    void **ptrs = (void **) kheap_alloc(array_size, ALLOCATE_DATA);
+    uint64_t *sizes = (uint64_t *) kheap_alloc(array_size, ALLOCATE_DATA);
+    uint64_t *alloc_cycles = (uint64_t *) kheap_alloc(array_size, ALLOCATE_DATA);
+    uint64_t *free_cycles = (uint64_t *) kheap_alloc(array_size, ALLOCATE_DATA);
+    bench_run_t *runs = (bench_run_t *) kheap_alloc(runs_size, ALLOCATE_DATA);
+    if (!ptrs || !sizes || !alloc_cycles || !free_cycles || !runs) {
+        printf("[Error] BENCH: No memory for the samples\n");
+        goto out;
+    }
+
+    printf(" %d ops per run, %d CPUs online, TSC %d Hz, latencies in cycles\n", BENCH_ALLOC_OPS, online, cpu_frequency_hz);
+
+    int count = sizeof(bench_allocators) / sizeof(bench_allocators[0]);
+    for (int a = 0; a < count; a++) {
+        const bench_allocator_t *allocator = &bench_allocators[a];
+
+        for (int p = BENCH_FIXED_LIFO; p <= BENCH_RANDOM; p++) {
+            runs[0] = (bench_run_t) {
+                .allocator = allocator, .pattern = (bench_pattern_t) p, .seed = 0x9E3779B97F4A7C15ULL,
+                .ptrs = ptrs, .sizes = sizes, .alloc_cycles = alloc_cycles, .free_cycles = free_cycles,
+            };
+            bench_alloc_run(&runs[0]);
+            bench_alloc_report(runs, 1);
+        }
+
+        if (!allocator->smp || online < 2) continue;
+
+        // Every core gets its slice of the sample arrays, the APs pick up their
+        // work on their next interrupt and wait at the start barrier
+        bench_group_t group = {.workers = UINT32_MAX, .ready = 0, .done = 0};
+        uint32_t self = get_lapic_id();
+        uint64_t workers = 0;
+        for (uint32_t id = 0; id < MAX_CPUS; id++) {
+            if (!cpu_datas[id].is_online) continue;
+
+            // runs[0] is this core's, it joins the barrier last
+            bench_run_t *run;
+            if (id == self) run = &runs[0];
+            else if (workers + 1 < online) run = &runs[workers + 1];
+            else continue;
+
+            uint64_t base = (run - runs) * BENCH_ALLOC_OPS;
+            *run = (bench_run_t) {
+                .allocator = allocator, .pattern = BENCH_FIXED_LIFO, .seed = 0x9E3779B97F4A7C15ULL + id, .group = &group,
+                .ptrs = ptrs + base, .sizes = sizes + base, .alloc_cycles = alloc_cycles + base, .free_cycles = free_cycles + base,
+            };
+            if (id != self && cpu_run_idle(id, bench_alloc_worker, run)) workers++;
+        }
+        workers++;                                      // This core
+
+        __atomic_store_n(&group.workers, (uint32_t) workers, __ATOMIC_RELEASE);
+        bench_alloc_worker(&runs[0]);
+        while (__atomic_load_n(&group.done, __ATOMIC_ACQUIRE) < workers) {
+            asm volatile("pause");
+        }
+
+        bench_alloc_report(runs, workers);
+    }
+
+out:
+    if (ptrs) kheap_free(ptrs, array_size);
+    if (sizes) kheap_free(sizes, array_size);
+    if (alloc_cycles) kheap_free(alloc_cycles, array_size);
+    if (free_cycles) kheap_free(free_cycles, array_size);
+    if (runs) kheap_free(runs, runs_size);
+}
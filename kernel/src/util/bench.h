@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BENCH_MIN_SIZE      16                  // Smallest buffer size measured
+#define BENCH_MAX_SIZE      (4 * 1024 * 1024)   // Largest buffer size measured, 4 MB
+#define BENCH_BYTES         (16 * 1024 * 1024)  // Bytes moved per measurement, sets the iteration count
+
+#define BENCH_ALLOC_OPS     512                 // Allocations per allocator run, every one is timed
+
+uint64_t bench_cycles();
+
+void bench_mem();       // memcpy, memset, memcmp and memmove throughput of every implementation
+void bench_alloc();     // malloc, kheap, uheap and PMM throughput, latency and overhead
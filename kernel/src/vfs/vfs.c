@@ -625,6 +625,27 @@ int vfs_get_fsize(int disk_no, void *fp) {
 
 
 
+// Read size bytes at offset without moving the file position, returns the bytes read or -1
+int vfs_pread(int disk_no, void *fp, uint32_t offset, char *buff, int size){
+    if(!fp || !buff || size <= 0 || disk_no >= disk_count || !disks) return -1;
+    Disk disk = disks[disk_no];
+    switch(disk.type){
+        case DISK_TYPE_SATAPI:
+            return iso9660_read_at(fp, offset, buff, size);
+            break;
+        case DISK_TYPE_AHCI_SATA:
+            FAT32_FILE file = *(FAT32_FILE *)fp;       // Own position, the caller's stays untouched
+            uint32_t br;
+            if(!f_lseek(&file, offset)) return -1;
+            return f_read(&file, buff, size, &br) ? (int) br : -1;
+            break;
+        default:
+            printf("VFS: Unsupported disk type %d for pread on disk %d\n", disk.type, disk_no);
+            return -1;
+    }
+}
+
+
 const char* vfs_error_string(int result){
 
     switch(result){
@@ -98,6 +98,7 @@ int vfs_forward(int disk_no);
 int vfs_expand(int disk_no);
 
 int vfs_get_fsize(int disk_no, void *fp);
+int vfs_pread(int disk_no, void *fp, uint32_t offset, char *buff, int size);
 
 uint64_t vfs_listdir(int disk_no, char *path);
 
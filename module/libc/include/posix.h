@@ -149,8 +149,9 @@ int getppid();
 
 
 // Memory Management
-int sbrk(intptr_t increment);   // Increases or decreases the data segment (heap).
-int mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset); // Maps file or anonymous memory to process space.
+int brk(void *addr);            // Sets the end of the data segment (heap).
+void *sbrk(intptr_t increment); // Increases or decreases the data segment (heap).
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset); // Maps file or anonymous memory to process space.
 int munmap(void *addr, size_t length); // Unmaps memory allocated via mmap.
 
 
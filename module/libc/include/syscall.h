@@ -115,7 +115,16 @@ enum int_syscall_number {
     INT_SYSCALL_PUTCHAR          = 113,
     INT_SYSCALL_CLEARING_PARTITION_TABLE = 114,
     INT_SYSCALL_UPDATE_PARTITION_MAPPING = 115,
-    INT_SYSCALL_UNMOUNT = 116
+    INT_SYSCALL_UNMOUNT = 116,
+
+    INT_SYSCALL_FORK            = 117,  // 0x75
+    INT_SYSCALL_BRK             = 118,  // 0x76
+    INT_SYSCALL_SBRK            = 119,  // 0x77
+    INT_SYSCALL_MMAP            = 120,  // 0x78
+    INT_SYSCALL_MUNMAP          = 121,  // 0x79
+    INT_SYSCALL_MEMINFO         = 122,  // 0x7A
+    INT_SYSCALL_NICE            = 123,  // 0x7B
+    INT_SYSCALL_YIELD           = 124   // 0x7C
 
 };
 
@@ -158,6 +167,34 @@ enum allocation_type {
     ALLOCATE_STACK = 0x3,  // Allocate for stack
 };
 
+// syscall_mmap() protection and flags
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2             // Anonymous mappings only, file mappings are read only
+#define PROT_EXEC       0x4
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_ANONYMOUS   0x20
+#define MAP_FAILED      ((void *) -1)
+
+// Filled by syscall_meminfo(), all sizes in bytes
+typedef struct meminfo {
+    uint64_t total;             // Usable physical memory
+    uint64_t used;
+    uint64_t free;
+    uint64_t kheap;             // Kernel heap pages
+    uint64_t kheap_reserved;    // Demand paged kernel heap, virtual size
+    uint64_t uheap;             // User heap pages of all processes
+    uint64_t uheap_reserved;    // Demand paged user memory (brk, mmap), virtual size
+    uint64_t malloc;            // In use by the kernel malloc()
+    uint64_t malloc_footprint;  // Pages behind the kernel malloc()
+    uint64_t kmalloc;
+    uint64_t page_tables;
+    uint64_t fs_cache;
+    uint64_t dma;
+    uint64_t resident;          // Resident memory of the calling process
+} meminfo_t;
+
 int syscall_keyboard_read(uint8_t *buffer, size_t size);
 int syscall_putc(char c);
 int syscall_print(const char *msg, int len);
@@ -166,6 +203,11 @@ int syscall_print_rax();
 
 uint64_t syscall_uheap_alloc(size_t size, enum allocation_type type);
 uint64_t syscall_uheap_free(void *ptr, size_t size);
+void *syscall_brk(void *addr);
+void *syscall_sbrk(intptr_t increment);
+void *syscall_mmap(size_t length, int prot, int flags, int disk_no, void *file, uint64_t offset);
+int syscall_munmap(void *addr, size_t length);
+int syscall_meminfo(meminfo_t *info);
 
 #if FF_MULTI_PARTITION
 uint64_t syscall_fdisk(int disk_no, void *ptbl, void* work);
@@ -204,6 +246,9 @@ void *syscall_create_process(char* process_name);
 int syscall_delete_process(void *process);
 void *syscall_get_process_from_pid(size_t pid);
 void *syscall_get_current_process();
+int syscall_fork();
+int syscall_nice(int increment);
+int syscall_yield();
 
 // Thread Manage
 void *syscall_create_thread(void* parent, const char* thread_name, void (*function)(void*), void* arg);
@@ -68,7 +68,7 @@ int rmdir(const char *pathname){
 
 // Creates a new process by duplicating the current process.
 int fork(){
-
+    return syscall_fork();      // Pages are shared copy-on-write by the kernel
 }
 
 // Replaces the current process image with a new one.
@@ -99,19 +99,26 @@ int getppid(){
 
 
 // ---------------------------------------Memory Management-------------------------//
-// Increases or decreases the data segment (heap).
-int sbrk(intptr_t increment){
-
+// Sets the end of the data segment (heap).
+int brk(void *addr){
+    return (syscall_brk(addr) == addr) ? 0 : -1;
 }
 
-// Maps file or anonymous memory to process space.
-int mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset){
+// Increases or decreases the data segment (heap), returns the old end.
+void *sbrk(intptr_t increment){
+    return syscall_sbrk(increment);
+}
 
+// Maps file or anonymous memory to process space. addr is only a hint and not used.
+// There are no file descriptors yet, files are mapped with syscall_mmap() and their VFS handle.
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset){
+    if(!(flags & MAP_ANONYMOUS) || fd != -1) return MAP_FAILED;
+    return syscall_mmap(length, prot, flags, 0, NULL, offset);
 }
 
 // Unmaps memory allocated via mmap.
 int munmap(void *addr, size_t length){
-
+    return syscall_munmap(addr, length);
 }
 
 
@@ -1,4 +1,5 @@
 #include "../include/stdlib.h"
+#include "../include/string.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -11,6 +12,7 @@ enum allocation_type {
 // External syscalls for user heap
 extern uint64_t syscall_uheap_alloc(size_t size, enum allocation_type type);
 extern uint64_t syscall_uheap_free(void *ptr, size_t size);
+extern void *syscall_sbrk(intptr_t increment);
 
 /* ---------- Basic absolute values ---------- */
 int abs(int value) {
@@ -118,26 +120,246 @@ long atol(const char *str) {
 }
 
 /* ---------- Memory management ---------- */
+// Every block starts with a header holding its size and the size of the block below it,
+// so free() knows how big a block is and can merge it with free neighbours. Free blocks
+// wait in size class bins: one per 16 bytes below 1 KB, then one per power of two.
+// The heap grows through sbrk() in HEAP_GROW_MIN steps, so small allocations stay in
+// user space. Only requests of DIRECT_ALLOC_MIN and more go to the kernel heap.
+
+#define ALLOC_ALIGN         16
+#define HEAP_GROW_MIN       0x20000         // 128 KB per sbrk()
+#define HEAP_TRIM_MIN       0x40000         // Free space on top of the heap given back to the kernel
+#define DIRECT_ALLOC_MIN    0x40000         // 256 KB, bigger blocks get their own kernel allocation
+
+#define SMALL_BINS          64              // Exact 16 byte classes below 1 KB
+#define LARGE_BINS          54              // 2^10 up to 2^63
+#define NUM_BINS            (SMALL_BINS + LARGE_BINS)
+
+#define BLOCK_USED          0x1
+#define BLOCK_DIRECT        0x2             // Own syscall_uheap_alloc() allocation
+#define BLOCK_FLAGS         0xF
+
+typedef struct block {
+    size_t prev_size;                       // Size of the block below, 0 for the first one
+    size_t size;                            // Whole block with header, low bits hold flags
+    struct block *next;                     // Bin links, only while the block is free
+    struct block *prev;
+} block_t;
+
+#define HEADER_SIZE         (2 * sizeof(size_t))
+#define MIN_BLOCK           sizeof(block_t)
+
+static block_t *bins[NUM_BINS];
+static uint64_t bin_map[(NUM_BINS + 63) / 64];      // Bit set for every non empty bin
+static char *heap_end = NULL;                       // End of the last sbrk() segment
+
+static inline size_t block_size(block_t *b) {
+    return b->size & ~(size_t) BLOCK_FLAGS;
+}
+
+static inline block_t *next_block(block_t *b) {
+    return (block_t *) ((char *) b + block_size(b));
+}
+
+static inline block_t *prev_block(block_t *b) {
+    return (block_t *) ((char *) b - b->prev_size);
+}
+
+static inline void *block_payload(block_t *b) {
+    return (char *) b + HEADER_SIZE;
+}
+
+static inline block_t *payload_block(void *ptr) {
+    return (block_t *) ((char *) ptr - HEADER_SIZE);
+}
+
+static int bin_index(size_t size) {
+    if (size < SMALL_BINS * ALLOC_ALIGN) return size / ALLOC_ALIGN;
+
+    int log = 0;
+    while ((size >> log) > 1) log++;
+    return SMALL_BINS + log - 10;
+}
+
+static void bin_insert(block_t *b) {
+    int i = bin_index(block_size(b));
+    b->prev = NULL;
+    b->next = bins[i];
+    if (bins[i]) bins[i]->prev = b;
+    bins[i] = b;
+    bin_map[i / 64] |= 1ULL << (i % 64);
+}
+
+static void bin_remove(block_t *b) {
+    int i = bin_index(block_size(b));
+    if (b->prev) b->prev->next = b->next;
+    else bins[i] = b->next;
+    if (b->next) b->next->prev = b->prev;
+    if (!bins[i]) bin_map[i / 64] &= ~(1ULL << (i % 64));
+}
+
+// Smallest class first. Small bins hold one size only, so their first block always fits.
+static block_t *bin_take(size_t size) {
+    for (int i = bin_index(size); i < NUM_BINS; i++) {
+        if (!(bin_map[i / 64] & (1ULL << (i % 64)))) {
+            if (!(bin_map[i / 64] >> (i % 64))) i |= 63;      // Rest of this word is empty
+            continue;
+        }
+        for (block_t *b = bins[i]; b; b = b->next) {
+            if (block_size(b) >= size) {
+                bin_remove(b);
+                return b;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Cut b down to size, the rest becomes a free block of its own
+static void split_block(block_t *b, size_t size) {
+    size_t rest = block_size(b) - size;
+    if (rest < MIN_BLOCK) return;
+
+    b->size = size | (b->size & BLOCK_FLAGS);
+
+    block_t *r = next_block(b);
+    r->prev_size = size;
+    r->size = rest;
+    next_block(r)->prev_size = rest;
+
+    // The block above may be free too
+    block_t *above = next_block(r);
+    if (!(above->size & BLOCK_USED)) {
+        bin_remove(above);
+        r->size += block_size(above);
+        next_block(r)->prev_size = block_size(r);
+    }
+    bin_insert(r);
+}
+
+// Merge free b with free neighbours, which leave their bins
+static block_t *merge_block(block_t *b) {
+    block_t *next = next_block(b);
+    if (!(next->size & BLOCK_USED)) {
+        bin_remove(next);
+        b->size += block_size(next);
+    }
+
+    if (b->prev_size) {
+        block_t *prev = prev_block(b);
+        if (!(prev->size & BLOCK_USED)) {
+            bin_remove(prev);
+            prev->size += block_size(b);
+            b = prev;
+        }
+    }
+
+    next_block(b)->prev_size = block_size(b);
+    return b;
+}
+
+// Give most of a free block on top of the heap back through sbrk()
+static block_t *trim_heap(block_t *b) {
+    block_t *end = next_block(b);
+    if ((char *) end + HEADER_SIZE != heap_end || block_size(b) < HEAP_TRIM_MIN + HEAP_GROW_MIN) return b;
+    if (syscall_sbrk(0) != heap_end) return b;      // Someone else moved the break
+
+    size_t release = (block_size(b) - HEAP_GROW_MIN) & ~(size_t) 0xFFF;
+    if (syscall_sbrk(-(intptr_t) release) == (void *) -1) return b;
+
+    heap_end -= release;
+    b->size -= release;
+
+    end = next_block(b);
+    end->prev_size = block_size(b);
+    end->size = HEADER_SIZE | BLOCK_USED;
+    return b;
+}
+
+// Add at least size bytes of free space. A segment ends with a header only block
+// marked used, so merging never runs past it.
+static int grow_heap(size_t size) {
+    // Room for the end block and for aligning a new segment
+    size_t grow = (size + 2 * HEADER_SIZE + ALLOC_ALIGN + HEAP_GROW_MIN - 1) & ~(size_t) (HEAP_GROW_MIN - 1);
+
+    char *mem = syscall_sbrk((intptr_t) grow);
+    if (mem == (void *) -1 || mem == NULL) return -1;
+
+    block_t *b;
+    if (heap_end && mem == heap_end) {
+        b = (block_t *) (heap_end - HEADER_SIZE);      // The old end block becomes the header
+        b->size = grow;
+    } else {
+        b = (block_t *) (((uintptr_t) mem + ALLOC_ALIGN - 1) & ~(uintptr_t) (ALLOC_ALIGN - 1));
+        b->prev_size = 0;
+        b->size = ((uintptr_t) (mem + grow - HEADER_SIZE) & ~(uintptr_t) (ALLOC_ALIGN - 1)) - (uintptr_t) b;
+    }
+
+    block_t *end = next_block(b);
+    end->prev_size = block_size(b);
+    end->size = HEADER_SIZE | BLOCK_USED;
+    heap_end = (char *) end + HEADER_SIZE;
+
+    bin_insert(merge_block(b));
+    return 0;
+}
+
+// Block size for a request of size bytes, 0 when it overflows
+static size_t request_size(size_t size) {
+    if (size > SIZE_MAX - HEADER_SIZE - ALLOC_ALIGN) return 0;
+    size = (size + HEADER_SIZE + ALLOC_ALIGN - 1) & ~(size_t) (ALLOC_ALIGN - 1);
+    return (size < MIN_BLOCK) ? MIN_BLOCK : size;
+}
+
 void *malloc(size_t size) {
     if (size == 0) return NULL;
-    return (void*)syscall_uheap_alloc(size, ALLOCATE_DATA);
+
+    size_t need = request_size(size);
+    if (need == 0) return NULL;
+
+    if (need >= DIRECT_ALLOC_MIN) {
+        uint64_t mem = syscall_uheap_alloc(need, ALLOCATE_DATA);
+        if (mem == 0 || mem == (uint64_t) -1) return NULL;
+
+        block_t *b = (block_t *) mem;
+        b->prev_size = 0;
+        b->size = need | BLOCK_USED | BLOCK_DIRECT;
+        return block_payload(b);
+    }
+
+    block_t *b = bin_take(need);
+    if (!b) {
+        if (grow_heap(need) != 0) return NULL;
+        b = bin_take(need);
+        if (!b) return NULL;
+    }
+
+    split_block(b, need);
+    b->size |= BLOCK_USED;
+    return block_payload(b);
 }
 
 void free(void *ptr) {
     if (ptr == NULL) return;
-    // In your syscall, size may be required; store metadata or ignore
-    syscall_uheap_free(ptr, 0);
+
+    block_t *b = payload_block(ptr);
+    if (!(b->size & BLOCK_USED)) return;            // Double free
+
+    if (b->size & BLOCK_DIRECT) {
+        syscall_uheap_free(b, block_size(b));
+        return;
+    }
+
+    b->size &= ~(size_t) BLOCK_USED;
+    bin_insert(trim_heap(merge_block(b)));
 }
 
 void *calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > SIZE_MAX / size) return NULL;
+
     size_t total = nmemb * size;
     void *ptr = malloc(total);
-    if (ptr) {
-        unsigned char *p = (unsigned char*)ptr;
-        for (size_t i = 0; i < total; i++) {
-            p[i] = 0;
-        }
-    }
+    if (ptr) memset(ptr, 0, total);
     return ptr;
 }
 
@@ -150,20 +372,33 @@ void *realloc(void *ptr, size_t size) {
         return NULL;
     }
 
-    // Simple strategy: allocate new, copy old, free old
-    // For real impl: store size in metadata
-    void *newptr = malloc(size);
-    if (!newptr) return NULL;
+    size_t need = request_size(size);
+    if (need == 0) return NULL;
+
+    block_t *b = payload_block(ptr);
+    size_t old_size = block_size(b);
 
-    // copy min(old_size, size) — here we don't know old size, so assume size
-    // Better: implement heap metadata in your kernel syscall layer
-    // For now: blind copy
-    unsigned char *dst = newptr;
-    unsigned char *src = ptr;
-    for (size_t i = 0; i < size; i++) {
-        dst[i] = src[i];
+    if (need <= old_size) {
+        if (!(b->size & BLOCK_DIRECT)) split_block(b, need);
+        return ptr;
     }
 
+    // Grow in place into a free block above
+    if (!(b->size & BLOCK_DIRECT)) {
+        block_t *next = next_block(b);
+        if (!(next->size & BLOCK_USED) && old_size + block_size(next) >= need) {
+            bin_remove(next);
+            b->size += block_size(next);
+            next_block(b)->prev_size = block_size(b);
+            split_block(b, need);
+            return ptr;
+        }
+    }
+
+    void *newptr = malloc(size);
+    if (!newptr) return NULL;
+
+    memcpy(newptr, ptr, old_size - HEADER_SIZE);    // Only what the old block holds
     free(ptr);
     return newptr;
 }
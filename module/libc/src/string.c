@@ -2,72 +2,307 @@
 #include "../include/syscall.h"
 
 
-// Copy dat of src into dest
-void *memcpy(void *dest, const void *src, size_t n) {
-    uint64_t *pdest64 = (uint64_t *) dest;
-    const uint64_t *psrc64 = (const uint64_t *) src;
+// memcpy(), memset() and memcmp() run one of the implementations below, picked from the
+// CPU features on first use:
+//   words : 8 bytes per move, works everywhere
+//   sse2  : 64 bytes per loop in xmm registers, non-temporal stores for big buffers
+//   erms  : rep movsb / rep stosb, which the CPU itself runs in cache line chunks
+// The xmm registers are caller saved, the SSE2 code only declares them clobbered.
 
-    size_t i;
-    for (i = 0; i < (n / sizeof(uint64_t)); i++) {
-        pdest64[i] = psrc64[i];  // Copy 64-bit chunks
-    }
+#define MEM_SSE2_MIN    64              // Smaller sizes go to the word loops
+#define MEM_ERMS_MIN    128             // rep movsb start up costs more than a short word loop
+#define MEM_NT_MIN      (512 * 1024)    // Bigger buffers bypass the cache, they would evict it anyway
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) mem_word_t;
 
-    // Copy any remaining bytes
-    uint8_t *pdest8 = (uint8_t *) (pdest64 + i);
-    const uint8_t *psrc8 = (const uint8_t *) (psrc64 + i);
-    for (i = 0; i < (n % sizeof(uint64_t)); i++) {
-        pdest8[i] = psrc8[i];  // Copy remaining bytes
+
+static void *memcpy_words(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *) dest;
+    const uint8_t *s = (const uint8_t *) src;
+
+    for (; n >= 8; n -= 8, d += 8, s += 8) {
+        *(mem_word_t *) d = *(const mem_word_t *) s;
+    }
+    for (; n > 0; n--) {
+        *d++ = *s++;
     }
 
     return dest;
 }
 
+static void *memset_words(void *s, int c, size_t n) {
+    uint8_t *p = (uint8_t *) s;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t) c;
 
-
-void *memset(void *s, int c, size_t n) {
-    uint8_t *p = (uint8_t *) s; // making uint8_t pointer from void pointer
-
-    for (size_t i = 0; i < n; i++) {
-        p[i] = (uint8_t) c; // fill with c
+    for (; n >= 8; n -= 8, p += 8) {
+        *(mem_word_t *) p = pattern;
+    }
+    for (; n > 0; n--) {
+        *p++ = (uint8_t) c;
     }
 
     return s;
 }
 
-/*
-* The memmove function copies n bytes from the memory area src to the memory area dest.
-*/
+static int memcmp_words(const void *s1, const void *s2, size_t n) {
+    const uint8_t *p1 = (const uint8_t *) s1;
+    const uint8_t *p2 = (const uint8_t *) s2;
 
-void *memmove(void *dest, const void *src, size_t n) {
-    uint32_t *pdest = (uint32_t *) dest;
-    const uint32_t *psrc = (const uint32_t *) src;
+    // Skip equal words, the first differing byte is then found in the byte loop
+    for (; n >= 8; n -= 8, p1 += 8, p2 += 8) {
+        if (*(const mem_word_t *) p1 != *(const mem_word_t *) p2) break;
+    }
+    for (; n > 0; n--, p1++, p2++) {
+        if (*p1 != *p2) return *p1 < *p2 ? -1 : 1;
+    }
+
+    return 0;
+}
 
-    // If src pointer location is located after dest
-    if (src > dest) {
-        for (size_t i = 0; i < n; i++) {
-            pdest[i] = psrc[i];
+
+static void *memcpy_sse2(void *dest, const void *src, size_t n) {
+    if (n < MEM_SSE2_MIN) return memcpy_words(dest, src, n);
+
+    uint8_t *d = (uint8_t *) dest;
+    const uint8_t *s = (const uint8_t *) src;
+
+    // Align the destination so the stores are aligned
+    size_t head = (16 - ((uint64_t) d & 15)) & 15;
+    memcpy_words(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    size_t blocks = n / 64;
+
+    if (blocks) {
+        if (n >= MEM_NT_MIN) {
+            asm volatile(
+                "1:\n\t"
+                "movdqu 0(%[s]), %%xmm0\n\t"
+                "movdqu 16(%[s]), %%xmm1\n\t"
+                "movdqu 32(%[s]), %%xmm2\n\t"
+                "movdqu 48(%[s]), %%xmm3\n\t"
+                "movntdq %%xmm0, 0(%[d])\n\t"
+                "movntdq %%xmm1, 16(%[d])\n\t"
+                "movntdq %%xmm2, 32(%[d])\n\t"
+                "movntdq %%xmm3, 48(%[d])\n\t"
+                "add $64, %[s]\n\t"
+                "add $64, %[d]\n\t"
+                "dec %[cnt]\n\t"
+                "jnz 1b\n\t"
+                "sfence\n\t"
+                : [s] "+r"(s), [d] "+r"(d), [cnt] "+r"(blocks)
+                :
+                : "xmm0", "xmm1", "xmm2", "xmm3", "cc", "memory");
+        } else {
+            asm volatile(
+                "1:\n\t"
+                "movdqu 0(%[s]), %%xmm0\n\t"
+                "movdqu 16(%[s]), %%xmm1\n\t"
+                "movdqu 32(%[s]), %%xmm2\n\t"
+                "movdqu 48(%[s]), %%xmm3\n\t"
+                "movdqa %%xmm0, 0(%[d])\n\t"
+                "movdqa %%xmm1, 16(%[d])\n\t"
+                "movdqa %%xmm2, 32(%[d])\n\t"
+                "movdqa %%xmm3, 48(%[d])\n\t"
+                "add $64, %[s]\n\t"
+                "add $64, %[d]\n\t"
+                "dec %[cnt]\n\t"
+                "jnz 1b\n\t"
+                : [s] "+r"(s), [d] "+r"(d), [cnt] "+r"(blocks)
+                :
+                : "xmm0", "xmm1", "xmm2", "xmm3", "cc", "memory");
         }
-    // If src pointer location is located before dest
-    } else if (src < dest) {
-        for (size_t i = n; i > 0; i--) {
-            pdest[i-1] = psrc[i-1];
+    }
+
+    memcpy_words(d, s, n % 64);
+    return dest;
+}
+
+static void *memset_sse2(void *s, int c, size_t n) {
+    if (n < MEM_SSE2_MIN) return memset_words(s, c, n);
+
+    uint8_t *p = (uint8_t *) s;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t) c;
+
+    size_t head = (16 - ((uint64_t) p & 15)) & 15;
+    memset_words(p, c, head);
+    p += head;
+    n -= head;
+
+    size_t blocks = n / 64;
+
+    if (blocks) {
+        if (n >= MEM_NT_MIN) {
+            asm volatile(
+                "movq %[pat], %%xmm0\n\t"
+                "punpcklqdq %%xmm0, %%xmm0\n\t"
+                "1:\n\t"
+                "movntdq %%xmm0, 0(%[p])\n\t"
+                "movntdq %%xmm0, 16(%[p])\n\t"
+                "movntdq %%xmm0, 32(%[p])\n\t"
+                "movntdq %%xmm0, 48(%[p])\n\t"
+                "add $64, %[p]\n\t"
+                "dec %[cnt]\n\t"
+                "jnz 1b\n\t"
+                "sfence\n\t"
+                : [p] "+r"(p), [cnt] "+r"(blocks)
+                : [pat] "r"(pattern)
+                : "xmm0", "cc", "memory");
+        } else {
+            asm volatile(
+                "movq %[pat], %%xmm0\n\t"
+                "punpcklqdq %%xmm0, %%xmm0\n\t"
+                "1:\n\t"
+                "movdqa %%xmm0, 0(%[p])\n\t"
+                "movdqa %%xmm0, 16(%[p])\n\t"
+                "movdqa %%xmm0, 32(%[p])\n\t"
+                "movdqa %%xmm0, 48(%[p])\n\t"
+                "add $64, %[p]\n\t"
+                "dec %[cnt]\n\t"
+                "jnz 1b\n\t"
+                : [p] "+r"(p), [cnt] "+r"(blocks)
+                : [pat] "r"(pattern)
+                : "xmm0", "cc", "memory");
         }
     }
 
+    memset_words(p, c, n % 64);
+    return s;
+}
+
+static int memcmp_sse2(const void *s1, const void *s2, size_t n) {
+    if (n < MEM_SSE2_MIN) return memcmp_words(s1, s2, n);
+
+    const uint8_t *p1 = (const uint8_t *) s1;
+    const uint8_t *p2 = (const uint8_t *) s2;
+    size_t off = 0;
+
+    // Find the first 16 byte block which differs, the word loop finds the byte inside it
+    asm volatile(
+        "1:\n\t"
+        "cmp %[end], %[off]\n\t"
+        "jae 2f\n\t"
+        "movdqu (%[a], %[off]), %%xmm0\n\t"
+        "movdqu (%[b], %[off]), %%xmm1\n\t"
+        "pcmpeqb %%xmm1, %%xmm0\n\t"
+        "pmovmskb %%xmm0, %%eax\n\t"
+        "cmp $0xFFFF, %%eax\n\t"
+        "jne 2f\n\t"
+        "add $16, %[off]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        : [off] "+r"(off)
+        : [a] "r"(p1), [b] "r"(p2), [end] "r"(n & ~(size_t) 15)
+        : "rax", "xmm0", "xmm1", "cc", "memory");
+
+    return memcmp_words(p1 + off, p2 + off, n - off);
+}
+
+
+static void *memcpy_erms(void *dest, const void *src, size_t n) {
+    if (n < MEM_ERMS_MIN) return memcpy_words(dest, src, n);
+
+    void *d = dest;
+    asm volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
     return dest;
 }
 
-int memcmp(const void *s1, const void *s2, size_t n) {
-    const uint8_t *p1 = (const uint8_t *)s1;
-    const uint8_t *p2 = (const uint8_t *)s2;
+static void *memset_erms(void *s, int c, size_t n) {
+    if (n < MEM_ERMS_MIN) return memset_words(s, c, n);
 
-    for (size_t i = 0; i < n; i++) {
-        if (p1[i] != p2[i]) {
-            return p1[i] < p2[i] ? -1 : 1;
-        }
+    void *p = s;
+    asm volatile("rep stosb" : "+D"(p), "+c"(n) : "a"(c) : "memory");
+    return s;
+}
+
+
+// Every implementation, the fastest last. repe cmpsb is slow, erms compares with SSE2.
+typedef struct mem_ops {
+    const char *name;
+    void *(*copy)(void *dest, const void *src, size_t n);
+    void *(*set)(void *s, int c, size_t n);
+    int (*cmp)(const void *s1, const void *s2, size_t n);
+} mem_ops_t;
+
+static const mem_ops_t mem_ops_all[] = {
+    { "words", memcpy_words, memset_words, memcmp_words },
+    { "sse2",  memcpy_sse2,  memset_sse2,  memcmp_sse2 },
+    { "erms",  memcpy_erms,  memset_erms,  memcmp_sse2 },
+};
+
+static const mem_ops_t *mem_ops = NULL;
+
+
+static void mem_cpuid(uint32_t leaf, uint32_t *ebx, uint32_t *edx) {
+    uint32_t eax, ecx;
+    asm volatile("cpuid" : "=a"(eax), "=b"(*ebx), "=c"(ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+// Implementation memcpy(), memset() and memcmp() use, chosen on the first call
+static const mem_ops_t *mem_ops_active() {
+    if (!mem_ops) {
+        uint32_t ebx, edx;
+        mem_cpuid(1, &ebx, &edx);
+        bool sse2 = edx & (1 << 26);
+        mem_cpuid(7, &ebx, &edx);
+        bool erms = ebx & (1 << 9);
+        mem_ops = &mem_ops_all[(sse2 && erms) ? 2 : (sse2 ? 1 : 0)];
     }
+    return mem_ops;
+}
 
-    return 0;
+
+// Copy dat of src into dest
+void *memcpy(void *dest, const void *src, size_t n) {
+    return mem_ops_active()->copy(dest, src, n);
+}
+
+void *memset(void *s, int c, size_t n) {
+    return mem_ops_active()->set(s, c, n);
+}
+
+
+
+// The memmove function copies n bytes from the memory area src to the memory area dest.
+void *memmove(void *dest, const void *src, size_t n) {
+    uint8_t *d = (uint8_t *) dest;
+    const uint8_t *s = (const uint8_t *) src;
+
+    if (d == s || n == 0) return dest;
+
+    // No overlap, any copy works
+    if (d + n <= s || s + n <= d) {
+        return memcpy(dest, src, n);
+    }
+
+    // dest before src: a forward copy reads every word before it is overwritten
+    if (d < s) {
+        return memcpy_words(dest, src, n);
+    }
+
+    // dest after src: copy backwards from the end
+    d += n;
+    s += n;
+    for (; n >= 8; n -= 8) {
+        d -= 8;
+        s -= 8;
+        *(mem_word_t *) d = *(const mem_word_t *) s;
+    }
+    while (n--) {
+        *--d = *--s;
+    }
+
+    return dest;
+}
+
+
+
+
+// compare two memory location with size n
+int memcmp(const void *s1, const void *s2, size_t n) {
+    return mem_ops_active()->cmp(s1, s2, n);
 }
 
 
@@ -104,6 +104,32 @@ uint64_t syscall_uheap_free(void *ptr, size_t size) {
     return system_call((uint64_t) INT_SYSCALL_FREE, (uint64_t) ptr, (uint64_t) size, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0); 
 }
 
+// Returns the new program break, NULL asks for the current one
+void *syscall_brk(void *addr) {
+    return (void *) system_call((uint64_t) INT_SYSCALL_BRK, (uint64_t) addr, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
+}
+
+// Returns the old program break or (void *) -1
+void *syscall_sbrk(intptr_t increment) {
+    return (void *) system_call((uint64_t) INT_SYSCALL_SBRK, (uint64_t) increment, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
+}
+
+// Map length bytes of zeroed memory (MAP_ANONYMOUS) or of an open file (read only), pages are
+// backed on first touch. Returns the address or MAP_FAILED.
+void *syscall_mmap(size_t length, int prot, int flags, int disk_no, void *file, uint64_t offset) {
+    return (void *) system_call((uint64_t) INT_SYSCALL_MMAP, (uint64_t) length, (uint64_t) prot, (uint64_t) flags, (uint64_t) disk_no, (uint64_t) file, (uint64_t) offset);
+}
+
+// Remove a whole mapping, returns 0 or -1
+int syscall_munmap(void *addr, size_t length) {
+    return (int) system_call((uint64_t) INT_SYSCALL_MUNMAP, (uint64_t) addr, (uint64_t) length, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
+}
+
+// Memory usage of the system and of this process, returns 0 or -1
+int syscall_meminfo(meminfo_t *info) {
+    return (int) system_call((uint64_t) INT_SYSCALL_MEMINFO, (uint64_t) info, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
+}
+
 
 
 
@@ -128,6 +154,20 @@ void *syscall_get_current_process(){
     return (void *) system_call((uint64_t) INT_GET_CURRENT_PROCESS, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0); 
 }
 
+// Returns the child's pid in the parent, 0 in the child and -1 on error
+int syscall_fork(){
+    return (int) system_call((uint64_t) INT_SYSCALL_FORK, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
+}
+
+// Adds increment to the nice level (-20 highest to 19 lowest priority) of the calling thread, returns the new level
+int syscall_nice(int increment){
+    return (int) system_call((uint64_t) INT_SYSCALL_NICE, (uint64_t)(int64_t) increment, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
+}
+
+int syscall_yield(){
+    return (int) system_call((uint64_t) INT_SYSCALL_YIELD, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0, (uint64_t) 0);
+}
+
 
 
 // ---------------------------- Thread Manage --------------------------------